@@ -1,9 +1,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "xml_lexer.h"
 #include "xml_parser.h"
 #include "xpath.h"
+#include "xpath_stream.h"
+#include "xml_encoding.h"
+#include "xml_writer.h"
+#include "xml_thread.h"
+#include "xml_loader.h"
+#include "xml_compress.h"
+#ifdef XML_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef XML_HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #ifdef LEX_DEBUG
 /* read entire file, and return contents. */
@@ -92,10 +110,10 @@ void Test_simplexml(XMLDocument *doc) {
   fprintf(stdout, "\n============Search Node with Selector ============\n");
   XMLNodeList *list = XMLFindNodeSelector(XML_ROOT(doc), PriceGreaterThanFiveFood, (void *)"price");
   if (list != NULL) {
-    fprintf(stdout, "food count=[%ld]\n", list->count);
+    fprintf(stdout, "food count=[%zu]\n", list->count);
     for (size_t i = 0; i < list->count; ++i) {
       XMLNode *food_node = list->nodes[i];
-      fprintf(stdout, "MATCHES [%ld]:\n", i);
+      fprintf(stdout, "MATCHES [%zu]:\n", i);
       for (size_t j = 0; j < food_node->children.count; ++j) {
         XMLNode *child = food_node->children.nodes[j];
         if (child->type == NT_COMMENT) continue;
@@ -126,7 +144,7 @@ void Test_testxml(XMLDocument *doc) {
   if (m) {
     XMLNodeList *list = XMLFindNode(m, "field");
     if (list) {
-      fprintf(stdout, "list count=[%ld]\n", list->count);
+      fprintf(stdout, "list count=[%zu]\n", list->count);
       for (size_t i = 0; i < list->count; ++i) {
         XMLNode *node = list->nodes[i];
         for (size_t j = 0; j < node->attrList.count; ++j) {
@@ -141,7 +159,7 @@ void Test_testxml(XMLDocument *doc) {
   fprintf(stdout, "\n============Search Node with Predicate============\n");
   XMLNodeList *list = XMLFindNodeWhere(m, NodeNameIsField, NULL);
   if (list) {
-      fprintf(stdout, "list count=[%ld]\n", list->count);
+      fprintf(stdout, "list count=[%zu]\n", list->count);
       for (size_t i = 0; i < list->count; ++i) {
         XMLNode *node = list->nodes[i];
         for (size_t j = 0; j < node->attrList.count; ++j) {
@@ -157,7 +175,7 @@ void Test_testxml(XMLDocument *doc) {
   if (m) {
     XMLNodeList *list = XMLFindNodeSelector(m2, AgeGreaterEqualThan48, (void*)"age");
     if (list) {
-      fprintf(stdout, "list count=[%ld]\n", list->count);
+      fprintf(stdout, "list count=[%zu]\n", list->count);
       for (size_t i = 0; i < list->count; ++i) {
         XMLNode *node = list->nodes[i];
         fprintf(stdout, "name: %s, age: %s\n", node->name, node->text);
@@ -240,7 +258,7 @@ static void Test_test4xml(XMLDocument *doc) {
   fprintf(stdout, "\n============Select all the prices============\n");
   XMLNodeList *list = XMLFindNodeSelector(root, SelectAllPricesNodes, (void *)"price");
   if (list != NULL) {
-    fprintf(stdout, "prices count=[%ld]\n", list->count);
+    fprintf(stdout, "prices count=[%zu]\n", list->count);
     for (size_t i = 0; i < list->count; ++i) {
       XMLNode *price = list->nodes[i];
       fprintf(stdout, "%s\n", price->text);
@@ -251,7 +269,7 @@ static void Test_test4xml(XMLDocument *doc) {
   fprintf(stdout, "\n============Select price nodes with price>35============\n");
   XMLNodeList *list2 = XMLFindNodeSelector(root, SelectPriceGreaterThan35, (void *)"price");
   if (list2 != NULL) {
-    fprintf(stdout, "prices greater than 35 count=[%ld]\n", list2->count);
+    fprintf(stdout, "prices greater than 35 count=[%zu]\n", list2->count);
     for (size_t i = 0; i < list2->count; ++i) {
       XMLNode *price = list2->nodes[i];
       fprintf(stdout, "%s\n", price->text);
@@ -262,7 +280,7 @@ static void Test_test4xml(XMLDocument *doc) {
   fprintf(stdout, "\n============Select title nodes with price>35============\n");
   XMLNodeList *list3 = XMLFindNodeSelector(root, SelectTitleWithPriceGreaterThan35, (void *)"price");
   if (list3 != NULL) {
-    fprintf(stdout, "title nodes with prices greater than 35 count=[%ld]\n", list3->count);
+    fprintf(stdout, "title nodes with prices greater than 35 count=[%zu]\n", list3->count);
     for (size_t i = 0; i < list3->count; ++i) {
       XMLNode *title = list3->nodes[i];
       fprintf(stdout, "%s\n", title->text);
@@ -328,62 +346,2306 @@ static void xpath_test(void) {
   XMLDocumentFree(&doc);
 }
 
-int main(int argc, char **argv) {
-  char *filename = "./test.xml";
-#ifdef LEX_DEBUG
-  char *contents = read_file(filename);
+/* XPath 1.0 expressions: each one is compared with the string value of its result */
+static void xpath_expr_test(void) {
+  static const struct {
+    const char *expr;
+    const char *expected;
+  } cases[] = {
+    {"/bookstore/book[@category='WEB']/title", "Learning XML"},
+    {"count(//book)", "3"},
+    {"count(/bookstore/book)", "2"},
+    {"//book[year > 2000 and price < 30]/title[2]", "Sub harry potter"},
+    {"//book[year < 1990 or @category='CHILDREN']/author", "J K.Rowlingk"},
+    {"/bookstore/book[last()]/book/author", "hhf"},
+    {"/bookstore/book[position() = 2]/@category", "WEB"},
+    {"(//title)[last()]", "Start"},
+    {"count(//title[contains(., 'arry')])", "2"},
+    {"//title[starts-with(., 'Learn')]/following-sibling::year", "2003"},
+    {"//author[.='hhf']/ancestor::book[1]/year", "1977"},
+    {"//author[.='hhf']/ancestor::book[last()]/@category", "WEB"},
+    {"//price[../@category='WEB']", "39.95"},
+    {"sum(//price)", "69.94"},
+    {"round(sum(//price) div 2)", "35"},
+    {"count(//book | //title)", "7"},
+    {"name(/*/@boss)", "boss"},
+    {"string-length(substring-before(//book[2]/title, ' '))", "8"},
+    {"concat(//book[1]/year, '-', //book[2]/year)", "2005-2003"},
+    {"//year[. = 2003]/preceding-sibling::*[1]", "Erik T.Ray"},
+    {"not(//book[@category='COOKING'])", "true"},
+    {"/bookstore/book[1]/title[1]/text()", "Harry Potter"},
+    /* numbers are never written with an exponent */
+    {"1000000 * 1000000 * 1000", "1000000000000000"},
+    {"1000000 * 1000000 * 1000000 * 1000000 + 0.5", "1000000000000000000000000"},
+    {"1 div 1000000", "0.000001"},
+    {"-1 div 1000000 div 1000000", "-0.000000000001"},
+    {"1 div 3", "0.333333333333333"},
+    {"-2.5 * 1000", "-2500"},
+    {"123456.75 div 1000", "123.45675"},
+  };
+  XMLDocument doc = { 0 };
+  if (!XMLDocumentParseFile(&doc, "./bookstore.xml")) {
+    fprintf(stderr, "XMLDocumentParseFile failed!\n");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < ARRAY_SIZE(cases); ++i) {
+    XPathExpr *expr = xpath_compile(cases[i].expr);
+    XPathValue value;
+    if (expr == NULL || !xpath_evaluate(expr, doc.root, &value)) {
+      fprintf(stderr, "xpath expression '%s' failed\n", cases[i].expr);
+      exit(1);
+    }
+    char *text = xpath_value_to_string(&value);
+    printf("%s = %s\n", cases[i].expr, text);
+    if (strcmp(text, cases[i].expected) != 0) {
+      fprintf(stderr, "xpath expression '%s': expected '%s'\n", cases[i].expr, cases[i].expected);
+      exit(1);
+    }
+    free(text);
+    xpath_value_free(&value);
+    xpath_expr_free(expr);
+  }
+
+  if (xpath_compile("/bookstore/book[") != NULL) {
+    fprintf(stderr, "xpath_compile accepted a broken expression\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+}
+
+typedef struct StreamTestData {
+  size_t count;
+  size_t bytes;
+  size_t limit; /* stop after this many matches, 0: never */
+}StreamTestData;
+
+static bool stream_test_callback(XMLNode *node, const char *value, void *user_data) {
+  StreamTestData *data = (StreamTestData *)user_data;
+  data->count++;
+  if (value) data->bytes += strlen(value);
+  else data->bytes += node->children.count; /* the matched subtree is complete */
+  return data->limit == 0 || data->count < data->limit;
+}
+
+static size_t stream_test_dom_count(XMLDocument *doc, const char *path) {
+  XPathExpr *expr = xpath_compile(path);
+  XPathValue value;
+  if (expr == NULL || !xpath_evaluate(expr, doc->root, &value)) {
+    fprintf(stderr, "xpath expression '%s' failed\n", path);
+    exit(1);
+  }
+  size_t count = value.nodes.count;
+  xpath_value_free(&value);
+  xpath_expr_free(expr);
+  return count;
+}
+
+/* stream `paths` over `xml`, or the file at `path` if it is set: the matches must agree with the XPath engine on `doc` */
+static void xpath_stream_test_paths(const char **paths, size_t count, const char *xml, const char *path, XMLDocument *doc) {
+  StreamTestData data[8] = { { 0 } };
+  XPathStream *stream = xpath_stream_new();
+  for (size_t i = 0; i < count; ++i) {
+    if (!xpath_stream_add(stream, paths[i], stream_test_callback, &data[i])) {
+      fprintf(stderr, "xpath_stream_add('%s') failed\n", paths[i]);
+      exit(1);
+    }
+  }
+  if (!(path ? xpath_stream_parse_file(stream, path) : xpath_stream_parse_str(stream, xml))) {
+    fprintf(stderr, "streaming the feed%s failed!\n", path ? " from a file" : "");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    size_t expected = stream_test_dom_count(doc, paths[i]);
+    printf("%s%s: %zu matches\n", paths[i], path ? "(file)" : "", data[i].count);
+    if (data[i].count != expected) {
+      fprintf(stderr, "xpath stream '%s': %zu matches, expected %zu\n", paths[i], data[i].count, expected);
+      exit(1);
+    }
+  }
+  xpath_stream_free(stream);
+}
+
+/* parse `xml` with one `path` registered: returns whether it is well formed, the matches are in `data` */
+static bool xpath_stream_test_one(const char *xml, const char *path, StreamTestData *data) {
+  XPathStream *stream = xpath_stream_new();
+  xpath_stream_add(stream, path, stream_test_callback, data);
+  bool ok = xpath_stream_parse_str(stream, xml);
+  xpath_stream_free(stream);
+  return ok;
+}
+
+/* streaming matches must agree with the XPath engine on the whole DOM */
+static void xpath_stream_test(void) {
+  static const char *paths[] = {
+    "/feed/entry",
+    "//entry[@type='news']",
+    "/feed/entry[@type!='news'][@lang]/title",
+    "//entry/@id",
+    "//entry[@lang='en']/title/text()",
+    "//*[@id]//link",
+  };
+  /* no `//`: most of the feed is stepped over */
+  static const char *skip_paths[] = {
+    "/feed/entry[@type='blog']/title/text()",
+    "/feed/entry/@id",
+  };
+  const char *file = "./xpath_stream.xml";
+  size_t size = 1 << 20, len = 0;
+  char *xml = malloc(size);
+  XMLDocument doc = { 0 };
+
+  len += snprintf(xml + len, size - len, "<feed>");
+  for (int i = 0; i < 2000; ++i) {
+    len += snprintf(xml + len, size - len, "<entry id=\"%d\" type=\"%s\"%s><title>t&amp;%d</title>",
+                    i, i % 3 ? "news" : "blog", i % 4 ? " lang=\"en\"" : "", i);
+    if (i % 5 == 0) len += snprintf(xml + len, size - len, "<entry id=\"n%d\"><link/></entry>", i);
+    len += snprintf(xml + len, size - len, "<link href=\"/%d\"/></entry>", i);
+  }
+  /* larger than a chunk of the file reader */
+  len += snprintf(xml + len, size - len, "<archive>");
+  for (int i = 0; i < 5000; ++i) len += snprintf(xml + len, size - len, "<old n=\"%d\"><!-- <x> -->y</old>", i);
+  snprintf(xml + len, size - len, "</archive></feed>");
+
+  FILE *fp = fopen(file, "w");
+  if (fp == NULL || fputs(xml, fp) < 0 || fclose(fp) != 0) {
+    fprintf(stderr, "can't write %s\n", file);
+    exit(1);
+  }
+  if (!XMLDocumentParseStr(&doc, xml)) {
+    fprintf(stderr, "parsing the feed failed!\n");
+    exit(1);
+  }
+  xpath_stream_test_paths(paths, ARRAY_SIZE(paths), xml, NULL, &doc);
+  xpath_stream_test_paths(paths, ARRAY_SIZE(paths), NULL, file, &doc);
+  xpath_stream_test_paths(skip_paths, ARRAY_SIZE(skip_paths), xml, NULL, &doc);
+  xpath_stream_test_paths(skip_paths, ARRAY_SIZE(skip_paths), NULL, file, &doc);
+  unlink(file);
+
+  XPathStream *stream = xpath_stream_new();
+  const char *unsupported[] = { "entry[1]", "/a/..", "/a/.", "/a/text()/b", "/a/b()", "/a[@.]" };
+  for (size_t i = 0; i < ARRAY_SIZE(unsupported); ++i) {
+    if (xpath_stream_add(stream, unsupported[i], stream_test_callback, NULL)) {
+      fprintf(stderr, "xpath_stream_add accepted an unsupported path %s\n", unsupported[i]);
+      exit(1);
+    }
+  }
+  xpath_stream_free(stream);
+
+  /* a callback can stop the parse */
+  StreamTestData first = { 0, 0, 3 };
+  if (!xpath_stream_test_one(xml, "//title/text()", &first) || first.count != 3) {
+    fprintf(stderr, "xpath stream did not stop after 3 matches\n");
+    exit(1);
+  }
+
+  /* the tags of a subtree which is stepped over must match too */
+  StreamTestData skipped = { 0 };
+  if (xpath_stream_test_one("<a><z><b></c></z></a>", "/a/b", &skipped) ||
+      xpath_stream_test_one("<a><z></y><b/></a>", "/a/b", &skipped) ||
+      !xpath_stream_test_one("<a><z><b></b></z><b/></a>", "/a/b", &skipped) || skipped.count != 1) {
+    fprintf(stderr, "xpath stream: mismatched tags of a skipped subtree not detected\n");
+    exit(1);
+  }
+
+  /* attribute values are decoded, like text */
+  StreamTestData attr = { 0 }, pred = { 0 };
+  if (!xpath_stream_test_one("<a><b k=\"1&lt;2\"/></a>", "/a/b/@k", &attr) || attr.count != 1 || attr.bytes != 3 ||
+      !xpath_stream_test_one("<a><b k=\"1&lt;2\"/></a>", "/a/b[@k='1<2']", &pred) || pred.count != 1) {
+    fprintf(stderr, "xpath stream: attribute values not decoded\n");
+    exit(1);
+  }
+
+  XMLDocumentFree(&doc);
+  free(xml);
+}
+
+static void stats_test_walk(const XMLNode *node, size_t depth, size_t *nodes, size_t *attrs, size_t *max_depth) {
+  (*nodes)++;
+  *attrs += node->attrList.count;
+  if (depth > *max_depth) *max_depth = depth;
+  for (size_t i = 0; i < node->children.count; ++i) {
+    stats_test_walk(node->children.nodes[i], depth + 1, nodes, attrs, max_depth);
+  }
+}
+
+/* the counters must agree with the tree they describe */
+static void stats_test(void) {
+  XMLDocument doc = { 0 };
+  XMLStats stats;
+  XPathStats narrow, wide;
+  XPathValue value;
+
+  /* only collected when asked for */
+  if (!XMLDocumentParseFile(&doc, "./bookstore.xml") || XMLDocumentGetStats(&doc, &stats) || stats.nodes != 0) {
+    fprintf(stderr, "stats: collected without XMLDocumentCollectStats\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+  XMLDocumentCollectStats(&doc, true);
+  if (!XMLDocumentParseFile(&doc, "./bookstore.xml")) {
+    fprintf(stderr, "XMLDocumentParseFile failed!\n");
+    exit(1);
+  }
+  XPathExpr *first = xpath_compile("/bookstore/book[1]/title");
+  XPathExpr *all = xpath_compile("//title");
+  xpath_evaluate_stats(first, doc.root, &value, &narrow);
+  xpath_value_free(&value);
+  xpath_evaluate_stats(all, doc.root, &value, &wide);
+  xpath_value_free(&value);
+
+  if (!XMLDocumentGetStats(&doc, &stats)) {
+    printf("stats: not built with XML_STATS\n");
+    if (stats.nodes != 0 || narrow.steps != 0 || wide.nodes_visited != 0) {
+      fprintf(stderr, "stats: counters without XML_STATS\n");
+      exit(1);
+    }
+  } else {
+    size_t nodes = 0, attrs = 0, max_depth = 0;
+    stats_test_walk(doc.root, 1, &nodes, &attrs, &max_depth);
+    nodes += doc.others.count;
+    printf("stats: %zu bytes, %zu nodes, %zu attrs, depth %zu, %zu bytes allocated, lex %.6fs, build %.6fs\n",
+           stats.bytes_lexed, stats.nodes, stats.attrs, stats.max_depth, stats.bytes_allocated,
+           stats.lex_seconds, stats.build_seconds);
+    printf("xpath stats: %zu steps/%zu nodes for the first title, %zu/%zu for all\n",
+           narrow.steps, narrow.nodes_visited, wide.steps, wide.nodes_visited);
+    if (stats.bytes_lexed != strlen(doc.contents) || stats.nodes != nodes || stats.attrs != attrs ||
+        stats.max_depth != max_depth || stats.tokens[TOKEN_OPEN_TAG] != nodes - doc.others.count ||
+        stats.bytes_allocated < nodes * sizeof(XMLNode) || stats.tokens[TOKEN_CLOSE_TAG] == 0) {
+      fprintf(stderr, "stats: counters don't match the tree(%zu nodes, %zu attrs, depth %zu)\n", nodes, attrs, max_depth);
+      exit(1);
+    }
+    if (narrow.steps == 0 || narrow.nodes_visited >= wide.nodes_visited) {
+      fprintf(stderr, "stats: xpath counters are off\n");
+      exit(1);
+    }
+
+    char out[64];
+    XMLNode entity = { 0 };
+    entity.text = "a &amp; b";
+    XMLDecodeTextTo(&entity, out, sizeof(out));
+    XMLStats after;
+    XMLDocumentGetStats(&doc, &after);
+    if (after.decoded_bytes != stats.decoded_bytes + strlen("a & b")) {
+      fprintf(stderr, "stats: decoding was not counted\n");
+      exit(1);
+    }
+  }
+
+  xpath_expr_free(first);
+  xpath_expr_free(all);
+  XMLDocumentFree(&doc);
+}
+
+/* comment nodes anywhere in the tree */
+static size_t flags_test_comments(const XMLNode *node) {
+  size_t count = node->type == NT_COMMENT;
+  for (size_t i = 0; i < node->children.count; ++i) count += flags_test_comments(node->children.nodes[i]);
+  return count;
+}
+
+static size_t flags_test_elements(const XMLNode *node) {
+  size_t count = node->type != NT_COMMENT;
+  for (size_t i = 0; i < node->children.count; ++i) count += flags_test_elements(node->children.nodes[i]);
+  return count;
+}
+
+static void flags_test(void) {
+  const char *xml = "<?xml version=\"1.0\"?>\n<!DOCTYPE list>\n<!-- prolog -->\n"
+                    "<list><!-- first --><item id=\"1\">one  \n</item><item id=\"2\"><!--x--><?pi in content?>two</item></list>";
+  struct {
+    unsigned flags;
+    size_t others;    /* nodes before the root */
+    size_t comments;  /* in the tree */
+    const char *text; /* of the first item */
+  } cases[] = {
+    { XML_PARSE_DEFAULT, 3, 2, "one  \n" },
+    { XML_PARSE_NO_COMMENTS | XML_PARSE_TRIM_TEXT, 2, 0, "one" },
+    { XML_PARSE_DATA, 0, 0, "one" },
+  };
+
+  for (size_t i = 0; i < ARRAY_SIZE(cases); ++i) {
+    for (int lazy = 0; lazy <= 1; ++lazy) {
+      XMLDocument doc = { 0 };
+      XMLDocumentSetParseFlags(&doc, cases[i].flags);
+      bool ok = lazy ? XMLDocumentParseStrLazy(&doc, xml, 1) && XMLDocumentExpandAll(&doc) : XMLDocumentParseStr(&doc, xml);
+      /* a PI in content has no node: it is an error unless XML_PARSE_NO_PI skips it */
+      if (!(cases[i].flags & XML_PARSE_NO_PI)) {
+        if (ok || doc.error.code != XML_ERROR_UNEXPECTED_TOKEN) {
+          fprintf(stderr, "flags %#x: PI in content gave %s\n", cases[i].flags, XMLErrorString(doc.error.code));
+          exit(1);
+        }
+        XMLDocumentFree(&doc);
+        continue;
+      }
+      XMLNode *item = ok ? XMLNodeChildrenGet(doc.root, 0) : NULL;
+      if (!ok || doc.others.count != cases[i].others || flags_test_comments(doc.root) != cases[i].comments ||
+          item == NULL || strcmp(item->text, cases[i].text) != 0 || XMLNodeChildrenCount(doc.root) != 2) {
+        fprintf(stderr, "flags %#x%s: %s, %zu others, %zu comments\n", cases[i].flags, lazy ? " lazy" : "",
+                XMLErrorString(doc.error.code), doc.others.count, ok ? flags_test_comments(doc.root) : 0);
+        exit(1);
+      }
+      XMLDocumentFree(&doc);
+    }
+  }
+
+  /* without the PI in content, the default keeps everything */
+  const char *plain = "<?xml version=\"1.0\"?>\n<!DOCTYPE list>\n<!-- prolog -->\n<list><!-- first --><item>one  </item></list>";
+  XMLDocument doc = { 0 };
+  if (!XMLDocumentParseStr(&doc, plain) || doc.others.count != 3 || flags_test_comments(doc.root) != 1 ||
+      strcmp(XMLNodeChildrenGet(doc.root, 1)->text, "one  ") != 0) {
+    fprintf(stderr, "flags: default parse lost something\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+
+  /* a data only parse has the same elements */
+  for (int i = 0; i < 2; ++i) {
+    const char *file = i ? "./bookstore.xml" : "./test.xml";
+    XMLDocument full = { 0 }, data = { 0 };
+    XMLDocumentSetParseFlags(&data, XML_PARSE_DATA);
+    if (!XMLDocumentParseFile(&full, file) || !XMLDocumentParseFile(&data, file)) {
+      fprintf(stderr, "flags: can't parse %s\n", file);
+      exit(1);
+    }
+    size_t elements = flags_test_elements(full.root);
+    if (flags_test_elements(data.root) != elements || flags_test_comments(data.root) != 0) {
+      fprintf(stderr, "flags: %s has other elements with XML_PARSE_DATA\n", file);
+      exit(1);
+    }
+    printf("flags: %s, %zu elements, %zu/%zu nodes before the root\n", file, elements, full.others.count, data.others.count);
+    XMLDocumentFree(&full);
+    XMLDocumentFree(&data);
+  }
+}
+
+/* repeated queries are answered from the cache until the document changes */
+static void xpath_cache_test(void) {
+  XMLDocument doc = { 0 };
+  if (!XMLDocumentParseFile(&doc, "./bookstore.xml")) {
+    fprintf(stderr, "XMLDocumentParseFile failed!\n");
+    exit(1);
+  }
+  XPathExpr *expensive = xpath_compile("//price[. > 30]");
+  XPathExpr *years = xpath_compile("count(//year)");
+  XPathCache *cache = xpath_cache_new(&doc, 16);
+
+  const XPathValue *first = xpath_cache_evaluate(cache, expensive, doc.root);
+  xpath_cache_evaluate(cache, years, doc.root);
+  const XPathValue *again = xpath_cache_evaluate(cache, expensive, doc.root);
+  if (first == NULL || first != again || again->nodes.count != 1) {
+    fprintf(stderr, "xpath cache: repeated query was not served from the cache\n");
+    exit(1);
+  }
+
+  /* 29.99 -> 35.00: the next query must see it */
+  XPathExpr *cheap = xpath_compile("/bookstore/book[1]/price");
+  XMLNode *price = xpath_cache_evaluate(cache, cheap, doc.root)->nodes.items[0].node;
+  free(price->text);
+  price->text = strdup("35.00");
+  XMLDocumentChanged(&doc);
+  const XPathValue *changed = xpath_cache_evaluate(cache, expensive, doc.root);
+  printf("//price[. > 30]: 1 before, %zu after the change\n", changed->nodes.count);
+  if (changed->nodes.count != 2) {
+    fprintf(stderr, "xpath cache: stale result after XMLDocumentChanged\n");
+    exit(1);
+  }
+
+  xpath_cache_free(cache);
+  xpath_expr_free(expensive);
+  xpath_expr_free(years);
+  xpath_expr_free(cheap);
+  XMLDocumentFree(&doc);
+}
+
+static bool snapshot_test_same(const XMLNode *a, const XMLNode *b) {
+  if (a->type != b->type || a->index != b->index || a->ns != b->ns || a->local != b->local) return false;
+  if ((a->name == NULL) != (b->name == NULL) || (a->name && strcmp(a->name, b->name))) return false;
+  if ((a->text == NULL) != (b->text == NULL) || (a->text && strcmp(a->text, b->text))) return false;
+  if (a->attrList.count != b->attrList.count || a->children.count != b->children.count) return false;
+  for (size_t i = 0; i < a->attrList.count; ++i) {
+    if (strcmp(a->attrList.attrs[i].key, b->attrList.attrs[i].key) || strcmp(a->attrList.attrs[i].value, b->attrList.attrs[i].value)) return false;
+    if (a->attrList.attrs[i].ns != b->attrList.attrs[i].ns || a->attrList.attrs[i].local != b->attrList.attrs[i].local) return false;
+    if (b->attrList.attrs[i].node != b) return false;
+  }
+  for (size_t i = 0; i < a->children.count; ++i) {
+    if (b->children.nodes[i]->parent != b) return false;
+    if (!snapshot_test_same(a->children.nodes[i], b->children.nodes[i])) return false;
+  }
+  return true;
+}
+
+/* a snapshot must load as the same tree, at its own address or relocated */
+static void snapshot_test(void) {
+  const char *path = "./test2.snapshot";
+  XMLDocument doc = { 0 }, mapped = { 0 }, relocated = { 0 };
+
+  if (!XMLDocumentParseFile(&doc, "./test2.xml") || !XMLDocumentSaveSnapshot(&doc, path)) {
+    fprintf(stderr, "writing the snapshot failed!\n");
+    exit(1);
+  }
+  /* the second mapping can't get the preferred address: its pointers are moved */
+  if (!XMLDocumentLoadSnapshot(&mapped, path) || !XMLDocumentLoadSnapshot(&relocated, path)) {
+    fprintf(stderr, "XMLDocumentLoadSnapshot failed!\n");
+    exit(1);
+  }
+  unlink(path);
+
+  if (!snapshot_test_same(doc.root, mapped.root) || !snapshot_test_same(doc.root, relocated.root) ||
+      mapped.others.count != doc.others.count) {
+    fprintf(stderr, "snapshot tree differs from the parsed tree\n");
+    exit(1);
+  }
+
+  XMLNode *td = XMLSelectNode(relocated.root, "/h:table/h:tr[3]/h:td[2]");
+  XPathResult result = xpath("/h:table/h:tr[1]/h:td[1]/text()", mapped.root);
+  printf("snapshot: %s, %s, mapped at %p and %p\n", XMLDecodeText(td), result.text, mapped.snapshot, relocated.snapshot);
+
+  xpath_free(&result);
+  XMLDocumentFree(&relocated);
+  XMLDocumentFree(&mapped);
+
+  /* a damaged file is refused: counts which overflow, a pointer off its section, a pool without its '\0'.
+   * The offsets are those of XMLSnapshotHeader in xml_snapshot.c: node_count at 64, list_offset at 88.
+   * */
+  if (!XMLDocumentSaveSnapshot(&doc, path)) {
+    fprintf(stderr, "writing the snapshot failed!\n");
+    exit(1);
+  }
+  FILE *fp = fopen(path, "rb");
+  char *image = (char *)malloc(1 << 20);
+  size_t size = fread(image, 1, 1 << 20, fp);
+  fclose(fp);
+  for (int damage = 0; damage < 3; ++damage) {
+    char *copy = (char *)malloc(size);
+    uint64_t value;
+    memcpy(copy, image, size);
+    if (damage == 0) {
+      value = UINT64_MAX / sizeof(XMLNode) + 2;
+      memcpy(copy + 64, &value, sizeof(value));
+    } else if (damage == 1) {
+      memcpy(&value, copy + 88, sizeof(value));
+      uintptr_t child;
+      memcpy(&child, copy + value, sizeof(child));
+      child += 8;
+      memcpy(copy + value, &child, sizeof(child));
+    } else {
+      copy[size - 1] = 'x';
+    }
+    fp = fopen(path, "wb");
+    fwrite(copy, 1, size, fp);
+    fclose(fp);
+    free(copy);
+    XMLDocument damaged = { 0 };
+    if (XMLDocumentLoadSnapshot(&damaged, path)) {
+      fprintf(stderr, "snapshot: damaged file %d was loaded\n", damage);
+      exit(1);
+    }
+  }
+  free(image);
+  unlink(path);
+  XMLDocumentFree(&doc);
+}
+
+/* token positions across multi-line values, and text which starts like markup */
+static void lexer_test(void) {
+  const char *xml = "<a x=\"1\n2\"\n  y='z'>\n>= t\n</a>";
+  token_type_t types[] = { TOKEN_OPEN_TAG, TOKEN_NAME, TOKEN_NAME, TOKEN_ASSIGN, TOKEN_STRING, TOKEN_NAME,
+                           TOKEN_ASSIGN, TOKEN_STRING, TOKEN_CLOSE_TAG, TOKEN_TEXT, TOKEN_OPENSLASH_TAG,
+                           TOKEN_NAME, TOKEN_CLOSE_TAG, TOKEN_EOF };
   lexer_t lexer;
-  lexer_init(&lexer, contents, filename);
+  token_t y, text, end;
 
-  /* get next two tokens, so we have two positions */
-  lexer_next_token(&lexer);
-  lexer_next_token(&lexer);
-  while (!lexer_cur_token_is(&lexer, TOKEN_EOF)) {
-#ifdef DEBUG
-    token_dump(lexer.cur_token);
-#endif
+  lexer_init(&lexer, xml, NULL);
+  for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
     lexer_next_token(&lexer);
-  } /* end while */
+    if (!lexer_peek_token_is(&lexer, types[i])) {
+      fprintf(stderr, "lexer: token %d is %s\n", (int)i, token_type_to_string(lexer.peek_token.type));
+      exit(1);
+    }
+    if (i == 5) y = lexer.peek_token;
+    if (i == 9) text = lexer.peek_token;
+    if (i == 10) end = lexer.peek_token;
+  }
+  if (y.pos.line != 3 || y.pos.column != 3 || text.len != 5 || strncmp(text.literal, ">= t", 4) != 0 ||
+      end.pos.line != 5 || end.pos.column != 1) {
+    fprintf(stderr, "lexer: y at %d:%d, text '%.*s', </ at %d:%d\n", y.pos.line, y.pos.column,
+            text.len, text.literal, end.pos.line, end.pos.column);
+    exit(1);
+  }
+  printf("lexer ok\n");
+}
 
-#else
-  if (argc == 2) filename = argv[1];
-#endif
+/* every element's end and next sibling, without tokenizing */
+static void skip_index_test(void) {
+  const char *xml = "<a x='>'><b><!-- <c> --><![CDATA[</b>]]></b><c/><?pi <d>?><d>t</d></a>";
+  lexer_index_t index;
 
-  /* open xml file & parser it */
+  if (!lexer_index_build(&index, xml, strlen(xml)) || index.count != 4) {
+    fprintf(stderr, "lexer_index_build failed\n");
+    exit(1);
+  }
+  /* a: [0], b: [1], c: [2], d: [3] */
+  const lexer_index_entry_t *a = &index.entries[0], *b = &index.entries[1], *c = &index.entries[2];
+  if (a->end != strlen(xml) || a->next != 4 || b->next != 2 || c->next != 3 ||
+      strncmp(xml + b->end, "<c/>", 4) != 0 || c->end - c->start != 4) {
+    fprintf(stderr, "lexer_index_build: wrong entries\n");
+    exit(1);
+  }
+  if (lexer_index_find(&index, c->start, 0) != 2 || lexer_index_find(&index, c->start + 1, 2) != LEXER_INDEX_NONE) {
+    fprintf(stderr, "lexer_index_find failed\n");
+    exit(1);
+  }
+  if (lexer_skip_element(xml, (int)strlen(xml), (int)b->start + 3) != (int)b->end) {
+    fprintf(stderr, "lexer_skip_element failed\n");
+    exit(1);
+  }
+  lexer_index_free(&index);
+
+  if (lexer_index_build(&index, "<a><b></a>", 10)) {
+    fprintf(stderr, "lexer_index_build: unbalanced tags not detected\n");
+    exit(1);
+  }
+
+  /* lookups of names which aren't there leave a lazy node unbuilt */
   XMLDocument doc = { 0 };
-  bool result = XMLDocumentParseFile(&doc, filename);
-  if (result != true) {
+  if (!XMLDocumentParseStrLazy(&doc, "<r><a><b><c/></b></a><a><bc/></a></r>", 1)) {
+    fprintf(stderr, "skip index: lazy parse failed\n");
+    exit(1);
+  }
+  XMLNode *root = XMLRootNode(&doc);
+  if (XMLNodeMayContain(root, "c", 1, false) || !XMLNodeMayContain(root, "c", 1, true) || XMLNodeMayContain(root, "d", 1, true) ||
+      XMLFindFirstNode(root, "b") != NULL || root->lazy == NULL) {
+    fprintf(stderr, "skip index: lookup built the node\n");
+    exit(1);
+  }
+  if (stream_test_dom_count(&doc, "//d") != 0 || stream_test_dom_count(&doc, "/r/b") != 0 || root->lazy == NULL) {
+    fprintf(stderr, "skip index: xpath built the node\n");
+    exit(1);
+  }
+  if (stream_test_dom_count(&doc, "//c") != 1 || stream_test_dom_count(&doc, "/r/a/bc") != 1 || root->lazy != NULL) {
+    fprintf(stderr, "skip index: xpath missed nodes\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+  printf("skip index ok\n");
+}
+
+/* a lazily parsed document builds, on demand, the same tree as a full parse */
+static void lazy_test(void) {
+  XMLDocument full = { 0 }, lazy = { 0 };
+
+  if (!XMLDocumentParseFile(&full, "./bookstore.xml") || !XMLDocumentParseFileLazy(&lazy, "./bookstore.xml", 1)) {
     fprintf(stderr, "XMLDocumentParseFile failed!\n");
     exit(1);
   }
+  if (lazy.root->lazy == NULL || lazy.root->children.count != 0 || XMLNodeChildrenCount(lazy.root) != 2) {
+    fprintf(stderr, "lazy: the root's children should be built on first access\n");
+    exit(1);
+  }
+  XMLNode *book = XMLNodeChildrenGet(lazy.root, 1);
+  if (book->lazy == NULL || strcmp(book->attrList.attrs[0].value, "WEB") != 0) {
+    fprintf(stderr, "lazy: a book should have its attributes but not its children\n");
+    exit(1);
+  }
 
-  fprintf(stdout, "\n============Pretty Print============\n");
-  XMLPrettyPrint(&doc, NULL, 4); /* output to console */
+  /* xpath expands what it walks */
+  XPathExpr *titles = xpath_compile("//title");
+  XPathValue value;
+  xpath_evaluate(titles, lazy.root, &value);
+  printf("lazy: //title = %zu\n", value.nodes.count);
+  if (value.nodes.count != 4) {
+    fprintf(stderr, "lazy: xpath missed nodes\n");
+    exit(1);
+  }
+  xpath_value_free(&value);
+  xpath_expr_free(titles);
 
-  /* Output to file */
-  //FILE *out = fopen("./log.txt", "w");
-  //XMLPrettyPrint(&doc, out, 4);
-  //fclose(out);
+  if (!XMLDocumentExpandAll(&lazy) || !snapshot_test_same(full.root, lazy.root)) {
+    fprintf(stderr, "lazy: the expanded tree differs\n");
+    exit(1);
+  }
+  XMLDocumentFree(&full);
+  XMLDocumentFree(&lazy);
 
-  if (strcmp(filename, "./test.xml") == 0) {
-    Test_testxml(&doc);
-  } else if (strcmp(filename, "./simple.xml") == 0) {
-    Test_simplexml(&doc);
-  } else if (strcmp(filename, "./test2.xml") == 0) {
-    Test_test2xml(&doc);
-  } else if (strcmp(filename, "./test4.xml") == 0) {
-    Test_test4xml(&doc);
-  } else if (strcmp(filename, "./cdata.xml") == 0) {
-    Test_cdataxml(&doc);
-  } else if (strcmp(filename, "./doctype.xml") == 0) {
-    Test_doctypexml(&doc);
+  /* with a context, and an error found only when the broken element is reached */
+  XMLParserContext ctx;
+  XMLParserContextInit(&ctx);
+  XMLDocumentInitWithContext(&lazy, &ctx);
+  const char *broken = "<a><b><c></d></b></a>";
+  if (!XMLDocumentParseStrLazy(&lazy, broken, 1)) {
+    fprintf(stderr, "lazy: %s should parse until <b> is built\n", broken);
+    exit(1);
+  }
+  XMLNode *b = XMLNodeChildrenGet(lazy.root, 0);
+  const XMLError *error = XMLDocumentGetError(&lazy);
+  if (b == NULL || XMLNodeExpand(b) || XMLNodeChildrenCount(b) != 1 || (error = XMLDocumentGetError(&lazy)) == NULL ||
+      error->code != XML_ERROR_MISMATCHED_TAG || error->offset != 11) {
+    fprintf(stderr, "lazy: the mismatched tag wasn't reported\n");
+    exit(1);
+  }
+  XMLDocumentFree(&lazy);
+  XMLParserContextFree(&ctx);
+}
+
+/* prefixes resolve to the same atoms whatever they are, in every kind of document */
+static void namespace_test(void) {
+  const char *xml =
+    "<catalog xmlns='urn:catalog' xmlns:b='urn:books'>"
+      "<b:book b:id='1' lang='en'><b:title>XML</b:title></b:book>"
+      "<bk:book xmlns:bk='urn:books'><bk:title>C</bk:title></bk:book>"
+      "<book><title>not a b:book</title></book>"
+      "<plain xmlns=''><b:book/><x:book/></plain>"
+    "</catalog>";
+  XMLDocument doc = { 0 }, lazy = { 0 };
+
+  if (!XMLDocumentParseStr(&doc, xml) || !XMLDocumentParseStrLazy(&lazy, xml, 1)) {
+    fprintf(stderr, "namespaces: parse failed\n");
+    exit(1);
+  }
+  XMLAtom catalog = XMLAtomIntern("urn:catalog"), books = XMLAtomIntern("urn:books"), book = XMLAtomIntern("book");
+  XMLNode *plain = XMLNodeChildrenGet(doc.root, 3);
+  XMLNode *unbound = XMLNodeChildrenGet(plain, 1);
+  const XMLAttr *id = &XMLNodeChildrenGet(doc.root, 0)->attrList.attrs[0];
+  const XMLAttr *lang = &XMLNodeChildrenGet(doc.root, 0)->attrList.attrs[1];
+  if (doc.root->ns != catalog || strcmp(XMLNodeLocalName(doc.root), "catalog") != 0 || plain->ns != 0 ||
+      unbound->ns != 0 || strcmp(XMLNodeLocalName(unbound), "x:book") != 0 ||
+      id->ns != books || lang->ns != 0 || strcmp(XMLAtomString(id->local), "id") != 0 ||
+      doc.root->attrList.attrs[0].ns != XMLAtomIntern(XML_NAMESPACE_XMLNS)) {
+    fprintf(stderr, "namespaces: wrong atoms\n");
+    exit(1);
+  }
+
+  XMLNodeList *found = XMLFindNodeNS(doc.root, books, book);
+  XMLNodeList *in_catalog = XMLFindNodeNS(doc.root, catalog, book);
+  printf("namespaces: %zu urn:books books, %zu urn:catalog book\n", found->count, in_catalog->count);
+  if (found->count != 2 || in_catalog->count != 1) {
+    fprintf(stderr, "XMLFindNodeNS failed\n");
+    exit(1);
+  }
+  free(found->nodes);
+  free(found);
+  free(in_catalog->nodes);
+  free(in_catalog);
+
+  /* the prefixes of the query are not the document's */
+  static const char *const namespaces[] = { "c", "urn:catalog", "books", "urn:books", NULL };
+  XPathExpr *titles = xpath_compile_ns("//books:book/books:title | /c:catalog/c:book/c:title", namespaces);
+  XPathExpr *uri = xpath_compile_ns("namespace-uri(//books:*[@books:id])", namespaces);
+  XPathValue value, uri_value;
+  if (titles == NULL || uri == NULL || xpath_compile_ns("//x:book", namespaces) != NULL ||
+      !xpath_evaluate(titles, lazy.root, &value) || !xpath_evaluate(uri, doc.root, &uri_value)) {
+    fprintf(stderr, "xpath_compile_ns failed\n");
+    exit(1);
+  }
+  printf("namespaces: %zu titles, %s\n", value.nodes.count, uri_value.string);
+  if (value.nodes.count != 3 || strcmp(uri_value.string, "urn:books") != 0) {
+    fprintf(stderr, "xpath_compile_ns: wrong result\n");
+    exit(1);
   }
+  xpath_value_free(&value);
+  xpath_value_free(&uri_value);
+  xpath_expr_free(titles);
+  xpath_expr_free(uri);
 
+  if (!XMLDocumentExpandAll(&lazy) || !snapshot_test_same(doc.root, lazy.root)) {
+    fprintf(stderr, "namespaces: the lazy tree has other atoms\n");
+    exit(1);
+  }
+  XMLDocumentFree(&lazy);
   XMLDocumentFree(&doc);
+}
 
-  /* XPATH TEST */
-  fprintf(stdout, "\n\n============XPATH============\n");
-  xpath_test();
+/* names of the children of `node`, checking that their index is right */
+static void edit_test_children(XMLNode *node, char *out) {
+  out[0] = '\0';
+  for (size_t i = 0; i < XMLNodeChildrenCount(node); ++i) {
+    XMLNode *child = XMLNodeChildrenGet(node, (int)i);
+    if (XMLNodeIndex(child) != i || child->parent != node) {
+      fprintf(stderr, "edit: %s has index %zu, at %zu\n", child->name, XMLNodeIndex(child), i);
+      exit(1);
+    }
+    if (i > 0) strcat(out, ",");
+    strcat(out, child->name);
+  }
+}
+
+/* edits keep the tree consistent for the query functions, with or without a context */
+static void edit_test_doc(XMLDocument *doc) {
+  static const char *const namespaces[] = { "n", "urn:n", NULL };
+  char names[256];
+  XPathExpr *count = xpath_compile("count(/list/*)");
+  XPathExpr *in_n = xpath_compile_ns("/list/n:*", namespaces);
+  XPathCache *cache = xpath_cache_new(doc, 16);
+
+  if (!XMLDocumentParseStr(doc, "<list xmlns:n='urn:n'><a/><c>t</c><n:d/></list>") ||
+      xpath_cache_evaluate(cache, count, doc->root)->number != 3) {
+    fprintf(stderr, "edit: parse failed\n");
+    exit(1);
+  }
+  XMLNode *a = XMLNodeChildrenGet(doc->root, 0), *c = XMLNodeChildrenGet(doc->root, 1);
+  XMLNode *b = XMLNodeCreate(doc, "b"), *e = XMLNodeCreate(doc, "n:e");
+  if (!XMLNodeInsertBefore(doc, c, b) || !XMLNodeAppendChild(doc, doc->root, e) || XMLNodeNextSibling(b) != c ||
+      XMLNodeAppendChild(doc, doc->root, b) || XMLNodeAppendChild(doc, b, doc->root)) {
+    fprintf(stderr, "edit: insert failed\n");
+    exit(1);
+  }
+  edit_test_children(doc->root, names);
+  const XPathValue *n = NULL;
+  if (strcmp(names, "a,b,c,n:d,n:e") != 0 || xpath_cache_evaluate(cache, count, doc->root)->number != 5 ||
+      (n = xpath_cache_evaluate(cache, in_n, doc->root))->nodes.count != 2 || n->nodes.items[1].node != e) {
+    fprintf(stderr, "edit: after inserting, %s\n", names);
+    exit(1);
+  }
+
+  if (!XMLNodeSetAttribute(doc, b, "title", "x < y & \"z\"") || !XMLNodeSetAttribute(doc, b, "id", "1") ||
+      !XMLNodeSetAttribute(doc, b, "title", NULL) || !XMLNodeSetText(doc, b, "1 < 2") ||
+      b->attrList.count != 1 || strcmp(b->attrList.attrs[0].value, "1") != 0 || strcmp(XMLDecodeText(b), "1 < 2") != 0 ||
+      !XMLNodeSetAttribute(doc, e, "kind", "a&b") || strcmp(e->attrList.attrs[0].value, "a&amp;b") != 0 ||
+      !XMLNodeSetAttribute(doc, c, "n:k", "v") || c->attrList.attrs[0].ns == 0 || b->type != NT_TEXT) {
+    fprintf(stderr, "edit: setting attributes or text failed\n");
+    exit(1);
+  }
+
+  /* c moves to the front in a's place, a goes away */
+  if (XMLNodeDetach(doc, c) != c || XMLNodeReplace(doc, a, c) != a || a->parent != NULL) {
+    fprintf(stderr, "edit: detach or replace failed\n");
+    exit(1);
+  }
+  XMLNodeDelete(doc, a);
+  XMLNodeDelete(doc, XMLNodeChildrenGet(doc->root, 2));
+  edit_test_children(doc->root, names);
+  if (strcmp(names, "c,b,n:e") != 0 || xpath_cache_evaluate(cache, count, doc->root)->number != 3 ||
+      XMLSelectNode(doc->root, "/list/b")->text == NULL) {
+    fprintf(stderr, "edit: after moving, %s\n", names);
+    exit(1);
+  }
+  printf("edit: %s\n", names);
+
+  xpath_cache_free(cache);
+  xpath_expr_free(count);
+  xpath_expr_free(in_n);
+}
+
+static void edit_test(void) {
+  XMLParserContext ctx;
+  XMLDocument doc = { 0 };
+
+  edit_test_doc(&doc);
+  XMLDocumentFree(&doc);
+
+  XMLParserContextInit(&ctx);
+  XMLDocumentInitWithContext(&doc, &ctx);
+  edit_test_doc(&doc);
+  if (ctx.free_nodes.count != 2) { /* a & n:d came back */
+    fprintf(stderr, "edit: deleted nodes not recycled\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+  XMLParserContextFree(&ctx);
+}
+
+/* a copied subtree is the same as the original, and outlives its document */
+static void clone_test(void) {
+  const char *xml =
+    "<records xmlns:m='urn:meta'>"
+      "<record id='1'><name>one</name></record>"
+      "<record id='2' m:state='new'><name>two &amp; more</name><!--c--><tags><tag/><tag/></tags></record>"
+    "</records>";
+  XMLDocument src = { 0 }, full = { 0 }, part = { 0 };
+  XMLParserContext ctx;
+  XMLDocument target;
+
+  XMLParserContextInit(&ctx);
+  XMLDocumentInitWithContext(&target, &ctx);
+  if (!XMLDocumentParseStrLazy(&src, xml, 1) || !XMLDocumentParseStr(&full, xml) ||
+      !XMLDocumentParseStr(&target, "<batch/>")) {
+    fprintf(stderr, "clone: parse failed\n");
+    exit(1);
+  }
+  /* from a lazy document: the subtree is built on the way */
+  XMLNode *expected = XMLNodeClone(&full, XMLNodeChildrenGet(full.root, 1));
+  if (!XMLDocumentFromSubtree(&part, XMLNodeChildrenGet(src.root, 1))) {
+    fprintf(stderr, "XMLDocumentFromSubtree failed\n");
+    exit(1);
+  }
+  XMLNode *copy = XMLNodeClone(&target, XMLNodeChildrenGet(src.root, 1));
+  XMLDocumentFree(&src);
+
+  if (expected == NULL || copy == NULL || !snapshot_test_same(expected, part.root) || !snapshot_test_same(expected, copy) ||
+      !XMLNodeAppendChild(&target, target.root, copy) || XMLNodeSetText(&part, part.root, "read only")) {
+    fprintf(stderr, "clone: copies differ\n");
+    exit(1);
+  }
+  XMLNodeList *tags = XMLFindNode(XMLSelectNode(part.root, "/record/tags"), "tag");
+  XPathExpr *expr = xpath_compile("string(/batch/record/@*[local-name() = 'state'])");
+  XPathValue state;
+  if (expr == NULL || !xpath_evaluate(expr, target.root, &state)) {
+    fprintf(stderr, "clone: xpath failed\n");
+    exit(1);
+  }
+  printf("clone: %s, %zu tags, state %s\n", XMLDecodeText(XMLSelectNode(part.root, "/record/name")), tags->count,
+         state.string);
+  if (tags->count != 2 || strcmp(state.string, "new") != 0) {
+    fprintf(stderr, "clone: wrong copy\n");
+    exit(1);
+  }
+  free(tags->nodes);
+  free(tags);
+  xpath_value_free(&state);
+  xpath_expr_free(expr);
+
+  XMLNodeDelete(&full, expected);
+  XMLDocumentFree(&full);
+  XMLDocumentFree(&part);
+  XMLDocumentFree(&target);
+  XMLParserContextFree(&ctx);
+}
+
+/* differences, as "changed a, inserted f" */
+static bool diff_test_report(XMLDiffType type, XMLNode *old_node, XMLNode *new_node, void *user_data) {
+  static const char *const names[] = { "changed", "replaced", "inserted", "removed" };
+  char *out = (char *)user_data;
+  if (out[0] != '\0') strcat(out, ", ");
+  strcat(out, names[type]);
+  strcat(out, " ");
+  strcat(out, (new_node ? new_node : old_node)->name);
+  return true;
+}
+
+static void diff_test(void) {
+  XMLDocument old_doc = { 0 }, new_doc = { 0 };
+  char out[256] = "";
+
+  if (!XMLDocumentParseStr(&old_doc, "<r><a x='1'>t</a><b/><!--c--><c><d/></c><e/></r>") ||
+      !XMLDocumentParseStr(&new_doc, "<r><a x='2'>t</a><b/><!--c--><c><d/><f/></c></r>")) {
+    fprintf(stderr, "diff: parse failed\n");
+    exit(1);
+  }
+  size_t count = XMLDocumentDiff(&old_doc, &new_doc, diff_test_report, out);
+  printf("diff: %s\n", out);
+  if (count != 3 || strcmp(out, "changed a, inserted f, removed e") != 0) {
+    fprintf(stderr, "diff: wrong differences\n");
+    exit(1);
+  }
+
+  /* edits drop the hashes they make stale */
+  XMLNode *a = XMLNodeChildrenGet(new_doc.root, 0);
+  XMLNode *e = XMLNodeCreate(&new_doc, "e");
+  if (!XMLNodeSetAttribute(&new_doc, a, "x", "1") || !XMLNodeAppendChild(&new_doc, new_doc.root, e) ||
+      XMLDocumentDiff(&old_doc, &new_doc, NULL, NULL) != 1) {
+    fprintf(stderr, "diff: stale hash after editing\n");
+    exit(1);
+  }
+  XMLNodeDelete(&new_doc, XMLSelectNode(new_doc.root, "/r/c/f"));
+  if (XMLNodeHash(old_doc.root) != XMLNodeHash(new_doc.root) || XMLDocumentDiff(&old_doc, &new_doc, NULL, NULL) != 0) {
+    fprintf(stderr, "diff: stale hash after editing\n");
+    exit(1);
+  }
+  XMLDocumentFree(&old_doc);
+  XMLDocumentFree(&new_doc);
+}
+
+/* hashes computed while parsing are the ones XMLNodeHash computes afterwards */
+static void hash_test(void) {
+  const char *xml = "<feed><record id='1'><title>a</title><!--x--></record><record id='2'><title>b</title></record>"
+                    "<record id='1'><title>a</title><!--x--></record></feed>";
+  XMLDocument hashed = { 0 }, plain = { 0 }, lazy = { 0 };
+
+  XMLDocumentHashOnParse(&hashed, true);
+  XMLDocumentHashOnParse(&lazy, true);
+  if (!XMLDocumentParseStr(&hashed, xml) || !XMLDocumentParseStr(&plain, xml) || !XMLDocumentParseStrLazy(&lazy, xml, 2)) {
+    fprintf(stderr, "hash: parse failed\n");
+    exit(1);
+  }
+  XMLNode *first = XMLNodeChildrenGet(hashed.root, 0), *second = XMLNodeChildrenGet(hashed.root, 1);
+  XMLNode *third = XMLNodeChildrenGet(hashed.root, 2);
+  if (hashed.root->hash == 0 || first->hash != third->hash || first->hash == second->hash || plain.root->hash != 0 ||
+      hashed.root->hash != XMLNodeHash(plain.root)) {
+    fprintf(stderr, "hash: wrong hash after parsing\n");
+    exit(1);
+  }
+  /* the records are lazy: they and the root are hashed when asked */
+  if (lazy.root->hash != 0 || XMLNodeHash(lazy.root) != hashed.root->hash) {
+    fprintf(stderr, "hash: wrong hash of a lazy document\n");
+    exit(1);
+  }
+  printf("hash: %s\n", first->hash == third->hash ? "records 1 & 3 are the same" : "records differ");
+  XMLDocumentFree(&hashed);
+  XMLDocumentFree(&plain);
+  XMLDocumentFree(&lazy);
+}
+
+/* replace `removed` bytes at `at`(found in the contents) with `text`, and check the tree
+ * against a full parse of the new contents
+ * */
+static XMLNode *reparse_test_apply(XMLDocument *doc, const char *at, size_t removed, const char *text) {
+  XMLDocument full = { 0 };
+  size_t offset = (size_t)(strstr(doc->contents, at) - doc->contents);
+  XMLNode *node = XMLDocumentReparse(doc, offset, removed, text, strlen(text));
+  bool ok = XMLDocumentParseStr(&full, doc->contents);
+
+  if ((node != NULL) != ok || (ok && (XMLDocumentDiff(&full, doc, NULL, NULL) != 0 ||
+                                      XMLNodeHash(full.root) != XMLNodeHash(doc->root)))) {
+    fprintf(stderr, "reparse: tree differs from a full parse of %s\n", doc->contents);
+    exit(1);
+  }
+  XMLDocumentFree(&full);
+  return node;
+}
+
+static void reparse_test_doc(XMLDocument *doc, bool lazy) {
+  const char *xml = "<list xmlns:n='urn:n'><item id='1'>one</item><!--c--><item id='2'>two</item>"
+                    "<n:item id='3'><n:b>x</n:b></n:item></list>";
+  if (!(lazy ? XMLDocumentParseStrLazy(doc, xml, 1) : XMLDocumentParseStr(doc, xml))) {
+    fprintf(stderr, "reparse: parse failed\n");
+    exit(1);
+  }
+  XMLNode *root = doc->root;
+  XMLNode *one = XMLNodeChildrenGet(root, 0), *three = XMLNodeChildrenGet(root, 3);
+
+  /* inside an element: only that one is new */
+  XMLNode *two = reparse_test_apply(doc, "two", 3, "TWO");
+  if (two == NULL || two != XMLNodeChildrenGet(root, 2) || strcmp(two->text, "TWO") != 0 || doc->root != root ||
+      XMLNodeChildrenGet(root, 0) != one || XMLNodeChildrenGet(root, 3) != three) {
+    fprintf(stderr, "reparse: text edit\n");
+    exit(1);
+  }
+  /* after the first edit the index has moved */
+  XMLNode *b = reparse_test_apply(doc, "x</n:b>", 1, "xyz");
+  if (b == NULL || b->parent != three || b->ns == 0 || strcmp(b->text, "xyz") != 0) {
+    fprintf(stderr, "reparse: nested edit\n");
+    exit(1);
+  }
+  /* the tags of `one` change: its parent is parsed again */
+  if (reparse_test_apply(doc, "ne</item>", 0, "</item><item id='4'>") != doc->root ||
+      XMLNodeChildrenCount(doc->root) != 5) {
+    fprintf(stderr, "reparse: tag edit\n");
+    exit(1);
+  }
+  /* a broken document, then fixed */
+  if (reparse_test_apply(doc, "><item", 1, "") != NULL || XMLDocumentGetError(doc) == NULL ||
+      reparse_test_apply(doc, "<item", 0, ">") == NULL || XMLDocumentGetError(doc) != NULL) {
+    fprintf(stderr, "reparse: error recovery\n");
+    exit(1);
+  }
+  /* edits next to each other, the index splice being checked by each one */
+  for (int i = 0; i < 20; ++i) {
+    XMLNode *node = reparse_test_apply(doc, "</n:b>", 0, i % 2 ? "<c/>" : "t");
+    if (node == NULL || strcmp(node->name, "n:b") != 0) {
+      fprintf(stderr, "reparse: repeated edit\n");
+      exit(1);
+    }
+  }
+}
+
+static void reparse_test(void) {
+  XMLParserContext ctx;
+  XMLDocument doc = { 0 };
+
+  reparse_test_doc(&doc, false);
+  printf("reparse: %s\n", doc.contents);
+  XMLDocumentFree(&doc);
+
+  reparse_test_doc(&doc, true);
+  XMLDocumentFree(&doc);
+
+  XMLParserContextInit(&ctx);
+  XMLDocumentInitWithContext(&doc, &ctx);
+  reparse_test_doc(&doc, false);
+  XMLDocumentFree(&doc);
+  XMLParserContextFree(&ctx);
+}
+
+/* canonical form of `doc` in memory */
+static char *c14n_test_write(const XMLDocument *doc, bool with_comments) {
+  XMLWriter w;
+  XMLWriterInit(&w, NULL, NULL);
+  if (!XMLDocumentWriteC14N(&w, doc, with_comments) || !XMLWriterPutChar(&w, '\0')) {
+    fprintf(stderr, "c14n: write failed\n");
+    exit(1);
+  }
+  return w.data;
+}
+
+/* the examples of the C14N recommendation(3.3 & 3.4) which don't need a DTD */
+static void c14n_test(void) {
+  const char *tags =
+    "<?xml version=\"1.0\"?>\n<?xml-stylesheet   href=\"doc.xsl\"\n   type=\"text/xsl\"   ?>\n<!--top-->\n"
+    "<doc>\n"
+    "   <e1   />\n   <e2   ></e2>\n"
+    "   <e3   name = \"elem3\"   id=\"elem3\"   />\n"
+    "   <e5 a:attr=\"out\" b:attr=\"sorted\" attr2=\"all\" attr=\"I'm\"\n"
+    "      xmlns:b=\"http://www.ietf.org\"\n      xmlns:a=\"http://www.w3.org\"\n      xmlns=\"http://example.org\"/>\n"
+    "   <e6 xmlns=\"\" xmlns:a=\"http://www.w3.org\">\n"
+    "      <e7 xmlns=\"http://www.ietf.org\">\n"
+    "         <e8 xmlns=\"\" xmlns:a=\"http://www.w3.org\">\n"
+    "            <e9 xmlns=\"\" xmlns:a=\"http://www.ietf.org\"/>\n"
+    "         </e8>\n      </e7>\n   </e6>\n"
+    "</doc>";
+  const char *tags_c14n =
+    "<?xml-stylesheet href=\"doc.xsl\"\n   type=\"text/xsl\"   ?>\n"
+    "<doc>\n"
+    "   <e1></e1>\n   <e2></e2>\n"
+    "   <e3 id=\"elem3\" name=\"elem3\"></e3>\n"
+    "   <e5 xmlns=\"http://example.org\" xmlns:a=\"http://www.w3.org\" xmlns:b=\"http://www.ietf.org\" "
+    "attr=\"I'm\" attr2=\"all\" b:attr=\"sorted\" a:attr=\"out\"></e5>\n"
+    "   <e6 xmlns:a=\"http://www.w3.org\">\n"
+    "      <e7 xmlns=\"http://www.ietf.org\">\n"
+    "         <e8 xmlns=\"\">\n"
+    "            <e9 xmlns:a=\"http://www.ietf.org\"></e9>\n"
+    "         </e8>\n      </e7>\n   </e6>\n"
+    "</doc>";
+  const char *chars =
+    "<doc>"
+    "<text>First line&#x0d;&#10;Second line</text>"
+    "<value>&#x32;</value>"
+    "<compute><![CDATA[value>\"0\" && value<\"10\" ?\"valid\":\"error\"]]></compute>"
+    "<compute expr='value>\"0\" &amp;&amp; value&lt;\"10\" ?\"valid\":\"error\"'>valid</compute>"
+    "<norm attr=' &apos;   &#x20;&#13;&#xa;&#9;   &apos; '/>"
+    "<!--in--></doc>";
+  const char *chars_c14n =
+    "<doc>"
+    "<text>First line&#xD;\nSecond line</text>"
+    "<value>2</value>"
+    "<compute>value&gt;\"0\" &amp;&amp; value&lt;\"10\" ?\"valid\":\"error\"</compute>"
+    "<compute expr=\"value>&quot;0&quot; &amp;&amp; value&lt;&quot;10&quot; ?&quot;valid&quot;:&quot;error&quot;\">valid</compute>"
+    "<norm attr=\" '    &#xD;&#xA;&#x9;   ' \"></norm>"
+    "<!--in--></doc>";
+  XMLDocument doc = { 0 };
+
+  if (!XMLDocumentParseStr(&doc, tags)) {
+    fprintf(stderr, "c14n: parse failed\n");
+    exit(1);
+  }
+  char *out = c14n_test_write(&doc, false);
+  if (strcmp(out, tags_c14n) != 0) {
+    fprintf(stderr, "c14n: got\n%s\nexpected\n%s\n", out, tags_c14n);
+    exit(1);
+  }
+  free(out);
+
+  /* a subset gets the declarations in scope */
+  XMLWriter w;
+  XMLWriterInit(&w, NULL, NULL);
+  XMLNode *e8 = XMLSelectNode(doc.root, "/doc/e6/e7/e8");
+  if (!XMLNodeWriteC14N(&w, &doc, e8, false) || !XMLWriterPutChar(&w, '\0') ||
+      strcmp(w.data, "<e8 xmlns:a=\"http://www.w3.org\">\n            <e9 xmlns:a=\"http://www.ietf.org\"></e9>\n         </e8>") != 0) {
+    fprintf(stderr, "c14n: subset %s\n", w.data);
+    exit(1);
+  }
+  XMLWriterFree(&w);
+  XMLDocumentFree(&doc);
+
+  if (!XMLDocumentParseStr(&doc, chars)) {
+    fprintf(stderr, "c14n: parse failed\n");
+    exit(1);
+  }
+  out = c14n_test_write(&doc, true);
+  printf("c14n: %s\n", out);
+  if (strcmp(out, chars_c14n) != 0) {
+    fprintf(stderr, "c14n: expected\n%s\n", chars_c14n);
+    exit(1);
+  }
+  free(out);
+  XMLDocumentFree(&doc);
+
+  /* mixed content & whitespace in document order, from a full or lazy parse */
+  const char *mixed = "<r>\n <a>x<b/>y <!--c-->z&amp;<![CDATA[<]]></a>\n</r>\n<!--after-->\n";
+  const char *mixed_c14n = "<r>\n <a>x<b></b>y <!--c-->z&amp;&lt;</a>\n</r>\n<!--after-->";
+  for (int lazy = 0; lazy < 2; ++lazy) {
+    if (!(lazy ? XMLDocumentParseStrLazy(&doc, mixed, 1) : XMLDocumentParseStr(&doc, mixed))) {
+      fprintf(stderr, "c14n: parse failed\n");
+      exit(1);
+    }
+    out = c14n_test_write(&doc, true);
+    if (strcmp(out, mixed_c14n) != 0) {
+      fprintf(stderr, "c14n: mixed content\n%s\nexpected\n%s\n", out, mixed_c14n);
+      exit(1);
+    }
+    free(out);
+    XMLWriterInit(&w, NULL, NULL);
+    if (!XMLNodeWriteC14N(&w, &doc, XMLSelectNode(doc.root, "/r/a"), false) || !XMLWriterPutChar(&w, '\0') ||
+        strcmp(w.data, "<a>x<b></b>y z&amp;&lt;</a>") != 0) {
+      fprintf(stderr, "c14n: mixed subset %s\n", w.data);
+      exit(1);
+    }
+    XMLWriterFree(&w);
+    XMLDocumentFree(&doc);
+  }
+
+  /* an edited tree is written as it is */
+  if (!XMLDocumentParseStr(&doc, "<a>x<b/>y</a>") || !XMLNodeSetText(&doc, doc.root, "t")) {
+    fprintf(stderr, "c14n: edit failed\n");
+    exit(1);
+  }
+  out = c14n_test_write(&doc, true);
+  if (strcmp(out, "<a>t<b></b></a>") != 0) {
+    fprintf(stderr, "c14n: edited tree %s\n", out);
+    exit(1);
+  }
+  free(out);
+  XMLDocumentFree(&doc);
+}
+
+/* UTF-16 & Latin-1 inputs come out as UTF-8, with Unicode names; invalid input is an error */
+static void encoding_test(void) {
+  /* <café ñ="ü">日本</café>, UTF-16LE with BOM */
+  static const unsigned char utf16[] = {
+    0xFF, 0xFE, '<', 0, 'c', 0, 'a', 0, 'f', 0, 0xE9, 0, ' ', 0, 0xF1, 0, '=', 0, '"', 0, 0xFC, 0, '"', 0, '>', 0,
+    0xE5, 0x65, 0x2C, 0x67, '<', 0, '/', 0, 'c', 0, 'a', 0, 'f', 0, 0xE9, 0, '>', 0
+  };
+  const char *path = "./utf16.xml";
+  XMLDocument doc = { 0 };
+
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL || fwrite(utf16, 1, sizeof(utf16), fp) != sizeof(utf16) || fclose(fp) != 0) {
+    fprintf(stderr, "can't write %s\n", path);
+    exit(1);
+  }
+  bool ok = XMLDocumentParseFile(&doc, path);
+  unlink(path);
+  if (!ok || strcmp(doc.root->name, "caf\xC3\xA9") != 0 || strcmp(doc.root->attrList.attrs[0].key, "\xC3\xB1") != 0 ||
+      strcmp(doc.root->attrList.attrs[0].value, "\xC3\xBC") != 0 || strcmp(doc.root->text, "\xE6\x97\xA5\xE6\x9C\xAC") != 0) {
+    fprintf(stderr, "UTF-16 input: wrong tree\n");
+    exit(1);
+  }
+  printf("encoding: UTF-16 <%s> %s\n", doc.root->name, doc.root->text);
+  XMLDocumentFree(&doc);
+
+  /* in memory, the length is given: the zero bytes of UTF-16 don't end it */
+  char utf16_buffer[sizeof(utf16) + 1];
+  memcpy(utf16_buffer, utf16, sizeof(utf16));
+  utf16_buffer[sizeof(utf16)] = '\0';
+  if (!XMLValidateBuffer(utf16_buffer, sizeof(utf16), NULL)) {
+    fprintf(stderr, "UTF-16 buffer: not valid\n");
+    exit(1);
+  }
+
+  /* a U+0000 unit inside a vector block must not cut the document to `<a/>` */
+  unsigned char nul16[2 + 2 * 26] = { 0xFF, 0xFE };
+  const char *nul_text = "<a/>                \0<junk";
+  for (size_t i = 0; i < 26; ++i) nul16[2 + 2 * i] = (unsigned char)nul_text[i];
+  XMLError nul_error;
+  fp = fopen(path, "wb");
+  if (fp == NULL || fwrite(nul16, 1, sizeof(nul16), fp) != sizeof(nul16) || fclose(fp) != 0) {
+    fprintf(stderr, "can't write %s\n", path);
+    exit(1);
+  }
+  ok = XMLDocumentParseFile(&doc, path) || XMLDocumentGetError(&doc)->code != XML_ERROR_ENCODING ||
+       XMLValidateFile(path, &nul_error) || nul_error.code != XML_ERROR_ENCODING;
+  unlink(path);
+  if (ok) {
+    fprintf(stderr, "UTF-16 NUL unit not reported\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+
+  /* the declaration names the encoding */
+  if (!XMLDocumentParseStr(&doc, "<?xml version=\"1.0\" encoding=\"ISO-8859-1\"?><a>caf\xE9</a>") ||
+      strcmp(doc.root->text, "caf\xC3\xA9") != 0) {
+    fprintf(stderr, "ISO-8859-1 input: wrong text\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+  if (!XMLDocumentParseStr(&doc, "<?xml version='1.0' encoding='windows-1252'?><a>\x80 5</a>") ||
+      strcmp(doc.root->text, "\xE2\x82\xAC 5") != 0) {
+    fprintf(stderr, "windows-1252 input: wrong text\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+
+  /* UTF-8 names & BOM */
+  if (!XMLDocumentParseStr(&doc, "\xEF\xBB\xBF<\xE6\x97\xA5\xE6\x9C\xAC \xC3\xA9t\xC3\xA9=\"1\"/>") ||
+      strcmp(doc.root->name, "\xE6\x97\xA5\xE6\x9C\xAC") != 0 || !XMLValidateStr("\xEF\xBB\xBF<\xC3\xA9/>", NULL)) {
+    fprintf(stderr, "UTF-8 names: parse failed\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+
+  /* an overlong '/', and an encoding we don't convert */
+  const XMLError *error = NULL;
+  if (XMLDocumentParseStr(&doc, "<a>\xC0\xAF</a>") || (error = XMLDocumentGetError(&doc)) == NULL ||
+      error->code != XML_ERROR_ENCODING || error->offset != 3) {
+    fprintf(stderr, "invalid UTF-8 not reported\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+  if (XMLDocumentParseStr(&doc, "<?xml version='1.0' encoding='EBCDIC'?><a/>") || XMLDocumentGetError(&doc)->code != XML_ERROR_ENCODING) {
+    fprintf(stderr, "unsupported encoding not reported\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+
+  /* the vector loop and the tail find the same first bad byte */
+  char text[100];
+  memset(text, 'x', sizeof(text));
+  for (size_t bad = 0; bad < sizeof(text); bad += 7) {
+    text[bad] = (char)0xFF;
+    if (XMLUTF8Validate(text, sizeof(text)) != bad) {
+      fprintf(stderr, "XMLUTF8Validate missed byte %zu\n", bad);
+      exit(1);
+    }
+    text[bad] = 'x';
+  }
+  printf("encoding ok\n");
+}
+
+/* well-formedness without a tree: the result & error offset of each payload, the same as the parser's */
+static void validate_test(void) {
+  static const struct {
+    const char *xml;
+    bool valid;
+    size_t offset;
+    XMLErrorCode code;
+  } cases[] = {
+    {"<a x=\"1\" y='2'><b>text</b><c/><!--c--><![CDATA[<x>]]></a>", true, 0, XML_OK},
+    {"<?xml version=\"1.0\"?>\n<!--c--><a/>", true, 0, XML_OK},
+    {"<a><b></a>", false, 8, XML_ERROR_MISMATCHED_TAG},
+    {"<a><ab></a></ab>", false, 9, XML_ERROR_MISMATCHED_TAG},
+    {"<a x=\"1\" x=\"2\"/>", false, 9, XML_ERROR_DUPLICATE_ATTRIBUTE},
+    {"<a x=1/>", false, 5, XML_ERROR_UNEXPECTED_TOKEN},       /* unquoted value */
+    {"<a x=\"1/>", false, 5, XML_ERROR_UNEXPECTED_TOKEN},     /* unterminated value */
+    {"<a/><b/>", false, 4, XML_ERROR_TRAILING_CONTENT},        /* two roots */
+    {"text<a/>", false, 0, XML_ERROR_UNEXPECTED_TOKEN},
+    {"<a><!-- open</a>", false, 3, XML_ERROR_UNTERMINATED},
+    {"<a>", false, 3, XML_ERROR_UNEXPECTED_TOKEN},             /* unclosed */
+    {"<a><![CDATA[open</a>", false, 3, XML_ERROR_UNTERMINATED},
+    {"<!-- open<a/>", false, 0, XML_ERROR_UNTERMINATED},
+    {"<a/><!--c--><?pi x?>", true, 0, XML_OK},                 /* allowed after the root */
+    {"<a/><!-- open", false, 4, XML_ERROR_UNTERMINATED},
+    {"<a/><!--c-->text", false, 12, XML_ERROR_TRAILING_CONTENT},
+    {"<a b=\"<\"/>", false, 6, XML_ERROR_ATTRIBUTE_VALUE},
+    {"<a><b c='x<y'/></a>", false, 9, XML_ERROR_ATTRIBUTE_VALUE},
+  };
+
+  for (size_t i = 0; i < ARRAY_SIZE(cases); ++i) {
+    XMLError error;
+    XMLDocument doc = { 0 };
+    bool valid = XMLValidateStr(cases[i].xml, &error);
+    if (valid != cases[i].valid || error.code != cases[i].code || (!valid && error.offset != cases[i].offset)) {
+      fprintf(stderr, "XMLValidateStr(%s) = %d %s at %zu, expected %d %s at %zu\n", cases[i].xml,
+              valid, XMLErrorString(error.code), error.offset,
+              cases[i].valid, XMLErrorString(cases[i].code), cases[i].offset);
+      exit(1);
+    }
+    bool parsed = XMLDocumentParseStr(&doc, cases[i].xml);
+    if (parsed != valid || doc.error.code != error.code || (!parsed && doc.error.offset != error.offset)) {
+      fprintf(stderr, "XMLDocumentParseStr(%s) = %d %s at %zu, the validator says %d %s at %zu\n", cases[i].xml,
+              parsed, XMLErrorString(doc.error.code), doc.error.offset, valid, XMLErrorString(error.code), error.offset);
+      exit(1);
+    }
+    XMLDocumentFree(&doc);
+  }
+
+  const char *files[] = { "./test.xml", "./test2.xml", "./test4.xml", "./bookstore.xml", "./cdata.xml", "./doctype.xml" };
+  for (size_t i = 0; i < ARRAY_SIZE(files); ++i) {
+    XMLError error;
+    if (!XMLValidateFile(files[i], &error)) {
+      fprintf(stderr, "XMLValidateFile(%s) failed: %s at %zu\n", files[i], XMLErrorString(error.code), error.offset);
+      exit(1);
+    }
+  }
+  printf("validate: %zu payloads, %zu files ok\n", ARRAY_SIZE(cases), ARRAY_SIZE(files));
+}
+
+static void error_test(void) {
+  XMLDocument doc = { 0 };
+  const char *bad = "<a>\n  <b x=\"1\">\n  </c>\n</a>";
+  int line = 0, column = 0;
+
+  /* a failed parse is silent, the error says what & where */
+  if (XMLDocumentParseStr(&doc, bad)) {
+    fprintf(stderr, "XMLDocumentParseStr(%s) should fail\n", bad);
+    exit(1);
+  }
+  const XMLError *error = XMLDocumentGetError(&doc);
+  if (error == NULL || error->code != XML_ERROR_MISMATCHED_TAG) {
+    fprintf(stderr, "XMLDocumentGetError: %s\n", error ? XMLErrorString(error->code) : "NULL");
+    exit(1);
+  }
+  XMLErrorPosition(error, bad, &line, &column);
+  if (line != 3 || column != 5) {
+    fprintf(stderr, "XMLErrorPosition = %d:%d, expected 3:5\n", line, column);
+    exit(1);
+  }
+  printf("error: %s at %d:%d\n", XMLErrorString(error->code), line, column);
+  XMLDocumentFree(&doc);
+
+  if (XMLDocumentParseStr(&doc, "<a x=\"1\" x=\"2\"/>") || XMLDocumentGetError(&doc)->code != XML_ERROR_DUPLICATE_ATTRIBUTE) {
+    fprintf(stderr, "duplicate attribute not reported\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+
+  /* a miss is not an error */
+  if (!XMLDocumentParseStr(&doc, "<a><b/></a>") || XMLDocumentGetError(&doc) != NULL) {
+    fprintf(stderr, "XMLDocumentParseStr failed\n");
+    exit(1);
+  }
+  if (XMLSelectNode(doc.root, "/a/c") != NULL || XMLSelectNode(doc.root, "/a/b") == NULL) {
+    fprintf(stderr, "XMLSelectNode failed\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+}
+
+static void context_test(void) {
+  const char *message = "<order id=\"42\"><item sku=\"a1\">Apple</item><item sku=\"b2\">Banana</item><!--note--></order>";
+  XMLParserContext ctx;
+  XMLDocument doc;
+  XMLNode *first_root = NULL;
+
+  XMLParserContextInit(&ctx);
+  XMLDocumentInitWithContext(&doc, &ctx);
+  for (int i = 0; i < 1000; ++i) {
+    if (!XMLDocumentParseStr(&doc, message)) {
+      fprintf(stderr, "XMLDocumentParseStr with context failed!\n");
+      exit(1);
+    }
+    XMLNode *item = XMLSelectNode(XML_ROOT(&doc), "/order/item[2]");
+    if (item == NULL || strcmp(item->text, "Banana") != 0 || strcmp(item->attrList.attrs[0].value, "b2") != 0) {
+      fprintf(stderr, "context parse %d gave wrong tree\n", i);
+      exit(1);
+    }
+    if (first_root == NULL) first_root = XML_ROOT(&doc);
+    if (XML_ROOT(&doc) != first_root) { /* nodes must come back from the context */
+      fprintf(stderr, "context parse %d did not reuse nodes\n", i);
+      exit(1);
+    }
+    XMLDocumentReset(&doc);
+  }
+  printf("context parse: %d documents, %zu free nodes, %zu names\n", 1000, ctx.free_nodes.count, ctx.name_count);
+
+  XMLDocumentFree(&doc);
+  XMLParserContextFree(&ctx);
+}
+
+/* expected answers, computed on the main thread before the workers start */
+typedef struct ThreadTestData {
+  XMLDocument *doc;
+  const char *price;       /* XMLSelectNode */
+  char description[256];   /* XMLDecodeText */
+  size_t food_count;       /* XMLFindNode */
+  char xpath_text[sizeof(((XPathResult *)0)->text)]; /* xpath */
+  bool failed;
+}ThreadTestData;
+
+static void *thread_test_worker(void *arg) {
+  ThreadTestData *data = (ThreadTestData *)arg;
+  XMLNode *root = XML_ROOT(data->doc);
+
+  for (int i = 0; i < 2000 && !data->failed; ++i) {
+    XMLNode *price = XMLSelectNode(root, "/breakfast_menu/food[2]/price");
+    if (price == NULL || price->text != data->price) data->failed = true;
+
+    XMLNode *description = XMLSelectNode(root, "/breakfast_menu/food[1]/description");
+    if (description == NULL || strcmp(XMLDecodeText(description), data->description) != 0) data->failed = true;
+
+    XMLNodeList *foods = XMLFindNode(root, "food");
+    if (foods == NULL || foods->count != data->food_count) data->failed = true;
+    if (foods) {
+      free(foods->nodes);
+      free(foods);
+    }
+
+    XPathResult result = xpath("/breakfast_menu/food[3]/name/text()", root);
+    if (strcmp(result.text, data->xpath_text) != 0) data->failed = true;
+    xpath_free(&result);
+  }
+  return NULL;
+}
+
+/* Many threads querying one document must all see the same, unchanged tree */
+static void thread_test(void) {
+  enum { THREADS = 8 };
+  XMLDocument doc = { 0 };
+  pthread_t threads[THREADS];
+  ThreadTestData data[THREADS];
+
+  if (!XMLDocumentParseFile(&doc, "./simple.xml")) {
+    fprintf(stderr, "XMLDocumentParseFile failed!\n");
+    exit(1);
+  }
+
+  XMLNode *root = XML_ROOT(&doc);
+  XMLNodeList *foods = XMLFindNode(root, "food");
+  XPathResult result = xpath("/breakfast_menu/food[3]/name/text()", root);
+  for (int i = 0; i < THREADS; ++i) {
+    data[i].doc = &doc;
+    data[i].price = XMLSelectNode(root, "/breakfast_menu/food[2]/price")->text;
+    snprintf(data[i].description, sizeof(data[i].description), "%s",
+             XMLDecodeText(XMLSelectNode(root, "/breakfast_menu/food[1]/description")));
+    data[i].food_count = foods->count;
+    snprintf(data[i].xpath_text, sizeof(data[i].xpath_text), "%s", result.text);
+    data[i].failed = false;
+  }
+  free(foods->nodes);
+  free(foods);
+  xpath_free(&result);
+
+  for (int i = 0; i < THREADS; ++i) pthread_create(&threads[i], NULL, thread_test_worker, &data[i]);
+  for (int i = 0; i < THREADS; ++i) pthread_join(threads[i], NULL);
+
+  for (int i = 0; i < THREADS; ++i) {
+    if (data[i].failed) {
+      fprintf(stderr, "thread %d saw a wrong query result\n", i);
+      exit(1);
+    }
+  }
+  printf("%d threads x 2000 queries: ok (description=%s)\n", THREADS, data[0].description);
+
+  XMLDocumentFree(&doc);
+}
+
+/* `//name` on 4 threads must give the same nodes, in the same order, as the serial walk */
+static void parallel_xpath_test(void) {
+  size_t size = 1 << 20, len = 0;
+  char *xml = malloc(size);
+  XMLDocument doc = { 0 };
+
+  len += snprintf(xml + len, size - len, "<catalog>");
+  for (int i = 0; i < 300; ++i) {
+    len += snprintf(xml + len, size - len, "<section id=\"%d\">", i);
+    for (int j = 0; j < i % 7; ++j) {
+      len += snprintf(xml + len, size - len, "<group><item>%d.%d</item><note>n</note></group>", i, j);
+    }
+    len += snprintf(xml + len, size - len, "<item>%d</item></section>", i);
+  }
+  snprintf(xml + len, size - len, "</catalog>");
+
+  if (!XMLDocumentParseStr(&doc, xml)) {
+    fprintf(stderr, "XMLDocumentParseStr failed!\n");
+    exit(1);
+  }
+
+  XPathResult serial = xpath("/catalog//item", doc.root);
+  XPathResult parallel = xpath_parallel("/catalog//item", doc.root, 4);
+  if (serial.nodes.count == 0 || serial.nodes.count != parallel.nodes.count) {
+    fprintf(stderr, "xpath_parallel found %zu nodes, xpath found %zu\n", parallel.nodes.count, serial.nodes.count);
+    exit(1);
+  }
+  for (size_t i = 0; i < serial.nodes.count; ++i) {
+    if (serial.nodes.nodes[i] != parallel.nodes.nodes[i]) {
+      fprintf(stderr, "xpath_parallel result %zu is out of order\n", i);
+      exit(1);
+    }
+  }
+  printf("xpath_parallel: %zu items, same as xpath\n", parallel.nodes.count);
+
+  xpath_free(&serial);
+  xpath_free(&parallel);
+  XMLDocumentFree(&doc);
+  free(xml);
+}
+
+/* JSON of `xml` in memory, NULL if the conversion failed */
+static char *json_test_convert(const char *xml, const XMLJsonOptions *options, XMLError *error) {
+  XMLWriter w;
+  XMLWriterInit(&w, NULL, NULL);
+  if (!XMLConvertJSON(&w, xml, strlen(xml), options, error) || !XMLWriterPutChar(&w, '\0')) {
+    XMLWriterFree(&w);
+    return NULL;
+  }
+  return w.data;
+}
+
+static void json_test_expect(const char *xml, const XMLJsonOptions *options, const char *expected) {
+  XMLError error;
+  char *out = json_test_convert(xml, options, &error);
+  if (out == NULL || strcmp(out, expected) != 0) {
+    fprintf(stderr, "json: got\n%s\nexpected\n%s\n", out ? out : XMLErrorString(error.code), expected);
+    exit(1);
+  }
+  free(out);
+}
+
+static void json_test(void) {
+  const char *feed =
+    "<?xml version=\"1.0\"?>\n<!-- feed -->\n"
+    "<feed id=\"1\" lang='en'>\n"
+    "  <title>News &amp; \"views\"  </title>\n"
+    "  <entry n=\"1\"><tag>a</tag><tag>b</tag></entry>\n"
+    "  <entry n=\"2\"><tag>c</tag><![CDATA[<raw>]]></entry>\n"
+    "  <note/>\n"
+    "  <entry n=\"3\">x<br/>y</entry>\n"
+    "  <line>one&#10;two\ttab</line>\n"
+    "</feed>";
+  const char *feed_json =
+    "{\"feed\":{\"@id\":\"1\",\"@lang\":\"en\",\"title\":\"News & \\\"views\\\"\","
+    "\"entry\":[{\"@n\":\"1\",\"tag\":[\"a\",\"b\"]},{\"@n\":\"2\",\"tag\":\"c\",\"#text\":\"<raw>\"}],"
+    "\"note\":null,\"entry\":{\"@n\":\"3\",\"br\":null,\"#text\":\"xy\"},\"line\":\"one\\ntwo\\ttab\"}}";
+  XMLJsonOptions options;
+  XMLError error;
+
+  json_test_expect(feed, NULL, feed_json);
+  printf("json: %s\n", feed_json);
+
+  XMLJsonOptionsInit(&options);
+  options.attr_prefix = "-";
+  options.text_key = "$";
+  json_test_expect("<a k=\"v\">t<b/></a>", &options, "{\"a\":{\"-k\":\"v\",\"b\":null,\"$\":\"t\"}}");
+  /* only consecutive repeats are grouped */
+  json_test_expect("<a><b/><c/><b/></a>", NULL, "{\"a\":{\"b\":null,\"c\":null,\"b\":null}}");
+  json_test_expect("<a k=\"\"></a>", NULL, "{\"a\":{\"@k\":\"\"}}");
+
+  /* nothing to put into a writer without a buffer yet */
+  XMLWriter empty;
+  XMLWriterInit(&empty, NULL, NULL);
+  if (!XMLWriterPut(&empty, "", 0) || empty.len != 0 || !XMLWriterFree(&empty)) {
+    fprintf(stderr, "json: an empty put failed\n");
+    exit(1);
+  }
+
+  /* without lookahead every run is decided by scanning the input, with the same result */
+  XMLJsonOptionsInit(&options);
+  options.lookahead = 0;
+  json_test_expect(feed, &options, feed_json);
+
+  size_t capacity = 1 << 20, len = 0;
+  char *big = (char *)malloc(capacity);
+  len += sprintf(big + len, "<records>");
+  for (int i = 0; i < 2000; ++i) {
+    len += sprintf(big + len, "<record id=\"%d\"><v>%d</v>%s<note>%s</note></record>", i, i,
+                   i % 3 ? "<v>again</v>" : "", i % 7 ? "" : "seventh");
+    if (i % 500 == 0) len += sprintf(big + len, "<mark/>");
+  }
+  sprintf(big + len, "</records>");
+  char *expected = json_test_convert(big, NULL, &error);
+  for (size_t lookahead = 0; lookahead < 100000; lookahead = lookahead * 8 + 1) {
+    options.lookahead = lookahead;
+    json_test_expect(big, &options, expected);
+  }
+  free(expected);
+  free(big);
+
+  /* the first error, as XMLValidateStr reports it */
+  if (json_test_convert("<a><b></a>", NULL, &error) != NULL || error.code != XML_ERROR_MISMATCHED_TAG || error.offset != 8 ||
+      json_test_convert("<a/><b/>", NULL, &error) != NULL || error.code != XML_ERROR_TRAILING_CONTENT ||
+      json_test_convert("<a>\xff</a>", NULL, &error) != NULL || error.code != XML_ERROR_ENCODING || error.offset != 3) {
+    fprintf(stderr, "json: errors not reported\n");
+    exit(1);
+  }
+}
+
+static void json_usage(void) {
+  fprintf(stderr,
+          "usage: xml_parser --json [--attr-prefix p] [--text-key k] [--lookahead bytes] file...\n"
+          "  each file as JSON, one per line; a file which fails writes nothing\n");
+}
+
+/* xml_parser --json [options] file...: each file as JSON, one per line. A file's output is
+ * kept in memory and written once it converted, so a failure leaves no partial JSON.
+ * */
+static int json_main(int argc, char **argv) {
+  XMLJsonOptions options;
+  XMLWriter w;
+  XMLError error;
+  int status = 0, i = 0;
+
+  XMLJsonOptionsInit(&options);
+  for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i) {
+    if (strcmp(argv[i], "--attr-prefix") == 0 && i + 1 < argc) {
+      options.attr_prefix = argv[++i];
+    } else if (strcmp(argv[i], "--text-key") == 0 && i + 1 < argc) {
+      options.text_key = argv[++i];
+    } else if (strcmp(argv[i], "--lookahead") == 0 && i + 1 < argc) {
+      options.lookahead = (size_t)strtoul(argv[++i], NULL, 10);
+    } else {
+      json_usage();
+      return 2;
+    }
+  }
+  if (i == argc) {
+    json_usage();
+    return 2;
+  }
+  XMLWriterInit(&w, NULL, NULL);
+  for (; i < argc; ++i) {
+    w.len = 0;
+    w.failed = false;
+    if (XMLConvertJSONFile(&w, argv[i], &options, &error) && XMLWriterPutChar(&w, '\n')) {
+      if (fwrite(w.data, 1, w.len, stdout) != w.len) status = 1;
+    } else {
+      fprintf(stderr, "xml_parser: %s: %s at offset %zu\n", argv[i], XMLErrorString(error.code), error.offset);
+      status = 1;
+    }
+  }
+  XMLWriterFree(&w);
+  if (fflush(stdout) != 0) status = 1;
+  return status;
+}
+
+/* xml_parser --batch [options] path...: parse every file on a thread pool */
+typedef enum BatchMode {
+  BATCH_PARSE,
+  BATCH_VALIDATE,  /* XMLValidateFile, no tree */
+  BATCH_XPATH,     /* and print the value of an expression */
+  BATCH_PRINT      /* and pretty print */
+}BatchMode;
+
+typedef struct Batch {
+  BatchMode mode;
+  XPathExpr *expr;
+  bool quiet;          /* only failures & the summary */
+  FILE *out;
+  char **paths;
+  size_t count, capacity;
+  size_t bytes, failed;
+  double seconds;      /* spent in the parser, over all the threads */
+  XMLParserContext *contexts; /* one per worker, reused from file to file */
+  pthread_mutex_t lock;
+}Batch;
+
+static double batch_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool batch_add(Batch *batch, const char *path) {
+  if (batch->count == batch->capacity) {
+    size_t capacity = batch->capacity ? batch->capacity * 2 : 64;
+    char **paths = (char **)realloc(batch->paths, sizeof(char *) * capacity);
+    if (paths == NULL) return false;
+    batch->paths = paths;
+    batch->capacity = capacity;
+  }
+  if ((batch->paths[batch->count] = strdup(path)) == NULL) return false;
+  batch->count++;
+  return true;
+}
+
+/* a file, the `*.xml` files below a directory, or `@list`: a file of paths, one per line(`@-`: stdin).
+ * Symbolic links to directories are not followed, so a link loop can't recurse forever.
+ * */
+static bool batch_add_path(Batch *batch, const char *path) {
+  struct stat sb;
+  if (path[0] == '@') {
+    FILE *fp = strcmp(path, "@-") == 0 ? stdin : fopen(path + 1, "r");
+    char line[4096];
+    bool ok = fp != NULL;
+    if (fp == NULL) fprintf(stderr, "xml_parser: %s: %s\n", path + 1, strerror(errno));
+    while (ok && fgets(line, sizeof(line), fp)) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0]) ok = batch_add_path(batch, line);
+    }
+    if (fp && fp != stdin) fclose(fp);
+    return ok;
+  }
+  if (stat(path, &sb) != 0) {
+    fprintf(stderr, "xml_parser: %s: not found\n", path);
+    return false;
+  }
+  if (!S_ISDIR(sb.st_mode)) return batch_add(batch, path);
+
+  DIR *dir = opendir(path);
+  struct dirent *entry;
+  if (dir == NULL) {
+    fprintf(stderr, "xml_parser: %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  bool ok = true;
+  while (ok) {
+    errno = 0;
+    if ((entry = readdir(dir)) == NULL) {
+      if (errno != 0) {
+        fprintf(stderr, "xml_parser: %s: %s\n", path, strerror(errno));
+        ok = false;
+      }
+      break;
+    }
+    const char *name = entry->d_name;
+    size_t len = strlen(name);
+    char child[4096];
+    if (name[0] == '.') continue;
+    if ((size_t)snprintf(child, sizeof(child), "%s/%s", path, name) >= sizeof(child)) {
+      fprintf(stderr, "xml_parser: %s/%s: path too long\n", path, name);
+      ok = false;
+    } else if (lstat(child, &sb) != 0) {
+      fprintf(stderr, "xml_parser: %s: %s\n", child, strerror(errno));
+      ok = false;
+    } else if (S_ISDIR(sb.st_mode)) {
+      ok = batch_add_path(batch, child);
+    } else if (len > 4 && strcmp(name + len - 4, ".xml") == 0 && (!S_ISLNK(sb.st_mode) || (stat(child, &sb) == 0 && !S_ISDIR(sb.st_mode)))) {
+      ok = batch_add(batch, child);
+    }
+  }
+  closedir(dir);
+  return ok;
+}
+
+static int batch_compare(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* on a worker, once the loader has read the file */
+static void batch_task(XMLLoadedFile *file, void *user_data) {
+  Batch *batch = (Batch *)user_data;
+  const char *path = file->path;
+  XMLDocument doc;
+  XMLError error = { 0 };
+  XPathValue value;
+  char *result = NULL;
+  size_t size = file->size;
+  bool ok = false;
+
+  XMLDocumentInitWithContext(&doc, &batch->contexts[file->worker]);
+  double start = batch_clock();
+  if (file->data == NULL) {
+    error.code = XML_ERROR_IO;
+  } else if (batch->mode == BATCH_VALIDATE) {
+    ok = XMLValidateBuffer(file->data, file->size, &error);
+    free(file->data);
+  } else {
+    ok = XMLDocumentParseBuffer(&doc, file->data, file->size, path);
+    if (!ok) error = *XMLDocumentGetError(&doc);
+  }
+  double seconds = batch_clock() - start;
+  if (ok && batch->mode == BATCH_XPATH && xpath_evaluate(batch->expr, XML_ROOT(&doc), &value)) {
+    if (value.type == XPATH_VALUE_NODESET) {
+      char *first = xpath_value_to_string(&value);
+      size_t len = strlen(first ? first : "") + 32;
+      if ((result = (char *)malloc(len)) != NULL) snprintf(result, len, "%zu nodes: %s", value.nodes.count, first ? first : "");
+      free(first);
+    } else {
+      result = xpath_value_to_string(&value);
+    }
+    xpath_value_free(&value);
+  }
+
+  pthread_mutex_lock(&batch->lock);
+  batch->bytes += size;
+  batch->seconds += seconds;
+  if (!ok) batch->failed++;
+  if (file->data == NULL) {
+    fprintf(batch->out, "FAIL %10zu B %9.3f ms  %s: %s\n", size, 0.0, path, strerror(file->error));
+  } else if (!ok) {
+    fprintf(batch->out, "FAIL %10zu B %9.3f ms  %s: %s at offset %zu\n", size, seconds * 1e3, path,
+            error.code == XML_OK ? "error" : XMLErrorString(error.code), error.offset);
+  } else if (!batch->quiet) {
+    fprintf(batch->out, "ok   %10zu B %9.3f ms  %s%s%s\n", size, seconds * 1e3, path, result ? "  " : "", result ? result : "");
+    if (batch->mode == BATCH_PRINT) XMLPrettyPrint(&doc, batch->out, 4);
+  }
+  pthread_mutex_unlock(&batch->lock);
+
+  free(result);
+  XMLDocumentFree(&doc);
+}
+
+/* load & parse every file of `batch` with `options`, then print the totals. Returns the number of failures. */
+static size_t batch_run(Batch *batch, const XMLLoadOptions *options) {
+  qsort(batch->paths, batch->count, sizeof(char *), batch_compare);
+  if ((batch->contexts = (XMLParserContext *)malloc(sizeof(XMLParserContext) * options->threads)) == NULL) {
+    fprintf(stderr, "xml_parser: out of memory\n");
+    return batch->failed = batch->count;
+  }
+  for (int i = 0; i < options->threads; ++i) XMLParserContextInit(&batch->contexts[i]);
+  pthread_mutex_init(&batch->lock, NULL);
+  double start = batch_clock();
+  XMLLoadBackend backend = XMLLoadFiles((const char *const *)batch->paths, batch->count, options, batch_task, batch);
+  double wall = batch_clock() - start;
+  pthread_mutex_destroy(&batch->lock);
+  for (int i = 0; i < options->threads; ++i) XMLParserContextFree(&batch->contexts[i]);
+  free(batch->contexts);
+  batch->contexts = NULL;
+
+  fprintf(batch->out, "%zu files, %zu failed, %.2f MB in %.3f s on %d threads(%s): %.1f MB/s(parser time %.3f s)\n",
+          batch->count, batch->failed, batch->bytes / 1e6, wall, options->threads, XMLLoadBackendString(backend),
+          wall > 0 ? batch->bytes / 1e6 / wall : 0.0, batch->seconds);
+  return batch->failed;
+}
+
+static void batch_free(Batch *batch) {
+  for (size_t i = 0; i < batch->count; ++i) free(batch->paths[i]);
+  free(batch->paths);
+  xpath_expr_free(batch->expr);
+}
+
+static void batch_usage(void) {
+  fprintf(stderr,
+          "usage: xml_parser --batch [-j threads] [-q] [--io auto|io_uring|threads] [--validate | --xpath expr | --print] path...\n"
+          "  path: a file, a directory(its *.xml files, recursively) or @list(a file of paths, @- for stdin)\n"
+          "  --io: how files are read while others are parsed, io_uring if available by default\n");
+}
+
+static int batch_main(int argc, char **argv) {
+  Batch batch;
+  XMLLoadOptions options;
+  int i = 0;
+
+  memset(&batch, 0, sizeof(Batch));
+  batch.out = stdout;
+  XMLLoadOptionsInit(&options);
+  for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      options.threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+      const char *io = argv[++i];
+      if (strcmp(io, "auto") == 0) options.backend = XML_LOAD_AUTO;
+      else if (strcmp(io, "io_uring") == 0) options.backend = XML_LOAD_IO_URING;
+      else if (strcmp(io, "threads") == 0) options.backend = XML_LOAD_THREADS;
+      else {
+        batch_usage();
+        batch_free(&batch);
+        return 2;
+      }
+    } else if (strcmp(argv[i], "-q") == 0) {
+      batch.quiet = true;
+    } else if (strcmp(argv[i], "--validate") == 0) {
+      batch.mode = BATCH_VALIDATE;
+    } else if (strcmp(argv[i], "--print") == 0) {
+      batch.mode = BATCH_PRINT;
+    } else if (strcmp(argv[i], "--xpath") == 0 && i + 1 < argc) {
+      batch.mode = BATCH_XPATH;
+      xpath_expr_free(batch.expr);
+      if ((batch.expr = xpath_compile(argv[++i])) == NULL) {
+        fprintf(stderr, "xml_parser: bad expression %s\n", argv[i]);
+        batch_free(&batch);
+        return 2;
+      }
+    } else {
+      batch_usage();
+      batch_free(&batch);
+      return 2;
+    }
+  }
+  if (i == argc || options.threads < 1) {
+    batch_usage();
+    batch_free(&batch);
+    return 2;
+  }
+  for (; i < argc; ++i) {
+    if (!batch_add_path(&batch, argv[i])) {
+      batch_free(&batch);
+      return 2;
+    }
+  }
+
+  size_t failed = batch_run(&batch, &options);
+  batch_free(&batch);
+  return failed > 0 ? 1 : 0;
+}
+
+typedef struct LoaderTestData {
+  pthread_mutex_t lock;
+  size_t *sizes;     /* per index, as loaded */
+  int *seen;
+  int *errors;
+}LoaderTestData;
+
+static void loader_test_file(XMLLoadedFile *file, void *user_data) {
+  LoaderTestData *data = (LoaderTestData *)user_data;
+  pthread_mutex_lock(&data->lock);
+  data->seen[file->index]++;
+  data->sizes[file->index] = file->data && strlen(file->data) == file->size ? file->size : (size_t)-1;
+  data->errors[file->index] = file->error;
+  pthread_mutex_unlock(&data->lock);
+  free(file->data);
+}
+
+/* every file exactly once, with its contents or its error */
+static void loader_test(void) {
+  enum { FILES = 300 };
+  const char *names[] = { "./test.xml", "./simple.xml", "./bookstore.xml", "./cdata.xml", "./no_such_file.xml" };
+  const char *paths[FILES];
+  size_t sizes[FILES];
+  int seen[FILES], errors[FILES];
+  LoaderTestData data = { PTHREAD_MUTEX_INITIALIZER, sizes, seen, errors };
+  XMLLoadOptions options;
+
+  for (size_t i = 0; i < FILES; ++i) paths[i] = names[i % ARRAY_SIZE(names)];
+  XMLLoadOptionsInit(&options);
+  options.threads = 4;
+  options.queue_depth = 8;
+  for (int backend = XML_LOAD_IO_URING; backend <= XML_LOAD_THREADS; ++backend) {
+    memset(seen, 0, sizeof(seen));
+    options.backend = (XMLLoadBackend)backend;
+    XMLLoadBackend used = XMLLoadFiles(paths, FILES, &options, loader_test_file, &data);
+    for (size_t i = 0; i < FILES; ++i) {
+      struct stat sb;
+      bool exists = stat(paths[i], &sb) == 0;
+      if (seen[i] != 1 || (exists ? sizes[i] != (size_t)sb.st_size || errors[i] != 0 : errors[i] != ENOENT)) {
+        fprintf(stderr, "loader(%s): %s seen %d times, size %zu, error %d\n", XMLLoadBackendString(used), paths[i], seen[i],
+                sizes[i], errors[i]);
+        exit(1);
+      }
+    }
+    printf("loader: %d files with %s\n", FILES, XMLLoadBackendString(used));
+  }
+}
+
+static void batch_test(void) {
+  Batch batch;
+  XMLLoadOptions options;
+  const char *files[] = { "./test.xml", "./simple.xml", "./bookstore.xml", "./cdata.xml" };
+  FILE *fp = fopen("./batch_list.txt", "w");
+  for (size_t i = 1; i < ARRAY_SIZE(files); ++i) fprintf(fp, "%s\n", files[i]);
+  fclose(fp);
+
+  /* both ways of reading, with fewer reads in flight than files */
+  XMLLoadOptionsInit(&options);
+  options.threads = 3;
+  options.queue_depth = 2;
+  for (int backend = XML_LOAD_AUTO; backend <= XML_LOAD_THREADS; ++backend) {
+    memset(&batch, 0, sizeof(Batch));
+    batch.out = stdout;
+    batch.mode = BATCH_XPATH;
+    batch.expr = xpath_compile("count(//*)");
+    options.backend = (XMLLoadBackend)backend;
+    if (!batch_add_path(&batch, files[0]) || !batch_add_path(&batch, "@./batch_list.txt") || batch.count != 4 ||
+        batch_run(&batch, &options) != 0 || batch.bytes == 0) {
+      fprintf(stderr, "batch: %zu files, %zu failed\n", batch.count, batch.failed);
+      exit(1);
+    }
+    batch_free(&batch);
+  }
+  remove("./batch_list.txt");
+
+  /* a link back up the tree is not followed */
+  memset(&batch, 0, sizeof(Batch));
+  mkdir("./batch_dir", 0755);
+  if ((fp = fopen("./batch_dir/a.xml", "w")) != NULL) {
+    fputs("<a/>", fp);
+    fclose(fp);
+  }
+  if (symlink(".", "./batch_dir/loop") != 0 || !batch_add_path(&batch, "./batch_dir") || batch.count != 1) {
+    fprintf(stderr, "batch: %zu files below a link loop\n", batch.count);
+    exit(1);
+  }
+  batch_free(&batch);
+  remove("./batch_dir/loop");
+  remove("./batch_dir/a.xml");
+  remove("./batch_dir");
+}
+
+/* hands out `data` a few bytes at a time */
+typedef struct StreamTestInput {
+  const char *data;
+  size_t len, pos;
+  size_t calls;
+  bool fail;     /* -1 at the end instead of 0 */
+}StreamTestInput;
+
+static long stream_test_read(char *buf, size_t size, void *user_data) {
+  StreamTestInput *in = (StreamTestInput *)user_data;
+  size_t n = 1 + in->calls++ % 7;
+  if (n > size) n = size;
+  if (n > in->len - in->pos) n = in->len - in->pos;
+  if (n == 0 && in->fail) return -1;
+  memcpy(buf, in->data + in->pos, n);
+  in->pos += n;
+  return (long)n;
+}
+
+/* the same tree as from XMLDocumentParseStr */
+static void stream_test_expect(XMLDocument *doc, const char *xml, const char *what) {
+  XMLDocument plain = { 0 };
+  StreamTestInput in = { xml, strlen(xml), 0, 0, false };
+  if (!XMLDocumentParseStream(doc, stream_test_read, &in, NULL) || !XMLDocumentParseStr(&plain, xml)) {
+    fprintf(stderr, "stream(%s): parse failed, %s at %zu\n", what, XMLErrorString(doc->error.code), doc->error.offset);
+    exit(1);
+  }
+  char *streamed = c14n_test_write(doc, true), *expected = c14n_test_write(&plain, true);
+  if (strcmp(streamed, expected) != 0 || strcmp(doc->contents, xml) != 0) {
+    fprintf(stderr, "stream(%s): got %s\nexpected %s\n", what, streamed, expected);
+    exit(1);
+  }
+  free(streamed);
+  free(expected);
+  XMLDocumentFree(&plain);
+}
+
+static void stream_test(void) {
+  const char *xml = "<?xml version=\"1.0\"?>\n<!DOCTYPE shop>\n<!-- a comment which runs over many reads -->\n"
+                    "<shop name=\"Caf\xc3\xa9 &amp; B\xc3\xa4r\"><item sku='\xe2\x82\xac" "1'>na\xc3\xafve &lt;text&gt;</item>"
+                    "<item/><![CDATA[<not a tag> \xf0\x9f\x98\x80]]><note>x</note></shop>\n";
+  XMLDocument doc = { 0 };
+  XMLParserContext ctx;
+
+  stream_test_expect(&doc, xml, "utf-8");
+  XMLDocumentFree(&doc);
+  XMLParserContextInit(&ctx);
+  XMLDocumentInitWithContext(&doc, &ctx);
+  for (int i = 0; i < 3; ++i) stream_test_expect(&doc, xml, "context");
+  XMLDocumentFree(&doc);
+  XMLParserContextFree(&ctx);
+
+  /* a sequence cut between two reads is fine, a bad one is an error where it starts */
+  struct { const char *xml; XMLErrorCode code; size_t offset; } cases[] = {
+    { "<a>\xc3\xa9\xc3\xa9\xc3\xa9</a>", XML_OK, 0 },
+    { "<a>xy\xc3\x28</a>", XML_ERROR_ENCODING, 5 },
+    { "<a>xy\xe2\x82", XML_ERROR_ENCODING, 5 },
+  };
+  for (size_t i = 0; i < ARRAY_SIZE(cases); ++i) {
+    StreamTestInput in = { cases[i].xml, strlen(cases[i].xml), 0, 0, false };
+    memset(&doc, 0, sizeof(doc));
+    bool ok = XMLDocumentParseStream(&doc, stream_test_read, &in, NULL);
+    if (ok != (cases[i].code == XML_OK) || doc.error.code != cases[i].code || (!ok && doc.error.offset != cases[i].offset)) {
+      fprintf(stderr, "stream: case %zu gave %s at %zu\n", i, XMLErrorString(doc.error.code), doc.error.offset);
+      exit(1);
+    }
+    XMLDocumentFree(&doc);
+  }
+  /* the end as when all is there */
+  XMLDocument plain = { 0 };
+  StreamTestInput unclosed = { "<a><b>text</b>", 14, 0, 0, false };
+  memset(&doc, 0, sizeof(doc));
+  if (XMLDocumentParseStream(&doc, stream_test_read, &unclosed, NULL) || XMLDocumentParseStr(&plain, unclosed.data) ||
+      doc.error.code != plain.error.code || doc.error.offset != plain.error.offset) {
+    fprintf(stderr, "stream: unclosed element gave %s at %zu\n", XMLErrorString(doc.error.code), doc.error.offset);
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+  XMLDocumentFree(&plain);
+  StreamTestInput failing = { "<a><b>", 6, 0, 0, true };
+  memset(&doc, 0, sizeof(doc));
+  if (XMLDocumentParseStream(&doc, stream_test_read, &failing, NULL) || doc.error.code != XML_ERROR_IO) {
+    fprintf(stderr, "stream: a read error gave %s\n", XMLErrorString(doc.error.code));
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+  printf("stream: %zu bytes in reads of 1 to 7 bytes\n", strlen(xml));
+}
+
+#if defined(XML_HAVE_ZLIB) || defined(XML_HAVE_ZSTD)
+/* a document of many chunks */
+static void compress_test_document(XMLWriter *w) {
+  XMLWriterInit(w, NULL, NULL);
+  XMLWriterPut(w, "<catalog>\n", 10);
+  for (int i = 0; i < 20000; ++i) {
+    char record[160];
+    int n = snprintf(record, sizeof(record), "  <book id=\"b%d\"><title>Title %d</title><price>%d.95</price><!--c--></book>\n",
+                     i, i * 7, i % 100);
+    XMLWriterPut(w, record, (size_t)n);
+  }
+  XMLWriterPut(w, "</catalog>\n", 12); /* with the null */
+}
+
+/* `path` gives the tree of `xml`, and cut short, the decompressor's error. The file is removed. */
+static void compress_test_check(const char *path, const char *xml, const char *format) {
+  XMLDocument doc = { 0 }, plain = { 0 };
+  if (!XMLDocumentParseCompressedFile(&doc, path) || !XMLDocumentParseStr(&plain, xml)) {
+    fprintf(stderr, "compress(%s): parse failed, %s at %zu\n", format, XMLErrorString(doc.error.code), doc.error.offset);
+    exit(1);
+  }
+  char *decompressed = c14n_test_write(&doc, true), *expected = c14n_test_write(&plain, true);
+  if (strcmp(decompressed, expected) != 0 || XMLNodeChildrenCount(doc.root) != 20000) {
+    fprintf(stderr, "compress(%s): the tree differs from the plain parse\n", format);
+    exit(1);
+  }
+  printf("compress: %zu bytes from %s, %zu books\n", strlen(xml), format, XMLNodeChildrenCount(doc.root));
+  free(decompressed);
+  free(expected);
+  XMLDocumentFree(&doc);
+  XMLDocumentFree(&plain);
+
+  FILE *fp = fopen(path, "rb");
+  char *data = (char *)malloc(1 << 20);
+  size_t len = fread(data, 1, 1 << 20, fp);
+  fclose(fp);
+  fp = fopen(path, "wb");
+  fwrite(data, 1, len - 64, fp);
+  fclose(fp);
+  memset(&doc, 0, sizeof(doc));
+  if (XMLDocumentParseCompressedFile(&doc, path) || doc.error.code != XML_ERROR_COMPRESSION) {
+    fprintf(stderr, "compress(%s): truncated input gave %s\n", format, XMLErrorString(doc.error.code));
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+  free(data);
+  remove(path);
+}
+#endif
+
+#ifdef XML_HAVE_ZLIB
+static void compress_test_write(const char *path, const char *mode, const char *data, size_t len) {
+  gzFile gz = gzopen(path, mode);
+  if (gz == NULL || gzwrite(gz, data, (unsigned)len) != (int)len || gzclose(gz) != Z_OK) {
+    fprintf(stderr, "compress: can't write %s\n", path);
+    exit(1);
+  }
+}
+
+/* a gzip file of two members */
+static void compress_test(void) {
+  XMLWriter w;
+  XMLDocument doc = { 0 };
+  compress_test_document(&w);
+  size_t half = w.len / 2;
+  compress_test_write("./compress_test.xml.gz", "wb", w.data, half);
+  compress_test_write("./compress_test.xml.gz", "ab", w.data + half, w.len - 1 - half);
+  compress_test_check("./compress_test.xml.gz", w.data, "gzip");
+
+  /* not compressed */
+  if (!XMLDocumentParseCompressedFile(&doc, "./simple.xml")) {
+    fprintf(stderr, "compress: plain file failed\n");
+    exit(1);
+  }
+  XMLDocumentFree(&doc);
+  XMLWriterFree(&w);
+}
+#endif
+
+#ifdef XML_HAVE_ZSTD
+/* a zstd file of two frames */
+static void compress_test_zstd(void) {
+  XMLWriter w;
+  compress_test_document(&w);
+  size_t half = w.len / 2;
+  FILE *fp = fopen("./compress_test.xml.zst", "wb");
+  for (int i = 0; fp && i < 2; ++i) {
+    size_t start = i == 0 ? 0 : half, len = i == 0 ? half : w.len - 1 - half, bound = ZSTD_compressBound(len);
+    char *frame = (char *)malloc(bound);
+    size_t size = frame ? ZSTD_compress(frame, bound, w.data + start, len, 1) : 0;
+    if (frame == NULL || ZSTD_isError(size) || fwrite(frame, 1, size, fp) != size) {
+      fprintf(stderr, "compress: can't write ./compress_test.xml.zst\n");
+      exit(1);
+    }
+    free(frame);
+  }
+  if (fp == NULL || fclose(fp) != 0) {
+    fprintf(stderr, "compress: can't write ./compress_test.xml.zst\n");
+    exit(1);
+  }
+  compress_test_check("./compress_test.xml.zst", w.data, "zstd");
+  XMLWriterFree(&w);
+}
+#endif
+
+int main(int argc, char **argv) {
+  char *filename = "./test.xml";
+  if (argc >= 2 && strcmp(argv[1], "--json") == 0) return json_main(argc - 2, argv + 2);
+  if (argc >= 2 && strcmp(argv[1], "--batch") == 0) return batch_main(argc - 2, argv + 2);
+#ifdef LEX_DEBUG
+  char *contents = read_file(filename);
+  lexer_t lexer;
+  lexer_init(&lexer, contents, filename);
+
+  /* get next two tokens, so we have two positions */
+  lexer_next_token(&lexer);
+  lexer_next_token(&lexer);
+  while (!lexer_cur_token_is(&lexer, TOKEN_EOF)) {
+#ifdef DEBUG
+    token_dump(lexer.cur_token);
+#endif
+    lexer_next_token(&lexer);
+  } /* end while */
+
+#else
+  if (argc == 2) filename = argv[1];
+#endif
+
+  /* open xml file & parser it */
+  XMLDocument doc = { 0 };
+  bool result = XMLDocumentParseFile(&doc, filename);
+  if (result != true) {
+    fprintf(stderr, "XMLDocumentParseFile failed!\n");
+    exit(1);
+  }
+
+  fprintf(stdout, "\n============Pretty Print============\n");
+  XMLPrettyPrint(&doc, NULL, 4); /* output to console */
+
+  /* Output to file */
+  //FILE *out = fopen("./log.txt", "w");
+  //XMLPrettyPrint(&doc, out, 4);
+  //fclose(out);
+
+  if (strcmp(filename, "./test.xml") == 0) {
+    Test_testxml(&doc);
+  } else if (strcmp(filename, "./simple.xml") == 0) {
+    Test_simplexml(&doc);
+  } else if (strcmp(filename, "./test2.xml") == 0) {
+    Test_test2xml(&doc);
+  } else if (strcmp(filename, "./test4.xml") == 0) {
+    Test_test4xml(&doc);
+  } else if (strcmp(filename, "./cdata.xml") == 0) {
+    Test_cdataxml(&doc);
+  } else if (strcmp(filename, "./doctype.xml") == 0) {
+    Test_doctypexml(&doc);
+  }
+
+  XMLDocumentFree(&doc);
+
+  /* XPATH TEST */
+  fprintf(stdout, "\n\n============XPATH============\n");
+  xpath_test();
+
+  fprintf(stdout, "\n\n============XPATH EXPRESSIONS============\n");
+  xpath_expr_test();
+
+  fprintf(stdout, "\n\n============XPATH CACHE============\n");
+  xpath_cache_test();
+
+  fprintf(stdout, "\n\n============STREAMING XPATH============\n");
+  xpath_stream_test();
+
+  fprintf(stdout, "\n\n============LEXER============\n");
+  lexer_test();
+
+  fprintf(stdout, "\n\n============SNAPSHOT============\n");
+  snapshot_test();
+
+  fprintf(stdout, "\n\n============LAZY PARSING============\n");
+  skip_index_test();
+  lazy_test();
+
+  fprintf(stdout, "\n\n============NAMESPACES============\n");
+  namespace_test();
+
+  fprintf(stdout, "\n\n============EDITING============\n");
+  edit_test();
+  clone_test();
+
+  fprintf(stdout, "\n\n============REPARSE & DIFF============\n");
+  diff_test();
+  hash_test();
+  reparse_test();
+
+  fprintf(stdout, "\n\n============C14N============\n");
+  c14n_test();
+
+  fprintf(stdout, "\n\n============JSON============\n");
+  json_test();
+
+  fprintf(stdout, "\n\n============BATCH============\n");
+  loader_test();
+  batch_test();
+
+  fprintf(stdout, "\n\n============STREAMING INPUT============\n");
+  stream_test();
+#ifdef XML_HAVE_ZLIB
+  compress_test();
+#endif
+#ifdef XML_HAVE_ZSTD
+  compress_test_zstd();
+#endif
+
+  fprintf(stdout, "\n\n============VALIDATE============\n");
+  validate_test();
+
+  fprintf(stdout, "\n\n============ERRORS============\n");
+  error_test();
+
+  fprintf(stdout, "\n\n============ENCODINGS============\n");
+  encoding_test();
+
+  fprintf(stdout, "\n\n============PARSE FLAGS============\n");
+  flags_test();
+
+  fprintf(stdout, "\n\n============STATS============\n");
+  stats_test();
+
+  fprintf(stdout, "\n\n============PARSER CONTEXT============\n");
+  context_test();
+
+  fprintf(stdout, "\n\n============THREADS============\n");
+  thread_test();
+
+  fprintf(stdout, "\n\n============PARALLEL XPATH============\n");
+  parallel_xpath_test();
 
   return 0;
 }
@@ -0,0 +1,108 @@
+/* Lexer microbenchmark
+ *
+ *   xml_bench [file...]
+ *
+ * Tokenizes each file(or, without arguments, a generated document made mostly of
+ * names and attributes) a few times and prints the best throughput, with the default lexer and
+ * with the LEXER_DATA one(no positions, comments or PIs, trimmed text). Build it with
+ * CMake's XMLPARSER_WITH_BENCH option(it is always compiled with -O2).
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "xml_lexer.h"
+
+#define BENCH_RUNS 7
+#define BENCH_RECORDS 60000
+
+static double bench_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* names & attributes, little text: the lexer's identifier and string paths */
+static char *bench_generate(size_t *size) {
+  static const char *record =
+    "  <record id=\"%d\" type=\"entry\" xml:lang=\"en\" data-key=\"k%d\" status='active'>\n"
+    "    <field name=\"title\" kind=\"string\" required=\"true\">Value %d</field>\n"
+    "    <field name=\"count\" kind=\"int\" unit=\"items\" min=\"0\" max=\"100\"/>\n"
+    "    <ns:link xmlns:ns=\"urn:bench\" ns:href=\"#r%d\" ns:rel=\"next\"/>\n"
+    "  </record>\n";
+  size_t capacity = (strlen(record) + 32) * BENCH_RECORDS + 64;
+  char *buf = (char *)malloc(capacity);
+  if (buf == NULL) return NULL;
+
+  size_t len = (size_t)sprintf(buf, "<records>\n");
+  for (int i = 0; i < BENCH_RECORDS; ++i) len += (size_t)sprintf(buf + len, record, i, i, i, i);
+  len += (size_t)sprintf(buf + len, "</records>\n");
+  *size = len;
+  return buf;
+}
+
+static char *bench_read(const char *path, size_t *size) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) return NULL;
+  fseek(fp, 0L, SEEK_END);
+  long len = ftell(fp);
+  rewind(fp);
+  char *buf = len >= 0 ? (char *)malloc((size_t)len + 1) : NULL;
+  if (buf == NULL || fread(buf, 1, (size_t)len, fp) != (size_t)len) {
+    free(buf);
+    fclose(fp);
+    return NULL;
+  }
+  fclose(fp);
+  buf[len] = '\0';
+  *size = (size_t)len;
+  return buf;
+}
+
+static void bench_lex(const char *name, const char *input, size_t size, unsigned flags) {
+  double best = 0;
+  unsigned long tokens = 0;
+
+  for (int run = 0; run < BENCH_RUNS; ++run) {
+    lexer_t lexer;
+    unsigned long count = 0;
+    double start = bench_clock();
+    lexer_init_len(&lexer, input, (int)size, NULL);
+    lexer_set_flags(&lexer, flags);
+    do {
+      lexer_next_token(&lexer);
+      count++;
+    } while (!lexer_peek_token_is(&lexer, TOKEN_EOF));
+    double seconds = bench_clock() - start;
+    if (run == 0 || seconds < best) best = seconds;
+    tokens = count;
+  }
+  printf("%-24s %-7s %8.2f MB %10lu tokens %8.1f MB/s %8.1f Mtokens/s\n", name, flags ? "data" : "default",
+         size / 1e6, tokens,
+         size / 1e6 / best, tokens / 1e6 / best);
+}
+
+int main(int argc, char **argv) {
+  size_t size = 0;
+
+  if (argc < 2) {
+    char *input = bench_generate(&size);
+    if (input == NULL) return 1;
+    bench_lex("(attribute heavy)", input, size, 0);
+    bench_lex("(attribute heavy)", input, size, LEXER_DATA);
+    free(input);
+    return 0;
+  }
+
+  for (int i = 1; i < argc; ++i) {
+    char *input = bench_read(argv[i], &size);
+    if (input == NULL) {
+      fprintf(stderr, "can't read %s\n", argv[i]);
+      return 1;
+    }
+    bench_lex(argv[i], input, size, 0);
+    bench_lex(argv[i], input, size, LEXER_DATA);
+    free(input);
+  }
+  return 0;
+}
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#ifdef XML_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef XML_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "xml_parser.h"
+#include "xml_compress.h"
+
+#define XML_COMPRESS_IN (128 * 1024)      /* compressed bytes read at a time */
+#define XML_COMPRESS_CHUNK (256 * 1024)   /* decompressed bytes handed to the parser at a time */
+#define XML_COMPRESS_CHUNKS 4             /* chunks decompressed ahead of the parser */
+
+typedef struct DecompressChunk {
+  char *data;
+  size_t len;
+}DecompressChunk;
+
+/* The decompressor fills the chunks of a ring, the parser empties them. */
+typedef struct Decompressor {
+  FILE *fp;
+  XMLCompression compression;
+  char *in;                /* compressed bytes */
+  size_t in_len;           /* read into `in` */
+  bool in_eof;
+  bool finished;           /* the last frame or member has ended */
+#ifdef XML_HAVE_ZLIB
+  z_stream z;
+#endif
+#ifdef XML_HAVE_ZSTD
+  ZSTD_DStream *zstd;
+  ZSTD_inBuffer zin;
+  size_t zstd_hint;        /* 0 at the end of a frame */
+#endif
+  bool threaded;           /* else the parser decompresses when it runs out */
+
+  DecompressChunk chunks[XML_COMPRESS_CHUNKS];
+  size_t head, count;
+  size_t taken;            /* bytes of the head chunk read by the parser */
+  bool done;               /* nothing more will be filled: finished, failed or cancelled */
+  bool failed;             /* corrupt or truncated input */
+  bool io_failed;
+  bool cancel;             /* the parser stopped */
+  pthread_mutex_t lock;
+  pthread_cond_t filled, emptied;
+}Decompressor;
+
+XMLCompression XMLDetectCompression(const void *data, size_t size) {
+  const unsigned char *p = (const unsigned char *)data;
+  if (size >= 2 && p[0] == 0x1f && p[1] == 0x8b) return XML_COMPRESSION_GZIP;
+  if (size >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) return XML_COMPRESSION_ZSTD;
+  return XML_COMPRESSION_NONE;
+}
+
+bool XMLCompressionSupported(XMLCompression compression) {
+  switch (compression) {
+    case XML_COMPRESSION_NONE: return true;
+#ifdef XML_HAVE_ZLIB
+    case XML_COMPRESSION_GZIP: return true;
+#endif
+#ifdef XML_HAVE_ZSTD
+    case XML_COMPRESSION_ZSTD: return true;
+#endif
+    default: return false;
+  }
+}
+
+const char *XMLCompressionString(XMLCompression compression) {
+  switch (compression) {
+    case XML_COMPRESSION_NONE: return "none";
+    case XML_COMPRESSION_GZIP: return "gzip";
+    case XML_COMPRESSION_ZSTD: return "zstd";
+    default: return "unknown";
+  }
+}
+
+#if defined(XML_HAVE_ZLIB) || defined(XML_HAVE_ZSTD)
+/* more compressed input, once the last was used up */
+static void DecompressReadInput(Decompressor *d) {
+  d->in_len = fread(d->in, 1, XML_COMPRESS_IN, d->fp);
+  if (d->in_len == 0) {
+    if (ferror(d->fp)) d->io_failed = true;
+    d->in_eof = true;
+  }
+}
+#endif
+
+#ifdef XML_HAVE_ZLIB
+/* a gzip file may be several members one after the other(`cat a.gz b.gz`) */
+static size_t DecompressGzip(Decompressor *d, char *out, size_t size) {
+  z_stream *z = &d->z;
+  z->next_out = (Bytef *)out;
+  z->avail_out = (uInt)size;
+  while (z->avail_out > 0 && !d->finished && !d->failed && !d->io_failed) {
+    if (z->avail_in == 0) {
+      DecompressReadInput(d);
+      z->next_in = (Bytef *)d->in;
+      z->avail_in = (uInt)d->in_len;
+    }
+    int ret = inflate(z, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      if (z->avail_in == 0 && !d->in_eof) {
+        DecompressReadInput(d);
+        z->next_in = (Bytef *)d->in;
+        z->avail_in = (uInt)d->in_len;
+      }
+      if (z->avail_in == 0) d->finished = true;
+      else if (inflateReset(z) != Z_OK) d->failed = true;
+    } else if (ret == Z_BUF_ERROR) { /* no progress: out of input in the middle of a member */
+      if (d->in_eof) d->failed = true;
+    } else if (ret != Z_OK) {
+      d->failed = true;
+    }
+  }
+  return size - z->avail_out;
+}
+#endif
+
+#ifdef XML_HAVE_ZSTD
+/* ZSTD_decompressStream goes from one frame on to the next */
+static size_t DecompressZstd(Decompressor *d, char *out, size_t size) {
+  ZSTD_outBuffer zout = { out, size, 0 };
+  while (zout.pos < zout.size && !d->finished && !d->failed && !d->io_failed) {
+    if (d->zin.pos == d->zin.size) {
+      if (!d->in_eof) DecompressReadInput(d);
+      if (d->in_eof) {
+        if (d->zstd_hint != 0) d->failed = true; /* in the middle of a frame */
+        d->finished = true;
+        break;
+      }
+      d->zin.src = d->in;
+      d->zin.size = d->in_len;
+      d->zin.pos = 0;
+    }
+    d->zstd_hint = ZSTD_decompressStream(d->zstd, &zout, &d->zin);
+    if (ZSTD_isError(d->zstd_hint)) d->failed = true;
+  }
+  return zout.pos;
+}
+#endif
+
+static bool DecompressInit(Decompressor *d) {
+  d->in = (char *)malloc(XML_COMPRESS_IN);
+  if (d->in == NULL) return false;
+  for (size_t i = 0; i < XML_COMPRESS_CHUNKS; ++i) {
+    d->chunks[i].data = (char *)malloc(XML_COMPRESS_CHUNK);
+    if (d->chunks[i].data == NULL) return false;
+  }
+  switch (d->compression) {
+#ifdef XML_HAVE_ZLIB
+    case XML_COMPRESSION_GZIP:
+      return inflateInit2(&d->z, 15 + 32) == Z_OK; /* 32: gzip header */
+#endif
+#ifdef XML_HAVE_ZSTD
+    case XML_COMPRESSION_ZSTD:
+      d->zstd = ZSTD_createDStream();
+      return d->zstd && !ZSTD_isError(ZSTD_initDStream(d->zstd));
+#endif
+    default:
+      return false;
+  }
+}
+
+static void DecompressFree(Decompressor *d) {
+  switch (d->compression) {
+#ifdef XML_HAVE_ZLIB
+    case XML_COMPRESSION_GZIP: inflateEnd(&d->z); break;
+#endif
+#ifdef XML_HAVE_ZSTD
+    case XML_COMPRESSION_ZSTD: ZSTD_freeDStream(d->zstd); break;
+#endif
+    default: break;
+  }
+  for (size_t i = 0; i < XML_COMPRESS_CHUNKS; ++i) free(d->chunks[i].data);
+  free(d->in);
+}
+
+/* Fill the next free chunk. False once decompression has ended. */
+static bool DecompressStep(Decompressor *d) {
+  pthread_mutex_lock(&d->lock);
+  while (d->threaded && d->count == XML_COMPRESS_CHUNKS && !d->cancel) pthread_cond_wait(&d->emptied, &d->lock);
+  bool stop = d->cancel || d->done;
+  DecompressChunk *chunk = &d->chunks[(d->head + d->count) % XML_COMPRESS_CHUNKS];
+  pthread_mutex_unlock(&d->lock);
+  if (stop) return false;
+
+  size_t len = 0;
+  switch (d->compression) {
+#ifdef XML_HAVE_ZLIB
+    case XML_COMPRESSION_GZIP: len = DecompressGzip(d, chunk->data, XML_COMPRESS_CHUNK); break;
+#endif
+#ifdef XML_HAVE_ZSTD
+    case XML_COMPRESSION_ZSTD: len = DecompressZstd(d, chunk->data, XML_COMPRESS_CHUNK); break;
+#endif
+    default: d->failed = true; break;
+  }
+
+  pthread_mutex_lock(&d->lock);
+  if (len > 0) {
+    chunk->len = len;
+    d->count++;
+  }
+  if (d->finished || d->failed || d->io_failed) d->done = true;
+  stop = d->done;
+  pthread_cond_signal(&d->filled);
+  pthread_mutex_unlock(&d->lock);
+  return !stop;
+}
+
+static void *DecompressRun(void *arg) {
+  Decompressor *d = (Decompressor *)arg;
+  while (DecompressStep(d)) {}
+  pthread_mutex_lock(&d->lock);
+  d->done = true; /* also when cancelled */
+  pthread_cond_signal(&d->filled);
+  pthread_mutex_unlock(&d->lock);
+  return NULL;
+}
+
+/* XMLReadFn of the parser */
+static long DecompressRead(char *buf, size_t size, void *user_data) {
+  Decompressor *d = (Decompressor *)user_data;
+  pthread_mutex_lock(&d->lock);
+  while (d->count == 0 && !d->done) {
+    if (!d->threaded) {
+      pthread_mutex_unlock(&d->lock);
+      DecompressStep(d);
+      pthread_mutex_lock(&d->lock);
+    } else {
+      pthread_cond_wait(&d->filled, &d->lock);
+    }
+  }
+  if (d->count == 0) {
+    bool failed = d->failed || d->io_failed;
+    pthread_mutex_unlock(&d->lock);
+    return failed ? -1 : 0;
+  }
+  DecompressChunk *chunk = &d->chunks[d->head]; /* the decompressor leaves it alone until it is emptied */
+  pthread_mutex_unlock(&d->lock);
+
+  size_t n = chunk->len - d->taken;
+  if (n > size) n = size;
+  memcpy(buf, chunk->data + d->taken, n);
+  d->taken += n;
+  if (d->taken == chunk->len) {
+    pthread_mutex_lock(&d->lock);
+    d->head = (d->head + 1) % XML_COMPRESS_CHUNKS;
+    d->count--;
+    d->taken = 0;
+    pthread_cond_signal(&d->emptied);
+    pthread_mutex_unlock(&d->lock);
+  }
+  return (long)n;
+}
+
+static bool DecompressError(XMLDocument *doc, XMLErrorCode code) {
+  memset(&doc->error, 0, sizeof(XMLError));
+  doc->error.code = code;
+  return false;
+}
+
+bool XMLDocumentParseCompressedFile(XMLDocument *doc, const char *path) {
+  unsigned char magic[4];
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) return DecompressError(doc, XML_ERROR_IO);
+  size_t n = fread(magic, 1, sizeof(magic), fp);
+  XMLCompression compression = XMLDetectCompression(magic, n);
+  if (compression == XML_COMPRESSION_NONE) {
+    fclose(fp);
+    return XMLDocumentParseFile(doc, path);
+  }
+  if (!XMLCompressionSupported(compression) || fseek(fp, 0, SEEK_SET) != 0) {
+    fclose(fp);
+    return DecompressError(doc, XMLCompressionSupported(compression) ? XML_ERROR_IO : XML_ERROR_COMPRESSION);
+  }
+
+  Decompressor *d = (Decompressor *)calloc(1, sizeof(Decompressor));
+  if (d == NULL) {
+    fclose(fp);
+    return DecompressError(doc, XML_ERROR_MEMORY);
+  }
+  d->fp = fp;
+  d->compression = compression;
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->filled, NULL);
+  pthread_cond_init(&d->emptied, NULL);
+
+  bool ok = false;
+  pthread_t tid;
+  if (!DecompressInit(d)) {
+    DecompressError(doc, XML_ERROR_MEMORY);
+  } else {
+    d->threaded = true; /* before the thread reads it */
+    if (pthread_create(&tid, NULL, DecompressRun, d) != 0) d->threaded = false;
+    ok = XMLDocumentParseStream(doc, DecompressRead, d, path);
+    if (d->threaded) { /* the parse may have stopped early */
+      pthread_mutex_lock(&d->lock);
+      d->cancel = true;
+      pthread_cond_signal(&d->emptied);
+      pthread_mutex_unlock(&d->lock);
+      pthread_join(tid, NULL);
+    }
+    if (!ok && doc->error.code == XML_ERROR_IO && d->failed) doc->error.code = XML_ERROR_COMPRESSION;
+  }
+
+  DecompressFree(d);
+  pthread_cond_destroy(&d->emptied);
+  pthread_cond_destroy(&d->filled);
+  pthread_mutex_destroy(&d->lock);
+  fclose(fp);
+  free(d);
+  return ok;
+}
@@ -0,0 +1,30 @@
+#ifndef __XML_COMPRESS_H__
+#define __XML_COMPRESS_H__
+
+#include <stddef.h>
+#include "xml_parser.h"
+
+/* Compressed input: gzip(.xml.gz, with zlib) and zstd(.xml.zst, with libzstd), each if the
+ * library was found at build time(XML_HAVE_ZLIB, XML_HAVE_ZSTD). The file is decompressed
+ * on a thread of its own, a few chunks ahead of the parser, which lexes them as they arrive
+ * (XMLDocumentParseStream): decompressing and parsing overlap, and no temporary file is written.
+ * */
+typedef enum XMLCompression {
+  XML_COMPRESSION_NONE,
+  XML_COMPRESSION_GZIP,
+  XML_COMPRESSION_ZSTD
+}XMLCompression;
+
+/* from the first bytes of a file(4 are enough): gzip 1f 8b, zstd 28 b5 2f fd */
+XMLCompression XMLDetectCompression(const void *data, size_t size);
+/* whether this build can decompress it */
+bool XMLCompressionSupported(XMLCompression compression);
+const char *XMLCompressionString(XMLCompression compression);
+
+/* Parse a file which may be compressed, told by its first bytes and not by its name.
+ * A file which isn't is parsed by XMLDocumentParseFile. Corrupt or truncated input, or a format
+ * this build can't decompress, is XML_ERROR_COMPRESSION. Error offsets are in the decompressed input.
+ * */
+bool XMLDocumentParseCompressedFile(XMLDocument *doc, const char *path);
+
+#endif
@@ -0,0 +1,338 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "xml_encoding.h"
+
+/******************************************************************************
+ * Detection
+ ******************************************************************************/
+static bool EncodingNameIs(const char *name, size_t len, const char *expected) {
+  if (strlen(expected) != len) return false;
+  for (size_t i = 0; i < len; ++i) {
+    if (toupper((unsigned char)name[i]) != expected[i]) return false;
+  }
+  return true;
+}
+
+static XMLEncoding EncodingFromName(const char *name, size_t len) {
+  static const struct {
+    const char *name;
+    XMLEncoding encoding;
+  } names[] = {
+    { "UTF-8", XML_ENCODING_UTF8 }, { "UTF8", XML_ENCODING_UTF8 },
+    { "US-ASCII", XML_ENCODING_UTF8 }, { "ASCII", XML_ENCODING_UTF8 }, /* subsets of UTF-8 */
+    /* without a BOM or zero bytes, the input was already converted by whoever made it a string */
+    { "UTF-16", XML_ENCODING_UTF8 },
+    { "ISO-8859-1", XML_ENCODING_LATIN1 }, { "ISO8859-1", XML_ENCODING_LATIN1 }, { "ISO_8859-1", XML_ENCODING_LATIN1 },
+    { "LATIN1", XML_ENCODING_LATIN1 }, { "LATIN-1", XML_ENCODING_LATIN1 }, { "L1", XML_ENCODING_LATIN1 },
+    { "WINDOWS-1252", XML_ENCODING_CP1252 }, { "CP1252", XML_ENCODING_CP1252 },
+  };
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+    if (EncodingNameIs(name, len, names[i].name)) return names[i].encoding;
+  }
+  return XML_ENCODING_UNKNOWN;
+}
+
+/* `encoding="..."` of `<?xml ...?>` at the start of `data` */
+static XMLEncoding EncodingFromDeclaration(const char *data, size_t size) {
+  if (size < 6 || memcmp(data, "<?xml", 5) != 0 || !isspace((unsigned char)data[5])) return XML_ENCODING_UTF8;
+
+  const char *end = (const char *)memchr(data, '>', size);
+  if (end == NULL) return XML_ENCODING_UTF8; /* the parser reports it */
+  for (const char *p = data + 5; p + 8 < end; ++p) {
+    if (memcmp(p, "encoding", 8) != 0 || !isspace((unsigned char)p[-1])) continue;
+    p += 8;
+    while (p < end && isspace((unsigned char)*p)) p++;
+    if (p == end || *p != '=') break;
+    p++;
+    while (p < end && isspace((unsigned char)*p)) p++;
+    if (p == end || (*p != '"' && *p != '\'')) break;
+    const char *name = p + 1;
+    const char *quote = (const char *)memchr(name, *p, (size_t)(end - name));
+    if (quote == NULL) break;
+    return EncodingFromName(name, (size_t)(quote - name));
+  }
+  return XML_ENCODING_UTF8;
+}
+
+XMLEncoding XMLDetectEncoding(const char *data, size_t size, size_t *bom_len) {
+  const unsigned char *s = (const unsigned char *)data;
+  size_t bom = 0;
+  XMLEncoding encoding = XML_ENCODING_UTF8;
+
+  if (size >= 3 && s[0] == 0xEF && s[1] == 0xBB && s[2] == 0xBF) {
+    bom = 3;
+  } else if (size >= 2 && s[0] == 0xFF && s[1] == 0xFE) {
+    bom = 2;
+    encoding = XML_ENCODING_UTF16LE;
+  } else if (size >= 2 && s[0] == 0xFE && s[1] == 0xFF) {
+    bom = 2;
+    encoding = XML_ENCODING_UTF16BE;
+  } else if (size >= 4 && s[0] == '<' && s[1] == 0 && s[2] == '?' && s[3] == 0) {
+    encoding = XML_ENCODING_UTF16LE;
+  } else if (size >= 4 && s[0] == 0 && s[1] == '<' && s[2] == 0 && s[3] == '?') {
+    encoding = XML_ENCODING_UTF16BE;
+  } else {
+    encoding = EncodingFromDeclaration(data, size);
+  }
+
+  if (bom_len) *bom_len = bom;
+  return encoding;
+}
+
+/******************************************************************************
+ * UTF-8
+ ******************************************************************************/
+
+/* number of ASCII bytes at the start of `s` */
+static size_t AsciiRun(const unsigned char *s, size_t size) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 16 <= size; i += 16) {
+    int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+    if (mask != 0) return i + (size_t)__builtin_ctz((unsigned int)mask);
+  }
+#else
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, s + i, 8);
+    if (word & 0x8080808080808080ULL) break;
+  }
+#endif
+  while (i < size && s[i] < 0x80) i++;
+  return i;
+}
+
+int XMLUTF8Decode(const char *str, size_t size, unsigned int *cp) {
+  const unsigned char *s = (const unsigned char *)str;
+  if (size == 0) return 0;
+  if (s[0] < 0x80) {
+    *cp = s[0];
+    return 1;
+  }
+
+  /* Unicode table 3-7: the allowed range of the second byte depends on the first */
+  unsigned char lo = 0x80, hi = 0xBF;
+  int len = 0;
+  unsigned int c = 0;
+  if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+    len = 2;
+    c = s[0] & 0x1F;
+  } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+    len = 3;
+    c = s[0] & 0x0F;
+    if (s[0] == 0xE0) lo = 0xA0;      /* overlong */
+    else if (s[0] == 0xED) hi = 0x9F; /* surrogates */
+  } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+    len = 4;
+    c = s[0] & 0x07;
+    if (s[0] == 0xF0) lo = 0x90;      /* overlong */
+    else if (s[0] == 0xF4) hi = 0x8F; /* above U+10FFFF */
+  } else {
+    return 0;
+  }
+
+  if ((size_t)len > size || s[1] < lo || s[1] > hi) return 0;
+  for (int i = 1; i < len; ++i) {
+    if ((s[i] & 0xC0) != 0x80) return 0;
+    c = (c << 6) | (s[i] & 0x3F);
+  }
+  *cp = c;
+  return len;
+}
+
+size_t XMLUTF8Validate(const char *data, size_t size) {
+  const unsigned char *s = (const unsigned char *)data;
+  size_t i = 0;
+  unsigned int cp;
+
+  while (i < size) {
+    i += AsciiRun(s + i, size - i);
+    if (i >= size) break;
+    int len = XMLUTF8Decode(data + i, size - i, &cp);
+    if (len == 0) return i;
+    i += (size_t)len;
+  }
+  return size;
+}
+
+static size_t UTF8Encode(unsigned int cp, char *out) {
+  unsigned char *o = (unsigned char *)out;
+  if (cp < 0x80) {
+    o[0] = (unsigned char)cp;
+    return 1;
+  } else if (cp < 0x800) {
+    o[0] = (unsigned char)(0xC0 | (cp >> 6));
+    o[1] = (unsigned char)(0x80 | (cp & 0x3F));
+    return 2;
+  } else if (cp < 0x10000) {
+    o[0] = (unsigned char)(0xE0 | (cp >> 12));
+    o[1] = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+    o[2] = (unsigned char)(0x80 | (cp & 0x3F));
+    return 3;
+  }
+  o[0] = (unsigned char)(0xF0 | (cp >> 18));
+  o[1] = (unsigned char)(0x80 | ((cp >> 12) & 0x3F));
+  o[2] = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+  o[3] = (unsigned char)(0x80 | (cp & 0x3F));
+  return 4;
+}
+
+/******************************************************************************
+ * Transcoding
+ ******************************************************************************/
+
+/* windows-1252 0x80-0x9F. The 5 undefined bytes map to the C1 control of the same value, as browsers do. */
+static const unsigned short cp1252_high[32] = {
+  0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021, 0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+  0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014, 0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178
+};
+
+static size_t TranscodeSingleByte(const unsigned char *s, size_t size, bool cp1252, char *out) {
+  size_t o = 0;
+  for (size_t i = 0; i < size;) {
+    size_t run = AsciiRun(s + i, size - i);
+    memcpy(out + o, s + i, run);
+    o += run;
+    i += run;
+    if (i >= size) break;
+    unsigned int cp = s[i++];
+    if (cp1252 && cp < 0xA0) cp = cp1252_high[cp - 0x80];
+    o += UTF8Encode(cp, out + o);
+  }
+  return o;
+}
+
+static unsigned int UTF16Unit(const unsigned char *s, bool big_endian) {
+  return big_endian ? (unsigned int)(s[0] << 8 | s[1]) : (unsigned int)(s[1] << 8 | s[0]);
+}
+
+static bool TranscodeUTF16(const unsigned char *s, size_t size, bool big_endian, char *out, size_t *out_size, size_t *error_offset) {
+  size_t o = 0, i = 0;
+  while (i + 2 <= size) {
+#if defined(__SSE2__)
+    /* 8 ASCII units at a time: the high byte & bit 7 of each unit must be 0, and a 0 unit is left to the loop below */
+    const __m128i ascii_mask = _mm_set1_epi16((short)0xFF80);
+    while (i + 16 <= size) {
+      __m128i units = _mm_loadu_si128((const __m128i *)(s + i));
+      if (big_endian) units = _mm_or_si128(_mm_slli_epi16(units, 8), _mm_srli_epi16(units, 8));
+      __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(units, ascii_mask), _mm_setzero_si128());
+      __m128i zero = _mm_cmpeq_epi16(units, _mm_setzero_si128());
+      if (_mm_movemask_epi8(_mm_andnot_si128(zero, ascii)) != 0xFFFF) break;
+      _mm_storel_epi64((__m128i *)(out + o), _mm_packus_epi16(units, units));
+      o += 8;
+      i += 16;
+    }
+    if (i + 2 > size) break;
+#endif
+    unsigned int cp = UTF16Unit(s + i, big_endian);
+    size_t at = i;
+    i += 2;
+    if (cp >= 0xD800 && cp <= 0xDBFF) { /* high surrogate: a low one must follow */
+      unsigned int low = i + 2 <= size ? UTF16Unit(s + i, big_endian) : 0;
+      if (low < 0xDC00 || low > 0xDFFF) {
+        *error_offset = at;
+        return false;
+      }
+      cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+      i += 2;
+    } else if ((cp >= 0xDC00 && cp <= 0xDFFF) || cp == 0) { /* lone low surrogate, or a NUL the parser can't see */
+      *error_offset = at;
+      return false;
+    }
+    o += UTF8Encode(cp, out + o);
+  }
+  if (i != size) { /* odd number of bytes */
+    *error_offset = i;
+    return false;
+  }
+  *out_size = o;
+  return true;
+}
+
+bool XMLTranscode(const char *data, size_t size, XMLEncoding encoding,
+                  char **out, size_t *capacity, size_t *out_size, size_t *error_offset) {
+  const unsigned char *s = (const unsigned char *)data;
+  size_t needed = 0; /* worst case */
+
+  switch (encoding) {
+    case XML_ENCODING_UTF8: needed = size; break;
+    case XML_ENCODING_LATIN1: needed = size * 2; break;
+    case XML_ENCODING_CP1252: needed = size * 3; break;
+    case XML_ENCODING_UTF16LE: case XML_ENCODING_UTF16BE: needed = size / 2 * 3 + 8; break; /* + a SSE2 store */
+    default:
+      *error_offset = 0;
+      return false;
+  }
+  if (*out == NULL || *capacity < needed + 1) {
+    char *new_out = (char *)realloc(*out, needed + 1);
+    if (new_out == NULL) {
+      *error_offset = size;
+      return false;
+    }
+    *out = new_out;
+    *capacity = needed + 1;
+  }
+
+  switch (encoding) {
+    case XML_ENCODING_UTF8:
+      *out_size = XMLUTF8Validate(data, size);
+      if (*out_size != size) {
+        *error_offset = *out_size;
+        return false;
+      }
+      if (*out != data) memmove(*out, data, size);
+      break;
+    case XML_ENCODING_LATIN1: case XML_ENCODING_CP1252:
+      *out_size = TranscodeSingleByte(s, size, encoding == XML_ENCODING_CP1252, *out);
+      break;
+    default:
+      if (!TranscodeUTF16(s, size, encoding == XML_ENCODING_UTF16BE, *out, out_size, error_offset)) return false;
+      break;
+  }
+  (*out)[*out_size] = '\0';
+  return true;
+}
+
+/******************************************************************************
+ * Names
+ ******************************************************************************/
+typedef struct CodeRange {
+  unsigned int first, last;
+}CodeRange;
+
+/* NameStartChar above ASCII */
+static const CodeRange name_start_ranges[] = {
+  { 0xC0, 0xD6 }, { 0xD8, 0xF6 }, { 0xF8, 0x2FF }, { 0x370, 0x37D }, { 0x37F, 0x1FFF }, { 0x200C, 0x200D },
+  { 0x2070, 0x218F }, { 0x2C00, 0x2FEF }, { 0x3001, 0xD7FF }, { 0xF900, 0xFDCF }, { 0xFDF0, 0xFFFD }, { 0x10000, 0xEFFFF }
+};
+
+/* what NameChar adds above ASCII */
+static const CodeRange name_char_ranges[] = {
+  { 0xB7, 0xB7 }, { 0x300, 0x36F }, { 0x203F, 0x2040 }
+};
+
+static bool InRanges(const CodeRange *ranges, size_t count, unsigned int cp) {
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (cp < ranges[mid].first) hi = mid;
+    else if (cp > ranges[mid].last) lo = mid + 1;
+    else return true;
+  }
+  return false;
+}
+
+bool XMLIsNameStartChar(unsigned int cp) {
+  if (cp < 0x80) return (cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z') || cp == '_' || cp == ':';
+  return InRanges(name_start_ranges, sizeof(name_start_ranges) / sizeof(name_start_ranges[0]), cp);
+}
+
+bool XMLIsNameChar(unsigned int cp) {
+  if (cp < 0x80) return XMLIsNameStartChar(cp) || (cp >= '0' && cp <= '9') || cp == '-' || cp == '.';
+  return XMLIsNameStartChar(cp) || InRanges(name_char_ranges, sizeof(name_char_ranges) / sizeof(name_char_ranges[0]), cp);
+}
@@ -0,0 +1,46 @@
+#ifndef __XML_ENCODING_H__
+#define __XML_ENCODING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Input encodings. The parser works on UTF-8: anything else is converted when the input is read. */
+typedef enum XMLEncoding {
+  XML_ENCODING_UNKNOWN = 0, /* declared, but not one of the below */
+  XML_ENCODING_UTF8,
+  XML_ENCODING_UTF16LE,
+  XML_ENCODING_UTF16BE,
+  XML_ENCODING_LATIN1,      /* ISO-8859-1 */
+  XML_ENCODING_CP1252       /* windows-1252: Latin-1 with printable characters in 0x80-0x9F */
+}XMLEncoding;
+
+/* Encoding of `data`: from its byte order mark, else from the first bytes(`<?` in UTF-16
+ * without BOM), else from the `encoding` of its XML declaration. UTF-8 if none says otherwise.
+ * `*bom_len`(if not NULL) is the length of the byte order mark, 0 if there is none.
+ * */
+XMLEncoding XMLDetectEncoding(const char *data, size_t size, size_t *bom_len);
+
+/* Length of the longest valid UTF-8 prefix of `data`, i.e. `size` if it is all valid.
+ * Overlong forms, surrogates and code points above U+10FFFF are invalid.
+ * Runs of ASCII are checked 16(SSE2) or 8 bytes at a time.
+ * */
+size_t XMLUTF8Validate(const char *data, size_t size);
+
+/* Decode the UTF-8 sequence at `s`(at most `size` bytes) into `*cp`.
+ * Returns its length, 0 if it is not valid.
+ * */
+int XMLUTF8Decode(const char *s, size_t size, unsigned int *cp);
+
+/* Convert `size` bytes of `data` from `encoding` to UTF-8(null terminated) into `*out`,
+ * growing it(and `*capacity`) with realloc if needed. `*out_size` is the length written.
+ * Returns false on an invalid sequence, whose offset in `data` is put in `*error_offset`,
+ * or if out of memory(`*error_offset` is then `size`).
+ * */
+bool XMLTranscode(const char *data, size_t size, XMLEncoding encoding,
+                  char **out, size_t *capacity, size_t *out_size, size_t *error_offset);
+
+/* XML 1.0(fifth edition) NameStartChar & NameChar, by code point */
+bool XMLIsNameStartChar(unsigned int cp);
+bool XMLIsNameChar(unsigned int cp);
+
+#endif
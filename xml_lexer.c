@@ -1,7 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef XML_STATS
+#include <time.h>
+#endif
 #include "xml_lexer.h"
+#include "xml_encoding.h"
 
 static src_pos_t src_pos_make(const char *file, int line, int column) {
   src_pos_t pos;
@@ -18,11 +22,11 @@ static const char *token_type_names[] = {
   ">",
   "</",
   "/>",
-  "<?",
-  "?>",
+  "PI",
   "NAME",
   "COMMENT",
   "CDATA",
+  "DOCTYPE",
   "ASSIGN",
   "STRING",
   "TEXT"
@@ -48,15 +52,43 @@ void token_dump(token_t tok) {
 }
 #endif
 
-static bool is_letter(char ch) {
-  return ('a' <= ch && ch <= 'z') || ('A' <= ch && ch <= 'Z') || ch == '_';
-}
+/* Character classes, one table lookup per byte instead of chains of comparisons.
+ * Bytes >= 0x80 are CC_UTF8: the sequence they start is decoded to classify it(see `name_char_len`).
+ * */
+#define CC_NAME_START 0x01 /* can start a name */
+#define CC_NAME_CHAR  0x02 /* can be in a name */
+#define CC_SPACE      0x04
+#define CC_TEXT_END   0x08 /* `<` & `\0`: where text stops */
+#define CC_QUOTE      0x10
+#define CC_UTF8       0x20
+static const unsigned char char_class[256] = {
+  0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x04, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x02, 0x00,
+  0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x03, 0x00, 0x08, 0x00, 0x00, 0x00,
+  0x00, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+  0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x00, 0x00, 0x00, 0x00, 0x03,
+  0x00, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+  0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+};
+#define CHAR_CLASS(ch) char_class[(unsigned char)(ch)]
 
-static bool is_digit(char ch) {
-  return ch >= '0' && ch <= '9';
-}
+/* The scanning functions take the lexer flags(see `lexer_set_flags`) and are always inlined into
+ * the instances of `lexer_scan` below: with the flags as constants, the compiler leaves out the code
+ * they turn off(e.g. counting newlines), and nothing is tested for them per character or token.
+ * */
+#define LEXER_INLINE static inline __attribute__((always_inline))
+#define POSITIONS(flags) (!((flags) & LEXER_NO_POSITIONS))
 
-static void read_char(lexer_t *lex) {
+LEXER_INLINE void read_char(lexer_t *lex, unsigned flags) {
   if (lex->next_position >= lex->input_len) {
     lex->ch = '\0';
   } else {
@@ -66,6 +98,7 @@ static void read_char(lexer_t *lex) {
   lex->position = lex->next_position;
   lex->next_position++;
 
+  if (!POSITIONS(flags)) return;
   if (lex->ch == '\n') {
     lex->line++;
     lex->column = 0;
@@ -74,6 +107,59 @@ static void read_char(lexer_t *lex) {
   }
 }
 
+LEXER_INLINE void set_position(lexer_t *lex, int position, unsigned flags) {
+  lex->position = position;
+  lex->next_position = position + 1;
+  lex->ch = position < lex->input_len ? lex->input[position] : '\0';
+  if (POSITIONS(flags) && lex->ch == '\n') { /* as `read_char`: counted when it becomes the current char */
+    lex->line++;
+    lex->column = 0;
+  }
+}
+
+/* `read_char` up to `position` at once: the scanning loops find the end of a token
+ * with the class table first, then move there, counting the lines in between.
+ * */
+LEXER_INLINE void advance_to(lexer_t *lex, int position, unsigned flags) {
+  if (position <= lex->position) return;
+  if (position > lex->input_len) position = lex->input_len;
+
+  if (POSITIONS(flags)) {
+    int column = lex->column;
+    for (int i = lex->position + 1; i < position; ++i) {
+      if (lex->input[i] == '\n') {
+        lex->line++;
+        column = 0;
+      } else {
+        column++;
+      }
+    }
+    lex->column = column + 1;
+  }
+  set_position(lex, position, flags);
+}
+
+/* `advance_to` when there is no newline in between, e.g. after a name */
+LEXER_INLINE void advance_on_line(lexer_t *lex, int position, unsigned flags) {
+  if (POSITIONS(flags)) lex->column += position - lex->position;
+  set_position(lex, position, flags);
+}
+
+/* `advance_to` for a scanning loop that counted the newlines it went over:
+ * `lines` of them, the last at `newline`.
+ * */
+LEXER_INLINE void advance_lines(lexer_t *lex, int position, int lines, int newline, unsigned flags) {
+  if (!POSITIONS(flags)) {
+    /* nothing counted */
+  } else if (lines > 0) {
+    lex->line += lines;
+    lex->column = position - newline;
+  } else {
+    lex->column += position - lex->position;
+  }
+  set_position(lex, position, flags);
+}
+
 static char peek_char(lexer_t *lex) {
   if (lex->next_position >= lex->input_len) return '\0';
   return lex->input[lex->next_position];
@@ -84,95 +170,112 @@ static char peek_nchar(lexer_t *lex, int n) {
   return lex->input[lex->next_position + n];
 }
 
-static const char *read_identifier(lexer_t *lex, int *out_len) {
-  int position = lex->position;
-  int len = 0;
-  while (is_digit(lex->ch) || is_letter(lex->ch) || lex->ch == ':' || lex->ch == '-' || lex->ch == '.') read_char(lex);
+/* length of the name character at `position`, 0 if it is not one. `flag`: CC_NAME_START or CC_NAME_CHAR. */
+static int name_char_len(const lexer_t *lex, int position, unsigned char flag) {
+  unsigned char ch = (unsigned char)lex->input[position];
+  if (!(char_class[ch] & CC_UTF8)) return (char_class[ch] & flag) ? 1 : 0;
 
-  len = lex->position - position;
-  *out_len = len;
-  return lex->input + position;
+  unsigned int cp;
+  int len = XMLUTF8Decode(lex->input + position, (size_t)(lex->input_len - position), &cp);
+  if (len == 0) return 0;
+  if (flag == CC_NAME_START ? !XMLIsNameStartChar(cp) : !XMLIsNameChar(cp)) return 0;
+  return len;
 }
 
-static const char *read_text(lexer_t *lex, int *out_len) {
+LEXER_INLINE const char *read_identifier(lexer_t *lex, int *out_len, unsigned flags) {
   int position = lex->position;
-  int len = 0;
-  while (lex->ch != '<') read_char(lex);
+  int end = position;
+  for (;;) {
+    while (end < lex->input_len && (CHAR_CLASS(lex->input[end]) & CC_NAME_CHAR)) end++;
+    if (end >= lex->input_len || !(CHAR_CLASS(lex->input[end]) & CC_UTF8)) break;
+    int n = name_char_len(lex, end, CC_NAME_CHAR);
+    if (n == 0) break;
+    end += n;
+  }
+  advance_on_line(lex, end, flags);
 
-  len = lex->position - position;
-  *out_len = len;
+  *out_len = end - position;
   return lex->input + position;
 }
 
-static const char *read_string(lexer_t *lex, int *out_len) {
+LEXER_INLINE const char *read_text(lexer_t *lex, int *out_len, unsigned flags) {
   int position = lex->position;
-  int len = 0;
-  read_char(lex);
-  while (lex->ch != '"' && lex->ch != '\'') read_char(lex);
-  read_char(lex);
+  int end = position + 1, lines = 0, newline = 0;
+  if (POSITIONS(flags)) {
+    while (end < lex->input_len && !(CHAR_CLASS(lex->input[end]) & CC_TEXT_END)) {
+      if (lex->input[end] == '\n') {
+        lines++;
+        newline = end;
+      }
+      end++;
+    }
+  } else {
+    while (end < lex->input_len && !(CHAR_CLASS(lex->input[end]) & CC_TEXT_END)) end++;
+  }
+  advance_lines(lex, end, lines, newline, flags);
 
-  len = lex->position - position;
-  *out_len = len;
+  if (flags & LEXER_TRIM_TEXT) { /* the first char is not a space: leading ones were skipped */
+    while (CHAR_CLASS(lex->input[end - 1]) & CC_SPACE) end--;
+  }
+  *out_len = end - position;
   return lex->input + position;
 }
 
-static const char *read_comment(lexer_t *lex, int *out_len) {
+/* quoted string, including the quotes. `*out_len` is -1 if the closing quote is missing. */
+LEXER_INLINE const char *read_string(lexer_t *lex, int *out_len, unsigned flags) {
   int position = lex->position;
-  int len = 0;
-
-  while (lex->ch != '\0') {
-    if (!strncmp(lex->input + lex->position, "-->", 3)) {
-      read_char(lex);
-      read_char(lex);
-      read_char(lex);
-      break;
+  int end = position + 1, lines = 0, newline = 0;
+  while (end < lex->input_len && lex->input[end] != lex->ch) {
+    if (POSITIONS(flags) && lex->input[end] == '\n') {
+      lines++;
+      newline = end;
     }
-    read_char(lex);
+    end++;
+  }
+  if (end >= lex->input_len) {
+    advance_lines(lex, lex->input_len, lines, newline, flags);
+    *out_len = -1;
+    return lex->input + position;
   }
+  advance_lines(lex, end + 1, lines, newline, flags);
 
-  len = lex->position - position;
-  *out_len = len;
+  *out_len = lex->position - position;
   return lex->input + position;
 }
 
-static const char *read_pi(lexer_t *lex, int *out_len) {
+/* markup up to and including `terminator`, or up to the end if it is missing */
+LEXER_INLINE const char *read_until(lexer_t *lex, const char *terminator, int terminator_len, int *out_len, unsigned flags) {
   int position = lex->position;
-  int len = 0;
+  const char *p = lex->input + position;
+  const char *end = lex->input + lex->input_len;
+  int stop = lex->input_len;
 
-  while (lex->ch != '\0') {
-    if (!strncmp(lex->input + lex->position, "?>", 2)) {
-      read_char(lex);
-      read_char(lex);
+  while ((p = (const char *)memchr(p, terminator[0], (size_t)(end - p))) != NULL) {
+    if (end - p >= terminator_len && memcmp(p, terminator, (size_t)terminator_len) == 0) {
+      stop = (int)(p - lex->input) + terminator_len;
       break;
     }
-    read_char(lex);
+    p++;
   }
+  advance_to(lex, stop, flags);
 
-  len = lex->position - position;
-  *out_len = len;
+  *out_len = lex->position - position;
   return lex->input + position;
 }
 
-static const char *read_cdata(lexer_t *lex, int *out_len) {
-  int position = lex->position;
-  int len = 0;
+LEXER_INLINE const char *read_comment(lexer_t *lex, int *out_len, unsigned flags) {
+  return read_until(lex, "-->", 3, out_len, flags);
+}
 
-  while (lex->ch != '\0') {
-    if (!strncmp(lex->input + lex->position, "]]>", 3)) {
-      read_char(lex);
-      read_char(lex);
-      read_char(lex);
-      break;
-    }
-    read_char(lex);
-  }
+LEXER_INLINE const char *read_pi(lexer_t *lex, int *out_len, unsigned flags) {
+  return read_until(lex, "?>", 2, out_len, flags);
+}
 
-  len = lex->position - position;
-  *out_len = len;
-  return lex->input + position;
+LEXER_INLINE const char *read_cdata(lexer_t *lex, int *out_len, unsigned flags) {
+  return read_until(lex, "]]>", 3, out_len, flags);
 }
 
-static const char *read_doctype(lexer_t *lex, int *out_len) {
+LEXER_INLINE const char *read_doctype(lexer_t *lex, int *out_len, unsigned flags) {
   int found_left_bracket = 0;
   int position = lex->position;
   int len = 0;
@@ -181,17 +284,17 @@ static const char *read_doctype(lexer_t *lex, int *out_len) {
     if (lex->ch == '[') found_left_bracket = 1;
     if (found_left_bracket) {
       if (!strncmp(lex->input + lex->position, "]>", 2)) {
-        read_char(lex);
-        read_char(lex);
+        read_char(lex, flags);
+        read_char(lex, flags);
         break;
       }
     } else {
       if (lex->ch == '>') {
-        read_char(lex);
+        read_char(lex, flags);
         break;
       }
     }
-    read_char(lex);
+    read_char(lex, flags);
   }
 
   len = lex->position - position;
@@ -199,17 +302,27 @@ static const char *read_doctype(lexer_t *lex, int *out_len) {
   return lex->input + position;
 }
 
-static void skip_whitespace(lexer_t *lex) {
-  char ch = lex->ch;
-  while (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r') {
-    read_char(lex);
-    ch = lex->ch;
+LEXER_INLINE void skip_whitespace(lexer_t *lex, unsigned flags) {
+  if (!(CHAR_CLASS(lex->ch) & CC_SPACE)) return;
+
+  int end = lex->position + 1, lines = 0, newline = 0;
+  while (end < lex->input_len && (CHAR_CLASS(lex->input[end]) & CC_SPACE)) {
+    if (POSITIONS(flags) && lex->input[end] == '\n') {
+      lines++;
+      newline = end;
+    }
+    end++;
   }
+  advance_lines(lex, end, lines, newline, flags);
 }
 
 bool lexer_init(lexer_t *lex, const char *input, const char *filename) {
+  return lexer_init_len(lex, input, (int)strlen(input), filename);
+}
+
+bool lexer_init_len(lexer_t *lex, const char *input, int len, const char *filename) {
   lex->input = input;
-  lex->input_len = (int)strlen(input);
+  lex->input_len = len;
   lex->position = 0;
   lex->next_position = 0;
   lex->ch = '\0';
@@ -217,14 +330,51 @@ bool lexer_init(lexer_t *lex, const char *input, const char *filename) {
   lex->column = 0;
   lex->file = filename;
   lex->inTag = false;
+  lex->stats = NULL;
+  lex->refill = NULL;
+  lex->refill_data = NULL;
+  lexer_set_flags(lex, 0);
 
-  read_char(lex);
+  read_char(lex, 0);
   token_init(&lex->cur_token, TOKEN_NONE, NULL, 0);
   token_init(&lex->peek_token, TOKEN_NONE, NULL, 0);
 
   return true;
 }
 
+bool lexer_init_refill(lexer_t *lex, const char *input, int len, const char *filename, lexer_refill_fn refill, void *user_data) {
+  lexer_init_len(lex, input, len, filename);
+  lex->refill = refill;
+  lex->refill_data = user_data;
+  return true;
+}
+
+static void rebase_token(token_t *tok, const char *old_input, int old_len, const char *input) {
+  if (tok->literal >= old_input && tok->literal <= old_input + old_len) tok->literal = input + (tok->literal - old_input);
+}
+
+void lexer_rebase(lexer_t *lex, const char *input, int len) {
+  rebase_token(&lex->cur_token, lex->input, lex->input_len, input);
+  rebase_token(&lex->peek_token, lex->input, lex->input_len, input);
+  lex->input = input;
+  lex->input_len = len;
+}
+
+static void discard_token(token_t *tok, const char *old_input, int old_len, int count, const char *input) {
+  if (tok->literal < old_input || tok->literal > old_input + old_len) return;
+  if (tok->literal < old_input + count) token_init(tok, TOKEN_NONE, NULL, 0);
+  else tok->literal = input + (tok->literal - old_input - count);
+}
+
+void lexer_discard(lexer_t *lex, const char *input, int len, int count) {
+  discard_token(&lex->cur_token, lex->input, lex->input_len, count, input);
+  discard_token(&lex->peek_token, lex->input, lex->input_len, count, input);
+  lex->input = input;
+  lex->input_len = len;
+  lex->position = lex->position > count ? lex->position - count : 0;
+  lex->next_position = lex->next_position > count ? lex->next_position - count : 0;
+}
+
 bool lexer_cur_token_is(lexer_t *lex, token_type_t type) {
   return lex->cur_token.type == type;
 }
@@ -243,50 +393,78 @@ bool lexer_expect_peek(lexer_t *lex, token_type_t type) {
   return true;
 }
 
-static token_t lexer_next_token_internal(lexer_t *lex) {
+LEXER_INLINE token_t lexer_scan(lexer_t *lex, unsigned flags) {
   while (true) {
-    skip_whitespace(lex);
+    skip_whitespace(lex, flags);
 
     token_t out_tok;
     out_tok.type = TOKEN_NONE;
     out_tok.literal = lex->input + lex->position;
     out_tok.len = 1;
-    out_tok.pos = src_pos_make(lex->file, lex->line, lex->column);
+    out_tok.pos = POSITIONS(flags) ? src_pos_make(lex->file, lex->line, lex->column) : src_pos_make(lex->file, 0, 0);
 
     char c = lex->ch;
-    /* check current char */
+    unsigned char cls = CHAR_CLASS(c);
+    /* dispatch on the class of the current char */
+    if (!lex->inTag && !(cls & CC_TEXT_END)) {
+      int text_len = 0;
+      const char *text = read_text(lex, &text_len, flags);
+      token_init(&out_tok, TOKEN_TEXT, text, text_len);
+      return out_tok;
+    }
+
+    if ((cls & CC_NAME_START) || ((cls & CC_UTF8) && name_char_len(lex, lex->position, CC_NAME_START) > 0)) {
+      int ident_len = 0;
+      const char *ident = read_identifier(lex, &ident_len, flags);
+      token_init(&out_tok, TOKEN_NAME, ident, ident_len);
+      return out_tok;
+    }
+
+    if (cls & CC_QUOTE) {
+      int str_len = 0;
+      const char *str = read_string(lex, &str_len, flags);
+      if (str_len < 0) { /* unterminated */
+        token_init(&out_tok, TOKEN_NONE, str, lex->input_len - (int)(str - lex->input));
+        return out_tok;
+      }
+      token_init(&out_tok, TOKEN_STRING, str+1, str_len-2);
+      return out_tok;
+    }
+
     switch (c) {
       case '\0': token_init(&out_tok, TOKEN_EOF, "EOF", 3); break;
-      case '>': token_init(&out_tok, TOKEN_CLOSE_TAG, ">", 1); lex->inTag = false; break;
-      case '=': token_init(&out_tok, TOKEN_ASSIGN, "=", 1); break;
+      case '>': token_init(&out_tok, TOKEN_CLOSE_TAG, out_tok.literal, 1); lex->inTag = false; break;
+      case '=': token_init(&out_tok, TOKEN_ASSIGN, out_tok.literal, 1); break;
       case '<': {
         if (peek_char(lex) == '/') {
-          token_init(&out_tok, TOKEN_OPENSLASH_TAG, "</", 2);
-          read_char(lex);
+          token_init(&out_tok, TOKEN_OPENSLASH_TAG, out_tok.literal, 2);
+          read_char(lex, flags);
         } else if (peek_char(lex) == '?') {
           int str_len = 0;
-          const char *str = read_pi(lex, &str_len);
+          const char *str = read_pi(lex, &str_len, flags);
+          if (flags & LEXER_SKIP_PI) continue;
           token_init(&out_tok, TOKEN_PI, str, str_len);
           return out_tok;
           //token_init(&out_tok, TOKEN_OPEN_HEADER, "<?", 2);
-          //read_char(lex);
+          //read_char(lex, flags);
         } else if ((peek_nchar(lex, 0) == '!') && (peek_nchar(lex, 1) == '-') && (peek_nchar(lex, 1) == '-')) {
           int str_len = 0;
-          const char *str = read_comment(lex, &str_len);
+          const char *str = read_comment(lex, &str_len, flags);
+          if (flags & LEXER_SKIP_COMMENTS) continue;
           token_init(&out_tok, TOKEN_COMMENT, str, str_len);
           return out_tok;
         } else if (!strncmp(lex->input + lex->position, "<![CDATA[", 9)) {
           int str_len = 0;
-          const char *str = read_cdata(lex, &str_len);
+          const char *str = read_cdata(lex, &str_len, flags);
           token_init(&out_tok, TOKEN_CDATA, str, str_len);
           return out_tok;
         } else if (!strncmp(lex->input + lex->position, "<!DOCTYPE", 9)) {
           int str_len = 0;
-          const char *str = read_doctype(lex, &str_len);
+          const char *str = read_doctype(lex, &str_len, flags);
           token_init(&out_tok, TOKEN_DOCTYPE, str, str_len);
           return out_tok;
         } else {
-          token_init(&out_tok, TOKEN_OPEN_TAG, "<", 1);
+          token_init(&out_tok, TOKEN_OPEN_TAG, out_tok.literal, 1);
         }
         lex->inTag = true;
       }
@@ -294,43 +472,351 @@ static token_t lexer_next_token_internal(lexer_t *lex) {
 
       case '/': {
         if (peek_char(lex) == '>') {
-          token_init(&out_tok, TOKEN_CLOSESLASH_TAG, "/>", 2);
-          read_char(lex);
+          token_init(&out_tok, TOKEN_CLOSESLASH_TAG, out_tok.literal, 2);
+          read_char(lex, flags);
           lex->inTag = false;
         }
       }
       break;
 
       default:
-        if (!lex->inTag) {
-          int text_len = 0;
-          const char *text = read_text(lex, &text_len);
-          token_init(&out_tok, TOKEN_TEXT, text, text_len);
-          return out_tok;
-        }
-
-        if (is_letter(lex->ch)) {
-          int ident_len = 0;
-          const char *ident = read_identifier(lex, &ident_len);
-          token_init(&out_tok, TOKEN_NAME, ident, ident_len);
-          return out_tok;
-        } else if (lex->ch == '"' || lex->ch == '\'') {
-          int str_len = 0;
-          const char *str = read_string(lex, &str_len);
-          token_init(&out_tok, TOKEN_STRING, str+1, str_len-2);
-          return out_tok;
-        }
         break;
     } /* end switch */
 
-    read_char(lex);
+    read_char(lex, flags);
     return out_tok;
   } /* end while */
 }
 
+/* The instances: what the parser uses by default, the leanest one, one for the tools which never
+ * look at positions, and one for any other combination, which tests the flags as it goes.
+ * */
+static token_t lexer_scan_default(lexer_t *lex) {
+  return lexer_scan(lex, 0);
+}
+
+static token_t lexer_scan_data(lexer_t *lex) {
+  return lexer_scan(lex, LEXER_DATA);
+}
+
+static token_t lexer_scan_no_positions(lexer_t *lex) {
+  return lexer_scan(lex, LEXER_NO_POSITIONS);
+}
+
+static token_t lexer_scan_flags(lexer_t *lex) {
+  return lexer_scan(lex, lex->flags);
+}
+
+void lexer_set_flags(lexer_t *lex, unsigned flags) {
+  lex->flags = flags;
+  switch (flags) {
+    case 0: lex->scan = lexer_scan_default; break;
+    case LEXER_DATA: lex->scan = lexer_scan_data; break;
+    case LEXER_NO_POSITIONS: lex->scan = lexer_scan_no_positions; break;
+    default: lex->scan = lexer_scan_flags; break;
+  }
+}
+
+#ifdef XML_STATS
+static double lexer_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+#endif
+
+/* a token closer than this to the end of incremental input may go on after it(`<![CDATA[` is the longest look ahead) */
+#define LEXER_REFILL_MARGIN 16
+
+static token_t lexer_next_token_refill(lexer_t *lex) {
+  while (true) {
+    int position = lex->position, next_position = lex->next_position;
+    int line = lex->line, column = lex->column, len = lex->input_len;
+    bool inTag = lex->inTag;
+
+    token_t tok = lex->scan(lex);
+    if (lex->position + LEXER_REFILL_MARGIN <= lex->input_len) return tok;
+    if (!lex->refill(lex, lex->refill_data)) {
+      lex->refill = NULL; /* all there: the token stands */
+      return tok;
+    }
+    /* a token longer than a chunk(a big text node) is lexed again once the input after its start
+     * has doubled, not after every chunk: O(n), not O(n^2 / chunk) */
+    while ((size_t)(lex->input_len - position) < 2 * (size_t)(len - position) && lex->refill(lex, lex->refill_data)) {}
+
+    /* again from the start of the token */
+    lex->position = position;
+    lex->next_position = next_position;
+    lex->line = line;
+    lex->column = column;
+    lex->inTag = inTag;
+    lex->ch = position < lex->input_len ? lex->input[position] : '\0';
+    if (position >= len && lex->ch == '\n') { /* became the current char only now */
+      lex->line++;
+      lex->column = 0;
+    }
+  }
+}
+
 void lexer_next_token(lexer_t *lex) {
+#ifdef XML_STATS
+  double start = lex->stats ? lexer_clock() : 0;
+#endif
   lex->cur_token = lex->peek_token;
-  lex->peek_token = lexer_next_token_internal(lex);
+  lex->peek_token = lex->refill ? lexer_next_token_refill(lex) : lex->scan(lex);
+#ifdef XML_STATS
+  if (lex->stats) {
+    lex->stats->tokens[lex->peek_token.type]++;
+    lex->stats->seconds += lexer_clock() - start;
+  }
+#endif
+}
+
+void lexer_seek(lexer_t *lex, int position) {
+  lex->next_position = position;
+  lex->inTag = false;
+  read_char(lex, lex->flags);
+  lexer_next_token(lex);
+  lexer_next_token(lex);
+}
+
+/******************************************************************************
+ * Structural index: only looks for `<`, and steps over markup the way the
+ * tokenizer reads it, so it agrees with it on where elements start and end.
+ ******************************************************************************/
+typedef enum {
+  INDEX_TAG_NONE,   /* no more tags */
+  INDEX_TAG_START,
+  INDEX_TAG_EMPTY,  /* <name/> */
+  INDEX_TAG_END,
+  INDEX_TAG_ERROR   /* unterminated */
+}index_tag_t;
+
+static const char *index_find(const char *p, const char *end, const char *str, size_t n) {
+  while ((p = memchr(p, str[0], end - p)) != NULL) {
+    if ((size_t)(end - p) < n) return NULL;
+    if (memcmp(p, str, n) == 0) return p;
+    p++;
+  }
+  return NULL;
 }
 
+/* the next start or end tag from `*pos`, which is moved after it. `*tag_start`: offset of its `<` */
+static index_tag_t index_next_tag(const char *input, size_t len, size_t *pos, size_t *tag_start) {
+  const char *end = input + len;
+  const char *p = input + *pos;
+  const char *q = NULL;
+
+  while (p < end && (p = memchr(p, '<', end - p)) != NULL) {
+    size_t left = end - p;
+    *tag_start = p - input;
+    if (left > 1 && p[1] == '/') {
+      if ((q = memchr(p, '>', left)) == NULL) return INDEX_TAG_ERROR;
+      *pos = q + 1 - input;
+      return INDEX_TAG_END;
+    } else if (left > 1 && p[1] == '?') {
+      if ((q = index_find(p, end, "?>", 2)) == NULL) return INDEX_TAG_ERROR;
+      p = q + 2;
+    } else if (left > 2 && p[1] == '!' && p[2] == '-') {
+      if ((q = index_find(p, end, "-->", 3)) == NULL) return INDEX_TAG_ERROR;
+      p = q + 3;
+    } else if (left >= 9 && !strncmp(p, "<![CDATA[", 9)) {
+      if ((q = index_find(p, end, "]]>", 3)) == NULL) return INDEX_TAG_ERROR;
+      p = q + 3;
+    } else if (left >= 9 && !strncmp(p, "<!DOCTYPE", 9)) { /* as `read_doctype` */
+      bool bracket = false;
+      for (q = p; q < end; ++q) {
+        if (*q == '[') bracket = true;
+        if (bracket ? (q + 1 < end && q[0] == ']' && q[1] == '>') : *q == '>') break;
+      }
+      if (q >= end) return INDEX_TAG_ERROR;
+      p = q + (bracket ? 2 : 1);
+    } else { /* start tag: up to the `>` which is not inside a quoted value */
+      for (q = p + 1; q < end && *q != '>'; ++q) {
+        if (*q == '"' || *q == '\'') {
+          q = memchr(q + 1, *q, end - (q + 1));
+          if (q == NULL) return INDEX_TAG_ERROR;
+        }
+      }
+      if (q >= end) return INDEX_TAG_ERROR;
+      *pos = q + 1 - input;
+      return q[-1] == '/' ? INDEX_TAG_EMPTY : INDEX_TAG_START;
+    }
+  }
+  return INDEX_TAG_NONE;
+}
 
+bool lexer_index_build(lexer_index_t *index, const char *input, size_t len) {
+  size_t *open = NULL; /* entries whose end tag is still to come */
+  size_t depth = 0, open_capacity = 0;
+  size_t pos = 0, tag_start = 0;
+  bool ok = true;
+
+  memset(index, 0, sizeof(lexer_index_t));
+  while (ok) {
+    index_tag_t tag = index_next_tag(input, len, &pos, &tag_start);
+    if (tag == INDEX_TAG_NONE) break;
+    if (tag == INDEX_TAG_ERROR || (tag == INDEX_TAG_END && depth == 0)) {
+      ok = false;
+    } else if (tag == INDEX_TAG_END) {
+      lexer_index_entry_t *entry = &index->entries[open[--depth]];
+      entry->end = pos;
+      entry->next = index->count;
+    } else {
+      if (index->count >= index->capacity) {
+        size_t capacity = index->capacity ? index->capacity * 2 : 256;
+        lexer_index_entry_t *entries = (lexer_index_entry_t *)realloc(index->entries, sizeof(lexer_index_entry_t) * capacity);
+        if (entries == NULL) {
+          ok = false;
+          break;
+        }
+        index->entries = entries;
+        index->capacity = capacity;
+      }
+      lexer_index_entry_t *entry = &index->entries[index->count++];
+      entry->start = tag_start;
+      entry->end = pos;
+      entry->next = index->count;
+      if (tag == INDEX_TAG_START) {
+        if (depth >= open_capacity) {
+          open_capacity = open_capacity ? open_capacity * 2 : 64;
+          size_t *new_open = (size_t *)realloc(open, sizeof(size_t) * open_capacity);
+          if (new_open == NULL) {
+            ok = false;
+            break;
+          }
+          open = new_open;
+        }
+        open[depth++] = index->count - 1;
+      }
+    }
+  }
+
+  free(open);
+  if (!ok || depth != 0) {
+    lexer_index_free(index);
+    return false;
+  }
+  return true;
+}
+
+size_t lexer_index_find(const lexer_index_t *index, size_t offset, size_t hint) {
+  if (hint < index->count && index->entries[hint].start == offset) return hint;
+
+  size_t entry = lexer_index_first(index, offset);
+  if (entry < index->count && index->entries[entry].start == offset) return entry;
+  return LEXER_INDEX_NONE;
+}
+
+size_t lexer_index_first(const lexer_index_t *index, size_t offset) {
+  size_t lo = 0, hi = index->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->entries[mid].start < offset) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+void lexer_index_free(lexer_index_t *index) {
+  free(index->entries);
+  memset(index, 0, sizeof(lexer_index_t));
+}
+
+int lexer_skip_element(const char *input, int len, int position) {
+  size_t pos = position, tag_start = 0;
+  int depth = 1;
+  while (depth > 0) {
+    switch (index_next_tag(input, len, &pos, &tag_start)) {
+      case INDEX_TAG_START: depth++; break;
+      case INDEX_TAG_EMPTY: break;
+      case INDEX_TAG_END: depth--; break;
+      default: return -1;
+    }
+  }
+  return (int)pos;
+}
+
+int lexer_next_sibling(const char *input, int len, int position) {
+  size_t pos = position, tag_start = 0;
+  switch (index_next_tag(input, len, &pos, &tag_start)) {
+    case INDEX_TAG_START:
+      if ((position = lexer_skip_element(input, len, (int)pos)) < 0) return -1;
+      pos = position;
+      break;
+    case INDEX_TAG_EMPTY: break;
+    default: return -1;
+  }
+  switch (index_next_tag(input, len, &pos, &tag_start)) {
+    case INDEX_TAG_START: case INDEX_TAG_EMPTY: return (int)tag_start;
+    default: return -1;
+  }
+}
+
+/* where the name of the tag at `tag_start` ends: `skip` is the length of `<` or `</` */
+static int index_name_len(const char *input, size_t len, size_t tag_start, int skip) {
+  size_t i = tag_start + skip;
+  while (i < len && input[i] != '>' && input[i] != '/' && !(CHAR_CLASS(input[i]) & CC_SPACE)) i++;
+  return (int)(i - tag_start - skip);
+}
+
+static bool skip_push(lexer_skip_t *skip, const char *name, int len) {
+  if (skip->depth >= skip->open_capacity) {
+    int capacity = skip->open_capacity ? skip->open_capacity * 2 : 64;
+    int *open = (int *)realloc(skip->open, sizeof(int) * capacity);
+    if (open == NULL) return false;
+    skip->open = open;
+    skip->open_capacity = capacity;
+  }
+  if (skip->names_len + len > skip->names_capacity) {
+    int capacity = skip->names_capacity ? skip->names_capacity : 256;
+    while (skip->names_len + len > capacity) capacity *= 2;
+    char *names = (char *)realloc(skip->names, capacity);
+    if (names == NULL) return false;
+    skip->names = names;
+    skip->names_capacity = capacity;
+  }
+  skip->open[skip->depth++] = skip->names_len;
+  memcpy(skip->names + skip->names_len, name, len);
+  skip->names_len += len;
+  return true;
+}
+
+int lexer_skip_resume(lexer_skip_t *skip, const char *input, int len, int *position) {
+  size_t pos = *position, tag_start = 0;
+  int name_len = 0;
+  while (true) {
+    index_tag_t tag = index_next_tag(input, len, &pos, &tag_start);
+    switch (tag) {
+      case INDEX_TAG_START:
+        name_len = index_name_len(input, len, tag_start, 1);
+        if (!skip_push(skip, input + tag_start + 1, name_len)) return -1;
+        break;
+      case INDEX_TAG_EMPTY:
+        break;
+      case INDEX_TAG_END: {
+        if (skip->depth == 0) return -1;
+        int open = skip->open[skip->depth - 1];
+        name_len = index_name_len(input, len, tag_start, 2);
+        if (name_len != skip->names_len - open || memcmp(input + tag_start + 2, skip->names + open, name_len) != 0) return -1;
+        skip->names_len = open;
+        skip->depth--;
+        break;
+      }
+      case INDEX_TAG_NONE: /* no `<` left */
+        *position = len;
+        return 0;
+      default: /* a tag which goes on after the end */
+        *position = (int)tag_start;
+        return 0;
+    }
+    *position = (int)pos;
+    if (skip->depth == 0) return 1;
+  }
+}
+
+void lexer_skip_free(lexer_skip_t *skip) {
+  free(skip->open);
+  free(skip->names);
+  memset(skip, 0, sizeof(lexer_skip_t));
+}
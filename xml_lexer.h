@@ -40,6 +40,28 @@ typedef struct token {
   src_pos_t pos;
 }token_t;
 
+/* filled by `lexer_next_token` when built with XML_STATS and `lexer.stats` is set */
+typedef struct lexer_stats {
+  unsigned long tokens[TOKEN_TEXT + 1]; /* per token type */
+  double seconds;
+}lexer_stats_t;
+
+/* Lexer flags(`lexer_set_flags`): for lexing what a caller wants and nothing more. A few sets of
+ * them have their own instance of the scanning code, compiled with the flags as constants.
+ * */
+#define LEXER_SKIP_COMMENTS 0x01 /* no COMMENT tokens */
+#define LEXER_SKIP_PI       0x02 /* no PI tokens(the XML declaration is one) */
+#define LEXER_TRIM_TEXT     0x04 /* TEXT without its trailing whitespace(the leading one is always skipped) */
+#define LEXER_NO_POSITIONS  0x08 /* lines & columns not counted: `pos` of the tokens is 0:0 */
+#define LEXER_DATA          0x0f /* all of them: the leanest instance */
+
+struct lexer;
+/* Incremental input: called when a token reaches the end of the input while more of it may come.
+ * It appends to the input(which may move: see `lexer_rebase`) and returns true, or returns false
+ * at the end of the input. The token is then lexed again, so tokens never end at a chunk boundary.
+ * */
+typedef bool (*lexer_refill_fn)(struct lexer *lex, void *user_data);
+
 /* lex struct */
 typedef struct lexer {
   const char *input;
@@ -53,18 +75,90 @@ typedef struct lexer {
   token_t cur_token;
   token_t peek_token;
   bool inTag;
+  lexer_stats_t *stats; /* NULL: not counted */
+  lexer_refill_fn refill; /* NULL: the input is all there */
+  void *refill_data;
+  unsigned flags;
+  token_t (*scan)(struct lexer *lex); /* the instance for `flags` */
 }lexer_t;
 
+/* Structural index: where every element ends, found without tokenizing.
+ * One entry per start tag, in document order.
+ * */
+typedef struct lexer_index_entry {
+  size_t start;  /* offset of the start tag's `<` */
+  size_t end;    /* offset just after the element: after the `>` of its end tag, or of `/>` */
+  size_t next;   /* first entry after the element's subtree, i.e. its next sibling if it has one */
+}lexer_index_entry_t;
+
+typedef struct lexer_index {
+  size_t count;
+  size_t capacity;
+  lexer_index_entry_t *entries;
+}lexer_index_t;
+
+#define LEXER_INDEX_NONE ((size_t)-1)
+
 #ifdef DEBUG
 void token_dump(token_t tok);
 #endif
 
 bool lexer_init(lexer_t *lex, const char *input, const char *filename);
+/* lex the first `len` bytes of `input` only */
+bool lexer_init_len(lexer_t *lex, const char *input, int len, const char *filename);
+/* lex input which arrives in chunks: `input`(`len` bytes) is what is there so far */
+bool lexer_init_refill(lexer_t *lex, const char *input, int len, const char *filename, lexer_refill_fn refill, void *user_data);
+/* for `refill`: the input is now `input`(`len` bytes, the same bytes first), tokens are moved along */
+void lexer_rebase(lexer_t *lex, const char *input, int len);
+/* for `refill` too: the first `count` bytes of the input are dropped, the input is now `input`(`len` bytes,
+ * starting with the bytes which followed them). Tokens in the dropped bytes become TOKEN_NONE.
+ * */
+void lexer_discard(lexer_t *lex, const char *input, int len, int count);
+/* LEXER_* flags, 0 after init. Set them before the first token. */
+void lexer_set_flags(lexer_t *lex, unsigned flags);
 bool lexer_cur_token_is(lexer_t *lex, token_type_t type);
 token_type_t lexer_cur_token(lexer_t *lex);
 bool lexer_peek_token_is(lexer_t *lex, token_type_t type);
 void lexer_next_token(lexer_t *lex);
 bool lexer_expect_peek(lexer_t *lex, token_type_t type);
 const char *token_type_to_string(token_type_t type);
+/* continue lexing at `position`(an offset in the input, outside of any tag): it becomes the current token.
+ * Note: line & column are not tracked across a seek.
+ * */
+void lexer_seek(lexer_t *lex, int position);
+
+/* Index the first `len` bytes of `input`. Returns false if the tags are not balanced. */
+bool lexer_index_build(lexer_index_t *index, const char *input, size_t len);
+/* the entry of the start tag at `offset`, LEXER_INDEX_NONE if there is none.
+ * `hint`: the entry it probably is(e.g. the `next` of the previous sibling), checked first.
+ * */
+size_t lexer_index_find(const lexer_index_t *index, size_t offset, size_t hint);
+/* the first entry whose start tag is at `offset` or after it, `index->count` if there is none */
+size_t lexer_index_first(const lexer_index_t *index, size_t offset);
+void lexer_index_free(lexer_index_t *index);
+/* `position`: just after a start tag. Returns the offset just after its end tag, -1 if there is none. */
+int lexer_skip_element(const char *input, int len, int position);
+/* `position`: the `<` of a start tag. Returns the offset of the `<` of the next start tag after the
+ * element at the same level, -1 if its parent ends first(or there is none).
+ * */
+int lexer_next_sibling(const char *input, int len, int position);
+
+/* Stepping over an element of input which arrives in chunks, checking that the end tags match the start tags.
+ * The names of the open elements are copied: the input before `*position` may be dropped between calls.
+ * */
+typedef struct lexer_skip {
+  int depth;      /* open elements */
+  int *open;      /* where the name of each one starts in `names` */
+  int open_capacity;
+  char *names;
+  int names_len, names_capacity;
+}lexer_skip_t;
+
+/* `skip`: zeroed for the first call, which starts at the `<` of the start tag at `*position`.
+ * Returns 1 when the element ended(`*position` is then just after it), 0 when the input ends first(go on at
+ * `*position` once there is more of it) and -1 when an end tag does not match or memory ran out.
+ * */
+int lexer_skip_resume(lexer_skip_t *skip, const char *input, int len, int *position);
+void lexer_skip_free(lexer_skip_t *skip);
 
 #endif
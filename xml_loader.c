@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define XML_HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+#include "xml_thread.h"
+#include "xml_loader.h"
+
+#define XML_LOAD_QUEUE_DEPTH 32
+#define XML_LOAD_READERS 4
+
+/* loaded files waiting for a worker: a ring of `capacity` */
+typedef struct LoadQueue {
+  XMLLoadedFile *items;
+  size_t capacity, head, count;
+  bool closed;         /* nothing more will be pushed */
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full;
+}LoadQueue;
+
+typedef struct Loader {
+  const char *const *paths;
+  size_t count;
+  size_t next;         /* the next path a reader thread takes */
+  pthread_mutex_t next_lock;
+  LoadQueue queue;
+  XMLLoadFn loadFn;
+  void *user_data;
+  int readers;         /* without io_uring */
+}Loader;
+
+typedef struct LoadWorker {
+  Loader *loader;
+  int id;
+}LoadWorker;
+
+void XMLLoadOptionsInit(XMLLoadOptions *options) {
+  options->threads = XMLThreadCount();
+  options->queue_depth = XML_LOAD_QUEUE_DEPTH;
+  options->readers = XML_LOAD_READERS;
+  options->backend = XML_LOAD_AUTO;
+}
+
+const char *XMLLoadBackendString(XMLLoadBackend backend) {
+  switch (backend) {
+    case XML_LOAD_IO_URING: return "io_uring";
+    case XML_LOAD_THREADS: return "threads";
+    default: return "auto";
+  }
+}
+
+/* Queue */
+static bool LoadQueueInit(LoadQueue *queue, size_t capacity) {
+  memset(queue, 0, sizeof(LoadQueue));
+  queue->items = (XMLLoadedFile *)malloc(sizeof(XMLLoadedFile) * capacity);
+  if (queue->items == NULL) return false;
+  queue->capacity = capacity;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+  return true;
+}
+
+static void LoadQueueFree(LoadQueue *queue) {
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_cond_destroy(&queue->not_full);
+  free(queue->items);
+}
+
+/* waits while the queue is full: readers don't get further ahead of the workers than that */
+static void LoadQueuePush(LoadQueue *queue, const XMLLoadedFile *file) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == queue->capacity) pthread_cond_wait(&queue->not_full, &queue->lock);
+  queue->items[(queue->head + queue->count) % queue->capacity] = *file;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/* false once the queue is closed and empty */
+static bool LoadQueuePop(LoadQueue *queue, XMLLoadedFile *file) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0 && !queue->closed) pthread_cond_wait(&queue->not_empty, &queue->lock);
+  bool found = queue->count > 0;
+  if (found) {
+    *file = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+static void LoadQueueClose(LoadQueue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = true;
+  pthread_cond_broadcast(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static void *LoadWorkerRun(void *arg) {
+  LoadWorker *worker = (LoadWorker *)arg;
+  Loader *loader = worker->loader;
+  XMLLoadedFile file;
+  while (LoadQueuePop(&loader->queue, &file)) {
+    file.worker = worker->id;
+    loader->loadFn(&file, loader->user_data);
+  }
+  return NULL;
+}
+
+/* Reading */
+
+/* Open `file` and allocate its buffer. Returns the descriptor to read from,
+ * -1 if there is nothing to read: on error(`file->error` is set), or for an empty file.
+ * */
+static int LoadOpen(XMLLoadedFile *file) {
+  struct stat sb;
+  int fd = open(file->path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &sb) != 0) {
+    file->error = errno;
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  file->size = (size_t)sb.st_size;
+  if ((file->data = (char *)malloc(file->size + 1)) == NULL) {
+    file->error = ENOMEM;
+    close(fd);
+    return -1;
+  }
+  file->data[0] = '\0';
+  if (file->size == 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* the end of a read: `done` bytes are in, or it failed with `error` */
+static void LoadFinish(XMLLoadedFile *file, int fd, size_t done, int error) {
+  close(fd);
+  if (error) {
+    free(file->data);
+    file->data = NULL;
+    file->size = 0;
+    file->error = error;
+    return;
+  }
+  file->size = done; /* less if it shrank meanwhile */
+  file->data[done] = '\0';
+}
+
+/* blocking read of the rest of the file, from `done` */
+static void LoadReadRest(XMLLoadedFile *file, int fd, size_t done) {
+  while (done < file->size) {
+    ssize_t n = pread(fd, file->data + done, file->size - done, (off_t)done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      LoadFinish(file, fd, done, errno);
+      return;
+    }
+    if (n == 0) break;
+    done += (size_t)n;
+  }
+  LoadFinish(file, fd, done, 0);
+}
+
+static void LoadFile(Loader *loader, size_t index, XMLLoadedFile *file) {
+  memset(file, 0, sizeof(XMLLoadedFile));
+  file->index = index;
+  file->path = loader->paths[index];
+  int fd = LoadOpen(file);
+  if (fd >= 0) LoadReadRest(file, fd, 0);
+}
+
+static void *LoadReaderRun(void *arg) {
+  Loader *loader = (Loader *)arg;
+  XMLLoadedFile file;
+  while (true) {
+    pthread_mutex_lock(&loader->next_lock);
+    size_t index = loader->next++;
+    pthread_mutex_unlock(&loader->next_lock);
+    if (index >= loader->count) break;
+    LoadFile(loader, index, &file);
+    LoadQueuePush(&loader->queue, &file);
+  }
+  return NULL;
+}
+
+/* reader threads doing blocking reads, the calling thread being one of them */
+static void LoadWithThreads(Loader *loader, int readers) {
+  pthread_t *tids = (pthread_t *)malloc(sizeof(pthread_t) * readers);
+  int started = 1;
+  for (int i = 1; tids && i < readers; ++i) {
+    if (pthread_create(&tids[i], NULL, LoadReaderRun, loader) != 0) break;
+    started = i + 1;
+  }
+  LoadReaderRun(loader);
+  for (int i = 1; i < started; ++i) pthread_join(tids[i], NULL);
+  free(tids);
+}
+
+#ifdef XML_HAVE_IO_URING
+/* io_uring through its system calls: the submission & completion rings are shared with the kernel */
+typedef struct LoadRing {
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  unsigned to_submit;
+}LoadRing;
+
+/* a read in flight */
+typedef struct LoadSlot {
+  XMLLoadedFile file;
+  int fd;
+  size_t done;
+  struct iovec iov;
+  bool busy;
+}LoadSlot;
+
+static void LoadRingFree(LoadRing *ring) {
+  if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+static bool LoadRingInit(LoadRing *ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(LoadRing));
+  memset(&params, 0, sizeof(params));
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) return false; /* e.g. ENOSYS, or EPERM in a sandbox */
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) ring->sq_ring = NULL;
+  ring->cq_ring = single ? ring->sq_ring :
+    mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  if (ring->cq_ring == MAP_FAILED) ring->cq_ring = NULL;
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                           ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+  if (ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL) {
+    LoadRingFree(ring);
+    return false;
+  }
+
+  char *sq = (char *)ring->sq_ring, *cq = (char *)ring->cq_ring;
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return true;
+}
+
+/* queue the read of the rest of `slot`'s file. There is always room: no more slots than entries. */
+static void LoadRingRead(LoadRing *ring, LoadSlot *slot, size_t id) {
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+
+  slot->iov.iov_base = slot->file.data + slot->done;
+  slot->iov.iov_len = slot->file.size - slot->done;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_READV; /* since 5.1, IORING_OP_READ needs 5.6 */
+  sqe->fd = slot->fd;
+  sqe->off = slot->done;
+  sqe->addr = (unsigned long)&slot->iov;
+  sqe->len = 1;
+  sqe->user_data = id;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+}
+
+/* submit what is queued and wait for a completion. False if io_uring_enter failed. */
+static bool LoadRingEnter(LoadRing *ring) {
+  while (true) {
+    int n = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (n >= 0) {
+      ring->to_submit -= (unsigned)n;
+      return true;
+    }
+    if (errno != EINTR && errno != EAGAIN) return false;
+  }
+}
+
+/* One thread keeps up to `depth` reads in flight. False if io_uring can't be used. */
+static bool LoadWithRing(Loader *loader, unsigned depth) {
+  LoadRing ring;
+  if (!LoadRingInit(&ring, depth)) return false;
+  LoadSlot *slots = (LoadSlot *)calloc(depth, sizeof(LoadSlot));
+  if (slots == NULL) {
+    LoadRingFree(&ring);
+    return false;
+  }
+
+  size_t next = 0;
+  unsigned in_flight = 0;
+  bool broken = false;
+  while (!broken && (next < loader->count || in_flight > 0)) {
+    for (unsigned i = 0; i < depth && next < loader->count; ++i) {
+      LoadSlot *slot = &slots[i];
+      if (slot->busy) continue;
+      memset(slot, 0, sizeof(LoadSlot));
+      slot->file.index = next;
+      slot->file.path = loader->paths[next++];
+      if ((slot->fd = LoadOpen(&slot->file)) < 0) { /* failed or empty: done already */
+        LoadQueuePush(&loader->queue, &slot->file);
+        continue;
+      }
+      slot->busy = true;
+      in_flight++;
+      LoadRingRead(&ring, slot, i);
+    }
+    if (in_flight == 0) continue;
+    if (!LoadRingEnter(&ring)) {
+      broken = true;
+      break;
+    }
+
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      LoadSlot *slot = &slots[cqe->user_data];
+      int res = cqe->res;
+      head++;
+      if (res == -EINTR || res == -EAGAIN) {
+        LoadRingRead(&ring, slot, (size_t)cqe->user_data);
+        continue;
+      }
+      if (res > 0) {
+        slot->done += (size_t)res;
+        if (slot->done < slot->file.size) { /* short read */
+          LoadRingRead(&ring, slot, (size_t)cqe->user_data);
+          continue;
+        }
+      }
+      LoadFinish(&slot->file, slot->fd, slot->done, res < 0 ? -res : 0);
+      slot->busy = false;
+      in_flight--;
+      LoadQueuePush(&loader->queue, &slot->file);
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  LoadRingFree(&ring);
+
+  /* io_uring_enter failed: finish with blocking reads(closing the ring cancelled what was in flight) */
+  for (unsigned i = 0; broken && i < depth; ++i) {
+    if (!slots[i].busy) continue;
+    LoadReadRest(&slots[i].file, slots[i].fd, 0);
+    LoadQueuePush(&loader->queue, &slots[i].file);
+  }
+  free(slots);
+  if (broken) {
+    loader->next = next;
+    LoadWithThreads(loader, loader->readers);
+  }
+  return true;
+}
+#endif
+
+XMLLoadBackend XMLLoadFiles(const char *const *paths, size_t count, const XMLLoadOptions *options,
+                            XMLLoadFn loadFn, void *user_data) {
+  XMLLoadOptions defaults;
+  Loader loader;
+  if (options == NULL) {
+    XMLLoadOptionsInit(&defaults);
+    options = &defaults;
+  }
+  int threads = options->threads > 0 ? options->threads : 1;
+  int depth = options->queue_depth > 0 ? options->queue_depth : XML_LOAD_QUEUE_DEPTH;
+  int readers = options->readers > 0 ? options->readers : XML_LOAD_READERS;
+  XMLLoadBackend backend = options->backend;
+
+  memset(&loader, 0, sizeof(Loader));
+  loader.paths = paths;
+  loader.count = count;
+  loader.loadFn = loadFn;
+  loader.user_data = user_data;
+  loader.readers = readers < depth ? readers : depth;
+  pthread_mutex_init(&loader.next_lock, NULL);
+  pthread_t *workers = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+  LoadWorker *ids = (LoadWorker *)malloc(sizeof(LoadWorker) * threads);
+  int started = 0;
+  if (workers && ids && LoadQueueInit(&loader.queue, (size_t)depth)) {
+    for (int i = 0; i < threads; ++i) {
+      ids[i].loader = &loader;
+      ids[i].id = i;
+      if (pthread_create(&workers[i], NULL, LoadWorkerRun, &ids[i]) != 0) break;
+      started = i + 1;
+    }
+    if (started == 0) LoadQueueFree(&loader.queue);
+  }
+  if (started == 0) { /* no pipeline: one file after the other */
+    XMLLoadedFile file;
+    for (size_t i = 0; i < count; ++i) {
+      LoadFile(&loader, i, &file);
+      file.worker = 0;
+      loadFn(&file, user_data);
+    }
+    free(workers);
+    free(ids);
+    pthread_mutex_destroy(&loader.next_lock);
+    return XML_LOAD_THREADS;
+  }
+
+  bool ring = false;
+#ifdef XML_HAVE_IO_URING
+  if (backend != XML_LOAD_THREADS) ring = LoadWithRing(&loader, (unsigned)depth);
+#endif
+  (void)backend;
+  if (!ring) LoadWithThreads(&loader, loader.readers);
+  LoadQueueClose(&loader.queue);
+
+  for (int i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+  free(workers);
+  free(ids);
+  LoadQueueFree(&loader.queue);
+  pthread_mutex_destroy(&loader.next_lock);
+  return ring ? XML_LOAD_IO_URING : XML_LOAD_THREADS;
+}
@@ -0,0 +1,49 @@
+#ifndef __XML_LOADER_H__
+#define __XML_LOADER_H__
+
+#include <stddef.h>
+
+/* Loading many files: reads are kept in flight while worker threads parse what has arrived,
+ * so the disk and the parser are busy at the same time. On Linux the reads go through
+ * io_uring(one thread submits and reaps them), elsewhere or when io_uring is unavailable
+ * a pool of reader threads does blocking reads instead. Files are handed out in the order
+ * their reads complete, not in the order of `paths`.
+ * */
+typedef enum XMLLoadBackend {
+  XML_LOAD_AUTO,      /* io_uring if available, else threads */
+  XML_LOAD_IO_URING,
+  XML_LOAD_THREADS
+}XMLLoadBackend;
+
+typedef struct XMLLoadedFile {
+  size_t index;       /* in `paths` */
+  const char *path;
+  char *data;         /* the contents, null terminated, from malloc: the callback owns it. NULL on error */
+  size_t size;
+  int error;          /* errno of the failed open or read, 0 if none */
+  int worker;         /* the thread calling `loadFn`, 0 to `threads` - 1: for per thread state */
+}XMLLoadedFile;
+
+/* Called on a worker thread once the contents of a file are in memory */
+typedef void (*XMLLoadFn)(XMLLoadedFile *file, void *user_data);
+
+typedef struct XMLLoadOptions {
+  int threads;            /* calling `loadFn`, XMLThreadCount() */
+  int queue_depth;        /* reads in flight, 32. Loaded files waiting for a worker are limited to as many. */
+  int readers;            /* without io_uring: reader threads, 4(the calling thread is one), at most `queue_depth`.
+                           * They only wait on the disk, in addition to the `threads` workers. */
+  XMLLoadBackend backend;
+}XMLLoadOptions;
+
+void XMLLoadOptionsInit(XMLLoadOptions *options);
+
+/* Read the `count` files of `paths` and call `loadFn` for each of them, on `threads` workers.
+ * Returns when all of them are done, with the backend which did the reads.
+ * `options`: NULL for the defaults.
+ * */
+XMLLoadBackend XMLLoadFiles(const char *const *paths, size_t count, const XMLLoadOptions *options,
+                            XMLLoadFn loadFn, void *user_data);
+
+const char *XMLLoadBackendString(XMLLoadBackend backend);
+
+#endif
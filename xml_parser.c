@@ -1,19 +1,48 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "xml_lexer.h"
 #include "xml_parser.h"
+#include "xml_encoding.h"
 
 #define NEXT(lexer) lexer_next_token((lexer))
-#define GET_CURR_TOKEN_VALUE(lexer) strndup((lexer)->cur_token.literal, (lexer)->cur_token.len)
-#define EXPECT(lexer, token_type) \
+#define GET_CURR_TOKEN_VALUE(doc, lexer) XMLStrDup((doc), (lexer)->cur_token.literal, (lexer)->cur_token.len)
+#define GET_CURR_TOKEN_NAME(doc, lexer) XMLNameDup((doc), (lexer)->cur_token.literal, (lexer)->cur_token.len)
+
+#define EXPECT(doc, lexer, token_type) \
   if (!lexer_expect_peek(lexer, token_type)) { \
-    fprintf(stderr, "Expect next token to be '%s', got '%s')\n", token_type_to_string(token_type), token_type_to_string(lexer->peek_token.type)); \
-    return false; \
+    return XMLSetError((doc), XML_ERROR_UNEXPECTED_TOKEN, (lexer), &(lexer)->peek_token, (token_type)); \
+}
+
+#define XML_ARENA_BLOCK_SIZE 16384
+
+#ifdef XML_STATS
+#include <time.h>
+#define XML_STAT_ADD(doc, field, n) ((doc)->collect_stats ? (void)((doc)->stats.field += (n)) : (void)0)
+#define XML_STAT_DEPTH(doc, depth) \
+  ((doc)->collect_stats && (depth) > (doc)->stats.max_depth ? (void)((doc)->stats.max_depth = (depth)) : (void)0)
+
+static double XMLStatsClock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
 }
 
-/* read entire file, and return contents. */
-static char *read_file(const char *filename) {
+/* XMLDecodeTextTo gets no document: its counters are process wide, from the first XMLDocumentCollectStats */
+static bool decode_stats;
+static unsigned long long decode_nanoseconds;
+static size_t decode_bytes;
+#else
+#define XML_STAT_ADD(doc, field, n) ((void)0)
+#define XML_STAT_DEPTH(doc, depth) ((void)0)
+#endif
+
+/* read entire file, and return contents. `*size`: the number of bytes read */
+static char *read_file(const char *filename, size_t *size) {
   FILE *fp = NULL;
   size_t size_to_read = 0;
   size_t size_read = 0;
@@ -48,9 +77,305 @@ static char *read_file(const char *filename) {
 
   fclose(fp);
   file_contents[size_read] = '\0';
+  *size = size_read;
   return file_contents;
 }
 
+/* same as `read_file`, but reads into `*buf`, growing it only when the file doesn't fit. */
+static char *read_file_into(const char *filename, char **buf, size_t *capacity, size_t *size) {
+  FILE *fp = NULL;
+  size_t size_to_read = 0;
+  size_t size_read = 0;
+  long pos = 0;
+
+  fp = fopen(filename, "r");
+  if (!fp) return NULL;
+
+  fseek(fp, 0L, SEEK_END);
+  pos = ftell(fp);
+  if (pos < 0) {
+    fclose(fp);
+    return NULL;
+  }
+
+  size_to_read = pos;
+  rewind(fp);
+
+  if (*buf == NULL || *capacity < size_to_read + 1) {
+    char *new_buf = (char *)realloc(*buf, sizeof(char) * (size_to_read + 1));
+    if (!new_buf) {
+      fclose(fp);
+      return NULL;
+    }
+    *buf = new_buf;
+    *capacity = size_to_read + 1;
+  }
+
+  size_read = fread(*buf, 1, size_to_read, fp);
+  if (size_read == 0 || ferror(fp)) {
+    fclose(fp);
+    return NULL;
+  }
+
+  fclose(fp);
+  (*buf)[size_read] = '\0';
+  *size = size_read;
+  return *buf;
+}
+
+/* Input stage: make `*buf`(`*size` bytes, null terminated) UTF-8 without byte order mark.
+ * Other encodings(see XMLDetectEncoding) are converted into a new buffer which replaces `*buf`;
+ * `*capacity`, if not NULL, is then its size. On error the offset is in the original bytes.
+ * */
+static bool XMLDecodeInput(char **buf, size_t *capacity, size_t *size, XMLError *error) {
+  size_t bom = 0, error_offset = 0;
+  XMLErrorCode code = XML_ERROR_ENCODING;
+  XMLEncoding encoding = XMLDetectEncoding(*buf, *size, &bom);
+
+  if (encoding == XML_ENCODING_UTF8) {
+    if (bom) {
+      memmove(*buf, *buf + bom, *size - bom + 1);
+      *size -= bom;
+    }
+    error_offset = XMLUTF8Validate(*buf, *size);
+    if (error_offset == *size) return true;
+  } else {
+    char *out = NULL;
+    size_t out_capacity = 0, out_size = 0;
+    if (XMLTranscode(*buf + bom, *size - bom, encoding, &out, &out_capacity, &out_size, &error_offset)) {
+      free(*buf);
+      *buf = out;
+      if (capacity) *capacity = out_capacity;
+      *size = out_size;
+      return true;
+    }
+    if (out == NULL && encoding != XML_ENCODING_UNKNOWN) code = XML_ERROR_MEMORY;
+    free(out);
+    error_offset += bom;
+  }
+
+  memset(error, 0, sizeof(XMLError));
+  error->code = code;
+  error->offset = error_offset;
+  return false;
+}
+
+/* Arena */
+static void *XMLArenaAlloc(XMLArena *arena, size_t size) {
+  XMLArenaBlock *block = arena->current;
+  while (block != NULL && block->used + size > block->size) {
+    block = block->next;
+    if (block != NULL) block->used = 0; /* rewound block, reuse it */
+  }
+
+  if (block == NULL) {
+    size_t block_size = size > XML_ARENA_BLOCK_SIZE ? size : XML_ARENA_BLOCK_SIZE;
+    block = (XMLArenaBlock *)malloc(sizeof(XMLArenaBlock) + block_size);
+    if (block == NULL) return NULL;
+    block->size = block_size;
+    block->used = 0;
+    block->next = NULL;
+    if (arena->current == NULL) {
+      arena->head = block;
+    } else {
+      /* keep the chain: append after the last block */
+      XMLArenaBlock *last = arena->current;
+      while (last->next != NULL) last = last->next;
+      last->next = block;
+    }
+  }
+
+  arena->current = block;
+  void *p = block->data + block->used;
+  block->used += size;
+  return p;
+}
+
+static void XMLArenaRewind(XMLArena *arena) {
+  arena->current = arena->head;
+  if (arena->head) arena->head->used = 0;
+}
+
+static void XMLArenaFree(XMLArena *arena) {
+  XMLArenaBlock *block = arena->head;
+  while (block != NULL) {
+    XMLArenaBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->head = arena->current = NULL;
+}
+
+static char *XMLArenaStrDup(XMLArena *arena, const char *str, size_t len) {
+  char *p = (char *)XMLArenaAlloc(arena, len + 1);
+  if (p == NULL) return NULL;
+  memcpy(p, str, len);
+  p[len] = '\0';
+  return p;
+}
+
+static size_t XMLNameHash(const char *str, size_t len) {
+  size_t h = 2166136261u; /* FNV-1a */
+  for (size_t i = 0; i < len; ++i) {
+    h ^= (unsigned char)str[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* Atoms: one table for the process, so ids compare across documents.
+ * Parsing goes through a per parse cache(XMLAtomCache) and only locks on a miss.
+ * */
+static pthread_mutex_t atom_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **atom_strings;    /* by atom, [0] unused */
+static size_t atom_count = 1, atom_capacity;
+static XMLAtom *atom_table;    /* open addressing hash table of atoms */
+static size_t atom_table_capacity;
+
+static bool XMLAtomTableGrow(void) {
+  size_t new_capacity = atom_table_capacity ? atom_table_capacity * 2 : 256;
+  XMLAtom *new_table = (XMLAtom *)calloc(new_capacity, sizeof(XMLAtom));
+  if (new_table == NULL) return false;
+  for (size_t i = 0; i < atom_table_capacity; ++i) {
+    XMLAtom atom = atom_table[i];
+    if (atom == 0) continue;
+    size_t j = XMLNameHash(atom_strings[atom], strlen(atom_strings[atom])) & (new_capacity - 1);
+    while (new_table[j] != 0) j = (j + 1) & (new_capacity - 1);
+    new_table[j] = atom;
+  }
+  free(atom_table);
+  atom_table = new_table;
+  atom_table_capacity = new_capacity;
+  return true;
+}
+
+/* `*stored`: the atom's own copy of the string, valid as long as the process */
+static XMLAtom XMLAtomInternN(const char *str, size_t len, const char **stored) {
+  XMLAtom atom = 0;
+  pthread_mutex_lock(&atom_lock);
+  if (atom_count * 2 >= atom_table_capacity && !XMLAtomTableGrow()) goto out;
+
+  size_t i = XMLNameHash(str, len) & (atom_table_capacity - 1);
+  while (atom_table[i] != 0) {
+    const char *name = atom_strings[atom_table[i]];
+    if (strncmp(name, str, len) == 0 && name[len] == '\0') {
+      atom = atom_table[i];
+      goto out;
+    }
+    i = (i + 1) & (atom_table_capacity - 1);
+  }
+
+  if (atom_count >= atom_capacity) {
+    size_t new_capacity = atom_capacity ? atom_capacity * 2 : 256;
+    char **new_strings = (char **)realloc(atom_strings, new_capacity * sizeof(char *));
+    if (new_strings == NULL) goto out;
+    atom_strings = new_strings;
+    atom_capacity = new_capacity;
+  }
+  char *name = strndup(str, len);
+  if (name == NULL) goto out;
+  atom = (XMLAtom)atom_count++;
+  atom_strings[atom] = name;
+  atom_table[i] = atom;
+
+out:
+  if (stored) *stored = atom ? atom_strings[atom] : NULL;
+  pthread_mutex_unlock(&atom_lock);
+  return atom;
+}
+
+XMLAtom XMLAtomIntern(const char *str) {
+  if (str == NULL) return 0;
+  return XMLAtomInternN(str, strlen(str), NULL);
+}
+
+const char *XMLAtomString(XMLAtom atom) {
+  const char *str = NULL;
+  pthread_mutex_lock(&atom_lock);
+  if (atom > 0 && atom < atom_count) str = atom_strings[atom];
+  pthread_mutex_unlock(&atom_lock);
+  return str;
+}
+
+/* Per parse, direct mapped: names repeat, so most of them never reach the table's lock */
+#define XML_ATOM_CACHE_SIZE 256
+typedef struct XMLAtomCache {
+  struct {
+    const char *str; /* the atom's copy */
+    size_t len;
+    XMLAtom atom;
+  } entries[XML_ATOM_CACHE_SIZE];
+}XMLAtomCache;
+
+static XMLAtom XMLAtomCacheIntern(XMLAtomCache *cache, const char *str, size_t len) {
+  size_t slot = XMLNameHash(str, len) & (XML_ATOM_CACHE_SIZE - 1);
+  if (cache->entries[slot].len == len && cache->entries[slot].str && memcmp(cache->entries[slot].str, str, len) == 0) {
+    return cache->entries[slot].atom;
+  }
+  const char *stored = NULL;
+  XMLAtom atom = XMLAtomInternN(str, len, &stored);
+  if (atom) {
+    cache->entries[slot].str = stored;
+    cache->entries[slot].len = len;
+    cache->entries[slot].atom = atom;
+  }
+  return atom;
+}
+
+/* Return the interned copy of `str`. Names live as long as the context. */
+static char *XMLContextIntern(XMLParserContext *ctx, const char *str, size_t len) {
+  if (ctx->name_count * 2 >= ctx->name_capacity) {
+    size_t new_capacity = ctx->name_capacity ? ctx->name_capacity * 2 : 64;
+    char **new_table = (char **)calloc(new_capacity, sizeof(char *));
+    if (new_table == NULL) return NULL;
+    for (size_t i = 0; i < ctx->name_capacity; ++i) {
+      char *name = ctx->name_table[i];
+      if (name == NULL) continue;
+      size_t j = XMLNameHash(name, strlen(name)) & (new_capacity - 1);
+      while (new_table[j] != NULL) j = (j + 1) & (new_capacity - 1);
+      new_table[j] = name;
+    }
+    free(ctx->name_table);
+    ctx->name_table = new_table;
+    ctx->name_capacity = new_capacity;
+  }
+
+  size_t i = XMLNameHash(str, len) & (ctx->name_capacity - 1);
+  while (ctx->name_table[i] != NULL) {
+    char *name = ctx->name_table[i];
+    if (strncmp(name, str, len) == 0 && name[len] == '\0') return name;
+    i = (i + 1) & (ctx->name_capacity - 1);
+  }
+
+  char *name = XMLArenaStrDup(&ctx->names, str, len);
+  if (name == NULL) return NULL;
+  ctx->name_table[i] = name;
+  ctx->name_count++;
+  return name;
+}
+
+/* copy a token's literal: into the context arena if there is one, otherwise on the heap */
+static char *XMLStrDup(XMLDocument *doc, const char *str, size_t len) {
+  XML_STAT_ADD(doc, bytes_allocated, len + 1);
+  if (doc->ctx) return XMLArenaStrDup(&doc->ctx->strings, str, len);
+  return strndup(str, len);
+}
+
+static char *XMLNameDup(XMLDocument *doc, const char *str, size_t len) {
+  if (doc->ctx) {
+#ifdef XML_STATS
+    size_t name_count = doc->ctx->name_count;
+    char *name = XMLContextIntern(doc->ctx, str, len);
+    if (doc->ctx->name_count != name_count) XML_STAT_ADD(doc, bytes_allocated, len + 1); /* a new name */
+    return name;
+#else
+    return XMLContextIntern(doc->ctx, str, len);
+#endif
+  }
+  XML_STAT_ADD(doc, bytes_allocated, len + 1);
+  return strndup(str, len);
+}
+
 static void XMLAttrFree(XMLAttr *attr) {
   if (attr == NULL) return;
   if (attr->key) {
@@ -157,22 +482,48 @@ void XMLNodeListFree(XMLNodeList *list) {
 }
 
 /* XML Node */
-static XMLNode *XMLNodeNew(XMLNode *parent) {
-  XMLNode *node = (XMLNode *)malloc(sizeof(XMLNode));
+static XMLNode *XMLNodeNew(XMLDocument *doc, XMLNode *parent) {
+  XMLNode *node = NULL;
+  if (doc->ctx && doc->ctx->free_nodes.count > 0) {
+    /* recycled node: the lists already have capacity, just empty them */
+    node = XMLNodeListRemove(&doc->ctx->free_nodes);
+    node->attrList.count = 0;
+    node->children.count = 0;
+  } else {
+    node = (XMLNode *)malloc(sizeof(XMLNode));
+    if (node == NULL) return NULL;
+    XMLAttrListInit(&node->attrList);
+    XMLNodeListInit(&node->children);
+  }
+
   node->index = 0;
   if (parent) node->index = parent->children.count;
+  node->renumber = 0;
   node->parent = parent;
   node->name = NULL;
   node->text = NULL;
-
-  XMLAttrListInit(&node->attrList);
-  XMLNodeListInit(&node->children);
+  node->lazy = NULL;
+  node->ns = node->local = 0;
+  node->hash = 0;
 
   if (parent) XMLNodeListAdd(&parent->children, node);
 
+  XML_STAT_ADD(doc, nodes, 1);
+  XML_STAT_ADD(doc, bytes_allocated, sizeof(XMLNode));
   return node;
 }
 
+/* Give `node` and its descendants back to the context. The nodes are pushed in
+ * reverse document order, so the next parse pops them in the order it creates
+ * nodes and a document of the same shape finds every list already big enough.
+ * */
+static void XMLNodeRecycle(XMLParserContext *ctx, XMLNode *node) {
+  for (size_t i = node->children.count; i > 0; --i) {
+    XMLNodeRecycle(ctx, node->children.nodes[i - 1]);
+  }
+  XMLNodeListAdd(&ctx->free_nodes, node);
+}
+
 static void XMLNodeFree(XMLNode *node) {
   if (node == NULL) return;
   if (node->name) {
@@ -188,12 +539,18 @@ static void XMLNodeFree(XMLNode *node) {
   //Free attributes
   XMLAttrListFree(&node->attrList);
 
+  if (node->lazy) {
+    free(node->lazy);
+    node->lazy = NULL;
+  }
+
   //Free children
   XMLNodeListFree(&node->children);
 }
 
 XMLNode *XMLNodeChildrenGet(XMLNode *node, int index) {
   if (node == NULL) return NULL;
+  XMLNodeExpand(node);
   if (index < 0) index = node->children.count + index; // allow negative indexes
   if (index < 0 || index >= node->children.count) return NULL; //index-out-of-bounds
   return node->children.nodes[index];
@@ -201,153 +558,540 @@ XMLNode *XMLNodeChildrenGet(XMLNode *node, int index) {
 
 size_t XMLNodeChildrenCount(XMLNode *node) {
   if (node == NULL) return 0;
+  XMLNodeExpand(node);
   return node->children.count;
 }
 
-static bool _XMLParseTree(lexer_t *lexer, XMLNode *node) {
-  EXPECT(lexer, TOKEN_NAME);
-  node->name = GET_CURR_TOKEN_VALUE(lexer);
-  node->type = NT_NODE;
-  NEXT(lexer);
+/* Errors */
+static size_t XMLTokenOffset(const lexer_t *lexer, const token_t *tok) {
+  if (tok->literal >= lexer->input && tok->literal <= lexer->input + lexer->input_len) {
+    return (size_t)(tok->literal - lexer->input);
+  }
+  return (size_t)lexer->input_len; /* EOF has a static literal */
+}
 
-  /* parse attributes */
-  while (!lexer_cur_token_is(lexer, TOKEN_CLOSE_TAG) && !lexer_cur_token_is(lexer, TOKEN_CLOSESLASH_TAG)) {
-    if (!lexer_cur_token_is(lexer, TOKEN_NAME)) return false;
-    XMLAttr curr_attr =  { 0 };
-    curr_attr.node = node;
-    curr_attr.key = GET_CURR_TOKEN_VALUE(lexer);
-    EXPECT(lexer, TOKEN_ASSIGN);
-    EXPECT(lexer, TOKEN_STRING);
-    curr_attr.value = GET_CURR_TOKEN_VALUE(lexer);
-    XMLAttrListAdd(&node->attrList, &curr_attr);
-    NEXT(lexer);
-  } //end while
+static void XMLErrorSet(XMLError *error, XMLErrorCode code, const lexer_t *lexer, const token_t *tok, token_type_t expected) {
+  error->code = code;
+  error->offset = (lexer && tok) ? XMLTokenOffset(lexer, tok) : 0;
+  error->expected = expected == TOKEN_NONE ? NULL : token_type_to_string(expected);
+  error->actual = tok ? token_type_to_string(tok->type) : NULL;
+}
 
-  if (lexer_cur_token_is(lexer, TOKEN_CLOSESLASH_TAG)) { //self contained node, no children
+/* record the first error of a parse, always returns false */
+static bool XMLSetError(XMLDocument *doc, XMLErrorCode code, const lexer_t *lexer, const token_t *tok, token_type_t expected) {
+  if (doc->error.code == XML_OK) XMLErrorSet(&doc->error, code, lexer, tok, expected);
+  return false;
+}
+
+/* Checks shared by the parser & the validator(XMLValidateStr), so that they accept the same documents */
+static bool XMLTokenEndsWith(const token_t *tok, const char *suffix, int len) {
+  return tok->len >= len && strncmp(tok->literal + tok->len - len, suffix, len) == 0;
+}
+
+/* XML_OK or what is wrong with `tok`: comment, PI, DOCTYPE & CDATA tokens run to the end of the input
+ * when they aren't closed, and an attribute value can't hold a `<`.
+ * */
+static XMLErrorCode XMLTokenCheck(const token_t *tok) {
+  bool ok = true;
+  switch (tok->type) {
+    case TOKEN_COMMENT: ok = tok->len >= 7 && XMLTokenEndsWith(tok, "-->", 3); break;
+    case TOKEN_PI: ok = tok->len >= 4 && XMLTokenEndsWith(tok, "?>", 2); break;
+    case TOKEN_CDATA: ok = tok->len >= 12 && XMLTokenEndsWith(tok, "]]>", 3); break;
+    case TOKEN_DOCTYPE: ok = XMLTokenEndsWith(tok, ">", 1); break;
+    case TOKEN_STRING: return memchr(tok->literal, '<', tok->len) ? XML_ERROR_ATTRIBUTE_VALUE : XML_OK;
+    default: break;
+  }
+  return ok ? XML_OK : XML_ERROR_UNTERMINATED;
+}
+
+/* After the root element only comments & PIs(not kept) may come. Returns the error at the current token. */
+static XMLErrorCode XMLSkipEpilog(lexer_t *lexer) {
+  while (lexer_cur_token_is(lexer, TOKEN_COMMENT) || lexer_cur_token_is(lexer, TOKEN_PI)) {
+    XMLErrorCode code = XMLTokenCheck(&lexer->cur_token);
+    if (code != XML_OK) return code;
     NEXT(lexer);
-    return true;
   }
+  return lexer_cur_token_is(lexer, TOKEN_EOF) ? XML_OK : XML_ERROR_TRAILING_CONTENT;
+}
+
+/* Namespaces in scope while parsing: the `xmlns` declarations of the open elements,
+ * innermost last. Resolved prefixes are remembered until a declaration comes or goes,
+ * so a run of elements with the same prefix doesn't walk the declarations again.
+ * */
+#define XML_NS_STACK 16
+#define XML_NS_RESOLVED 4
+#define XML_NS_UNBOUND ((XMLAtom)-1)
+
+typedef struct XMLNSBinding {
+  const char *prefix; /* not null terminated, length 0 for the default namespace */
+  size_t len;
+  XMLAtom uri;        /* 0: `xmlns=""`, no default namespace */
+}XMLNSBinding;
+
+typedef struct XMLNSScope {
+  XMLNSBinding stack[XML_NS_STACK]; /* documents rarely declare more */
+  XMLNSBinding *bindings;
+  size_t count, capacity;
+  size_t depth;                     /* of the element being parsed, for the stats */
+  unsigned long version;            /* bumped by every push & pop */
+  struct {
+    const char *prefix;
+    size_t len;
+    XMLAtom uri;
+    unsigned long version;          /* of the scope it was resolved in */
+  } resolved[XML_NS_RESOLVED];
+  size_t next_resolved;
+  XMLAtom xml, xmlns;               /* the prefixes which need no declaration */
+  XMLAtomCache names;               /* local names & URIs */
+}XMLNSScope;
+
+static void XMLNSScopeInit(XMLNSScope *scope) {
+  memset(scope, 0, sizeof(XMLNSScope));
+  scope->bindings = scope->stack;
+  scope->capacity = XML_NS_STACK;
+  scope->version = 1;
+  scope->xml = XMLAtomIntern(XML_NAMESPACE_XML);
+  scope->xmlns = XMLAtomIntern(XML_NAMESPACE_XMLNS);
+}
+
+static void XMLNSScopeFree(XMLNSScope *scope) {
+  if (scope->bindings != scope->stack) free(scope->bindings);
+}
+
+static bool XMLNSPush(XMLNSScope *scope, const char *prefix, size_t len, XMLAtom uri) {
+  if (scope->count == scope->capacity) {
+    size_t new_capacity = scope->capacity * 2;
+    XMLNSBinding *new_bindings = (XMLNSBinding *)malloc(new_capacity * sizeof(XMLNSBinding));
+    if (new_bindings == NULL) return false;
+    memcpy(new_bindings, scope->bindings, scope->count * sizeof(XMLNSBinding));
+    if (scope->bindings != scope->stack) free(scope->bindings);
+    scope->bindings = new_bindings;
+    scope->capacity = new_capacity;
+  }
+  scope->bindings[scope->count].prefix = prefix;
+  scope->bindings[scope->count].len = len;
+  scope->bindings[scope->count].uri = uri;
+  scope->count++;
+  scope->version++;
+  return true;
+}
+
+/* drop the declarations made after `mark` */
+static void XMLNSPop(XMLNSScope *scope, size_t mark) {
+  if (scope->count == mark) return;
+  scope->count = mark;
+  scope->version++;
+}
+
+/* URI bound to `prefix`(length 0: the default namespace), XML_NS_UNBOUND if none */
+static XMLAtom XMLNSResolve(XMLNSScope *scope, const char *prefix, size_t len) {
+  for (size_t i = 0; i < XML_NS_RESOLVED; ++i) {
+    if (scope->resolved[i].version == scope->version && scope->resolved[i].len == len &&
+        memcmp(scope->resolved[i].prefix, prefix, len) == 0) {
+      return scope->resolved[i].uri;
+    }
+  }
+
+  XMLAtom uri = len == 0 ? 0 : XML_NS_UNBOUND; /* no default namespace is not an error */
+  if (len == 3 && memcmp(prefix, "xml", 3) == 0) {
+    uri = scope->xml;
+  } else if (len == 5 && memcmp(prefix, "xmlns", 5) == 0) {
+    uri = scope->xmlns;
+  } else {
+    for (size_t i = scope->count; i > 0; --i) {
+      const XMLNSBinding *binding = &scope->bindings[i - 1];
+      if (binding->len == len && memcmp(binding->prefix, prefix, len) == 0) {
+        uri = binding->uri;
+        break;
+      }
+    }
+  }
+
+  size_t slot = scope->next_resolved++ % XML_NS_RESOLVED;
+  scope->resolved[slot].prefix = prefix;
+  scope->resolved[slot].len = len;
+  scope->resolved[slot].uri = uri;
+  scope->resolved[slot].version = scope->version;
+  return uri;
+}
+
+static void XMLNSResolveName(XMLNSScope *scope, const char *name, bool is_attr, XMLAtom *ns, XMLAtom *local) {
+  size_t len = strlen(name);
+  const char *colon = (const char *)memchr(name, ':', len);
+  if (colon == NULL) {
+    *ns = 0;
+    if (!is_attr) {
+      XMLAtom uri = XMLNSResolve(scope, name, 0);
+      if (uri != XML_NS_UNBOUND) *ns = uri;
+    } else if (len == 5 && memcmp(name, "xmlns", 5) == 0) { /* other unprefixed attributes are in no namespace */
+      *ns = scope->xmlns;
+    }
+    *local = XMLAtomCacheIntern(&scope->names, name, len);
+    return;
+  }
+
+  XMLAtom uri = XMLNSResolve(scope, name, (size_t)(colon - name));
+  if (uri == XML_NS_UNBOUND) { /* not declared: a plain name */
+    *ns = 0;
+    *local = XMLAtomCacheIntern(&scope->names, name, len);
+  } else {
+    *ns = uri;
+    *local = XMLAtomCacheIntern(&scope->names, colon + 1, len - (size_t)(colon + 1 - name));
+  }
+}
+
+/* push the `xmlns` & `xmlns:prefix` attributes of `node` */
+static bool XMLNSDeclare(XMLNSScope *scope, const XMLNode *node) {
+  for (size_t i = 0; i < node->attrList.count; ++i) {
+    const XMLAttr *attr = &node->attrList.attrs[i];
+    const char *key = attr->key;
+    if (key[0] != 'x' || strncmp(key, "xmlns", 5) != 0 || (key[5] != '\0' && key[5] != ':')) continue;
+
+    const char *prefix = key[5] == ':' ? key + 6 : key + 5;
+    XMLAtom uri = attr->value[0] ? XMLAtomCacheIntern(&scope->names, attr->value, strlen(attr->value)) : 0;
+    if (!XMLNSPush(scope, prefix, strlen(prefix), uri)) return false;
+  }
+  return true;
+}
+
+/* set the atoms of `node` and its attributes, its own declarations being in scope */
+static void XMLNSResolveNode(XMLNSScope *scope, XMLNode *node) {
+  XMLNSResolveName(scope, node->name, false, &node->ns, &node->local);
+  for (size_t i = 0; i < node->attrList.count; ++i) {
+    XMLAttr *attr = &node->attrList.attrs[i];
+    XMLNSResolveName(scope, attr->key, true, &attr->ns, &attr->local);
+  }
+}
+
+/* the declarations in scope inside `node`, for a lazy node parsed later */
+static bool XMLNSDeclareAncestors(XMLNSScope *scope, const XMLNode *node) {
+  if (node == NULL) return true;
+  scope->depth++;
+  return XMLNSDeclareAncestors(scope, node->parent) && XMLNSDeclare(scope, node);
+}
 
-  /* parse children */
+/* Lazy parsing: the unparsed content of a node, between its start and end tags */
+typedef struct XMLLazy {
+  XMLDocument *doc;
+  size_t offset; /* in `doc->contents` */
+  size_t length;
+}XMLLazy;
+
+static bool _XMLParseTree(XMLDocument *doc, lexer_t *lexer, XMLNSScope *scope, XMLNode *node, int levels);
+static void XMLNodeHashParsed(XMLNode *node);
+static void XMLLexerSetFlags(const XMLDocument *doc, lexer_t *lexer);
+
+/* at `</`: the end tag must close `node` */
+static bool _XMLParseEndTag(XMLDocument *doc, lexer_t *lexer, XMLNode *node) {
+  EXPECT(doc, lexer, TOKEN_NAME);
+  if (strncmp(node->name, lexer->cur_token.literal, lexer->cur_token.len) != 0 || node->name[lexer->cur_token.len] != '\0') {
+    return XMLSetError(doc, XML_ERROR_MISMATCHED_TAG, lexer, &lexer->cur_token, TOKEN_NONE);
+  }
+  EXPECT(doc, lexer, TOKEN_CLOSE_TAG);
   NEXT(lexer);
-  while (!lexer_cur_token_is(lexer, TOKEN_EOF)) {
+  return true;
+}
+
+/* Parse the content of `node` up to `</`(left as the current token) or EOF.
+ * `levels`: how many levels to build below `node`, negative for all of them.
+ * `with_text` is false when expanding a lazy node: its text is already set.
+ * */
+static bool _XMLParseContent(XMLDocument *doc, lexer_t *lexer, XMLNSScope *scope, XMLNode *node, int levels, bool with_text) {
+  while (!lexer_cur_token_is(lexer, TOKEN_EOF) && !lexer_cur_token_is(lexer, TOKEN_OPENSLASH_TAG)) {
     if (lexer_cur_token_is(lexer, TOKEN_OPEN_TAG)) {
-      XMLNode *child = XMLNodeNew(node);
-      if (!_XMLParseTree(lexer, child)) return false;
-    } else if (lexer_cur_token_is(lexer, TOKEN_OPENSLASH_TAG)) {
-      EXPECT(lexer, TOKEN_NAME);
-      if (strncmp(node->name, lexer->cur_token.literal, lexer->cur_token.len) != 0) {
-        fprintf(stderr, "Mismatched name(%s != %.*s\n", node->name, lexer->cur_token.len, lexer->cur_token.literal);
-        return false;
-      }
-      NEXT(lexer);
-      NEXT(lexer);
-      break;
+      XMLNode *child = XMLNodeNew(doc, node);
+      if (!_XMLParseTree(doc, lexer, scope, child, levels < 0 ? levels : levels - 1)) return false;
     } else if (lexer_cur_token_is(lexer, TOKEN_TEXT)) {
-      node->text = GET_CURR_TOKEN_VALUE(lexer);
-      node->type = NT_TEXT;
+      if (with_text) { /* mixed content: the last text wins */
+        if (doc->ctx == NULL) free(node->text);
+        node->text = GET_CURR_TOKEN_VALUE(doc, lexer);
+        node->type = NT_TEXT;
+      }
       NEXT(lexer);
     } else if (lexer_cur_token_is(lexer, TOKEN_CDATA)) { /* CDATA is treated as text */
-      node->text = GET_CURR_TOKEN_VALUE(lexer);
-      node->type = NT_CDATA;
+      if (XMLTokenCheck(&lexer->cur_token) != XML_OK) return XMLSetError(doc, XML_ERROR_UNTERMINATED, lexer, &lexer->cur_token, TOKEN_NONE);
+      if (with_text) {
+        if (doc->ctx == NULL) free(node->text);
+        node->text = GET_CURR_TOKEN_VALUE(doc, lexer);
+        node->type = NT_CDATA;
+      }
       NEXT(lexer);
     } else if (lexer_cur_token_is(lexer, TOKEN_COMMENT)) {
-      XMLNode *child = XMLNodeNew(node);
-      child->name = GET_CURR_TOKEN_VALUE(lexer);
+      if (XMLTokenCheck(&lexer->cur_token) != XML_OK) return XMLSetError(doc, XML_ERROR_UNTERMINATED, lexer, &lexer->cur_token, TOKEN_NONE);
+      XML_STAT_DEPTH(doc, scope->depth + 1);
+      XMLNode *child = XMLNodeNew(doc, node);
+      child->name = GET_CURR_TOKEN_VALUE(doc, lexer);
       child->type = NT_COMMENT;
       NEXT(lexer);
     } else {
-      return false;
+      return XMLSetError(doc, XML_ERROR_UNEXPECTED_TOKEN, lexer, &lexer->cur_token, TOKEN_NONE);
+    }
+  } //end while
+  return true;
+}
+
+/* Lazy parsing: read the text of `node`, step over its children and remember where they are.
+ * Called with the `>` of the start tag as the current token.
+ * With the document's skip index a child is stepped over at once, otherwise it is lexed through.
+ * */
+static bool _XMLSkipContent(XMLDocument *doc, lexer_t *lexer, XMLNode *node) {
+  const char *start = lexer->cur_token.literal + 1;
+  const lexer_index_t *index = (const lexer_index_t *)doc->skip_index;
+  int base = (int)(lexer->input - doc->contents); /* the lexer may only see a range of `contents` */
+  size_t next = LEXER_INDEX_NONE;
+  bool has_children = false;
+  size_t depth = 0;
+
+  NEXT(lexer);
+  while (!lexer_cur_token_is(lexer, TOKEN_EOF)) {
+    XMLErrorCode code = XMLTokenCheck(&lexer->cur_token);
+    if (code != XML_OK) return XMLSetError(doc, code, lexer, &lexer->cur_token, TOKEN_NONE);
+    switch (lexer_cur_token(lexer)) {
+      case TOKEN_OPEN_TAG: /* a start tag opens a level unless it is `/>` */
+        has_children = true;
+        if (index && depth == 0) {
+          size_t entry = lexer_index_find(index, lexer->cur_token.literal - doc->contents, next);
+          if (entry != LEXER_INDEX_NONE) {
+            next = index->entries[entry].next;
+            lexer_seek(lexer, (int)(index->entries[entry].end - base));
+            continue;
+          }
+        }
+        do {
+          NEXT(lexer);
+        } while (!lexer_cur_token_is(lexer, TOKEN_CLOSE_TAG) && !lexer_cur_token_is(lexer, TOKEN_CLOSESLASH_TAG) &&
+                 !lexer_cur_token_is(lexer, TOKEN_EOF));
+        if (lexer_cur_token_is(lexer, TOKEN_CLOSE_TAG)) depth++;
+        break;
+      case TOKEN_OPENSLASH_TAG:
+        if (depth == 0) { /* our own end tag */
+          if (has_children) {
+            XMLLazy *lazy = NULL;
+            if (doc->ctx) { /* the string arena isn't aligned */
+              char *p = (char *)XMLArenaAlloc(&doc->ctx->strings, sizeof(XMLLazy) + _Alignof(XMLLazy) - 1);
+              if (p) lazy = (XMLLazy *)(((uintptr_t)p + _Alignof(XMLLazy) - 1) & ~(uintptr_t)(_Alignof(XMLLazy) - 1));
+            } else {
+              lazy = (XMLLazy *)malloc(sizeof(XMLLazy));
+            }
+            if (lazy == NULL) return XMLSetError(doc, XML_ERROR_MEMORY, lexer, &lexer->cur_token, TOKEN_NONE);
+            lazy->doc = doc;
+            lazy->offset = (size_t)(start - doc->contents);
+            lazy->length = (size_t)(lexer->cur_token.literal - start);
+            node->lazy = lazy;
+            XML_STAT_ADD(doc, bytes_allocated, sizeof(XMLLazy));
+          }
+          return _XMLParseEndTag(doc, lexer, node);
+        }
+        depth--;
+        while (!lexer_cur_token_is(lexer, TOKEN_CLOSE_TAG) && !lexer_cur_token_is(lexer, TOKEN_EOF)) NEXT(lexer);
+        break;
+      case TOKEN_TEXT: case TOKEN_CDATA:
+        if (depth == 0) {
+          if (doc->ctx == NULL) free(node->text);
+          node->text = GET_CURR_TOKEN_VALUE(doc, lexer);
+          node->type = lexer_cur_token_is(lexer, TOKEN_TEXT) ? NT_TEXT : NT_CDATA;
+        }
+        break;
+      case TOKEN_COMMENT:
+        if (depth == 0) has_children = true;
+        break;
+      default:
+        return XMLSetError(doc, XML_ERROR_UNEXPECTED_TOKEN, lexer, &lexer->cur_token, TOKEN_NONE);
+    }
+    NEXT(lexer);
+  }
+
+  /* EOF before the end tag */
+  return XMLSetError(doc, XML_ERROR_UNEXPECTED_TOKEN, lexer, &lexer->cur_token, TOKEN_OPENSLASH_TAG);
+}
+
+/* `levels`: how many levels to build below `node`, negative for all of them */
+static bool _XMLParseTree(XMLDocument *doc, lexer_t *lexer, XMLNSScope *scope, XMLNode *node, int levels) {
+  EXPECT(doc, lexer, TOKEN_NAME);
+  node->name = GET_CURR_TOKEN_NAME(doc, lexer);
+  node->type = NT_NODE;
+  NEXT(lexer);
+
+  /* parse attributes */
+  while (!lexer_cur_token_is(lexer, TOKEN_CLOSE_TAG) && !lexer_cur_token_is(lexer, TOKEN_CLOSESLASH_TAG)) {
+    if (!lexer_cur_token_is(lexer, TOKEN_NAME)) return XMLSetError(doc, XML_ERROR_UNEXPECTED_TOKEN, lexer, &lexer->cur_token, TOKEN_NAME);
+    for (size_t i = 0; i < node->attrList.count; ++i) {
+      const char *key = node->attrList.attrs[i].key;
+      if (strncmp(key, lexer->cur_token.literal, lexer->cur_token.len) == 0 && key[lexer->cur_token.len] == '\0') {
+        return XMLSetError(doc, XML_ERROR_DUPLICATE_ATTRIBUTE, lexer, &lexer->cur_token, TOKEN_NONE);
+      }
+    }
+    XMLAttr curr_attr =  { 0 };
+    curr_attr.node = node;
+    curr_attr.key = GET_CURR_TOKEN_NAME(doc, lexer);
+    token_type_t expected = TOKEN_NONE;
+    if (!lexer_expect_peek(lexer, TOKEN_ASSIGN)) expected = TOKEN_ASSIGN;
+    else if (!lexer_expect_peek(lexer, TOKEN_STRING)) expected = TOKEN_STRING;
+    if (expected != TOKEN_NONE || XMLTokenCheck(&lexer->cur_token) != XML_OK) {
+      if (doc->ctx == NULL) free(curr_attr.key);
+      if (expected != TOKEN_NONE) return XMLSetError(doc, XML_ERROR_UNEXPECTED_TOKEN, lexer, &lexer->peek_token, expected);
+      return XMLSetError(doc, XML_ERROR_ATTRIBUTE_VALUE, lexer, &lexer->cur_token, TOKEN_NONE);
     }
+    curr_attr.value = GET_CURR_TOKEN_VALUE(doc, lexer);
+    XMLAttrListAdd(&node->attrList, &curr_attr);
+    XML_STAT_ADD(doc, attrs, 1);
+    XML_STAT_ADD(doc, bytes_allocated, sizeof(XMLAttr));
+    NEXT(lexer);
   } //end while
 
+  size_t ns_mark = scope->count;
+  if (!XMLNSDeclare(scope, node)) return XMLSetError(doc, XML_ERROR_MEMORY, lexer, &lexer->cur_token, TOKEN_NONE);
+  XMLNSResolveNode(scope, node);
+
+  bool ok = true;
+  scope->depth++;
+  XML_STAT_DEPTH(doc, scope->depth);
+  if (lexer_cur_token_is(lexer, TOKEN_CLOSESLASH_TAG)) { //self contained node, no children
+    NEXT(lexer);
+  } else if (levels == 0) {
+    ok = _XMLSkipContent(doc, lexer, node);
+  } else { /* parse children */
+    NEXT(lexer);
+    ok = _XMLParseContent(doc, lexer, scope, node, levels, true);
+    if (ok && lexer_cur_token_is(lexer, TOKEN_OPENSLASH_TAG)) {
+      ok = _XMLParseEndTag(doc, lexer, node);
+    } else if (ok) { /* EOF before the end tag */
+      ok = XMLSetError(doc, XML_ERROR_UNEXPECTED_TOKEN, lexer, &lexer->cur_token, TOKEN_OPENSLASH_TAG);
+    }
+  }
+  if (ok && doc->hash_on_parse) XMLNodeHashParsed(node); /* bottom up: the children closed first */
+  scope->depth--;
+  XMLNSPop(scope, ns_mark);
+  return ok;
+}
+
+static pthread_mutex_t lazy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool XMLNodeExpand(XMLNode *node) {
+  if (node == NULL || __atomic_load_n(&node->lazy, __ATOMIC_ACQUIRE) == NULL) return true;
+
+  bool ok = true;
+  pthread_mutex_lock(&lazy_lock);
+  XMLLazy *lazy = node->lazy;
+  if (lazy != NULL) { /* nobody expanded it while we waited */
+    XMLDocument *doc = lazy->doc;
+    bool had_error = doc->error.code != XML_OK;
+    lexer_t lexer;
+    XMLNSScope scope;
+    XMLNSScopeInit(&scope);
+    lexer_init_len(&lexer, doc->contents + lazy->offset, (int)lazy->length, NULL);
+    XMLLexerSetFlags(doc, &lexer);
+    NEXT(&lexer);
+    NEXT(&lexer);
+    ok = XMLNSDeclareAncestors(&scope, node);
+    if (!ok) XMLSetError(doc, XML_ERROR_MEMORY, NULL, NULL, TOKEN_NONE);
+    if (ok) ok = _XMLParseContent(doc, &lexer, &scope, node, doc->lazy_levels, false);
+    if (ok && !lexer_cur_token_is(&lexer, TOKEN_EOF)) { /* a `</` of its own */
+      ok = XMLSetError(doc, XML_ERROR_MISMATCHED_TAG, &lexer, &lexer.cur_token, TOKEN_NONE);
+    }
+    if (!ok && !had_error) doc->error.offset += lazy->offset; /* the lexer only saw the range */
+    XMLNSScopeFree(&scope);
+    if (doc->ctx == NULL) free(lazy);
+    __atomic_store_n(&node->lazy, NULL, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&lazy_lock);
+  return ok;
+}
+
+static bool XMLNodeExpandAll(XMLNode *node) {
+  if (!XMLNodeExpand(node)) return false;
+  for (size_t i = 0; i < node->children.count; ++i) {
+    if (!XMLNodeExpandAll(node->children.nodes[i])) return false;
+  }
   return true;
 }
 
+bool XMLDocumentExpandAll(XMLDocument *doc) {
+  if (doc == NULL || doc->root == NULL) return true;
+  return XMLNodeExpandAll(doc->root);
+}
+
+/* the entry's tag name starts with the `len` bytes of `name` */
+static bool XMLIndexNameStarts(const XMLDocument *doc, const lexer_index_entry_t *entry, const char *name, size_t len) {
+  return entry->end - entry->start > len + 1 && memcmp(doc->contents + entry->start + 1, name, len) == 0;
+}
+
+bool XMLNodeMayContain(XMLNode *node, const char *name, size_t len, bool descendants) {
+  if (node == NULL || __atomic_load_n(&node->lazy, __ATOMIC_ACQUIRE) == NULL) return true;
+
+  bool found = true;
+  pthread_mutex_lock(&lazy_lock);
+  XMLLazy *lazy = node->lazy;
+  const lexer_index_t *index = lazy ? (const lexer_index_t *)lazy->doc->skip_index : NULL;
+  if (index != NULL) {
+    size_t end = lazy->offset + lazy->length;
+    size_t entry = lexer_index_first(index, lazy->offset);
+    found = false;
+    while (!found && entry < index->count && index->entries[entry].start < end) {
+      found = XMLIndexNameStarts(lazy->doc, &index->entries[entry], name, len);
+      entry = descendants ? entry + 1 : index->entries[entry].next;
+    }
+  }
+  pthread_mutex_unlock(&lazy_lock);
+  return found;
+}
+
+/* `XMLFindFirstNode` for a name which is not null terminated */
+static XMLNode *XMLFindFirstNodeN(const XMLNode *node, const char *node_name, size_t len) {
+  if (strncmp(node->name, node_name, len) == 0) return (XMLNode *)node;
+
+  if (!XMLNodeMayContain((XMLNode *)node, node_name, len, false)) return NULL; /* not built just to miss */
+  XMLNodeExpand((XMLNode *)node);
+  for (size_t i = 0; i < node->children.count; ++i) {
+    XMLNode *child = node->children.nodes[i];
+    if (strncmp(child->name, node_name, len) == 0) {
+      return child;
+    }
+  }
+
+  return NULL;
+}
+
+/* Walks `node_path` segment by segment in place: no copy of the path and no `strtok`,
+ * so it is safe to call from many threads at once.
+ * */
 XMLNode *XMLSelectNode(XMLNode *node, const char *node_path) {
   if (node == NULL) return NULL;
   if (node_path == NULL || node_path[0] == '\0') return node;
 
   XMLNode *result = node;
+  const char *p = node_path;
 
-  int len = strlen(node_path) + 2;
-  char *tag = (char *)malloc(len * sizeof(char));
-  if (tag == NULL) {
-    fprintf(stderr, "Cannot allocate enough memory.\n");
-    return NULL;
-  }
+  while (*p != '\0') {
+    while (*p == '/') p++; /* skip separators, like `strtok` did */
+    if (*p == '\0') break;
 
-  if (*node_path != '/') {
-    sprintf(tag, "/%s", node_path);
-  } else {
-    strcpy(tag, node_path);
-  }
+    const char *end = strchr(p, '/');
+    if (end == NULL) end = p + strlen(p);
 
-  char *p = strtok(tag, "/");
-  while (p != NULL) {
-    char *p1 = strchr(p, '[');
-    char *p2 = NULL;
-    if (p1 != NULL) p2 = strchr(p, ']');
+    const char *p1 = memchr(p, '[', end - p);
+    const char *p2 = memchr(p, ']', end - p);
 
-    if ((p2 < p1) || (p1 == NULL && p2 != NULL) || (p1 != NULL && p2 == NULL)) {
-      fprintf(stderr, "Unmatched '[' and ']'.\n");
-      free(tag);
-      return NULL;
-    }
+    if ((p2 < p1) || (p1 == NULL && p2 != NULL) || (p1 != NULL && p2 == NULL)) return NULL; /* unmatched '[' and ']' */
 
     bool has_index = (p1 != NULL) && (p2 != NULL);
     if (has_index) {
-      //char index[8] = { 0 };
-      char *index = malloc((p2 - p1) * sizeof(char));
-      if (index == NULL) {
-        fprintf(stderr, "malloc failed\n");
-        free(tag);
-        return NULL;
-      }
-      strncpy(index, p1 + 1, p2 - p1 - 1);
-      index[p2 - p1 - 1] = '\0'; //make sure it is null terminated
-      int idx = atoi(index);
+      int idx = (int)strtol(p1 + 1, NULL, 10);
+      XMLNodeExpand(result);
       if (idx < 0) idx = result->children.count + idx + 1; // allow negative indexes
-      if (idx < 0 || idx > result->children.count) {
-        fprintf(stderr, "index out of bounds\n");
-        free(tag);
-        free(index);
-        return NULL;
-      }
-      free(index);
-
-      //char tagname[128] = { 0 };
-      char *tagname = malloc((p1 - p + 1) * sizeof(char));
-      if (tagname == NULL) {
-        fprintf(stderr, "malloc failed\n");
-        free(tag);
-        return NULL;
-      }
-      strncpy(tagname, p, p1 - p);
-      tagname[p1 - p] = '\0'; //make sure it is null terminated
+      if (idx < 0 || idx > result->children.count) return NULL; /* index out of bounds */
 
+      size_t tagname_len = p1 - p;
       XMLNode *child = result->children.nodes[idx - 1];
-      if (strncmp(child->name, tagname, strlen(tagname)) == 0) {
-        result = child;
-        free(tagname);
-      } else {
-        fprintf(stderr, "Node name '%s' not found\n", tagname);
-        free(tag);
-        free(tagname);
-        return NULL;
-      }
+      if (strncmp(child->name, p, tagname_len) != 0) return NULL;
+      result = child;
     } else {
-     result = XMLFindFirstNode(result, p);
-    }
-    if (result == NULL) {
-      fprintf(stderr, "Node not found\n");
-      free(tag);
-      return NULL;
+     result = XMLFindFirstNodeN(result, p, end - p);
     }
-    p = strtok(NULL, "/");
+    if (result == NULL) return NULL; /* misses are normal for optional paths: no message */
+    p = end;
   } //end while
 
-  free(tag);
   return result;
 }
 
@@ -357,16 +1101,7 @@ XMLNode *XMLRootNode(XMLDocument *doc) {
 }
 
 XMLNode *XMLFindFirstNode(const XMLNode *node, const char *node_name) {
-  if (strncmp(node->name, node_name, strlen(node_name)) == 0) return (XMLNode *)node;
-
-  for (size_t i = 0; i < node->children.count; ++i) {
-    XMLNode *child = node->children.nodes[i];
-    if (strncmp(child->name, node_name, strlen(node_name)) == 0) {
-      return child;
-    }
-  }
-
-  return NULL;
+  return XMLFindFirstNodeN(node, node_name, strlen(node_name));
 }
 
 XMLNodeList *XMLFindNode(const XMLNode *node, const char *node_name) {
@@ -374,6 +1109,7 @@ XMLNodeList *XMLFindNode(const XMLNode *node, const char *node_name) {
   if (list == NULL) return NULL;
 
   XMLNodeListInit(list);
+  XMLNodeExpand((XMLNode *)node);
   for (size_t i = 0; i < node->children.count; ++i) {
     XMLNode *child = node->children.nodes[i];
     if (strncmp(child->name, node_name, strlen(node_name)) == 0) {
@@ -384,11 +1120,38 @@ XMLNodeList *XMLFindNode(const XMLNode *node, const char *node_name) {
   return list;
 }
 
-XMLNodeList *XMLFindNodeWhere(const XMLNode *node, Predicate predicateFn, void *user_data) {
-  XMLNodeList *list = malloc(sizeof(XMLNodeList));
-  if (list == NULL) return NULL;
+const char *XMLNodeNamespaceURI(const XMLNode *node) {
+  if (node == NULL) return NULL;
+  return XMLAtomString(node->ns);
+}
 
-  XMLNodeListInit(list);
+const char *XMLNodeLocalName(const XMLNode *node) {
+  if (node == NULL) return NULL;
+  return XMLAtomString(node->local);
+}
+
+XMLNodeList *XMLFindNodeNS(const XMLNode *node, XMLAtom ns, XMLAtom local) {
+  XMLNodeList *list = malloc(sizeof(XMLNodeList));
+  if (list == NULL) return NULL;
+
+  XMLNodeListInit(list);
+  XMLNodeExpand((XMLNode *)node);
+  for (size_t i = 0; i < node->children.count; ++i) {
+    XMLNode *child = node->children.nodes[i];
+    if (child->local == local && child->ns == ns && child->type != NT_COMMENT) {
+      XMLNodeListAdd(list, child);
+    }
+  }
+
+  return list;
+}
+
+XMLNodeList *XMLFindNodeWhere(const XMLNode *node, Predicate predicateFn, void *user_data) {
+  XMLNodeList *list = malloc(sizeof(XMLNodeList));
+  if (list == NULL) return NULL;
+
+  XMLNodeListInit(list);
+  XMLNodeExpand((XMLNode *)node);
   for (size_t i = 0; i < node->children.count; ++i) {
     XMLNode *child = node->children.nodes[i];
     if (predicateFn(child, i, user_data)) {
@@ -404,6 +1167,7 @@ XMLNodeList *XMLFindNodeSelector(const XMLNode *node, Selector selectFn, void *u
   if (list == NULL) return NULL;
 
   XMLNodeListInit(list);
+  XMLNodeExpand((XMLNode *)node);
   for (size_t i = 0; i < node->children.count; ++i) {
     XMLNode *child = node->children.nodes[i];
     XMLNodeList *new = selectFn(child, i, user_data);
@@ -427,62 +1191,622 @@ static struct Special_Mapping {
   {'\0', NULL, 0},
 };
 
-char *XMLDecodeText(const XMLNode *node) {
-  char *d, *s;
+size_t XMLDecodeTextTo(const XMLNode *node, char *out, size_t size) {
+  size_t len = 0;
+  bool in_cdata = false;
   int i = 0;
 
-  if (node == NULL || node->text == NULL) return "";
-
-  char *result = node->text;
-  for(d = result, s = node->text; *s; s++, d++) {
-    if (strncmp(s, "<![CDATA[", 9) == 0) {
+  if (node == NULL || node->text == NULL) {
+    if (size > 0) out[0] = '\0';
+    return 0;
+  }
+#ifdef XML_STATS
+  bool timed = __atomic_load_n(&decode_stats, __ATOMIC_RELAXED);
+  double start = timed ? XMLStatsClock() : 0;
+#endif
+
+  for (const char *s = node->text; *s; ) {
+    char ch = *s;
+    if (!in_cdata && strncmp(s, "<![CDATA[", 9) == 0) {
+      in_cdata = true;
       s += 9;
-    } else if (strncmp(s, "]]>", 3) == 0) {
+      continue;
+    } else if (in_cdata && strncmp(s, "]]>", 3) == 0) {
+      in_cdata = false;
       s += 3;
-    }
-    if (*s != '&') {
-      if (d != s) *d = *s;
       continue;
     }
 
-    for (i = 0; Mapping[i].ch; i++) {
-      if (strncmp(s, Mapping[i].str, Mapping[i].str_len)) continue;
-      *d = Mapping[i].ch;
-      s += Mapping[i].str_len - 1;
-      break;
+    s++;
+    if (ch == '&' && !in_cdata) {
+      for (i = 0; Mapping[i].ch; i++) {
+        if (strncmp(s - 1, Mapping[i].str, Mapping[i].str_len)) continue;
+        ch = Mapping[i].ch;
+        s += Mapping[i].str_len - 1;
+        break;
+      }
     }
 
-   if (Mapping[i].ch == '\0' && d != s) *d = *s;
+    if (len + 1 < size) out[len] = ch;
+    len++;
   }
 
-  *d = '\0';
-  return result;
+  if (size > 0) out[len < size ? len : size - 1] = '\0';
+#ifdef XML_STATS
+  if (timed) {
+    __atomic_fetch_add(&decode_nanoseconds, (unsigned long long)((XMLStatsClock() - start) * 1e9), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&decode_bytes, len, __ATOMIC_RELAXED);
+  }
+#endif
+  return len;
+}
+
+/* per-thread buffer for `XMLDecodeText` */
+typedef struct DecodeBuffer {
+  char *data;
+  size_t capacity;
+}DecodeBuffer;
+
+static pthread_key_t decode_buffer_key;
+static pthread_once_t decode_buffer_once = PTHREAD_ONCE_INIT;
+
+static void DecodeBufferFree(void *p) {
+  DecodeBuffer *buf = (DecodeBuffer *)p;
+  free(buf->data);
+  free(buf);
+}
+
+static void DecodeBufferKeyCreate(void) {
+  pthread_key_create(&decode_buffer_key, DecodeBufferFree);
+}
+
+char *XMLDecodeText(const XMLNode *node) {
+  if (node == NULL || node->text == NULL) return "";
+
+  /* nothing to decode: hand back the text itself */
+  if (strchr(node->text, '&') == NULL && strstr(node->text, "<![CDATA[") == NULL) return node->text;
+
+  pthread_once(&decode_buffer_once, DecodeBufferKeyCreate);
+  DecodeBuffer *buf = (DecodeBuffer *)pthread_getspecific(decode_buffer_key);
+  if (buf == NULL) {
+    buf = (DecodeBuffer *)calloc(1, sizeof(DecodeBuffer));
+    if (buf == NULL) return "";
+    pthread_setspecific(decode_buffer_key, buf);
+  }
+
+  size_t len = strlen(node->text) + 1; /* decoding never makes the text longer */
+  if (buf->capacity < len) {
+    char *data = (char *)realloc(buf->data, len);
+    if (data == NULL) return "";
+    buf->data = data;
+    buf->capacity = len;
+  }
+
+  XMLDecodeTextTo(node, buf->data, buf->capacity);
+  return buf->data;
 }
 
 XMLNode *XMLNodeNextSibling(XMLNode *node)
 {
-  int i = 0;
-  XMLNode* parent = NULL;
-  
   if (node == NULL || node->parent == NULL) return NULL;
-  
-  parent = node->parent;
-  for (i = 0; i < parent->children.count && parent->children.nodes[i] != node; i++) ;
-  i++;
 
-  return i < parent->children.count ? parent->children.nodes[i] : NULL;
+  size_t i = XMLNodeIndex(node) + 1;
+  return i < node->parent->children.count ? node->parent->children.nodes[i] : NULL;
 }
 
-/* XML Document */
-static bool _XMLDocumentParseInternal(XMLDocument *doc, const char *xmlStr, const char *path, lexer_t *lexer) {
-  XMLNodeListInit(&doc->others);
+/******************************************************************************
+ * Subtree hashes & diff
+ ******************************************************************************/
+#define XML_HASH_SEED 0x9e3779b97f4a7c15ULL
+
+/* an element keeps NT_TEXT/NT_CDATA once it has text */
+static bool XMLNodeIsElement(const XMLNode *node) {
+  return node->type != NT_COMMENT && node->type != NT_PI && node->type != NT_DOCTYPE;
+}
+
+static inline uint64_t XMLHashMix(uint64_t h, uint64_t v) {
+  h = (h ^ v) * 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 32);
+}
 
-  if (path == NULL) {
-    lexer_init(lexer, xmlStr, NULL);
+/* 8 bytes at a time; the length goes in with the tail, so that "ab","c" and "a","bc" differ */
+static uint64_t XMLHashString(uint64_t h, const char *str) {
+  if (str == NULL) return XMLHashMix(h, 0xff);
+  size_t len = strlen(str);
+  for (; len >= 8; len -= 8, str += 8) {
+    uint64_t v;
+    memcpy(&v, str, 8);
+    h = XMLHashMix(h, v);
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, str, len);
+  return XMLHashMix(h, tail ^ ((uint64_t)len << 56));
+}
+
+/* the part of the hash from `node` itself: type, name, attributes & text */
+static uint64_t XMLNodeHashOwn(const XMLNode *node) {
+  uint64_t h = XMLHashMix(XML_HASH_SEED, (uint64_t)node->type);
+  h = XMLHashMix(h, ((uint64_t)node->attrList.count << 32) | node->children.count);
+  h = XMLHashString(h, node->name);
+  for (size_t i = 0; i < node->attrList.count; ++i) {
+    h = XMLHashString(h, node->attrList.attrs[i].key);
+    h = XMLHashString(h, node->attrList.attrs[i].value);
+  }
+  return XMLHashString(h, node->text);
+}
+
+/* Concurrent readers may compute the same hash at once: they store the same value. */
+static uint64_t XMLNodeHashStore(XMLNode *node, uint64_t h) {
+  if (h == 0) h = 1; /* 0 is "not computed" */
+  __atomic_store_n(&node->hash, h, __ATOMIC_RELAXED);
+  return h;
+}
+
+uint64_t XMLNodeHash(XMLNode *node) {
+  if (node == NULL) return 0;
+  uint64_t h = __atomic_load_n(&node->hash, __ATOMIC_RELAXED);
+  if (h != 0) return h;
+
+  XMLNodeExpand(node);
+  h = XMLNodeHashOwn(node);
+  for (size_t i = 0; i < node->children.count; ++i) h = XMLHashMix(h, XMLNodeHash(node->children.nodes[i]));
+  return XMLNodeHashStore(node, h);
+}
+
+/* Parsing with XMLDocumentHashOnParse: `node` just closed, its elements are hashed already.
+ * Comments are hashed here. A subtree left lazy isn't, and neither are the nodes above it:
+ * XMLNodeHash does it when asked, which builds it.
+ * */
+static void XMLNodeHashParsed(XMLNode *node) {
+  if (node->lazy) return;
+  uint64_t h = XMLNodeHashOwn(node);
+  for (size_t i = 0; i < node->children.count; ++i) {
+    XMLNode *child = node->children.nodes[i];
+    if (child->hash == 0 && (child->lazy || child->children.count > 0)) return;
+    h = XMLHashMix(h, child->hash ? child->hash : XMLNodeHash(child));
+  }
+  XMLNodeHashStore(node, h);
+}
+
+void XMLDocumentHashOnParse(XMLDocument *doc, bool on) {
+  if (doc) doc->hash_on_parse = on;
+}
+
+void XMLDocumentCollectStats(XMLDocument *doc, bool on) {
+  if (doc) doc->collect_stats = on;
+#ifdef XML_STATS
+  if (on) __atomic_store_n(&decode_stats, true, __ATOMIC_RELAXED);
+#endif
+}
+
+void XMLDocumentSetParseFlags(XMLDocument *doc, unsigned flags) {
+  if (doc) doc->parse_flags = flags;
+}
+
+/* the lexer instance for parsing `doc`. Token positions are never read here: errors are offsets. */
+static void XMLLexerSetFlags(const XMLDocument *doc, lexer_t *lexer) {
+  unsigned flags = LEXER_NO_POSITIONS;
+  if (doc->parse_flags & XML_PARSE_NO_COMMENTS) flags |= LEXER_SKIP_COMMENTS;
+  if (doc->parse_flags & XML_PARSE_NO_PI) flags |= LEXER_SKIP_PI;
+  if (doc->parse_flags & XML_PARSE_TRIM_TEXT) flags |= LEXER_TRIM_TEXT;
+  lexer_set_flags(lexer, flags);
+}
+
+/* `node` changed: drop its hash and its ancestors'. A node with a hash has its children's,
+ * so the walk stops at the first one without.
+ * */
+static void XMLNodeTouch(XMLNode *node) {
+  for (; node && node->hash != 0; node = node->parent) node->hash = 0;
+}
+
+typedef struct XMLDiffState {
+  XMLDiffCallback callback;
+  void *user_data;
+  size_t count;
+  bool stopped;
+}XMLDiffState;
+
+static void XMLDiffReport(XMLDiffState *state, XMLDiffType type, XMLNode *old_node, XMLNode *new_node) {
+  if (state->stopped) return;
+  state->count++;
+  if (state->callback && !state->callback(type, old_node, new_node, state->user_data)) state->stopped = true;
+}
+
+static bool XMLStrEqual(const char *a, const char *b) {
+  return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+/* the same element, or the same kind of other node: a change in place rather than a replacement */
+static bool XMLDiffSameKind(const XMLNode *a, const XMLNode *b) {
+  if (XMLNodeIsElement(a) != XMLNodeIsElement(b)) return false;
+  return XMLNodeIsElement(a) ? XMLStrEqual(a->name, b->name) : a->type == b->type;
+}
+
+/* everything but the children */
+static bool XMLDiffSameContent(const XMLNode *a, const XMLNode *b) {
+  if (a->type != b->type || !XMLStrEqual(a->name, b->name) || !XMLStrEqual(a->text, b->text)) return false;
+  if (a->attrList.count != b->attrList.count) return false;
+  for (size_t i = 0; i < a->attrList.count; ++i) {
+    if (!XMLStrEqual(a->attrList.attrs[i].key, b->attrList.attrs[i].key) ||
+        !XMLStrEqual(a->attrList.attrs[i].value, b->attrList.attrs[i].value)) return false;
+  }
+  return true;
+}
+
+static void XMLDiffChildren(XMLDiffState *state, XMLNode *old_node, XMLNode *new_node);
+
+static void XMLDiffPair(XMLDiffState *state, XMLNode *old_node, XMLNode *new_node) {
+  if (state->stopped || XMLNodeHash(old_node) == XMLNodeHash(new_node)) return;
+  if (!XMLDiffSameKind(old_node, new_node)) {
+    XMLDiffReport(state, XML_DIFF_REPLACED, old_node, new_node);
+    return;
+  }
+  if (!XMLDiffSameContent(old_node, new_node)) XMLDiffReport(state, XML_DIFF_CHANGED, old_node, new_node);
+  XMLDiffChildren(state, old_node, new_node);
+}
+
+/* both are hashed, so built */
+static void XMLDiffChildren(XMLDiffState *state, XMLNode *old_node, XMLNode *new_node) {
+  XMLNode **a = old_node->children.nodes, **b = new_node->children.nodes;
+  size_t end_a = old_node->children.count, end_b = new_node->children.count;
+  size_t i = 0, j = 0;
+
+  while (i < end_a && j < end_b && XMLNodeHash(a[i]) == XMLNodeHash(b[j])) i++, j++;
+  while (end_a > i && end_b > j && XMLNodeHash(a[end_a - 1]) == XMLNodeHash(b[end_b - 1])) end_a--, end_b--;
+
+  while (i < end_a && j < end_b && !state->stopped) {
+    if (i + 1 < end_a && XMLNodeHash(a[i + 1]) == XMLNodeHash(b[j])) {
+      XMLDiffReport(state, XML_DIFF_REMOVED, a[i++], NULL);
+    } else if (j + 1 < end_b && XMLNodeHash(a[i]) == XMLNodeHash(b[j + 1])) {
+      XMLDiffReport(state, XML_DIFF_INSERTED, NULL, b[j++]);
+    } else {
+      XMLDiffPair(state, a[i++], b[j++]);
+    }
+  }
+  while (i < end_a) XMLDiffReport(state, XML_DIFF_REMOVED, a[i++], NULL);
+  while (j < end_b) XMLDiffReport(state, XML_DIFF_INSERTED, NULL, b[j++]);
+}
+
+size_t XMLNodeDiff(XMLNode *old_node, XMLNode *new_node, XMLDiffCallback callback, void *user_data) {
+  XMLDiffState state = { callback, user_data, 0, false };
+  if (old_node && new_node) {
+    XMLDiffPair(&state, old_node, new_node);
+  } else if (old_node || new_node) {
+    XMLDiffReport(&state, old_node ? XML_DIFF_REMOVED : XML_DIFF_INSERTED, old_node, new_node);
+  }
+  return state.count;
+}
+
+size_t XMLDocumentDiff(const XMLDocument *old_doc, const XMLDocument *new_doc, XMLDiffCallback callback, void *user_data) {
+  return XMLNodeDiff(old_doc ? old_doc->root : NULL, new_doc ? new_doc->root : NULL, callback, user_data);
+}
+
+/******************************************************************************
+ * Editing
+ ******************************************************************************/
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Inserting & detaching only mark where the stale indexes start; the first reader renumbers
+ * them, once for any number of edits. Readers may run in parallel, hence the lock.
+ * */
+size_t XMLNodeIndex(const XMLNode *node) {
+  XMLNode *parent = node->parent;
+  if (parent == NULL || __atomic_load_n(&parent->renumber, __ATOMIC_ACQUIRE) == 0) return node->index;
+
+  pthread_mutex_lock(&index_lock);
+  if (parent->renumber != 0) { /* nobody renumbered them while we waited */
+    for (size_t i = parent->renumber - 1; i < parent->children.count; ++i) {
+      parent->children.nodes[i]->index = i;
+    }
+    __atomic_store_n(&parent->renumber, 0, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&index_lock);
+  return node->index;
+}
+
+/* the children of `parent` from `from` on have moved */
+static void XMLNodeStaleFrom(XMLNode *parent, size_t from) {
+  if (from >= parent->children.count) return;
+  if (parent->renumber == 0 || from + 1 < parent->renumber) parent->renumber = from + 1;
+}
+
+/* `str` with the special characters replaced by their entity, as parsed text is stored */
+static char *XMLEscapeDup(XMLDocument *doc, const char *str) {
+  size_t len = 0;
+  for (const char *s = str; *s; ++s) {
+    int i = 0;
+    while (Mapping[i].ch && Mapping[i].ch != *s) i++;
+    len += Mapping[i].ch ? (size_t)Mapping[i].str_len : 1;
+  }
+
+  XML_STAT_ADD(doc, bytes_allocated, len + 1);
+  char *out = doc->ctx ? (char *)XMLArenaAlloc(&doc->ctx->strings, len + 1) : (char *)malloc(len + 1);
+  if (out == NULL) return NULL;
+  char *p = out;
+  for (const char *s = str; *s; ++s) {
+    int i = 0;
+    while (Mapping[i].ch && Mapping[i].ch != *s) i++;
+    if (Mapping[i].ch) {
+      memcpy(p, Mapping[i].str, Mapping[i].str_len);
+      p += Mapping[i].str_len;
+    } else {
+      *p++ = *s;
+    }
+  }
+  *p = '\0';
+  return out;
+}
+
+/* a string of `doc` which is being replaced: only the ones on the heap are freed */
+static void XMLStrRelease(XMLDocument *doc, char *str) {
+  if (doc->ctx == NULL) free(str);
+}
+
+/* set the atoms of `node`(and of its subtree if `deep`), its ancestors' declarations being in `scope` */
+static bool XMLNSResolveSubtree(XMLNSScope *scope, XMLNode *node, bool deep) {
+  size_t mark = scope->count;
+  bool ok = XMLNSDeclare(scope, node);
+  if (ok) XMLNSResolveNode(scope, node);
+  if (ok && deep && node->lazy == NULL) { /* a lazy subtree resolves its names when it is built */
+    for (size_t i = 0; i < node->children.count && ok; ++i) {
+      if (XMLNodeIsElement(node->children.nodes[i])) ok = XMLNSResolveSubtree(scope, node->children.nodes[i], true);
+    }
+  }
+  XMLNSPop(scope, mark);
+  return ok;
+}
+
+/* set the atoms of `node`(and of its subtree if `deep`) for where it is in the tree now */
+static bool XMLNSResolveEdited(XMLNode *node, bool deep) {
+  if (!XMLNodeIsElement(node)) return true;
+
+  XMLNSScope scope;
+  XMLNSScopeInit(&scope);
+  bool ok = XMLNSDeclareAncestors(&scope, node->parent) && XMLNSResolveSubtree(&scope, node, deep);
+  XMLNSScopeFree(&scope);
+  return ok;
+}
+
+/* the root or one of the nodes before it */
+static bool XMLDocumentOwnsTop(const XMLDocument *doc, const XMLNode *node) {
+  if (node == doc->root) return true;
+  for (size_t i = 0; i < doc->others.count; ++i) {
+    if (doc->others.nodes[i] == node) return true;
+  }
+  return false;
+}
+
+/* `node` can be put under `parent`: it is not in the tree, and not above `parent` */
+static bool XMLNodeInsertable(XMLDocument *doc, XMLNode *parent, const XMLNode *node) {
+  if (doc == NULL || doc->snapshot || parent == NULL || node == NULL) return false;
+  if (node->parent != NULL || XMLDocumentOwnsTop(doc, node)) return false;
+  for (const XMLNode *n = parent; n; n = n->parent) {
+    if (n == node) return false;
+  }
+  return XMLNodeExpand(parent);
+}
+
+static bool XMLNodeInsertAt(XMLDocument *doc, XMLNode *parent, size_t at, XMLNode *node) {
+  XMLNodeList *children = &parent->children;
+  node->parent = parent;
+  if (!XMLNSResolveEdited(node, true)) {
+    node->parent = NULL;
+    return false;
+  }
+
+  XMLNodeListAdd(children, node);
+  if (at + 1 < children->count) {
+    memmove(children->nodes + at + 1, children->nodes + at, (children->count - 1 - at) * sizeof(XMLNode *));
+    children->nodes[at] = node;
+    XMLNodeStaleFrom(parent, at + 1);
+  }
+  node->index = at;
+  XMLNodeTouch(parent);
+  XMLDocumentChanged(doc);
+  return true;
+}
+
+bool XMLNodeAppendChild(XMLDocument *doc, XMLNode *parent, XMLNode *node) {
+  if (!XMLNodeInsertable(doc, parent, node)) return false;
+  return XMLNodeInsertAt(doc, parent, parent->children.count, node);
+}
+
+bool XMLNodeInsertBefore(XMLDocument *doc, XMLNode *sibling, XMLNode *node) {
+  if (sibling == NULL || !XMLNodeInsertable(doc, sibling->parent, node)) return false;
+  return XMLNodeInsertAt(doc, sibling->parent, XMLNodeIndex(sibling), node);
+}
+
+bool XMLNodeInsertAfter(XMLDocument *doc, XMLNode *sibling, XMLNode *node) {
+  if (sibling == NULL || !XMLNodeInsertable(doc, sibling->parent, node)) return false;
+  return XMLNodeInsertAt(doc, sibling->parent, XMLNodeIndex(sibling) + 1, node);
+}
+
+XMLNode *XMLNodeDetach(XMLDocument *doc, XMLNode *node) {
+  if (doc == NULL || doc->snapshot || node == NULL) return NULL;
+
+  XMLNode *parent = node->parent;
+  if (parent == NULL) {
+    if (node == doc->root) {
+      doc->root = NULL;
+    } else {
+      for (size_t i = 0; i < doc->others.count; ++i) {
+        if (doc->others.nodes[i] != node) continue;
+        memmove(doc->others.nodes + i, doc->others.nodes + i + 1, (doc->others.count - 1 - i) * sizeof(XMLNode *));
+        doc->others.count--;
+        break;
+      }
+    }
+    XMLDocumentChanged(doc);
+    return node;
+  }
+
+  size_t at = XMLNodeIndex(node);
+  XMLNodeList *children = &parent->children;
+  memmove(children->nodes + at, children->nodes + at + 1, (children->count - 1 - at) * sizeof(XMLNode *));
+  children->count--;
+  XMLNodeStaleFrom(parent, at);
+  XMLNodeTouch(parent);
+
+  node->parent = NULL;
+  node->index = 0;
+  XMLDocumentChanged(doc);
+  return node;
+}
+
+XMLNode *XMLNodeReplace(XMLDocument *doc, XMLNode *old, XMLNode *node) {
+  if (doc == NULL || doc->snapshot || old == NULL || node == NULL || old == node) return NULL;
+  if (node->parent != NULL || XMLDocumentOwnsTop(doc, node)) return NULL;
+
+  XMLNode *parent = old->parent;
+  if (parent == NULL) {
+    if (old != doc->root || !XMLNSResolveEdited(node, true)) return NULL;
+    doc->root = node;
+  } else {
+    for (const XMLNode *n = parent; n; n = n->parent) {
+      if (n == node) return NULL;
+    }
+    size_t at = XMLNodeIndex(old);
+    node->parent = parent;
+    if (!XMLNSResolveEdited(node, true)) {
+      node->parent = NULL;
+      return NULL;
+    }
+    parent->children.nodes[at] = node;
+    node->index = at;
+    XMLNodeTouch(parent);
+  }
+
+  old->parent = NULL;
+  old->index = 0;
+  XMLDocumentChanged(doc);
+  return old;
+}
+
+void XMLNodeDelete(XMLDocument *doc, XMLNode *node) {
+  if (XMLNodeDetach(doc, node) == NULL) return;
+  if (doc->ctx) {
+    XMLNodeRecycle(doc->ctx, node);
+  } else {
+    XMLNodeFree(node);
+    free(node);
+  }
+}
+
+XMLNode *XMLNodeCreate(XMLDocument *doc, const char *name) {
+  if (doc == NULL || doc->snapshot || name == NULL) return NULL;
+
+  XMLNode *node = XMLNodeNew(doc, NULL);
+  if (node == NULL) return NULL;
+  node->type = NT_NODE;
+  node->name = XMLNameDup(doc, name, strlen(name));
+  if (node->name == NULL) {
+    XMLNodeDelete(doc, node);
+    return NULL;
+  }
+  return node;
+}
+
+/* copy `node`'s strings, attributes and subtree into `copy`, a new node of `doc` */
+static bool XMLNodeCopyInto(XMLDocument *doc, const XMLNode *node, XMLNode *copy) {
+  if (!XMLNodeExpand((XMLNode *)node)) return false;
+  copy->type = node->type;
+  copy->ns = node->ns;
+  copy->local = node->local;
+  copy->hash = node->hash;
+  if (node->name) {
+    size_t len = strlen(node->name);
+    copy->name = XMLNodeIsElement(node) ? XMLNameDup(doc, node->name, len) : XMLStrDup(doc, node->name, len);
+    if (copy->name == NULL) return false;
+  }
+  if (node->text && (copy->text = XMLStrDup(doc, node->text, strlen(node->text))) == NULL) return false;
+
+  for (size_t i = 0; i < node->attrList.count; ++i) {
+    const XMLAttr *attr = &node->attrList.attrs[i];
+    XMLAttr attr_copy = { 0 };
+    attr_copy.node = copy;
+    attr_copy.ns = attr->ns;
+    attr_copy.local = attr->local;
+    attr_copy.key = XMLNameDup(doc, attr->key, strlen(attr->key));
+    attr_copy.value = XMLStrDup(doc, attr->value, strlen(attr->value));
+    XMLAttrListAdd(&copy->attrList, &attr_copy);
+    if (attr_copy.key == NULL || attr_copy.value == NULL) return false;
+  }
+
+  for (size_t i = 0; i < node->children.count; ++i) {
+    XMLNode *child = XMLNodeNew(doc, copy);
+    if (child == NULL || !XMLNodeCopyInto(doc, node->children.nodes[i], child)) return false;
+  }
+  return true;
+}
+
+XMLNode *XMLNodeClone(XMLDocument *doc, const XMLNode *node) {
+  if (doc == NULL || doc->snapshot || node == NULL) return NULL;
+
+  XMLNode *copy = XMLNodeNew(doc, NULL);
+  if (copy == NULL) return NULL;
+  if (!XMLNodeCopyInto(doc, node, copy)) {
+    XMLNodeDelete(doc, copy);
+    return NULL;
+  }
+  return copy;
+}
+
+bool XMLNodeSetAttribute(XMLDocument *doc, XMLNode *node, const char *key, const char *value) {
+  if (doc == NULL || doc->snapshot || node == NULL || !XMLNodeIsElement(node) || key == NULL) return false;
+
+  XMLAttrList *list = &node->attrList;
+  size_t i = 0;
+  while (i < list->count && strcmp(list->attrs[i].key, key) != 0) i++;
+
+  if (value == NULL) { /* remove */
+    if (i == list->count) return true;
+    XMLAttr removed = list->attrs[i];
+    memmove(list->attrs + i, list->attrs + i + 1, (list->count - 1 - i) * sizeof(XMLAttr));
+    list->count--;
+    XMLStrRelease(doc, removed.value);
+    if (doc->ctx == NULL) free(removed.key);
   } else {
-    lexer_init(lexer, xmlStr, path);
+    char *escaped = XMLEscapeDup(doc, value);
+    if (escaped == NULL) return false;
+    if (i < list->count) {
+      XMLStrRelease(doc, list->attrs[i].value);
+      list->attrs[i].value = escaped;
+    } else {
+      XMLAttr attr = { 0 };
+      attr.node = node;
+      attr.key = XMLNameDup(doc, key, strlen(key));
+      attr.value = escaped;
+      if (attr.key == NULL) {
+        XMLStrRelease(doc, escaped);
+        return false;
+      }
+      XMLAttrListAdd(list, &attr);
+    }
   }
 
+  /* a namespace declaration changes the names of the whole subtree */
+  bool declaration = strncmp(key, "xmlns", 5) == 0 && (key[5] == '\0' || key[5] == ':');
+  bool ok = XMLNSResolveEdited(node, declaration);
+  XMLNodeTouch(node);
+  XMLDocumentChanged(doc);
+  return ok;
+}
+
+bool XMLNodeSetText(XMLDocument *doc, XMLNode *node, const char *text) {
+  if (doc == NULL || doc->snapshot || node == NULL) return false;
+
+  char *escaped = NULL;
+  if (text != NULL && (escaped = XMLEscapeDup(doc, text)) == NULL) return false;
+  XMLStrRelease(doc, node->text);
+  node->text = escaped;
+  if (XMLNodeIsElement(node)) node->type = escaped ? NT_TEXT : NT_NODE; /* as the parser sets it */
+  XMLNodeTouch(node);
+  XMLDocumentChanged(doc);
+  return true;
+}
+
+/* XML Document */
+static bool _XMLDocumentParseTokens(XMLDocument *doc, lexer_t *lexer) {
   /* get next two tokens, so we have two positions */
   NEXT(lexer);
   NEXT(lexer);
@@ -490,8 +1814,13 @@ static bool _XMLDocumentParseInternal(XMLDocument *doc, const char *xmlStr, cons
   /* check for node before root */
   while (lexer_cur_token_is(lexer, TOKEN_DOCTYPE) || lexer_cur_token_is(lexer, TOKEN_COMMENT) || 
          lexer_cur_token_is(lexer, TOKEN_CDATA) || lexer_cur_token_is(lexer, TOKEN_PI)) {
-    XMLNode *node = XMLNodeNew(NULL);
     token_type_t curTok = lexer_cur_token(lexer);
+    if (XMLTokenCheck(&lexer->cur_token) != XML_OK) return XMLSetError(doc, XML_ERROR_UNTERMINATED, lexer, &lexer->cur_token, TOKEN_NONE);
+    if (curTok == TOKEN_DOCTYPE && (doc->parse_flags & XML_PARSE_NO_PI)) { /* the lexer drops the PIs */
+      NEXT(lexer);
+      continue;
+    }
+    XMLNode *node = XMLNodeNew(doc, NULL);
     switch (curTok) {
       case TOKEN_DOCTYPE: node->type = NT_DOCTYPE; break;
       case TOKEN_COMMENT: node->type = NT_COMMENT; break;
@@ -499,36 +1828,772 @@ static bool _XMLDocumentParseInternal(XMLDocument *doc, const char *xmlStr, cons
       case TOKEN_PI: node->type = NT_PI; break;
       default: break;
     } /* end switch */
-    node->name = GET_CURR_TOKEN_VALUE(lexer);
+    node->name = GET_CURR_TOKEN_VALUE(doc, lexer);
     XMLNodeListAdd(&doc->others, node);
     NEXT(lexer);
   }
 
   // parse root node
-  doc->root = XMLNodeNew(NULL);
-  if (!_XMLParseTree(lexer, doc->root)) return false;
+  doc->root = XMLNodeNew(doc, NULL);
+  if (!lexer_cur_token_is(lexer, TOKEN_OPEN_TAG)) return XMLSetError(doc, XML_ERROR_UNEXPECTED_TOKEN, lexer, &lexer->cur_token, TOKEN_OPEN_TAG);
+  XMLNSScope scope;
+  XMLNSScopeInit(&scope);
+  bool ok = _XMLParseTree(doc, lexer, &scope, doc->root, doc->lazy_levels > 0 ? doc->lazy_levels - 1 : -1);
+  XMLNSScopeFree(&scope);
+  if (!ok) return false;
+
+  XMLErrorCode code = XMLSkipEpilog(lexer);
+  if (code != XML_OK) return XMLSetError(doc, code, lexer, &lexer->cur_token, code == XML_ERROR_TRAILING_CONTENT ? TOKEN_EOF : TOKEN_NONE);
+  return true;
+}
 
-  return lexer_cur_token_is(lexer, TOKEN_EOF);
+static void XMLDocumentFreeSkipIndex(XMLDocument *doc) {
+  if (doc->skip_index == NULL) return;
+  lexer_index_free((lexer_index_t *)doc->skip_index);
+  free(doc->skip_index);
+  doc->skip_index = NULL;
 }
 
-bool XMLDocumentParseFile(XMLDocument *doc, const char *path) {
+/* `lexer` is set up on the input */
+static bool _XMLDocumentParseLexer(XMLDocument *doc, lexer_t *lexer) {
+  doc->generation++;
+  if (doc->snapshot) XMLDocumentFree(doc); /* its lists live in the mapping */
+  XMLDocumentFreeSkipIndex(doc);
+  memset(&doc->error, 0, sizeof(XMLError));
+  memset(&doc->stats, 0, sizeof(XMLStats));
+  if (doc->others.nodes == NULL) XMLNodeListInit(&doc->others); /* a reset document keeps its list */
+  XMLLexerSetFlags(doc, lexer);
+
+  if (doc->lazy_levels > 0) { /* without an index(e.g. unbalanced tags), skipping lexes */
+    lexer_index_t *index = (lexer_index_t *)malloc(sizeof(lexer_index_t));
+    if (index && lexer_index_build(index, lexer->input, lexer->input_len)) {
+      doc->skip_index = index;
+      XML_STAT_ADD(doc, bytes_allocated, sizeof(lexer_index_t) + index->capacity * sizeof(lexer_index_entry_t));
+    } else {
+      free(index);
+    }
+  }
+#ifdef XML_STATS
+  lexer_stats_t lex_stats = { { 0 }, 0 };
+  double start = doc->collect_stats ? XMLStatsClock() : 0;
+  if (doc->collect_stats) lexer->stats = &lex_stats;
+#endif
+
+  bool ok = _XMLDocumentParseTokens(doc, lexer);
+  if (ok) doc->parsed_generation = doc->generation;
+
+#ifdef XML_STATS
+  if (doc->collect_stats) {
+    double total = XMLStatsClock() - start;
+    doc->stats.bytes_lexed = (size_t)(lexer->position < lexer->input_len ? lexer->position : lexer->input_len);
+    for (size_t i = 0; i < ARRAY_SIZE(lex_stats.tokens) && i < XML_STATS_TOKEN_TYPES; ++i) {
+      doc->stats.tokens[i] = lex_stats.tokens[i];
+    }
+    doc->stats.lex_seconds = lex_stats.seconds;
+    doc->stats.build_seconds = total > lex_stats.seconds ? total - lex_stats.seconds : 0;
+    lexer->stats = NULL;
+  }
+#endif
+  return ok;
+}
+
+static bool _XMLDocumentParseInternal(XMLDocument *doc, const char *xmlStr, const char *path, lexer_t *lexer) {
+  size_t len = strlen(xmlStr);
+  if (len > XML_MAX_INPUT) {
+    XMLSetError(doc, XML_ERROR_TOO_LARGE, NULL, NULL, TOKEN_NONE);
+    doc->error.offset = XML_MAX_INPUT;
+    return false;
+  }
+  lexer_init_len(lexer, xmlStr, (int)len, path);
+  return _XMLDocumentParseLexer(doc, lexer);
+}
+
+static bool _XMLDocumentParseFile(XMLDocument *doc, const char *path) {
   lexer_t lexer = { 0 };
-  char *xmlStr = doc->contents = read_file(path);
-  if (xmlStr == NULL) return false;
+  char *xmlStr = NULL;
+  size_t size = 0;
+  if (doc->ctx) {
+    if (doc->root) XMLDocumentReset(doc);
+    xmlStr = doc->contents = read_file_into(path, &doc->ctx->buffer, &doc->ctx->buffer_capacity, &size);
+  } else {
+    xmlStr = doc->contents = read_file(path, &size);
+  }
+  if (xmlStr == NULL) {
+    memset(&doc->error, 0, sizeof(XMLError));
+    return XMLSetError(doc, XML_ERROR_IO, NULL, NULL, TOKEN_NONE);
+  }
+  if (doc->ctx) {
+    if (!XMLDecodeInput(&doc->ctx->buffer, &doc->ctx->buffer_capacity, &size, &doc->error)) return false;
+    xmlStr = doc->contents = doc->ctx->buffer;
+  } else {
+    if (!XMLDecodeInput(&doc->contents, NULL, &size, &doc->error)) return false;
+    xmlStr = doc->contents;
+  }
   return _XMLDocumentParseInternal(doc, xmlStr, path, &lexer);
 }
 
-bool XMLDocumentParseStr(XMLDocument *doc, const char *xmlStr) {
+static bool _XMLDocumentParseStr(XMLDocument *doc, const char *xmlStr) {
   lexer_t lexer = { 0 };
-  /* we need to own the string, so that in `XMLNodListFree`, we could free it */
-  char *buf = doc->contents = strdup(xmlStr);
-  if (buf == NULL) return false;
+  char *buf = NULL;
+  size_t len = strlen(xmlStr);
+  if (doc->ctx) {
+    XMLParserContext *ctx = doc->ctx;
+    if (doc->root) XMLDocumentReset(doc);
+    if (ctx->buffer == NULL || ctx->buffer_capacity < len + 1) {
+      char *new_buf = (char *)realloc(ctx->buffer, len + 1);
+      if (new_buf == NULL) {
+        memset(&doc->error, 0, sizeof(XMLError));
+        return XMLSetError(doc, XML_ERROR_MEMORY, NULL, NULL, TOKEN_NONE);
+      }
+      ctx->buffer = new_buf;
+      ctx->buffer_capacity = len + 1;
+    }
+    memcpy(ctx->buffer, xmlStr, len + 1);
+    buf = doc->contents = ctx->buffer;
+  } else {
+    /* we need to own the string, so that in `XMLNodListFree`, we could free it */
+    buf = doc->contents = strdup(xmlStr);
+  }
+  if (buf == NULL) {
+    memset(&doc->error, 0, sizeof(XMLError));
+    return XMLSetError(doc, XML_ERROR_MEMORY, NULL, NULL, TOKEN_NONE);
+  }
+  if (doc->ctx) {
+    if (!XMLDecodeInput(&doc->ctx->buffer, &doc->ctx->buffer_capacity, &len, &doc->error)) return false;
+    buf = doc->contents = doc->ctx->buffer;
+  } else {
+    if (!XMLDecodeInput(&doc->contents, NULL, &len, &doc->error)) return false;
+    buf = doc->contents;
+  }
   return _XMLDocumentParseInternal(doc, buf, NULL, &lexer);
 }
 
+bool XMLDocumentParseFile(XMLDocument *doc, const char *path) {
+  doc->lazy_levels = 0;
+  return _XMLDocumentParseFile(doc, path);
+}
+
+bool XMLDocumentParseStr(XMLDocument *doc, const char *xmlStr) {
+  doc->lazy_levels = 0;
+  return _XMLDocumentParseStr(doc, xmlStr);
+}
+
+bool XMLDocumentParseBuffer(XMLDocument *doc, char *data, size_t size, const char *path) {
+  lexer_t lexer = { 0 };
+  doc->lazy_levels = 0;
+  if (doc->ctx) {
+    if (doc->root) XMLDocumentReset(doc);
+    free(doc->ctx->buffer);
+    doc->ctx->buffer = doc->contents = data;
+    doc->ctx->buffer_capacity = data ? size + 1 : 0;
+  } else {
+    doc->contents = data;
+  }
+  if (data == NULL) {
+    memset(&doc->error, 0, sizeof(XMLError));
+    return XMLSetError(doc, XML_ERROR_MEMORY, NULL, NULL, TOKEN_NONE);
+  }
+  if (doc->ctx) {
+    if (!XMLDecodeInput(&doc->ctx->buffer, &doc->ctx->buffer_capacity, &size, &doc->error)) return false;
+    doc->contents = doc->ctx->buffer;
+  } else {
+    if (!XMLDecodeInput(&doc->contents, NULL, &size, &doc->error)) return false;
+  }
+  return _XMLDocumentParseInternal(doc, doc->contents, path, &lexer);
+}
+
+/* Incremental input */
+#define XML_STREAM_CHUNK 65536
+
+typedef struct XMLStreamInput {
+  XMLDocument *doc;
+  XMLReadFn read;
+  void *user_data;
+  char *buf;       /* the input so far, null terminated */
+  size_t len, capacity;
+  size_t valid;    /* checked UTF-8: what the lexer sees */
+  bool eof;        /* read to the end, or failed */
+}XMLStreamInput;
+
+static bool XMLStreamFail(XMLStreamInput *in, XMLErrorCode code, size_t offset) {
+  in->eof = true;
+  if (in->doc->error.code == XML_OK) {
+    XMLSetError(in->doc, code, NULL, NULL, TOKEN_NONE);
+    in->doc->error.offset = offset;
+  }
+  return false;
+}
+
+/* one more `read`. False at the end. */
+static bool XMLStreamRead(XMLStreamInput *in) {
+  if (in->eof) return false;
+  if (in->capacity - in->len < XML_STREAM_CHUNK + 1) {
+    size_t capacity = in->capacity ? in->capacity : XML_STREAM_CHUNK * 4;
+    while (capacity - in->len < XML_STREAM_CHUNK + 1) capacity *= 2;
+    char *buf = (char *)realloc(in->buf, capacity);
+    if (buf == NULL) return XMLStreamFail(in, XML_ERROR_MEMORY, in->len);
+    in->buf = buf;
+    in->capacity = capacity;
+  }
+  long n = in->read(in->buf + in->len, in->capacity - in->len - 1, in->user_data);
+  if (n < 0) return XMLStreamFail(in, XML_ERROR_IO, in->len);
+  in->len += (size_t)n;
+  in->buf[in->len] = '\0';
+  if (n == 0) in->eof = true;
+  return n > 0;
+}
+
+/* check what was read since: a sequence cut at the end of a chunk waits for the next one */
+static bool XMLStreamValidate(XMLStreamInput *in) {
+  size_t ok = XMLUTF8Validate(in->buf + in->valid, in->len - in->valid);
+  size_t left = in->len - in->valid - ok;
+  if (left >= 4 || (left > 0 && in->eof)) return XMLStreamFail(in, XML_ERROR_ENCODING, in->valid + ok);
+  in->valid += ok;
+  if (in->valid > XML_MAX_INPUT) return XMLStreamFail(in, XML_ERROR_TOO_LARGE, XML_MAX_INPUT);
+  return true;
+}
+
+static bool XMLStreamRefill(lexer_t *lexer, void *user_data) {
+  XMLStreamInput *in = (XMLStreamInput *)user_data;
+  size_t valid = in->valid;
+  while (in->valid == valid) {
+    bool more = XMLStreamRead(in);
+    if (in->doc->error.code != XML_OK || !XMLStreamValidate(in)) return false;
+    if (!more && in->valid == valid) return false;
+  }
+  lexer_rebase(lexer, in->buf, (int)in->valid);
+  return true;
+}
+
+bool XMLDocumentParseStream(XMLDocument *doc, XMLReadFn read, void *user_data, const char *path) {
+  XMLStreamInput in = { doc, read, user_data, NULL, 0, 0, 0, false };
+  lexer_t lexer = { 0 };
+  bool ok = false;
+
+  doc->lazy_levels = 0;
+  if (doc->ctx) { /* read into the context's buffer */
+    if (doc->root) XMLDocumentReset(doc);
+    in.buf = doc->ctx->buffer;
+    in.capacity = doc->ctx->buffer_capacity;
+    doc->ctx->buffer = NULL;
+  }
+  memset(&doc->error, 0, sizeof(XMLError));
+
+  /* the first chunk tells the encoding */
+  while (in.len < XML_STREAM_CHUNK && XMLStreamRead(&in)) {}
+  size_t bom = 0;
+  XMLEncoding encoding = in.buf ? XMLDetectEncoding(in.buf, in.len, &bom) : XML_ENCODING_UTF8;
+  if (doc->error.code != XML_OK) {
+    ok = false;
+  } else if (encoding != XML_ENCODING_UTF8) { /* converted as a whole */
+    while (XMLStreamRead(&in)) {}
+    if (doc->error.code == XML_OK) ok = XMLDecodeInput(&in.buf, &in.capacity, &in.len, &doc->error);
+    if (ok) ok = _XMLDocumentParseInternal(doc, in.buf, path, &lexer);
+  } else {
+    if (bom) {
+      memmove(in.buf, in.buf + bom, in.len - bom + 1);
+      in.len -= bom;
+    }
+    if (XMLStreamValidate(&in)) {
+      lexer_init_refill(&lexer, in.buf ? in.buf : "", (int)in.valid, path, XMLStreamRefill, &in);
+      ok = _XMLDocumentParseLexer(doc, &lexer);
+      /* the first error may have come from reading, after which the parse saw the end */
+      ok = ok && doc->error.code == XML_OK;
+    }
+  }
+
+  if (doc->ctx) {
+    free(doc->ctx->buffer);
+    doc->ctx->buffer = in.buf;
+    doc->ctx->buffer_capacity = in.capacity;
+  }
+  doc->contents = in.buf;
+  return ok;
+}
+
+bool XMLDocumentParseFileLazy(XMLDocument *doc, const char *path, int levels) {
+  doc->lazy_levels = levels > 0 ? levels : 1;
+  return _XMLDocumentParseFile(doc, path);
+}
+
+bool XMLDocumentParseStrLazy(XMLDocument *doc, const char *xmlStr, int levels) {
+  doc->lazy_levels = levels > 0 ? levels : 1;
+  return _XMLDocumentParseStr(doc, xmlStr);
+}
+
+/* Incremental re-parse */
+typedef struct XMLReparseLevel {
+  size_t entry;  /* in the skip index */
+  XMLNode *node;
+}XMLReparseLevel;
+
+/* `node`, parsed from `contents`, is the element at `start` */
+static bool XMLReparseNameAt(const char *contents, size_t start, const XMLNode *node) {
+  size_t len = strlen(node->name);
+  const char *name = contents + start + 1;
+  if (strncmp(name, node->name, len) != 0) return false;
+  char c = name[len];
+  return c == '>' || c == '/' || c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* The elements around [offset, offset + removed), from the root down, in `*levels`. Their
+ * tags are not touched by the edit. Returns how many there are, -1 if out of memory.
+ * */
+static int XMLReparseFindLevels(XMLDocument *doc, const lexer_index_t *index, size_t offset, size_t removed,
+                                XMLReparseLevel **levels) {
+  const lexer_index_entry_t *entries = index->entries;
+  int count = 0, capacity = 0;
+  size_t entry = 0;
+  XMLNode *node = doc->root;
+
+  *levels = NULL;
+  while (entry < index->count && entries[entry].start < offset && offset + removed < entries[entry].end &&
+         XMLReparseNameAt(doc->contents, entries[entry].start, node)) {
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      XMLReparseLevel *new_levels = (XMLReparseLevel *)realloc(*levels, sizeof(XMLReparseLevel) * capacity);
+      if (new_levels == NULL) return -1;
+      *levels = new_levels;
+    }
+    (*levels)[count].entry = entry;
+    (*levels)[count++].node = node;
+
+    /* the child element around the edit: entries & children(less comments) go in the same order */
+    size_t child = entry + 1;
+    size_t i = 0;
+    XMLNode *found = NULL;
+    while (child < entries[entry].next && entries[child].start < offset) {
+      while (i < node->children.count && !XMLNodeIsElement(node->children.nodes[i])) i++;
+      if (i == node->children.count) break;
+      if (offset + removed < entries[child].end) {
+        found = node->children.nodes[i];
+        break;
+      }
+      child = entries[child].next;
+      i++;
+    }
+    if (found == NULL) break;
+    entry = child;
+    node = found;
+  }
+  return count;
+}
+
+/* `levels[at]` was parsed again from `len` bytes of the new contents: update the index.
+ * The entries after it move by `delta` bytes, and by as many entries as its subtree gained.
+ * */
+static bool XMLReparseUpdateIndex(XMLDocument *doc, const XMLReparseLevel *levels, int at, size_t len, ptrdiff_t delta) {
+  lexer_index_t *index = (lexer_index_t *)doc->skip_index;
+  size_t entry = levels[at].entry, start = index->entries[entry].start;
+  lexer_index_t sub;
+  if (!lexer_index_build(&sub, doc->contents + start, len)) return false;
+
+  size_t old_count = index->entries[entry].next - entry;
+  ptrdiff_t added = (ptrdiff_t)sub.count - (ptrdiff_t)old_count;
+  if (index->count + added > index->capacity) {
+    lexer_index_entry_t *entries = (lexer_index_entry_t *)realloc(index->entries, sizeof(lexer_index_entry_t) * (index->count + added));
+    if (entries == NULL) {
+      lexer_index_free(&sub);
+      return false;
+    }
+    index->entries = entries;
+    index->capacity = index->count + added;
+  }
+  lexer_index_entry_t *entries = index->entries;
+  memmove(entries + entry + sub.count, entries + entry + old_count, sizeof(lexer_index_entry_t) * (index->count - entry - old_count));
+  index->count += added;
+  for (size_t i = 0; i < sub.count; ++i) {
+    entries[entry + i].start = sub.entries[i].start + start;
+    entries[entry + i].end = sub.entries[i].end + start;
+    entries[entry + i].next = sub.entries[i].next + entry;
+  }
+  for (size_t i = entry + sub.count; i < index->count; ++i) {
+    entries[i].start += delta;
+    entries[i].end += delta;
+    entries[i].next += added;
+  }
+  for (int i = 0; i < at; ++i) { /* the ancestors end later */
+    entries[levels[i].entry].end += delta;
+    entries[levels[i].entry].next += added;
+  }
+  lexer_index_free(&sub);
+  return true;
+}
+
+/* parse the element at [start, end) of `contents` again and put it in the place of `old` */
+static XMLNode *XMLReparseElement(XMLDocument *doc, XMLNode *old, size_t start, size_t end) {
+  lexer_t lexer;
+  XMLNSScope scope;
+  XMLNSScopeInit(&scope);
+  lexer_init_len(&lexer, doc->contents + start, (int)(end - start), NULL);
+  XMLLexerSetFlags(doc, &lexer);
+  NEXT(&lexer);
+  NEXT(&lexer);
+
+  XMLNode *node = XMLNodeNew(doc, NULL);
+  bool ok = lexer_cur_token_is(&lexer, TOKEN_OPEN_TAG) && XMLNSDeclareAncestors(&scope, old->parent) &&
+            _XMLParseTree(doc, &lexer, &scope, node, -1) && lexer_cur_token_is(&lexer, TOKEN_EOF);
+  XMLNSScopeFree(&scope);
+  if (ok && XMLNodeReplace(doc, old, node) == old) {
+    XMLNodeDelete(doc, old);
+    return node;
+  }
+  XMLNodeDelete(doc, node);
+  return NULL;
+}
+
+/* parse all of the (already edited and decoded) contents again */
+static XMLNode *XMLReparseDocument(XMLDocument *doc) {
+  lexer_t lexer = { 0 };
+  char *contents = doc->contents;
+  if (doc->ctx) {
+    XMLDocumentReset(doc); /* `contents` is the context's buffer */
+  } else {
+    doc->contents = NULL;
+    XMLDocumentFree(doc);
+  }
+  doc->contents = contents;
+  return _XMLDocumentParseInternal(doc, contents, NULL, &lexer) ? doc->root : NULL;
+}
+
+XMLNode *XMLDocumentReparse(XMLDocument *doc, size_t offset, size_t removed, const char *text, size_t len) {
+  if (doc == NULL || doc->snapshot || doc->contents == NULL || (text == NULL && len > 0)) return NULL;
+  size_t size = strlen(doc->contents);
+  if (offset > size || removed > size - offset || size - removed + len >= INT_MAX) return NULL;
+  bool whole = doc->root == NULL || doc->error.code != XML_OK || (doc->lazy_levels > 0 && !XMLDocumentExpandAll(doc));
+  doc->lazy_levels = 0; /* built */
+
+  /* where the edit is, before it moves anything */
+  lexer_index_t *index = (lexer_index_t *)doc->skip_index;
+  if (!whole && index == NULL && (index = (lexer_index_t *)malloc(sizeof(lexer_index_t))) != NULL) {
+    if (lexer_index_build(index, doc->contents, size)) {
+      doc->skip_index = index;
+    } else {
+      free(index);
+      index = NULL;
+    }
+  }
+  XMLReparseLevel *levels = NULL;
+  int depth = whole || index == NULL ? 0 : XMLReparseFindLevels(doc, index, offset, removed, &levels);
+  if (depth < 0) depth = 0;
+
+  /* edit */
+  size_t new_size = size - removed + len;
+  char *contents = doc->contents;
+  if (new_size > size) {
+    if (doc->ctx) {
+      if (doc->ctx->buffer_capacity < new_size + 1) {
+        contents = (char *)realloc(doc->ctx->buffer, new_size + 1);
+        if (contents) doc->ctx->buffer = contents, doc->ctx->buffer_capacity = new_size + 1;
+      }
+    } else {
+      contents = (char *)realloc(contents, new_size + 1);
+    }
+    if (contents == NULL) {
+      free(levels);
+      memset(&doc->error, 0, sizeof(XMLError));
+      XMLSetError(doc, XML_ERROR_MEMORY, NULL, NULL, TOKEN_NONE);
+      return NULL;
+    }
+    doc->contents = contents;
+  }
+  memmove(contents + offset + len, contents + offset + removed, size - offset - removed + 1);
+  if (len > 0) memcpy(contents + offset, text, len);
+  doc->generation++;
+
+  /* the innermost element which still parses on its own */
+  ptrdiff_t delta = (ptrdiff_t)len - (ptrdiff_t)removed;
+  XMLNode *node = NULL;
+  for (int at = depth - 1; at >= 0 && node == NULL; --at) {
+    const lexer_index_entry_t *entry = &index->entries[levels[at].entry];
+    size_t start = entry->start, end = entry->end + delta;
+    memset(&doc->error, 0, sizeof(XMLError));
+    node = XMLReparseElement(doc, levels[at].node, start, end);
+    if (node && !XMLReparseUpdateIndex(doc, levels, at, end - start, delta)) XMLDocumentFreeSkipIndex(doc);
+  }
+  free(levels);
+  if (node) {
+    memset(&doc->error, 0, sizeof(XMLError));
+    doc->parsed_generation = doc->generation; /* the tree is `contents` again */
+    return node;
+  }
+  return XMLReparseDocument(doc);
+}
+
+bool XMLDocumentGetStats(const XMLDocument *doc, XMLStats *stats) {
+  if (stats == NULL) return false;
+  memset(stats, 0, sizeof(XMLStats));
+#ifdef XML_STATS
+  if (doc == NULL || !doc->collect_stats) return false;
+  *stats = doc->stats;
+  stats->decode_seconds = (double)__atomic_load_n(&decode_nanoseconds, __ATOMIC_RELAXED) / 1e9;
+  stats->decoded_bytes = __atomic_load_n(&decode_bytes, __ATOMIC_RELAXED);
+  return true;
+#else
+  (void)doc;
+  return false;
+#endif
+}
+
+const XMLError *XMLDocumentGetError(const XMLDocument *doc) {
+  if (doc == NULL || doc->error.code == XML_OK) return NULL;
+  return &doc->error;
+}
+
+void XMLErrorPosition(const XMLError *error, const char *input, int *line, int *column) {
+  int l = 1, c = 1;
+  if (error && input) {
+    for (size_t i = 0; i < error->offset && input[i] != '\0'; ++i) {
+      if (input[i] == '\n') {
+        l++;
+        c = 1;
+      } else {
+        c++;
+      }
+    }
+  }
+  if (line) *line = l;
+  if (column) *column = c;
+}
+
+const char *XMLErrorString(XMLErrorCode code) {
+  switch (code) {
+    case XML_OK: return "no error";
+    case XML_ERROR_IO: return "can't read the input";
+    case XML_ERROR_MEMORY: return "out of memory";
+    case XML_ERROR_UNEXPECTED_TOKEN: return "unexpected token";
+    case XML_ERROR_MISMATCHED_TAG: return "end tag doesn't match the start tag";
+    case XML_ERROR_DUPLICATE_ATTRIBUTE: return "duplicate attribute";
+    case XML_ERROR_UNTERMINATED: return "unterminated markup";
+    case XML_ERROR_TRAILING_CONTENT: return "content after the root element";
+    case XML_ERROR_ENCODING: return "invalid or unsupported encoding";
+    case XML_ERROR_COMPRESSION: return "corrupt or unsupported compressed input";
+    case XML_ERROR_ATTRIBUTE_VALUE: return "'<' in an attribute value";
+    case XML_ERROR_TOO_LARGE: return "input larger than 2 GB";
+  }
+  return "unknown error";
+}
+
+/* Validation: the parser's grammar, without building anything */
+typedef struct ValidateName {
+  const char *name;
+  int len;
+}ValidateName;
+
+/* small documents never touch the heap: the first levels live on the stack */
+#define XML_VALIDATE_STACK 64
+
+typedef struct ValidateStack {
+  ValidateName *items;
+  size_t count;
+  size_t capacity;
+  ValidateName local[XML_VALIDATE_STACK];
+}ValidateStack;
+
+typedef struct Validator {
+  lexer_t lexer;
+  ValidateStack names; /* open elements */
+  ValidateStack attrs; /* attribute names of the current start tag */
+  XMLError error;
+}Validator;
+
+static void ValidateStackInit(ValidateStack *stack) {
+  stack->items = stack->local;
+  stack->count = 0;
+  stack->capacity = XML_VALIDATE_STACK;
+}
+
+static void ValidateStackFree(ValidateStack *stack) {
+  if (stack->items != stack->local) free(stack->items);
+}
+
+static bool ValidatePush(ValidateStack *stack, const char *name, int len) {
+  if (stack->count == stack->capacity) {
+    size_t capacity = stack->capacity * 2;
+    ValidateName *items = NULL;
+    if (stack->items == stack->local) {
+      items = (ValidateName *)malloc(sizeof(ValidateName) * capacity);
+      if (items) memcpy(items, stack->local, sizeof(stack->local));
+    } else {
+      items = (ValidateName *)realloc(stack->items, sizeof(ValidateName) * capacity);
+    }
+    if (items == NULL) return false;
+    stack->items = items;
+    stack->capacity = capacity;
+  }
+  stack->items[stack->count].name = name;
+  stack->items[stack->count].len = len;
+  stack->count++;
+  return true;
+}
+
+/* record the error at `tok` and fail */
+static bool ValidateFail(Validator *v, XMLErrorCode code, const token_t *tok, token_type_t expected) {
+  XMLErrorSet(&v->error, code, &v->lexer, tok, expected);
+  return false;
+}
+
+/* '<' name (name = "value")* ('>' | '/>'), with unique attribute names */
+static bool ValidateStartTag(Validator *v, ValidateName *name) {
+  lexer_t *lexer = &v->lexer;
+  if (!lexer_expect_peek(lexer, TOKEN_NAME)) return ValidateFail(v, XML_ERROR_UNEXPECTED_TOKEN, &lexer->peek_token, TOKEN_NAME);
+  name->name = lexer->cur_token.literal;
+  name->len = lexer->cur_token.len;
+  NEXT(lexer);
+
+  v->attrs.count = 0;
+  while (lexer_cur_token_is(lexer, TOKEN_NAME)) {
+    token_t key = lexer->cur_token;
+    for (size_t i = 0; i < v->attrs.count; ++i) {
+      if (v->attrs.items[i].len == key.len && strncmp(v->attrs.items[i].name, key.literal, key.len) == 0) {
+        return ValidateFail(v, XML_ERROR_DUPLICATE_ATTRIBUTE, &key, TOKEN_NONE);
+      }
+    }
+    if (!ValidatePush(&v->attrs, key.literal, key.len)) return ValidateFail(v, XML_ERROR_MEMORY, &key, TOKEN_NONE);
+    if (!lexer_expect_peek(lexer, TOKEN_ASSIGN)) return ValidateFail(v, XML_ERROR_UNEXPECTED_TOKEN, &lexer->peek_token, TOKEN_ASSIGN);
+    if (!lexer_expect_peek(lexer, TOKEN_STRING)) return ValidateFail(v, XML_ERROR_UNEXPECTED_TOKEN, &lexer->peek_token, TOKEN_STRING);
+    if (XMLTokenCheck(&lexer->cur_token) != XML_OK) return ValidateFail(v, XML_ERROR_ATTRIBUTE_VALUE, &lexer->cur_token, TOKEN_NONE);
+    NEXT(lexer);
+  }
+  if (!lexer_cur_token_is(lexer, TOKEN_CLOSE_TAG) && !lexer_cur_token_is(lexer, TOKEN_CLOSESLASH_TAG)) {
+    return ValidateFail(v, XML_ERROR_UNEXPECTED_TOKEN, &lexer->cur_token, TOKEN_CLOSE_TAG);
+  }
+  return true;
+}
+
+static bool ValidateDocument(Validator *v) {
+  lexer_t *lexer = &v->lexer;
+  ValidateName name;
+
+  NEXT(lexer);
+  NEXT(lexer);
+
+  /* nodes before root, as in `_XMLDocumentParseInternal` */
+  while (lexer_cur_token_is(lexer, TOKEN_DOCTYPE) || lexer_cur_token_is(lexer, TOKEN_COMMENT) ||
+         lexer_cur_token_is(lexer, TOKEN_CDATA) || lexer_cur_token_is(lexer, TOKEN_PI)) {
+    if (XMLTokenCheck(&lexer->cur_token) != XML_OK) return ValidateFail(v, XML_ERROR_UNTERMINATED, &lexer->cur_token, TOKEN_NONE);
+    NEXT(lexer);
+  }
+  if (!lexer_cur_token_is(lexer, TOKEN_OPEN_TAG)) return ValidateFail(v, XML_ERROR_UNEXPECTED_TOKEN, &lexer->cur_token, TOKEN_OPEN_TAG);
+
+  /* the elements, as in `_XMLParseTree` */
+  do {
+    token_t *tok = &lexer->cur_token;
+    switch (tok->type) {
+      case TOKEN_OPEN_TAG:
+        if (!ValidateStartTag(v, &name)) return false;
+        if (lexer_cur_token_is(lexer, TOKEN_CLOSE_TAG) && !ValidatePush(&v->names, name.name, name.len)) {
+          return ValidateFail(v, XML_ERROR_MEMORY, tok, TOKEN_NONE);
+        }
+        break;
+      case TOKEN_OPENSLASH_TAG: {
+        if (!lexer_expect_peek(lexer, TOKEN_NAME)) return ValidateFail(v, XML_ERROR_UNEXPECTED_TOKEN, &lexer->peek_token, TOKEN_NAME);
+        ValidateName *open = &v->names.items[v->names.count - 1];
+        if (open->len != tok->len || strncmp(open->name, tok->literal, tok->len) != 0) {
+          return ValidateFail(v, XML_ERROR_MISMATCHED_TAG, tok, TOKEN_NONE);
+        }
+        if (!lexer_expect_peek(lexer, TOKEN_CLOSE_TAG)) return ValidateFail(v, XML_ERROR_UNEXPECTED_TOKEN, &lexer->peek_token, TOKEN_CLOSE_TAG);
+        v->names.count--;
+        break;
+      }
+      case TOKEN_TEXT:
+        break;
+      case TOKEN_CDATA: case TOKEN_COMMENT:
+        if (XMLTokenCheck(tok) != XML_OK) return ValidateFail(v, XML_ERROR_UNTERMINATED, tok, TOKEN_NONE);
+        break;
+      case TOKEN_EOF: /* before the end tag */
+        return ValidateFail(v, XML_ERROR_UNEXPECTED_TOKEN, tok, TOKEN_OPENSLASH_TAG);
+      default:
+        return ValidateFail(v, XML_ERROR_UNEXPECTED_TOKEN, tok, TOKEN_NONE);
+    }
+    NEXT(lexer);
+  } while (v->names.count > 0);
+
+  /* a single root: only comments & PIs may follow it */
+  XMLErrorCode code = XMLSkipEpilog(lexer);
+  if (code != XML_OK) return ValidateFail(v, code, &lexer->cur_token, code == XML_ERROR_TRAILING_CONTENT ? TOKEN_EOF : TOKEN_NONE);
+  return true;
+}
+
+/* `xmlStr` is UTF-8 already */
+static bool ValidateDecoded(const char *xmlStr, XMLError *error) {
+  Validator v;
+  size_t len = strlen(xmlStr);
+  if (len > XML_MAX_INPUT) {
+    if (error) {
+      XMLErrorSet(error, XML_ERROR_TOO_LARGE, NULL, NULL, TOKEN_NONE);
+      error->offset = XML_MAX_INPUT;
+    }
+    return false;
+  }
+
+  ValidateStackInit(&v.names);
+  ValidateStackInit(&v.attrs);
+  memset(&v.error, 0, sizeof(XMLError));
+  lexer_init_len(&v.lexer, xmlStr, (int)len, NULL);
+  lexer_set_flags(&v.lexer, LEXER_NO_POSITIONS);
+
+  bool ok = ValidateDocument(&v);
+  if (error) *error = v.error;
+  ValidateStackFree(&v.names);
+  ValidateStackFree(&v.attrs);
+  return ok;
+}
+
+bool XMLValidateStr(const char *xmlStr, XMLError *error) {
+  if (xmlStr == NULL) return false;
+  return XMLValidateBuffer(xmlStr, strlen(xmlStr), error);
+}
+
+bool XMLValidateBuffer(const char *data, size_t size, XMLError *error) {
+  XMLError decode_error;
+  size_t bom = 0;
+  if (data == NULL) return false;
+
+  /* UTF-8 is checked in place, only other encodings need a copy */
+  if (XMLDetectEncoding(data, size, &bom) == XML_ENCODING_UTF8) {
+    size_t valid = XMLUTF8Validate(data + bom, size - bom);
+    if (valid == size - bom) return ValidateDecoded(data + bom, error);
+    if (error) {
+      XMLErrorSet(error, XML_ERROR_ENCODING, NULL, NULL, TOKEN_NONE);
+      error->offset = bom + valid;
+    }
+    return false;
+  }
+
+  char *decoded = (char *)malloc(size + 1);
+  if (decoded == NULL) {
+    if (error) XMLErrorSet(error, XML_ERROR_MEMORY, NULL, NULL, TOKEN_NONE);
+    return false;
+  }
+  memcpy(decoded, data, size);
+  decoded[size] = '\0';
+  bool ok = XMLDecodeInput(&decoded, NULL, &size, &decode_error);
+  if (ok) ok = ValidateDecoded(decoded, error);
+  else if (error) *error = decode_error;
+  free(decoded);
+  return ok;
+}
+
+bool XMLValidateFile(const char *path, XMLError *error) {
+  XMLError decode_error;
+  size_t size = 0;
+  char *xmlStr = read_file(path, &size);
+  if (xmlStr == NULL) {
+    if (error) XMLErrorSet(error, XML_ERROR_IO, NULL, NULL, TOKEN_NONE);
+    return false;
+  }
+  bool ok = XMLDecodeInput(&xmlStr, NULL, &size, &decode_error);
+  if (ok) ok = ValidateDecoded(xmlStr, error);
+  else if (error) *error = decode_error;
+  free(xmlStr);
+  return ok;
+}
+
 static void _XMLPrettyPrintInternal(XMLNode *node, FILE *fp, int indent_len, int times) {
   for (size_t i = 0; i < node->children.count; ++i) {
     XMLNode *child = node->children.nodes[i];
+    XMLNodeExpand(child);
 
     //indent level
     if (times > 0) fprintf(fp, "%*s", indent_len * times, " ");
@@ -580,12 +2645,48 @@ void XMLPrettyPrint(XMLDocument *doc, FILE *fp, int indent_len) {
       fprintf(fp, " %s = \"%s\"", attr.key, attr.value);
   }
   fprintf(fp, ">\n");
+  XMLNodeExpand(doc->root);
   _XMLPrettyPrintInternal(doc->root, fp, indent_len, 1);
   fprintf(fp, "</%s>\n", doc->root->name);
 }
 
+/* return all the nodes of `doc` to its context */
+static void XMLDocumentRecycle(XMLDocument *doc) {
+  XMLParserContext *ctx = doc->ctx;
+  if (doc->root) {
+    XMLNodeRecycle(ctx, doc->root);
+    doc->root = NULL;
+  }
+  for (size_t i = doc->others.count; i > 0; --i) {
+    XMLNodeListAdd(&ctx->free_nodes, doc->others.nodes[i - 1]);
+  }
+  doc->others.count = 0;
+  doc->contents = NULL; /* owned by the context */
+  XMLArenaRewind(&ctx->strings);
+}
+
 void XMLDocumentFree(XMLDocument *doc) {
   if (doc == NULL) return;
+  doc->generation++;
+  XMLDocumentFreeSkipIndex(doc);
+  if (doc->snapshot) { /* the whole tree is in the mapping */
+    if (doc->snapshot_size) munmap(doc->snapshot, doc->snapshot_size);
+    else free(doc->snapshot);
+    doc->snapshot = NULL;
+    doc->snapshot_size = 0;
+    doc->root = NULL;
+    memset(&doc->others, 0, sizeof(XMLNodeList));
+    return;
+  }
+  if (doc->ctx) {
+    XMLDocumentRecycle(doc);
+    if (doc->others.nodes) {
+      free(doc->others.nodes);
+      doc->others.nodes = NULL;
+    }
+    return;
+  }
+
   if (doc->contents) {
     free(doc->contents);
     doc->contents = NULL;
@@ -596,7 +2697,64 @@ void XMLDocumentFree(XMLDocument *doc) {
 
   if (doc->root) {
     XMLNodeFree(doc->root);
+    free(doc->root);
     doc->root = NULL;
   }
 }
 
+void XMLDocumentReset(XMLDocument *doc) {
+  if (doc == NULL) return;
+  if (doc->ctx == NULL || doc->snapshot) {
+    XMLDocumentFree(doc);
+    return;
+  }
+  doc->generation++;
+  XMLDocumentFreeSkipIndex(doc);
+  XMLDocumentRecycle(doc);
+}
+
+void XMLDocumentChanged(XMLDocument *doc) {
+  if (doc) doc->generation++;
+}
+
+/* Parser Context */
+void XMLParserContextInit(XMLParserContext *ctx) {
+  memset(ctx, 0, sizeof(XMLParserContext));
+  XMLNodeListInit(&ctx->free_nodes);
+}
+
+void XMLParserContextFree(XMLParserContext *ctx) {
+  if (ctx == NULL) return;
+  for (size_t i = 0; i < ctx->free_nodes.count; ++i) {
+    XMLNode *node = ctx->free_nodes.nodes[i];
+    free(node->attrList.attrs);
+    free(node->children.nodes);
+    free(node);
+  }
+  if (ctx->free_nodes.nodes) {
+    free(ctx->free_nodes.nodes);
+    ctx->free_nodes.nodes = NULL;
+  }
+  ctx->free_nodes.count = 0;
+
+  XMLArenaFree(&ctx->strings);
+  XMLArenaFree(&ctx->names);
+
+  if (ctx->name_table) {
+    free(ctx->name_table);
+    ctx->name_table = NULL;
+  }
+  ctx->name_count = ctx->name_capacity = 0;
+
+  if (ctx->buffer) {
+    free(ctx->buffer);
+    ctx->buffer = NULL;
+  }
+  ctx->buffer_capacity = 0;
+}
+
+void XMLDocumentInitWithContext(XMLDocument *doc, XMLParserContext *ctx) {
+  memset(doc, 0, sizeof(XMLDocument));
+  doc->ctx = ctx;
+}
+
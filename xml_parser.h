@@ -2,11 +2,27 @@
 #define __XML_PARSER_H__
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+
+/* Thread safety:
+ *   A parsed document can be read from many threads at once: the query functions
+ *   (XMLSelectNode, XMLFind*, XMLDecodeText, xpath) never modify the tree and keep their
+ *   scratch memory per call or per thread. Parsing, freeing or editing a document, and
+ *   using a XMLParserContext, need the document (or context) for one thread only.
+ * */
+
+/* Interned string: the same string always gets the same id in a process, so names and
+ * namespace URIs compare as integers. 0 is no string(e.g. no namespace). See XMLAtomIntern.
+ * */
+typedef unsigned int XMLAtom;
 
 typedef struct XMLAttr {
   char *key;
   char *value;
   struct XMLNode *node; //Node which the attribute belongs
+  XMLAtom ns;    /* namespace URI, 0 if none(unprefixed attributes have none) */
+  XMLAtom local; /* local name */
 }XMLAttr;
 
 typedef struct XMLAttrList {
@@ -37,13 +53,105 @@ typedef struct XMLNode {
   struct XMLNode *parent;
   XMLAttrList attrList;
   XMLNodeList children;
-  size_t index; /* index in parent's children. The index start at 0 */
+  size_t index; /* index in parent's children. The index start at 0. After editing, read it with XMLNodeIndex */
+  size_t renumber; /* non 0: the index of the children from `renumber - 1` on is stale, see XMLNodeIndex */
+  XMLAtom ns;    /* elements: namespace URI, 0 if none */
+  XMLAtom local; /* elements: local name, the part after the prefix */
+  struct XMLLazy *lazy; /* non NULL: `children` are not built yet, see XMLDocumentParseStrLazy */
+  uint64_t hash; /* of the subtree, 0 until computed, see XMLNodeHash */
 }XMLNode;
 
+typedef enum XMLErrorCode {
+  XML_OK = 0,
+  XML_ERROR_IO,                 /* the file can't be read */
+  XML_ERROR_MEMORY,
+  XML_ERROR_UNEXPECTED_TOKEN,   /* see `expected` & `actual` */
+  XML_ERROR_MISMATCHED_TAG,     /* </b> closing <a> */
+  XML_ERROR_DUPLICATE_ATTRIBUTE,
+  XML_ERROR_UNTERMINATED,       /* comment, CDATA, PI or DOCTYPE without its end */
+  XML_ERROR_TRAILING_CONTENT,   /* something after the root element */
+  XML_ERROR_ENCODING,           /* not valid UTF-8, or an encoding which can't be converted, see xml_encoding.h */
+  XML_ERROR_COMPRESSION,        /* corrupt compressed input, or a format this build can't decompress, see xml_compress.h */
+  XML_ERROR_ATTRIBUTE_VALUE,    /* `<` in an attribute value */
+  XML_ERROR_TOO_LARGE           /* more than XML_MAX_INPUT bytes */
+}XMLErrorCode;
+
+/* The largest input the parser and the validator take(after conversion to UTF-8): the lexer's offsets are ints */
+#define XML_MAX_INPUT ((size_t)INT_MAX)
+
+/* Why a parse or validation failed. Line & column are only computed on request, see `XMLErrorPosition`. */
+typedef struct XMLError {
+  XMLErrorCode code;
+  size_t offset;        /* byte offset of the offending token in the input */
+  const char *expected; /* token names(e.g. "NAME", ">"), NULL if not applicable */
+  const char *actual;
+}XMLError;
+
+/* What the last parse of a document did, see `XMLDocumentGetStats`.
+ * Only collected when the library is built with XML_STATS(otherwise the
+ * counting code is compiled out and every field stays 0), for a document
+ * which asked for them with `XMLDocumentCollectStats`.
+ * */
+#define XML_STATS_TOKEN_TYPES 16
+typedef struct XMLStats {
+  size_t bytes_lexed;
+  unsigned long tokens[XML_STATS_TOKEN_TYPES]; /* per token type, indexed by token_type_t(xml_lexer.h) */
+  size_t nodes;           /* nodes created, including the ones before root */
+  size_t attrs;
+  size_t bytes_allocated; /* nodes, attributes & strings, wherever they come from */
+  size_t max_depth;       /* the root is at depth 1 */
+  double lex_seconds;     /* in the lexer */
+  double build_seconds;   /* the rest of the parse */
+  /* XMLDecodeText only sees nodes, so these two count the decoding done by the whole process */
+  double decode_seconds;
+  size_t decoded_bytes;
+}XMLStats;
+
+/* Bump allocator block, see XMLArena */
+typedef struct XMLArenaBlock {
+  struct XMLArenaBlock *next;
+  size_t size;
+  size_t used;
+  char data[];
+}XMLArenaBlock;
+
+/* Chain of blocks. Rewinding keeps the blocks for the next document. */
+typedef struct XMLArena {
+  XMLArenaBlock *head;
+  XMLArenaBlock *current;
+}XMLArena;
+
+/* Reusable parse state for many small documents.
+ * A context backs one document at a time: parse, read, `XMLDocumentReset`, parse again...
+ * Once warm, parsing documents of a similar shape does no heap allocation.
+ * */
+typedef struct XMLParserContext {
+  XMLArena strings;        /* text, attribute values and comments, rewound on reset */
+  XMLArena names;          /* interned tag & attribute names, kept across documents */
+  char **name_table;       /* open addressing hash table into `names` */
+  size_t name_count;
+  size_t name_capacity;
+  XMLNodeList free_nodes;  /* recycled nodes, their children/attribute arrays keep capacity */
+  char *buffer;            /* copy of the input */
+  size_t buffer_capacity;
+}XMLParserContext;
+
 typedef struct XMLDocument {
   char *contents;
-  XMLNodeList others; /* other nodes before root */
+  XMLNodeList others; /* other nodes before root(comments & PIs after it are not kept) */
   XMLNode *root;
+  XMLParserContext *ctx; /* NULL: every node & string is malloc'ed and freed on its own */
+  unsigned long generation; /* bumped whenever the tree changes, see XMLDocumentChanged */
+  unsigned long parsed_generation; /* `generation` when the tree was last parsed from `contents` */
+  XMLError error;        /* of the last parse, see XMLDocumentGetError */
+  XMLStats stats;        /* of the last parse, see XMLDocumentGetStats */
+  int lazy_levels;       /* 0: the whole tree is built, otherwise levels built at once */
+  void *skip_index;      /* lazy parsing & XMLDocumentReparse: where the elements of `contents` start & end */
+  void *snapshot;        /* non NULL: the tree lives in this mapping, see XMLDocumentLoadSnapshot */
+  size_t snapshot_size;  /* 0: `snapshot` is a malloc'ed block, see XMLDocumentFromSubtree */
+  bool hash_on_parse;    /* see XMLDocumentHashOnParse */
+  bool collect_stats;    /* see XMLDocumentCollectStats */
+  unsigned parse_flags;  /* XML_PARSE_*, see XMLDocumentSetParseFlags */
   //char *version;
   //char *encoding;
 }XMLDocument;
@@ -102,16 +210,268 @@ XMLNodeList *XMLFindNodeWhere(const XMLNode *node, Predicate predicateFn, void *
  * */
 XMLNodeList *XMLFindNodeSelector(const XMLNode *node, Selector selectFn, void *user_data);
 
-/* decode xml node text */
+/* Namespaces
+ *
+ * Parsing resolves the prefix of every element and attribute name against the `xmlns`
+ * declarations in scope and stores the namespace URI and the local name as atoms, so
+ * looking for a name in a namespace is two integer comparisons per node.
+ * A prefix which is not declared is not an error: the name gets no namespace and its
+ * local name is the whole name, as if namespaces were not used.
+ * Nodes built by the streaming xpath(xpath_stream.h) carry no atoms.
+ * */
+#define XML_NAMESPACE_XML "http://www.w3.org/XML/1998/namespace"
+#define XML_NAMESPACE_XMLNS "http://www.w3.org/2000/xmlns/"
+
+/* The atom of `str`, created if needed. Returns 0 for NULL or if out of memory. */
+XMLAtom XMLAtomIntern(const char *str);
+/* The string of `atom`, NULL for 0 or an unknown atom. Atoms live as long as the process. */
+const char *XMLAtomString(XMLAtom atom);
+
+/* Namespace URI & local name of an element, NULL if none. For an attribute: XMLAtomString(attr->ns) */
+const char *XMLNodeNamespaceURI(const XMLNode *node);
+const char *XMLNodeLocalName(const XMLNode *node);
+
+/* Find all child elements of `node` in namespace `ns`(0: no namespace) with local name `local`.
+ * Note: you must free the returned XMLNodeList if the result is not NULL;
+ * */
+XMLNodeList *XMLFindNodeNS(const XMLNode *node, XMLAtom ns, XMLAtom local);
+
+/* decode xml node text.
+ * Note: the node is not modified. The result is either the node's text or a per-thread buffer,
+ *       which stays valid until the next call of `XMLDecodeText` on the same thread.
+ * */
 char *XMLDecodeText(const XMLNode *node);
 
+/* decode xml node text into `out` (at most `size` bytes, null terminated).
+ * Returns the length of the decoded text, like `snprintf`.
+ * */
+size_t XMLDecodeTextTo(const XMLNode *node, char *out, size_t size);
+
 /* Get the next sibling node or NULL if `node` is the last child */
 XMLNode *XMLNodeNextSibling(XMLNode *node);
 
+/* Editing
+ *
+ * The functions below change the tree of `doc` and keep `parent`, `index`, the namespace
+ * atoms and the results cached for the document(XMLDocumentChanged) up to date, so every
+ * query function can be used between edits. Appending, replacing and the text setter move no
+ * other node; inserting or detaching in the middle of a children list moves the pointers after
+ * it, and leaves renumbering them to the next XMLNodeIndex of one of them. Inserting or replacing
+ * a node and setting an attribute resolve the namespaces of what changed: that walks its ancestors,
+ * and the whole subtree for an inserted node or an `xmlns` attribute. Setting an attribute also
+ * looks for it among the node's attributes.
+ * Nodes can only move within the document they were created or parsed in, and a node is
+ * inserted once: detach it(or replace it) before inserting it elsewhere.
+ * Strings are copied; the ones replaced stay in the context's arena until the next reset
+ * when the document has a context, and are freed otherwise. Deleted nodes go back to the
+ * context's free list. Every function fails(false or NULL) on a snapshot, which is read only.
+ * */
+
+/* A new element, not in the tree yet: insert it with one of the functions below */
+XMLNode *XMLNodeCreate(XMLDocument *doc, const char *name);
+/* A deep copy of `node`(from any document), allocated like the nodes `doc` parses; not in the tree yet */
+XMLNode *XMLNodeClone(XMLDocument *doc, const XMLNode *node);
+/* Insert `node` as the last child of `parent` */
+bool XMLNodeAppendChild(XMLDocument *doc, XMLNode *parent, XMLNode *node);
+/* Insert `node` before/after `sibling`, which must have a parent */
+bool XMLNodeInsertBefore(XMLDocument *doc, XMLNode *sibling, XMLNode *node);
+bool XMLNodeInsertAfter(XMLDocument *doc, XMLNode *sibling, XMLNode *node);
+/* Take `node` and its subtree out of the tree. Returns `node`, owned by the caller until
+ * it is inserted again or deleted. Detaching the root leaves the document without one.
+ * */
+XMLNode *XMLNodeDetach(XMLDocument *doc, XMLNode *node);
+/* Put `node` where `old` is. Returns `old`, detached */
+XMLNode *XMLNodeReplace(XMLDocument *doc, XMLNode *old, XMLNode *node);
+/* Detach `node` if needed, and free it with its subtree */
+void XMLNodeDelete(XMLDocument *doc, XMLNode *node);
+/* Set the attribute `key` of an element to `value`(escaped as needed), adding it if it is
+ * not there. A NULL `value` removes the attribute.
+ * */
+bool XMLNodeSetAttribute(XMLDocument *doc, XMLNode *node, const char *key, const char *value);
+/* Set the text of `node` to `text`(escaped as needed), NULL to remove it */
+bool XMLNodeSetText(XMLDocument *doc, XMLNode *node, const char *text);
+/* Index of `node` in its parent's children */
+size_t XMLNodeIndex(const XMLNode *node);
+
+/* Subtree hashes & diff
+ *
+ * XMLNodeHash is a 64 bit hash of a subtree's structure: type, name, attributes in order,
+ * text(as stored, i.e. escaped) and the hashes of the children. Equal subtrees hash the same,
+ * in any document. It is computed on first use and kept in `hash`; the editing functions above
+ * reset it on the nodes they change and their ancestors. A node changed by hand needs `hash`
+ * set to 0 on it and its ancestors.
+ * */
+uint64_t XMLNodeHash(XMLNode *node);
+/* Compute the hash of every element while parsing `doc`(off by default): bottom up, as each
+ * element closes, from its own content and its children's hashes. Parsing costs a little more,
+ * and hashing records after parsing no longer walks them again. Elements left lazy are hashed
+ * when XMLNodeHash asks, like without this option. Kept across parses, like the context.
+ * */
+void XMLDocumentHashOnParse(XMLDocument *doc, bool on);
+
+/* What a parse leaves out. The lexer has an instance compiled for these flags(see lexer_set_flags in
+ * xml_lexer.h), so they are not tested token by token, and XML_PARSE_DATA is its leanest path.
+ * Some things need no flag: whitespace-only text never makes a node, entity references are only
+ * replaced when asked(XMLDecodeText), and lines & columns are not counted(errors are offsets, see
+ * XMLErrorPosition).
+ * */
+typedef enum XMLParseFlags {
+  XML_PARSE_DEFAULT     = 0,
+  XML_PARSE_NO_COMMENTS = 0x01, /* no NT_COMMENT nodes */
+  XML_PARSE_NO_PI       = 0x02, /* no NT_PI or NT_DOCTYPE nodes in `others`. PIs in content are skipped too:
+                                 * without this flag, a PI inside an element is XML_ERROR_UNEXPECTED_TOKEN,
+                                 * as the tree has no place for it. */
+  XML_PARSE_TRIM_TEXT   = 0x04, /* text without its trailing whitespace */
+  XML_PARSE_DATA        = 0x07  /* elements, attributes & text only */
+}XMLParseFlags;
+
+/* XML_PARSE_* flags for the next parses of `doc`(and expanding its lazy nodes). Kept across parses, like the context. */
+void XMLDocumentSetParseFlags(XMLDocument *doc, unsigned flags);
+
+typedef enum XMLDiffType {
+  XML_DIFF_CHANGED,  /* same element(or same kind of node), other attributes or text; its children are reported apart */
+  XML_DIFF_REPLACED, /* a different element is in its place: the whole subtree changed */
+  XML_DIFF_INSERTED, /* `new_node` only */
+  XML_DIFF_REMOVED   /* `old_node` only */
+}XMLDiffType;
+
+/* Diff callback: return false to stop */
+typedef bool (*XMLDiffCallback)(XMLDiffType type, XMLNode *old_node, XMLNode *new_node, void *user_data);
+
+/* Report how the subtree of `new_node` differs from the one of `old_node`, top down in document
+ * order. Children are matched in order: the head and tail which hash the same are skipped, the
+ * rest is paired by hash, then by name. Subtrees which hash the same are never entered, so once
+ * hashes are computed the work follows the changes(and the children lists around them), not the
+ * size of the trees. Returns how many differences were reported; `callback` may be NULL to only
+ * count them.
+ * */
+size_t XMLNodeDiff(XMLNode *old_node, XMLNode *new_node, XMLDiffCallback callback, void *user_data);
+/* XMLNodeDiff of the root elements */
+size_t XMLDocumentDiff(const XMLDocument *old_doc, const XMLDocument *new_doc, XMLDiffCallback callback, void *user_data);
+
 /* XML Document */
 bool XMLDocumentParseFile(XMLDocument *doc, const char *path);
 bool XMLDocumentParseStr(XMLDocument *doc, const char *xmlStr);
+/* Parse `data`(`size` bytes, null terminated, from malloc) without copying it: `doc` takes it
+ * over, even on failure(with a context it becomes the context's buffer). For input read by the
+ * caller, e.g. with XMLLoadFiles(xml_loader.h). `path` is only used for token positions, may be NULL.
+ * */
+bool XMLDocumentParseBuffer(XMLDocument *doc, char *data, size_t size, const char *path);
+/* Incremental input: `read` puts up to `size` bytes in `buf` and returns how many, 0 at the end, -1 on error */
+typedef long (*XMLReadFn)(char *buf, size_t size, void *user_data);
+/* Parse input which arrives in chunks, e.g. from a decompressor(see xml_compress.h) or a socket:
+ * the chunks are lexed as they come instead of once all of them are read. UTF-8 input is checked
+ * chunk by chunk; another encoding is read whole and converted first. As with the other parse
+ * functions, the whole input ends up in `doc->contents`. A read error is XML_ERROR_IO.
+ * */
+bool XMLDocumentParseStream(XMLDocument *doc, XMLReadFn read, void *user_data, const char *path);
 void XMLPrettyPrint(XMLDocument *doc, FILE *fp, int ident_len);
 void XMLDocumentFree(XMLDocument *doc);
 
+/* Lazy parsing
+ *
+ * Build only the top `levels` levels of the tree(1: just the root). The deeper elements are
+ * remembered as a byte range of `doc->contents` and parsed the first time they are reached
+ * through `XMLNodeChildrenGet`, `XMLNodeChildrenCount`, the `XMLFind*` & `XMLSelectNode`
+ * functions or xpath, again `levels` levels at a time. Names, attributes and text of a built
+ * node are always there; only `children` must not be read directly before `XMLNodeExpand`.
+ * A document must be well formed to parse lazily. Errors inside a range which is not built
+ * yet are found when it is: the function reaching it sees a node without those children and
+ * `XMLDocumentGetError` tells why.
+ * Expanding is serialized, so lazily parsed documents can still be read from many threads.
+ * */
+bool XMLDocumentParseStrLazy(XMLDocument *doc, const char *xmlStr, int levels);
+bool XMLDocumentParseFileLazy(XMLDocument *doc, const char *path, int levels);
+/* Build the children of `node` if they are not yet. Returns false if they don't parse. */
+bool XMLNodeExpand(XMLNode *node);
+/* Build the whole tree of a lazily parsed document */
+bool XMLDocumentExpandAll(XMLDocument *doc);
+/* Whether the unbuilt children(all descendants if `descendants`) of `node` may have an element whose
+ * name starts with the `len` bytes of `name`. False only when the skip index of the document says
+ * none has, so a lookup can miss without building `node`; true for a built node.
+ * */
+bool XMLNodeMayContain(XMLNode *node, const char *name, size_t len, bool descendants);
+
+/* Incremental re-parse
+ *
+ * Replace the `removed` bytes at `offset` of `doc->contents` with the `len` bytes of `text`(UTF-8),
+ * then re-parse only the innermost element around them: its new subtree takes the place of the
+ * old one, which is deleted, and every node outside of it stays as it was(pointers, hashes).
+ * When that element doesn't parse on its own any more(e.g. the edit moved one of its tags), its
+ * parent is tried, and so on up to the whole document. Finding the element takes the skip index
+ * of the document(built on the first call), so an edit costs a copy of `contents` and the parse
+ * of one element.
+ * Returns the root of the new subtree(`doc->root` when the whole document was parsed again), or
+ * NULL with the error in XMLDocumentGetError: `contents` is edited and the tree is what the failed
+ * parse left, as for XMLDocumentParseStr. The tree must be the one parsed from `contents`: the
+ * editing functions above don't change `contents`. A lazily parsed document is built first.
+ * */
+XMLNode *XMLDocumentReparse(XMLDocument *doc, size_t offset, size_t removed, const char *text, size_t len);
+
+/* The error of the last failed parse of `doc`, or NULL if it succeeded.
+ * Parsing never prints: check this instead.
+ * */
+const XMLError *XMLDocumentGetError(const XMLDocument *doc);
+/* 1 based line & column of `error` in `input`(for a document: `doc->contents`) */
+void XMLErrorPosition(const XMLError *error, const char *input, int *line, int *column);
+const char *XMLErrorString(XMLErrorCode code);
+
+/* Collect statistics in the next parses of `doc`. Off by default: the lexer then reads the clock twice
+ * per token. Decoding is counted process wide from the first document which asks. Kept across parses.
+ * */
+void XMLDocumentCollectStats(XMLDocument *doc, bool on);
+/* Copy the statistics of the last parse of `doc` into `*stats`.
+ * Returns false(and zeroes `*stats`) if the library was built without XML_STATS or `doc` doesn't collect them.
+ * */
+bool XMLDocumentGetStats(const XMLDocument *doc, XMLStats *stats);
+
+/* Check that `xmlStr` would parse, without building a tree: tags are balanced and
+ * properly nested, attributes are `name = "value"` and unique per tag, markup is
+ * closed and there is exactly one root. Returns false on the first error, described
+ * in `*error`(if not NULL).
+ * */
+bool XMLValidateStr(const char *xmlStr, XMLError *error);
+/* `size` bytes of `data`, which may hold null bytes(UTF-16, UTF-32) and must be followed by one */
+bool XMLValidateBuffer(const char *data, size_t size, XMLError *error);
+bool XMLValidateFile(const char *path, XMLError *error);
+
+/* Parser Context */
+void XMLParserContextInit(XMLParserContext *ctx);
+void XMLParserContextFree(XMLParserContext *ctx);
+
+/* Make `doc` allocate from `ctx`. The parse functions above then reuse the context's memory. */
+void XMLDocumentInitWithContext(XMLDocument *doc, XMLParserContext *ctx);
+
+/* Drop the parsed tree but keep the memory for the next parse.
+ * For a document without context, this is the same as `XMLDocumentFree`.
+ * */
+void XMLDocumentReset(XMLDocument *doc);
+
+/* Tell `doc` that its tree was modified in place(nodes, texts or attributes),
+ * so results cached for it(e.g. by XPathCache) are dropped.
+ * Parsing, resetting and freeing the document do this already.
+ * */
+void XMLDocumentChanged(XMLDocument *doc);
+
+/* Binary snapshot
+ *
+ * `XMLDocumentSaveSnapshot` writes the tree of `doc` as an image of its nodes,
+ * attributes and (deduplicated) strings. `XMLDocumentLoadSnapshot` maps that
+ * image back: there is nothing to parse and, when the image's preferred address
+ * is free, nothing to fix up either. The loaded document works with every query
+ * function, but its tree is read only; `XMLDocumentFree` unmaps it.
+ * Snapshots are only readable by a build with the same pointer size and byte order.
+ * A damaged file is refused: the sections, every pointer and the string pool are checked
+ * against the mapping before the tree is used, which reads the whole image once.
+ * */
+bool XMLDocumentSaveSnapshot(const XMLDocument *doc, const char *path);
+bool XMLDocumentLoadSnapshot(XMLDocument *doc, const char *path);
+
+/* Make `doc` a standalone copy of `node`'s subtree, laid out like a loaded snapshot in one
+ * malloc'ed block: nodes, attributes and children lists in document order, then each distinct
+ * string once. It costs a single free, can be handed to another thread while `node`'s document
+ * goes away, and is read only. Use XMLNodeClone for a copy which can be edited.
+ * */
+bool XMLDocumentFromSubtree(XMLDocument *doc, const XMLNode *node);
+
 #endif
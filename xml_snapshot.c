@@ -0,0 +1,617 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "xml_parser.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0 /* old headers: the address is only a hint, checked below */
+#endif
+
+/* Snapshot file:
+ *
+ *   header | XMLNode[node_count] | XMLAttr[attr_count] | XMLNode *[list_count] | atoms | strings
+ *
+ * Nodes are stored in document order(`others` first, then the root's subtree).
+ * Every pointer in the file is already the pointer it will be once the file is
+ * mapped at `base`, so loading is a single mmap. `base` is picked per file at
+ * save time, so several snapshots can usually be mapped at their own address;
+ * if the address is taken, the pointers are moved to wherever the file was mapped.
+ * Atoms(XMLAtom) are only stable within a process: `atoms` lists the ones the nodes use with
+ * their string, and a process which numbered them differently renumbers the nodes on load.
+ * */
+#define XML_SNAPSHOT_MAGIC "XMLSNAP"
+#define XML_SNAPSHOT_VERSION 4
+#define XML_SNAPSHOT_BYTE_ORDER 0x0102030405060708ULL
+#define XML_SNAPSHOT_BASE 0x200000000000ULL /* 32TB, well inside a 47 bit address space */
+#define XML_SNAPSHOT_BASE_SLOTS 1024
+#define XML_SNAPSHOT_BASE_SLOT_SIZE (4ULL << 30)
+
+typedef struct XMLSnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t node_size;      /* sizeof(XMLNode), sizeof(XMLAttr) & byte order must match the reader's */
+  uint32_t attr_size;
+  uint32_t pointer_size;
+  uint64_t byte_order;
+  uint64_t base;           /* address the file is meant to be mapped at */
+  uint64_t size;           /* of the whole file */
+  uint64_t root;           /* offsets from the start of the file */
+  uint64_t node_offset, node_count;
+  uint64_t attr_offset, attr_count;
+  uint64_t list_offset, list_count;
+  uint64_t others_offset, others_count;
+  uint64_t atom_offset, atom_count;
+  uint64_t string_offset, string_size;
+}XMLSnapshotHeader;
+
+typedef struct SnapshotAtom {
+  uint64_t atom;   /* as numbered by the writer */
+  uint64_t string; /* offset in the string pool */
+}SnapshotAtom;
+
+/******************************************************************************
+ * Writing
+ ******************************************************************************/
+typedef struct SnapshotString {
+  uint64_t offset; /* in the string pool */
+  size_t len;
+  size_t hash;
+}SnapshotString;
+
+typedef struct SnapshotWriter {
+  char *image;
+  uint64_t base;
+  XMLSnapshotHeader header;
+  uint64_t next_node, next_attr, next_list;
+
+  /* string pool: every distinct string is stored once(with `names_only`, only the names are shared) */
+  bool names_only;
+  char *strings;
+  size_t string_size, string_capacity;
+  size_t string_bound;      /* of every string with its '\0', before deduplication */
+  SnapshotString *table;
+  size_t table_count, table_capacity;
+
+  /* atoms used by the nodes */
+  XMLAtom *atoms;
+  size_t atom_count, atom_capacity;
+  unsigned char *atom_seen; /* by atom */
+  size_t atom_seen_size;
+}SnapshotWriter;
+
+static void SnapshotWriterFree(SnapshotWriter *w) {
+  free(w->strings);
+  free(w->table);
+  free(w->atoms);
+  free(w->atom_seen);
+}
+
+static void *SnapshotPointer(const SnapshotWriter *w, uint64_t offset) {
+  return (void *)(uintptr_t)(w->base + offset);
+}
+
+static size_t SnapshotHash(const char *str, size_t len) {
+  size_t hash = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)str[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static bool SnapshotTableGrow(SnapshotWriter *w) {
+  size_t capacity = w->table_capacity ? w->table_capacity * 2 : 1024;
+  SnapshotString *table = (SnapshotString *)calloc(capacity, sizeof(SnapshotString));
+  if (table == NULL) return false;
+  for (size_t i = 0; i < w->table_capacity; ++i) {
+    SnapshotString *entry = &w->table[i];
+    if (entry->len == 0) continue;
+    size_t slot = entry->hash & (capacity - 1);
+    while (table[slot].len != 0) slot = (slot + 1) & (capacity - 1);
+    table[slot] = *entry;
+  }
+  free(w->table);
+  w->table = table;
+  w->table_capacity = capacity;
+  return true;
+}
+
+static bool SnapshotReserve(SnapshotWriter *w, size_t len) {
+  if (w->string_size + len <= w->string_capacity) return true;
+  size_t capacity = w->string_capacity ? w->string_capacity : 4096;
+  while (w->string_size + len > capacity) capacity *= 2;
+  char *strings = (char *)realloc(w->strings, capacity);
+  if (strings == NULL) return false;
+  w->strings = strings;
+  w->string_capacity = capacity;
+  return true;
+}
+
+/* offset of `str` in the string pool, stored again even if it is already there */
+static uint64_t SnapshotAppend(SnapshotWriter *w, const char *str) {
+  size_t len = strlen(str) + 1;
+  if (!SnapshotReserve(w, len)) return UINT64_MAX;
+  memcpy(w->strings + w->string_size, str, len);
+  w->string_size += len;
+  return w->string_size - len;
+}
+
+/* offset of `str` in the string pool, adding it if needed. Returns UINT64_MAX if out of memory. */
+static uint64_t SnapshotIntern(SnapshotWriter *w, const char *str) {
+  size_t len = strlen(str) + 1; /* with the '\0', so the empty string has a non zero length */
+  size_t hash = SnapshotHash(str, len);
+
+  if ((w->table_count + 1) * 2 > w->table_capacity && !SnapshotTableGrow(w)) return UINT64_MAX;
+  size_t slot = hash & (w->table_capacity - 1);
+  while (w->table[slot].len != 0) {
+    SnapshotString *entry = &w->table[slot];
+    if (entry->hash == hash && entry->len == len && !memcmp(w->strings + entry->offset, str, len)) return entry->offset;
+    slot = (slot + 1) & (w->table_capacity - 1);
+  }
+
+  if (!SnapshotReserve(w, len)) return UINT64_MAX;
+  memcpy(w->strings + w->string_size, str, len);
+
+  SnapshotString *entry = &w->table[slot];
+  entry->offset = w->string_size;
+  entry->len = len;
+  entry->hash = hash;
+  w->table_count++;
+  w->string_size += len;
+  return entry->offset;
+}
+
+/* texts, values, comments...: shared unless `names_only` */
+static uint64_t SnapshotValue(SnapshotWriter *w, const char *str) {
+  return w->names_only ? SnapshotAppend(w, str) : SnapshotIntern(w, str);
+}
+
+static bool SnapshotUseAtom(SnapshotWriter *w, XMLAtom atom) {
+  if (atom == 0) return true;
+  if (atom >= w->atom_seen_size) {
+    size_t size = w->atom_seen_size ? w->atom_seen_size : 256;
+    while (atom >= size) size *= 2;
+    unsigned char *seen = (unsigned char *)realloc(w->atom_seen, size);
+    if (seen == NULL) return false;
+    memset(seen + w->atom_seen_size, 0, size - w->atom_seen_size);
+    w->atom_seen = seen;
+    w->atom_seen_size = size;
+  }
+  if (w->atom_seen[atom]) return true;
+  if (w->atom_count == w->atom_capacity) {
+    size_t capacity = w->atom_capacity ? w->atom_capacity * 2 : 64;
+    XMLAtom *atoms = (XMLAtom *)realloc(w->atoms, capacity * sizeof(XMLAtom));
+    if (atoms == NULL) return false;
+    w->atoms = atoms;
+    w->atom_capacity = capacity;
+  }
+  w->atom_seen[atom] = 1;
+  w->atoms[w->atom_count++] = atom;
+  return true;
+}
+
+#define SNAPSHOT_STRING_LEN(str) ((str) ? strlen(str) + 1 : 0)
+
+static bool SnapshotCount(SnapshotWriter *w, const XMLNode *node) {
+  XMLSnapshotHeader *header = &w->header;
+  if (!XMLNodeExpand((XMLNode *)node)) return false; /* a lazily parsed document */
+  header->node_count++;
+  w->string_bound += SNAPSHOT_STRING_LEN(node->name) + SNAPSHOT_STRING_LEN(node->text);
+  header->attr_count += node->attrList.count;
+  header->list_count += node->children.count;
+  if (!SnapshotUseAtom(w, node->ns) || !SnapshotUseAtom(w, node->local)) return false;
+  for (size_t i = 0; i < node->attrList.count; ++i) {
+    const XMLAttr *attr = &node->attrList.attrs[i];
+    if (!SnapshotUseAtom(w, attr->ns) || !SnapshotUseAtom(w, attr->local)) return false;
+    w->string_bound += SNAPSHOT_STRING_LEN(attr->key) + SNAPSHOT_STRING_LEN(attr->value);
+  }
+  for (size_t i = 0; i < node->children.count; ++i) {
+    if (!SnapshotCount(w, node->children.nodes[i])) return false;
+  }
+  return true;
+}
+
+/* Pointers to strings are written as offsets in the pool first, see SnapshotFixStrings. */
+#define SNAPSHOT_STRING(w, str, out) SNAPSHOT_STRING_WITH(w, str, out, SnapshotIntern)
+#define SNAPSHOT_VALUE(w, str, out) SNAPSHOT_STRING_WITH(w, str, out, SnapshotValue)
+#define SNAPSHOT_STRING_WITH(w, str, out, store) \
+  if ((str) != NULL) { \
+    uint64_t offset_ = store((w), (str)); \
+    if (offset_ == UINT64_MAX) return UINT64_MAX; \
+    (out) = (char *)(uintptr_t)(offset_ + 1); \
+  }
+
+/* Copy `node` and its subtree, in document order. Returns the node's offset in the image. */
+static uint64_t SnapshotWriteNode(SnapshotWriter *w, const XMLNode *node, uint64_t parent, size_t index) {
+  uint64_t offset = w->header.node_offset + w->next_node++ * sizeof(XMLNode);
+  XMLNode *copy = (XMLNode *)(w->image + offset);
+  memset(copy, 0, sizeof(XMLNode));
+  copy->type = node->type;
+  copy->index = index;
+  copy->ns = node->ns;
+  copy->local = node->local;
+  copy->hash = node->hash;
+  copy->parent = parent ? (XMLNode *)SnapshotPointer(w, parent) : NULL;
+  if (node->type != NT_COMMENT && node->type != NT_PI && node->type != NT_DOCTYPE) { /* elements, with or without text */
+    SNAPSHOT_STRING(w, node->name, copy->name);
+  } else { /* the whole comment, PI... */
+    SNAPSHOT_VALUE(w, node->name, copy->name);
+  }
+  SNAPSHOT_VALUE(w, node->text, copy->text);
+
+  copy->attrList.count = copy->attrList.capacity = node->attrList.count;
+  if (node->attrList.count > 0) {
+    uint64_t attrs = w->header.attr_offset + w->next_attr * sizeof(XMLAttr);
+    w->next_attr += node->attrList.count;
+    copy->attrList.attrs = (XMLAttr *)SnapshotPointer(w, attrs);
+    for (size_t i = 0; i < node->attrList.count; ++i) {
+      XMLAttr *attr = (XMLAttr *)(w->image + attrs) + i;
+      memset(attr, 0, sizeof(XMLAttr));
+      attr->node = (XMLNode *)SnapshotPointer(w, offset);
+      attr->ns = node->attrList.attrs[i].ns;
+      attr->local = node->attrList.attrs[i].local;
+      SNAPSHOT_STRING(w, node->attrList.attrs[i].key, attr->key);
+      SNAPSHOT_VALUE(w, node->attrList.attrs[i].value, attr->value);
+    }
+  }
+
+  copy->children.count = copy->children.capacity = node->children.count;
+  if (node->children.count > 0) {
+    uint64_t list = w->header.list_offset + w->next_list * sizeof(XMLNode *);
+    w->next_list += node->children.count;
+    copy->children.nodes = (XMLNode **)SnapshotPointer(w, list);
+    for (size_t i = 0; i < node->children.count; ++i) {
+      uint64_t child = SnapshotWriteNode(w, node->children.nodes[i], offset, i);
+      if (child == UINT64_MAX) return UINT64_MAX;
+      ((XMLNode **)(w->image + list))[i] = (XMLNode *)SnapshotPointer(w, child);
+    }
+  }
+  return offset;
+}
+
+/* the string pool goes last, so string pointers are only known once every node is written */
+static void SnapshotFixStrings(SnapshotWriter *w) {
+  uint64_t strings = w->base + w->header.string_offset - 1; /* offsets were stored + 1, NULL stays NULL */
+#define FIX(p) if (p) (p) = (char *)(uintptr_t)((uintptr_t)(p) + strings)
+  XMLNode *nodes = (XMLNode *)(w->image + w->header.node_offset);
+  for (uint64_t i = 0; i < w->header.node_count; ++i) {
+    FIX(nodes[i].name);
+    FIX(nodes[i].text);
+  }
+  XMLAttr *attrs = (XMLAttr *)(w->image + w->header.attr_offset);
+  for (uint64_t i = 0; i < w->header.attr_count; ++i) {
+    FIX(attrs[i].key);
+    FIX(attrs[i].value);
+  }
+#undef FIX
+}
+
+static uint64_t SnapshotPickBase(const XMLDocument *doc, uint64_t size) {
+  /* spread snapshots over a few thousand slots, keyed on the content */
+  size_t hash = SnapshotHash(doc->root->name ? doc->root->name : "", strlen(doc->root->name ? doc->root->name : ""));
+  hash ^= (size_t)size * 2654435761u;
+  if (size > XML_SNAPSHOT_BASE_SLOT_SIZE) return XML_SNAPSHOT_BASE;
+  return XML_SNAPSHOT_BASE + (hash % XML_SNAPSHOT_BASE_SLOTS) * XML_SNAPSHOT_BASE_SLOT_SIZE;
+}
+
+static uint64_t SnapshotAlign(uint64_t n) {
+  return (n + 15) & ~15ULL;
+}
+
+bool XMLDocumentSaveSnapshot(const XMLDocument *doc, const char *path) {
+  SnapshotWriter w;
+  XMLSnapshotHeader *header = &w.header;
+  bool ok = false;
+
+  if (doc == NULL || doc->root == NULL || path == NULL) return false;
+  memset(&w, 0, sizeof(w));
+
+  header->others_count = doc->others.count;
+  header->list_count = doc->others.count;
+  for (size_t i = 0; i < doc->others.count; ++i) {
+    if (!SnapshotCount(&w, doc->others.nodes[i])) goto out;
+  }
+  if (!SnapshotCount(&w, doc->root)) goto out;
+  header->atom_count = w.atom_count;
+
+  header->node_offset = SnapshotAlign(sizeof(XMLSnapshotHeader));
+  header->attr_offset = SnapshotAlign(header->node_offset + header->node_count * sizeof(XMLNode));
+  header->list_offset = SnapshotAlign(header->attr_offset + header->attr_count * sizeof(XMLAttr));
+  header->others_offset = header->list_offset;
+  header->atom_offset = SnapshotAlign(header->list_offset + header->list_count * sizeof(XMLNode *));
+  header->string_offset = SnapshotAlign(header->atom_offset + header->atom_count * sizeof(SnapshotAtom));
+
+  w.image = (char *)calloc(1, header->string_offset);
+  if (w.image == NULL) goto out;
+  w.base = SnapshotPickBase(doc, header->string_offset);
+  w.next_list = doc->others.count;
+
+  for (size_t i = 0; i < doc->others.count; ++i) {
+    uint64_t other = SnapshotWriteNode(&w, doc->others.nodes[i], 0, i);
+    if (other == UINT64_MAX) goto out;
+    ((XMLNode **)(w.image + header->others_offset))[i] = (XMLNode *)SnapshotPointer(&w, other);
+  }
+  header->root = SnapshotWriteNode(&w, doc->root, 0, 0);
+  if (header->root == UINT64_MAX) goto out;
+  for (size_t i = 0; i < w.atom_count; ++i) {
+    SnapshotAtom *atom = (SnapshotAtom *)(w.image + header->atom_offset) + i;
+    const char *str = XMLAtomString(w.atoms[i]);
+    atom->atom = w.atoms[i];
+    atom->string = SnapshotIntern(&w, str ? str : "");
+    if (atom->string == UINT64_MAX) goto out;
+  }
+
+  header->string_size = w.string_size;
+  header->size = header->string_offset + w.string_size;
+  SnapshotFixStrings(&w);
+
+  memcpy(header->magic, XML_SNAPSHOT_MAGIC, sizeof(header->magic));
+  header->version = XML_SNAPSHOT_VERSION;
+  header->node_size = sizeof(XMLNode);
+  header->attr_size = sizeof(XMLAttr);
+  header->pointer_size = sizeof(void *);
+  header->byte_order = XML_SNAPSHOT_BYTE_ORDER;
+  header->base = w.base;
+  memcpy(w.image, header, sizeof(XMLSnapshotHeader));
+
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) goto out;
+  ok = fwrite(w.image, 1, header->string_offset, fp) == header->string_offset &&
+       fwrite(w.strings, 1, w.string_size, fp) == w.string_size;
+  ok = (fclose(fp) == 0) && ok;
+
+out:
+  free(w.image);
+  SnapshotWriterFree(&w);
+  return ok;
+}
+
+bool XMLDocumentFromSubtree(XMLDocument *doc, const XMLNode *node) {
+  SnapshotWriter w;
+  XMLSnapshotHeader *header = &w.header;
+  bool ok = false;
+
+  if (doc == NULL || node == NULL) return false;
+  memset(&w, 0, sizeof(w));
+  if (!SnapshotCount(&w, node)) goto out;
+
+  /* no file header: the block is the tree. Offset 0 stays unused, it is the NULL parent. */
+  header->node_offset = SnapshotAlign(1);
+  header->attr_offset = SnapshotAlign(header->node_offset + header->node_count * sizeof(XMLNode));
+  header->list_offset = SnapshotAlign(header->attr_offset + header->attr_count * sizeof(XMLAttr));
+  header->string_offset = SnapshotAlign(header->list_offset + header->list_count * sizeof(XMLNode *));
+
+  /* The pool is the end of the block, with room for every string: it never grows, so nothing
+   * moves. Only names are looked up, texts and values are mostly distinct.
+   * */
+  w.image = (char *)malloc(header->string_offset + w.string_bound);
+  if (w.image == NULL) goto out;
+  w.base = (uint64_t)(uintptr_t)w.image;
+  w.names_only = true;
+  w.strings = w.image + header->string_offset;
+  w.string_capacity = w.string_bound;
+  header->root = SnapshotWriteNode(&w, node, 0, 0);
+  w.strings = NULL;
+  if (header->root == UINT64_MAX) goto out;
+  SnapshotFixStrings(&w);
+
+  if (doc->root || doc->snapshot) XMLDocumentReset(doc); /* `node` may be one of its nodes: done with it now */
+  if (doc->others.nodes) { /* kept by a reset with a context */
+    free(doc->others.nodes);
+    doc->others.nodes = NULL;
+  }
+  doc->snapshot = w.image;
+  doc->snapshot_size = 0;
+  doc->contents = NULL;
+  doc->lazy_levels = 0;
+  doc->root = (XMLNode *)(w.image + header->root);
+  doc->others.count = doc->others.capacity = 0;
+  memset(&doc->error, 0, sizeof(XMLError));
+  doc->generation++;
+  w.image = NULL;
+  ok = true;
+
+out:
+  free(w.image);
+  SnapshotWriterFree(&w);
+  return ok;
+}
+
+/******************************************************************************
+ * Loading
+ ******************************************************************************/
+
+/* the image is mapped at `image` instead of `header->base`: move every pointer */
+static void SnapshotRelocate(char *image, const XMLSnapshotHeader *header) {
+  intptr_t delta = (intptr_t)((uintptr_t)image - (uintptr_t)header->base);
+#define MOVE(p) if (p) (p) = (void *)((char *)(p) + delta)
+  XMLNode *nodes = (XMLNode *)(image + header->node_offset);
+  for (uint64_t i = 0; i < header->node_count; ++i) {
+    MOVE(nodes[i].name);
+    MOVE(nodes[i].text);
+    MOVE(nodes[i].parent);
+    MOVE(nodes[i].attrList.attrs);
+    MOVE(nodes[i].children.nodes);
+  }
+  XMLAttr *attrs = (XMLAttr *)(image + header->attr_offset);
+  for (uint64_t i = 0; i < header->attr_count; ++i) {
+    MOVE(attrs[i].key);
+    MOVE(attrs[i].value);
+    MOVE(attrs[i].node);
+  }
+  XMLNode **list = (XMLNode **)(image + header->list_offset);
+  for (uint64_t i = 0; i < header->list_count; ++i) MOVE(list[i]);
+#undef MOVE
+}
+
+/* Give the nodes this process's numbers for their atoms. Nothing to do when they already match. */
+static bool SnapshotRenumberAtoms(char *image, const XMLSnapshotHeader *header) {
+  const SnapshotAtom *atoms = (const SnapshotAtom *)(image + header->atom_offset);
+  const char *strings = image + header->string_offset;
+  uint64_t max = 0;
+  bool same = true;
+
+  for (uint64_t i = 0; i < header->atom_count; ++i) {
+    if (atoms[i].string >= header->string_size || atoms[i].atom > UINT32_MAX) return false;
+    if (XMLAtomIntern(strings + atoms[i].string) != atoms[i].atom) same = false;
+    if (atoms[i].atom > max) max = atoms[i].atom;
+  }
+  if (same) return true;
+
+  XMLAtom *map = (XMLAtom *)calloc(max + 1, sizeof(XMLAtom)); /* by the writer's atom */
+  if (map == NULL) return false;
+  for (uint64_t i = 0; i < header->atom_count; ++i) map[atoms[i].atom] = XMLAtomIntern(strings + atoms[i].string);
+#define RENUMBER(a) (a) = (a) <= max ? map[(a)] : 0
+  XMLNode *nodes = (XMLNode *)(image + header->node_offset);
+  for (uint64_t i = 0; i < header->node_count; ++i) {
+    RENUMBER(nodes[i].ns);
+    RENUMBER(nodes[i].local);
+  }
+  XMLAttr *attrs = (XMLAttr *)(image + header->attr_offset);
+  for (uint64_t i = 0; i < header->attr_count; ++i) {
+    RENUMBER(attrs[i].ns);
+    RENUMBER(attrs[i].local);
+  }
+#undef RENUMBER
+  free(map);
+  return true;
+}
+
+/* `count` items of `size` bytes from `offset` end at or before `limit`. Written so that nothing overflows. */
+static bool SnapshotRangeValid(uint64_t offset, uint64_t count, uint64_t size, uint64_t limit) {
+  return offset <= limit && offset % 16 == 0 && count <= (limit - offset) / size;
+}
+
+/* `p` points at one of the `count` items of `size` bytes from `image + offset`, and `n - 1` more follow it */
+static bool SnapshotPointerValid(const char *image, const void *p, uint64_t offset, uint64_t count, uint64_t size, uint64_t n) {
+  uintptr_t start = (uintptr_t)image + offset, at = (uintptr_t)p;
+  if (at < start || (at - start) % size != 0) return false;
+  uint64_t index = (at - start) / size;
+  return index < count && n <= count - index;
+}
+
+static bool SnapshotHeaderValid(const XMLSnapshotHeader *header, uint64_t file_size) {
+  if (memcmp(header->magic, XML_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) return false;
+  if (header->version != XML_SNAPSHOT_VERSION || header->byte_order != XML_SNAPSHOT_BYTE_ORDER) return false;
+  if (header->node_size != sizeof(XMLNode) || header->attr_size != sizeof(XMLAttr) || header->pointer_size != sizeof(void *)) return false;
+  if (header->size != file_size || header->string_offset > file_size || header->string_size != file_size - header->string_offset ||
+      header->string_size == 0) return false;
+  if (header->node_offset < sizeof(XMLSnapshotHeader)) return false;
+  if (!SnapshotRangeValid(header->node_offset, header->node_count, sizeof(XMLNode), header->attr_offset)) return false;
+  if (!SnapshotRangeValid(header->attr_offset, header->attr_count, sizeof(XMLAttr), header->list_offset)) return false;
+  if (!SnapshotRangeValid(header->list_offset, header->list_count, sizeof(XMLNode *), header->atom_offset)) return false;
+  if (!SnapshotRangeValid(header->atom_offset, header->atom_count, sizeof(SnapshotAtom), header->string_offset)) return false;
+  if (header->others_offset != header->list_offset || header->others_count > header->list_count) return false;
+  if (header->root < header->node_offset || (header->root - header->node_offset) % sizeof(XMLNode) != 0 ||
+      (header->root - header->node_offset) / sizeof(XMLNode) >= header->node_count) return false;
+  return true;
+}
+
+/* Every pointer of the mapped image points into the section it belongs to, strings into the pool(which ends
+ * with a '\0'), and the nodes form a tree: a child comes after its parent in the image and points back to it.
+ * So nothing read from the file leads outside the mapping, or around in a loop.
+ * */
+static bool SnapshotTreeValid(const char *image, const XMLSnapshotHeader *h) {
+#define STRING_VALID(p) ((p) == NULL || SnapshotPointerValid(image, (p), h->string_offset, h->string_size, 1, 1))
+#define NODE_VALID(p, n) SnapshotPointerValid(image, (p), h->node_offset, h->node_count, sizeof(XMLNode), (n))
+  if (image[h->size - 1] != '\0') return false;
+  XMLNode *nodes = (XMLNode *)(image + h->node_offset);
+  XMLAttr *attrs = (XMLAttr *)(image + h->attr_offset);
+  XMLNode **list = (XMLNode **)(image + h->list_offset);
+
+  for (uint64_t i = 0; i < h->list_count; ++i) {
+    if (!NODE_VALID(list[i], 1)) return false;
+  }
+  for (uint64_t i = 0; i < h->attr_count; ++i) {
+    if (!STRING_VALID(attrs[i].key) || !STRING_VALID(attrs[i].value) || !NODE_VALID(attrs[i].node, 1)) return false;
+  }
+  for (uint64_t i = 0; i < h->node_count; ++i) {
+    const XMLNode *node = &nodes[i];
+    if (node->type > NT_DOCTYPE || node->lazy != NULL || node->renumber != 0) return false;
+    if (!STRING_VALID(node->name) || !STRING_VALID(node->text)) return false;
+    if (node->attrList.count != node->attrList.capacity || node->children.count != node->children.capacity) return false;
+    if (node->attrList.count > 0 &&
+        !SnapshotPointerValid(image, node->attrList.attrs, h->attr_offset, h->attr_count, sizeof(XMLAttr), node->attrList.count)) {
+      return false;
+    }
+    for (size_t j = 0; j < node->attrList.count; ++j) {
+      if (node->attrList.attrs[j].node != node) return false;
+    }
+    if (node->children.count > 0 &&
+        !SnapshotPointerValid(image, node->children.nodes, h->list_offset, h->list_count, sizeof(XMLNode *), node->children.count)) {
+      return false;
+    }
+    if (node->parent != NULL && !NODE_VALID(node->parent, 1)) return false;
+  }
+  /* then the links between them, now that each node's own pointers are known to be good */
+  for (uint64_t i = 0; i < h->node_count; ++i) {
+    const XMLNode *node = &nodes[i];
+    for (size_t j = 0; j < node->children.count; ++j) {
+      const XMLNode *child = node->children.nodes[j];
+      if ((uintptr_t)child <= (uintptr_t)node || child->parent != node || child->index != j) return false;
+    }
+    if (node->parent != NULL &&
+        (node->index >= node->parent->children.count || node->parent->children.nodes[node->index] != node)) {
+      return false;
+    }
+  }
+  for (uint64_t i = 0; i < h->others_count; ++i) {
+    if (list[i]->parent != NULL || list[i]->index != i) return false;
+  }
+  if (((const XMLNode *)(image + h->root))->parent != NULL) return false;
+#undef STRING_VALID
+#undef NODE_VALID
+  return true;
+}
+
+bool XMLDocumentLoadSnapshot(XMLDocument *doc, const char *path) {
+  XMLSnapshotHeader header;
+  struct stat st;
+
+  if (doc == NULL || path == NULL) return false;
+  if (doc->root || doc->snapshot) XMLDocumentReset(doc);
+  if (doc->others.nodes) { /* kept by a reset with a context */
+    free(doc->others.nodes);
+    doc->others.nodes = NULL;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+      !SnapshotHeaderValid(&header, (uint64_t)st.st_size)) {
+    close(fd);
+    return false;
+  }
+
+  /* private mapping: pages are shared with the page cache until something writes them */
+  void *want = (void *)(uintptr_t)header.base;
+  char *image = (char *)mmap(want, header.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+  if (image != MAP_FAILED && image != want) { /* the kernel ignored the address */
+    munmap(image, header.size);
+    image = MAP_FAILED;
+  }
+  if (image == MAP_FAILED) {
+    image = (char *)mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (image != MAP_FAILED) SnapshotRelocate(image, &header);
+  }
+  close(fd);
+  if (image == MAP_FAILED) return false;
+  if (!SnapshotTreeValid(image, &header) || !SnapshotRenumberAtoms(image, &header)) {
+    munmap(image, header.size);
+    return false;
+  }
+
+  doc->snapshot = image;
+  doc->snapshot_size = header.size;
+  doc->contents = NULL;
+  doc->root = (XMLNode *)(image + header.root);
+  doc->others.count = doc->others.capacity = header.others_count;
+  doc->others.nodes = (XMLNode **)(image + header.others_offset);
+  doc->generation++;
+  return true;
+}
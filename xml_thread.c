@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "xml_thread.h"
+
+/* indexes [begin, end) not yet started by one worker */
+typedef struct WorkRange {
+  pthread_mutex_t lock;
+  size_t begin;
+  size_t end;
+}WorkRange;
+
+typedef struct WorkShared {
+  WorkRange *ranges;
+  int threads;
+  XMLTaskFn taskFn;
+  void *user_data;
+}WorkShared;
+
+typedef struct Worker {
+  WorkShared *shared;
+  int id;
+}Worker;
+
+int XMLThreadCount(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+/* take the next index of my own range */
+static bool WorkPop(WorkRange *range, size_t *index) {
+  bool found = false;
+  pthread_mutex_lock(&range->lock);
+  if (range->begin < range->end) {
+    *index = range->begin++;
+    found = true;
+  }
+  pthread_mutex_unlock(&range->lock);
+  return found;
+}
+
+/* move the upper half of `victim`'s remaining range into `mine` */
+static bool WorkSteal(WorkRange *victim, WorkRange *mine) {
+  size_t begin = 0, end = 0;
+  pthread_mutex_lock(&victim->lock);
+  if (victim->begin < victim->end) {
+    size_t left = victim->end - victim->begin;
+    begin = victim->end - (left + 1) / 2;
+    end = victim->end;
+    victim->end = begin;
+  }
+  pthread_mutex_unlock(&victim->lock);
+  if (begin == end) return false;
+
+  pthread_mutex_lock(&mine->lock);
+  mine->begin = begin;
+  mine->end = end;
+  pthread_mutex_unlock(&mine->lock);
+  return true;
+}
+
+static void *WorkerRun(void *arg) {
+  Worker *worker = (Worker *)arg;
+  WorkShared *shared = worker->shared;
+  WorkRange *mine = &shared->ranges[worker->id];
+  size_t index = 0;
+
+  while (true) {
+    while (WorkPop(mine, &index)) shared->taskFn(index, shared->user_data);
+
+    /* own range is empty, look for a victim */
+    bool stolen = false;
+    for (int i = 1; i < shared->threads && !stolen; ++i) {
+      int victim = (worker->id + i) % shared->threads;
+      stolen = WorkSteal(&shared->ranges[victim], mine);
+    }
+    /* every range looked empty. A steal moves work into the thief's range, so a range seen empty may
+     * get some later, but only its thief runs it: the work left overall only decreases, nothing is lost */
+    if (!stolen) break;
+  }
+  return NULL;
+}
+
+void XMLParallelFor(size_t count, int threads, XMLTaskFn taskFn, void *user_data) {
+  if (count == 0) return;
+  if (threads > (int)count) threads = (int)count;
+  if (threads <= 1) {
+    for (size_t i = 0; i < count; ++i) taskFn(i, user_data);
+    return;
+  }
+
+  WorkRange *ranges = (WorkRange *)malloc(sizeof(WorkRange) * threads);
+  Worker *workers = (Worker *)malloc(sizeof(Worker) * threads);
+  pthread_t *tids = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+  if (ranges == NULL || workers == NULL || tids == NULL) {
+    free(ranges);
+    free(workers);
+    free(tids);
+    for (size_t i = 0; i < count; ++i) taskFn(i, user_data);
+    return;
+  }
+
+  WorkShared shared = { ranges, threads, taskFn, user_data };
+  for (int i = 0; i < threads; ++i) {
+    pthread_mutex_init(&ranges[i].lock, NULL);
+    ranges[i].begin = count * i / threads;
+    ranges[i].end = count * (i + 1) / threads;
+    workers[i].shared = &shared;
+    workers[i].id = i;
+  }
+
+  int started = 1;
+  for (int i = 1; i < threads; ++i) {
+    /* a thread which fails to start leaves its range to be stolen */
+    if (pthread_create(&tids[i], NULL, WorkerRun, &workers[i]) == 0) started = i + 1;
+    else break;
+  }
+  WorkerRun(&workers[0]);
+  for (int i = 1; i < started; ++i) pthread_join(tids[i], NULL);
+
+  /* ranges of threads which never started */
+  for (int i = started; i < threads; ++i) {
+    for (size_t j = ranges[i].begin; j < ranges[i].end; ++j) taskFn(j, user_data);
+  }
+
+  for (int i = 0; i < threads; ++i) pthread_mutex_destroy(&ranges[i].lock);
+  free(ranges);
+  free(workers);
+  free(tids);
+}
@@ -0,0 +1,20 @@
+#ifndef __XML_THREAD_H__
+#define __XML_THREAD_H__
+
+#include <stddef.h>
+
+/* Task callback: called once for every index */
+typedef void (*XMLTaskFn)(size_t index, void *user_data);
+
+/* Number of threads worth starting: the number of online CPUs */
+int XMLThreadCount(void);
+
+/* Call `taskFn(i, user_data)` for every `i` in [0, count) on `threads` threads
+ * (the calling thread is one of them) and wait for all of them.
+ * Every thread starts with an equal slice of the indexes; a thread whose slice is
+ * done steals half of what is left in another thread's slice, so uneven tasks still
+ * keep all the threads busy.
+ * */
+void XMLParallelFor(size_t count, int threads, XMLTaskFn taskFn, void *user_data);
+
+#endif
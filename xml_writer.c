@@ -0,0 +1,1134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "xml_writer.h"
+#include "xml_lexer.h"
+#include "xml_encoding.h"
+
+#define XML_WRITER_BUFFER 65536
+
+/* Writer */
+void XMLWriterInit(XMLWriter *w, XMLWriteFn write, void *user_data) {
+  memset(w, 0, sizeof(XMLWriter));
+  w->write = write;
+  w->user_data = user_data;
+}
+
+static bool XMLWriterFileWrite(const char *data, size_t len, void *user_data) {
+  return fwrite(data, 1, len, (FILE *)user_data) == len;
+}
+
+void XMLWriterInitFile(XMLWriter *w, FILE *fp) {
+  XMLWriterInit(w, XMLWriterFileWrite, fp);
+}
+
+bool XMLWriterFlush(XMLWriter *w) {
+  if (w->write == NULL) return !w->failed;
+  if (w->len > 0 && !w->failed && !w->write(w->data, w->len, w->user_data)) w->failed = true;
+  w->len = 0;
+  return !w->failed;
+}
+
+bool XMLWriterFree(XMLWriter *w) {
+  bool ok = XMLWriterFlush(w);
+  free(w->data);
+  w->data = NULL;
+  w->len = w->capacity = 0;
+  return ok;
+}
+
+bool XMLWriterPutSlow(XMLWriter *w, const char *data, size_t len) {
+  if (w->failed) return false;
+  if (w->write) {
+    if (!XMLWriterFlush(w)) return false;
+    if (len >= XML_WRITER_BUFFER) { /* no use copying it */
+      if (!w->write(data, len, w->user_data)) w->failed = true;
+      return !w->failed;
+    }
+  }
+  if (w->capacity - w->len < len) {
+    size_t capacity = w->capacity ? w->capacity : XML_WRITER_BUFFER;
+    while (capacity - w->len < len) capacity *= 2;
+    char *new_data = (char *)realloc(w->data, capacity);
+    if (new_data == NULL) {
+      w->failed = true;
+      return false;
+    }
+    w->data = new_data;
+    w->capacity = capacity;
+  }
+  memcpy(w->data + w->len, data, len);
+  w->len += len;
+  return true;
+}
+
+/* Characters */
+static void XMLPutUTF8(XMLWriter *w, unsigned int cp) {
+  char buf[4];
+  size_t len = 0;
+  if (cp < 0x80) {
+    buf[len++] = (char)cp;
+  } else if (cp < 0x800) {
+    buf[len++] = (char)(0xC0 | (cp >> 6));
+    buf[len++] = (char)(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    buf[len++] = (char)(0xE0 | (cp >> 12));
+    buf[len++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    buf[len++] = (char)(0x80 | (cp & 0x3F));
+  } else {
+    buf[len++] = (char)(0xF0 | (cp >> 18));
+    buf[len++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    buf[len++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    buf[len++] = (char)(0x80 | (cp & 0x3F));
+  }
+  XMLWriterPut(w, buf, len);
+}
+
+/* `s` at `&`: length of the reference up to its `;` with the character in `*cp`, 0 if it is not one */
+static size_t XMLReference(const char *s, size_t len, unsigned int *cp) {
+  static const struct { const char *name; size_t len; char ch; } entities[] = {
+    { "&lt;", 4, '<' }, { "&gt;", 4, '>' }, { "&amp;", 5, '&' }, { "&quot;", 6, '"' }, { "&apos;", 6, '\'' },
+  };
+  if (len > 2 && s[1] == '#') {
+    bool hex = s[2] == 'x';
+    size_t i = hex ? 3 : 2;
+    unsigned int value = 0;
+    for (; i < len && s[i] != ';' && i < 12; ++i) {
+      char c = s[i];
+      unsigned int digit;
+      if (c >= '0' && c <= '9') digit = (unsigned int)(c - '0');
+      else if (hex && c >= 'a' && c <= 'f') digit = (unsigned int)(c - 'a' + 10);
+      else if (hex && c >= 'A' && c <= 'F') digit = (unsigned int)(c - 'A' + 10);
+      else return 0;
+      value = value * (hex ? 16 : 10) + digit;
+    }
+    if (i >= len || s[i] != ';' || i == (hex ? 3u : 2u) || value == 0 || value > 0x10FFFF ||
+        (value >= 0xD800 && value <= 0xDFFF)) return 0;
+    *cp = value;
+    return i + 1;
+  }
+  for (size_t i = 0; i < sizeof(entities) / sizeof(entities[0]); ++i) {
+    if (len >= entities[i].len && memcmp(s, entities[i].name, entities[i].len) == 0) {
+      *cp = (unsigned char)entities[i].ch;
+      return entities[i].len;
+    }
+  }
+  return 0;
+}
+
+/* Canonical XML */
+#define C14N_TEXT  0x01 /* looked at in text */
+#define C14N_ATTR  0x02 /* looked at in attribute values */
+#define C14N_URI_CACHE 64
+
+static const unsigned char c14n_special[256] = {
+  ['&'] = C14N_TEXT | C14N_ATTR,
+  ['<'] = C14N_TEXT | C14N_ATTR,
+  ['>'] = C14N_TEXT,
+  ['\r'] = C14N_TEXT | C14N_ATTR,
+  ['"'] = C14N_ATTR,
+  ['\t'] = C14N_ATTR,
+  ['\n'] = C14N_ATTR,
+};
+
+typedef struct C14NAttr {
+  const char *uri;   /* "": no namespace */
+  XMLAtom ns;
+  const char *local;
+  const XMLAttr *attr;
+}C14NAttr;
+
+typedef struct C14NNamespace {
+  const char *prefix; /* "": the default namespace */
+  const char *uri;    /* as written in the declaration */
+}C14NNamespace;
+
+typedef struct C14NState {
+  XMLWriter *w;
+  bool comments;
+  C14NNamespace *rendered; /* declarations written on the open elements, innermost last */
+  size_t rendered_count, rendered_capacity;
+  C14NNamespace *decls;    /* scratch lists for the element being written */
+  size_t decls_capacity;
+  C14NAttr *attrs;
+  size_t attrs_capacity;
+  struct {
+    XMLAtom atom;
+    const char *uri;
+  } uris[C14N_URI_CACHE];  /* XMLAtomString takes a lock */
+  bool failed;
+}C14NState;
+
+static bool C14NReserve(C14NState *st, void **items, size_t *capacity, size_t count, size_t size) {
+  if (count < *capacity) return true;
+  size_t new_capacity = *capacity ? *capacity * 2 : 16;
+  void *new_items = realloc(*items, new_capacity * size);
+  if (new_items == NULL) {
+    st->failed = true;
+    return false;
+  }
+  *items = new_items;
+  *capacity = new_capacity;
+  return true;
+}
+
+static const char *C14NURI(C14NState *st, XMLAtom atom) {
+  if (atom == 0) return "";
+  size_t slot = atom % C14N_URI_CACHE;
+  if (st->uris[slot].atom != atom) {
+    const char *uri = XMLAtomString(atom);
+    st->uris[slot].atom = atom;
+    st->uris[slot].uri = uri ? uri : "";
+  }
+  return st->uris[slot].uri;
+}
+
+/* a character of text or of an attribute value, as C14N writes it */
+static void C14NPutChar(XMLWriter *w, unsigned int cp, bool attr) {
+  switch (cp) {
+    case '&': XMLWriterPut(w, "&amp;", 5); break;
+    case '<': XMLWriterPut(w, "&lt;", 4); break;
+    case '>': if (attr) XMLWriterPutChar(w, '>'); else XMLWriterPut(w, "&gt;", 4); break;
+    case '"': if (attr) XMLWriterPut(w, "&quot;", 6); else XMLWriterPutChar(w, '"'); break;
+    case '\r': XMLWriterPut(w, "&#xD;", 5); break;
+    case '\t': if (attr) XMLWriterPut(w, "&#x9;", 5); else XMLWriterPutChar(w, '\t'); break;
+    case '\n': if (attr) XMLWriterPut(w, "&#xA;", 5); else XMLWriterPutChar(w, '\n'); break;
+    default: XMLPutUTF8(w, cp); break;
+  }
+}
+
+/* `len` bytes of text or of an attribute value as stored(`literal`: CDATA content, without
+ * references). Runs which need nothing are copied at once.
+ * */
+static void C14NPutValue(XMLWriter *w, const char *s, size_t len, bool attr, bool literal) {
+  const unsigned char mask = attr ? C14N_ATTR : C14N_TEXT;
+  size_t i = 0, run = 0;
+  while (i < len) {
+    unsigned char c = (unsigned char)s[i];
+    if (!(c14n_special[c] & mask)) {
+      i++;
+      continue;
+    }
+    XMLWriterPut(w, s + run, i - run);
+    unsigned int cp = 0;
+    size_t n = 0;
+    if (c == '&' && !literal && (n = XMLReference(s + i, len - i, &cp)) > 0) {
+      C14NPutChar(w, cp, attr);
+      i += n;
+    } else if (c == '\r' || (attr && (c == '\t' || c == '\n'))) { /* line ends are `\n`, then values turn blanks into spaces */
+      if (c == '\r' && i + 1 < len && s[i + 1] == '\n') i++;
+      XMLWriterPutChar(w, attr ? ' ' : '\n');
+      i++;
+    } else {
+      C14NPutChar(w, c, attr);
+      i++;
+    }
+    run = i;
+  }
+  XMLWriterPut(w, s + run, i - run);
+}
+
+/* comment or PI data: only the line ends change */
+static void C14NPutLines(XMLWriter *w, const char *s, size_t len) {
+  const char *end = s + len;
+  const char *cr;
+  while ((cr = (const char *)memchr(s, '\r', (size_t)(end - s))) != NULL) {
+    XMLWriterPut(w, s, (size_t)(cr - s));
+    XMLWriterPutChar(w, '\n');
+    s = cr + 1 < end && cr[1] == '\n' ? cr + 2 : cr + 1;
+  }
+  XMLWriterPut(w, s, (size_t)(end - s));
+}
+
+/* `<?target data?>`: one space between target and data, none if there is no data. False for the XML declaration. */
+static bool C14NPutPI(XMLWriter *w, const char *pi, size_t len) {
+  if (len < 4) return false;
+  const char *target = pi + 2, *end = pi + len - 2;
+  const char *p = target;
+  while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+  if (p - target == 3 && memcmp(target, "xml", 3) == 0) return false;
+
+  XMLWriterPut(w, pi, (size_t)(p - pi));
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+  if (p < end) {
+    XMLWriterPutChar(w, ' ');
+    C14NPutLines(w, p, (size_t)(end - p));
+  }
+  XMLWriterPut(w, "?>", 2);
+  return true;
+}
+
+static bool C14NIsDeclaration(const char *key) {
+  return key[0] == 'x' && strncmp(key, "xmlns", 5) == 0 && (key[5] == '\0' || key[5] == ':');
+}
+
+/* URI of `prefix` where the output is, "" if none */
+static const char *C14NRenderedURI(const C14NState *st, const char *prefix) {
+  for (size_t i = st->rendered_count; i > 0; --i) {
+    if (strcmp(st->rendered[i - 1].prefix, prefix) == 0) return st->rendered[i - 1].uri;
+  }
+  return "";
+}
+
+static int C14NAttrCompare(const void *pa, const void *pb) {
+  const C14NAttr *a = (const C14NAttr *)pa, *b = (const C14NAttr *)pb;
+  if (a->ns != b->ns) {
+    int c = strcmp(a->uri, b->uri);
+    if (c != 0) return c;
+  }
+  return strcmp(a->local, b->local);
+}
+
+/* attribute lists are short: insertion sort, qsort past that */
+static void C14NSortAttrs(C14NAttr *attrs, size_t count) {
+  if (count > 16) {
+    qsort(attrs, count, sizeof(C14NAttr), C14NAttrCompare);
+    return;
+  }
+  for (size_t i = 1; i < count; ++i) {
+    C14NAttr attr = attrs[i];
+    size_t j = i;
+    while (j > 0 && C14NAttrCompare(&attrs[j - 1], &attr) > 0) {
+      attrs[j] = attrs[j - 1];
+      j--;
+    }
+    attrs[j] = attr;
+  }
+}
+
+static void C14NSortNamespaces(C14NNamespace *decls, size_t count) {
+  for (size_t i = 1; i < count; ++i) {
+    C14NNamespace decl = decls[i];
+    size_t j = i;
+    while (j > 0 && strcmp(decls[j - 1].prefix, decl.prefix) > 0) {
+      decls[j] = decls[j - 1];
+      j--;
+    }
+    decls[j] = decl;
+  }
+}
+
+/* the declarations `node` must write. The apex of a subset also writes the ones it inherits. */
+static size_t C14NNamespaces(C14NState *st, const XMLNode *node, bool apex) {
+  size_t count = 0;
+  for (const XMLNode *n = node; n; n = apex ? n->parent : NULL) {
+    for (size_t i = 0; i < n->attrList.count; ++i) {
+      const XMLAttr *attr = &n->attrList.attrs[i];
+      if (!C14NIsDeclaration(attr->key)) continue;
+      const char *prefix = attr->key[5] == ':' ? attr->key + 6 : "";
+      size_t j = 0;
+      while (j < count && strcmp(st->decls[j].prefix, prefix) != 0) j++;
+      if (j < count) continue; /* declared closer to `node` */
+      if (!C14NReserve(st, (void **)&st->decls, &st->decls_capacity, count, sizeof(C14NNamespace))) return 0;
+      st->decls[count].prefix = prefix;
+      st->decls[count++].uri = attr->value;
+    }
+  }
+
+  /* what is in scope already isn't written again */
+  size_t kept = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (strcmp(C14NRenderedURI(st, st->decls[i].prefix), st->decls[i].uri) != 0) st->decls[kept++] = st->decls[i];
+  }
+  C14NSortNamespaces(st->decls, kept);
+  return kept;
+}
+
+/* the attributes of `node`, sorted. The apex of a subset also gets the `xml:*` ones it inherits. */
+static size_t C14NAttributes(C14NState *st, const XMLNode *node, bool apex) {
+  size_t count = 0;
+  for (const XMLNode *n = node; n; n = apex ? n->parent : NULL) {
+    for (size_t i = 0; i < n->attrList.count; ++i) {
+      const XMLAttr *attr = &n->attrList.attrs[i];
+      if (C14NIsDeclaration(attr->key)) continue;
+      if (n != node) {
+        if (strncmp(attr->key, "xml:", 4) != 0) continue;
+        size_t j = 0;
+        while (j < count && strcmp(st->attrs[j].attr->key, attr->key) != 0) j++;
+        if (j < count) continue;
+      }
+      if (!C14NReserve(st, (void **)&st->attrs, &st->attrs_capacity, count, sizeof(C14NAttr))) return 0;
+      const char *colon = attr->ns ? strchr(attr->key, ':') : NULL;
+      C14NAttr *out = &st->attrs[count++];
+      out->ns = attr->ns;
+      out->uri = C14NURI(st, attr->ns);
+      out->local = colon ? colon + 1 : attr->key;
+      out->attr = attr;
+    }
+  }
+  C14NSortAttrs(st->attrs, count);
+  return count;
+}
+
+static void C14NNode(C14NState *st, XMLNode *node, bool apex);
+
+/* the start tag of `node`: the declarations it writes stay rendered until the caller drops them */
+static void C14NStartTag(C14NState *st, XMLNode *node, bool apex) {
+  XMLWriter *w = st->w;
+
+  XMLWriterPutChar(w, '<');
+  XMLWriterPut(w, node->name, strlen(node->name));
+
+  size_t decls = C14NNamespaces(st, node, apex);
+  for (size_t i = 0; i < decls; ++i) {
+    const C14NNamespace *decl = &st->decls[i];
+    if (decl->prefix[0]) {
+      XMLWriterPut(w, " xmlns:", 7);
+      XMLWriterPut(w, decl->prefix, strlen(decl->prefix));
+    } else {
+      XMLWriterPut(w, " xmlns", 6);
+    }
+    XMLWriterPut(w, "=\"", 2);
+    C14NPutValue(w, decl->uri, strlen(decl->uri), true, false);
+    XMLWriterPutChar(w, '"');
+    if (C14NReserve(st, (void **)&st->rendered, &st->rendered_capacity, st->rendered_count, sizeof(C14NNamespace))) {
+      st->rendered[st->rendered_count++] = *decl;
+    }
+  }
+
+  size_t attrs = C14NAttributes(st, node, apex);
+  for (size_t i = 0; i < attrs; ++i) {
+    const XMLAttr *attr = st->attrs[i].attr;
+    XMLWriterPutChar(w, ' ');
+    XMLWriterPut(w, attr->key, strlen(attr->key));
+    XMLWriterPut(w, "=\"", 2);
+    C14NPutValue(w, attr->value, strlen(attr->value), true, false);
+    XMLWriterPutChar(w, '"');
+  }
+  XMLWriterPutChar(w, '>');
+}
+
+static void C14NEndTag(XMLWriter *w, const XMLNode *node) {
+  XMLWriterPut(w, "</", 2);
+  XMLWriterPut(w, node->name, strlen(node->name));
+  XMLWriterPutChar(w, '>');
+}
+
+/* from the tree: the text of an element before its children */
+static void C14NElement(C14NState *st, XMLNode *node, bool apex) {
+  size_t mark = st->rendered_count;
+
+  XMLNodeExpand(node);
+  C14NStartTag(st, node, apex);
+  if (node->text) {
+    size_t len = strlen(node->text);
+    if (node->type == NT_CDATA && len >= 12 && strncmp(node->text, "<![CDATA[", 9) == 0) {
+      C14NPutValue(st->w, node->text + 9, len - 12, false, true);
+    } else {
+      C14NPutValue(st->w, node->text, len, false, false);
+    }
+  }
+  for (size_t i = 0; i < node->children.count; ++i) C14NNode(st, node->children.nodes[i], false);
+  C14NEndTag(st->w, node);
+  st->rendered_count = mark;
+}
+
+static void C14NNode(C14NState *st, XMLNode *node, bool apex) {
+  switch (node->type) {
+    case NT_COMMENT: /* `<!--...-->` */
+      if (st->comments) C14NPutLines(st->w, node->name, strlen(node->name));
+      break;
+    case NT_PI:
+      C14NPutPI(st->w, node->name, strlen(node->name));
+      break;
+    case NT_DOCTYPE:
+      break;
+    default:
+      C14NElement(st, node, apex);
+      break;
+  }
+}
+
+/* From `contents`: the tree, as parsed, gives the tags and the source gives the character data
+ * between them, so mixed content and whitespace keep their place.
+ * */
+static bool C14NHasSource(const XMLDocument *doc) {
+  return doc && doc->contents && doc->snapshot == NULL && doc->error.code == XML_OK &&
+         doc->parsed_generation == doc->generation;
+}
+
+static bool C14NIsElement(const XMLNode *node) {
+  return node->type != NT_COMMENT && node->type != NT_PI && node->type != NT_DOCTYPE;
+}
+
+/* offset just after the markup at `at`(a `<`) of `src`, null terminated at `len`. 0 if it doesn't end. */
+static size_t C14NMarkupEnd(const char *src, size_t len, size_t at) {
+  const char *end = src + len, *p = src + at, *q = NULL;
+  if (len - at >= 4 && !strncmp(p, "<!--", 4)) {
+    q = strstr(p + 4, "-->");
+    return q ? (size_t)(q + 3 - src) : 0;
+  }
+  if (len - at >= 9 && !strncmp(p, "<![CDATA[", 9)) {
+    q = strstr(p + 9, "]]>");
+    return q ? (size_t)(q + 3 - src) : 0;
+  }
+  if (len - at >= 2 && p[1] == '?') {
+    q = strstr(p + 2, "?>");
+    return q ? (size_t)(q + 2 - src) : 0;
+  }
+  if (len - at >= 2 && p[1] == '!') { /* DOCTYPE, as `read_doctype` */
+    bool bracket = false;
+    for (q = p; q < end; ++q) {
+      if (*q == '[') bracket = true;
+      if (bracket ? (q + 1 < end && q[0] == ']' && q[1] == '>') : *q == '>') return (size_t)(q - src) + (bracket ? 2 : 1);
+    }
+    return 0;
+  }
+  for (q = p + 1; q < end && *q != '>'; ++q) { /* a tag: up to the `>` outside of quoted values */
+    if (*q == '"' || *q == '\'') {
+      q = memchr(q + 1, *q, (size_t)(end - q - 1));
+      if (q == NULL) return 0;
+    }
+  }
+  return q < end ? (size_t)(q + 1 - src) : 0;
+}
+
+/* the tag at `at` names `node` */
+static bool C14NTagIs(const char *src, size_t len, size_t at, const XMLNode *node) {
+  size_t name_len = strlen(node->name);
+  const char *name = src + at + 1;
+  if (len - at < name_len + 2 || memcmp(name, node->name, name_len) != 0) return false;
+  char c = name[name_len];
+  return c == '>' || c == '/' || c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* comment, PI or CDATA section at [at, end) of `src`. False for anything else. */
+static bool C14NSourceMarkup(C14NState *st, const char *src, size_t at, size_t end) {
+  if (!strncmp(src + at, "<!--", 4)) {
+    if (st->comments) C14NPutLines(st->w, src + at, end - at);
+  } else if (!strncmp(src + at, "<![CDATA[", 9)) {
+    C14NPutValue(st->w, src + at + 9, end - at - 12, false, true);
+  } else if (src[at + 1] == '?') {
+    C14NPutPI(st->w, src + at, end - at);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/* `node`, whose start tag is at `at`. Returns the offset after its end tag, 0 if `src` and the tree disagree. */
+static size_t C14NSourceElement(C14NState *st, XMLNode *node, const char *src, size_t len, size_t at, bool apex) {
+  size_t mark = st->rendered_count;
+  size_t end = C14NMarkupEnd(src, len, at);
+  if (end == 0 || !C14NTagIs(src, len, at, node)) return 0;
+
+  C14NStartTag(st, node, apex);
+  if (src[end - 2] != '/') {
+    XMLNodeExpand(node);
+    size_t child = 0;
+    while (true) {
+      const char *lt = (const char *)memchr(src + end, '<', len - end);
+      if (lt == NULL) return 0;
+      size_t tag = (size_t)(lt - src);
+      C14NPutValue(st->w, src + end, tag - end, false, false);
+      if (tag + 1 < len && src[tag + 1] == '/') {
+        if ((end = C14NMarkupEnd(src, len, tag)) == 0) return 0;
+        break;
+      }
+      if (tag + 1 < len && (src[tag + 1] == '!' || src[tag + 1] == '?')) {
+        if ((end = C14NMarkupEnd(src, len, tag)) == 0 || !C14NSourceMarkup(st, src, tag, end)) return 0;
+        continue;
+      }
+      while (child < node->children.count && !C14NIsElement(node->children.nodes[child])) child++;
+      if (child == node->children.count) return 0;
+      if ((end = C14NSourceElement(st, node->children.nodes[child++], src, len, tag, false)) == 0) return 0;
+    }
+  }
+  C14NEndTag(st->w, node);
+  st->rendered_count = mark;
+  return end;
+}
+
+/* where the start tag of `node` is: from the root down, counting element children. C14N_NOT_FOUND if it isn't. */
+#define C14N_NOT_FOUND ((size_t)-1)
+
+static size_t C14NSourceFind(const XMLDocument *doc, const XMLNode *node, size_t len) {
+  const char *src = doc->contents;
+  size_t at = 0, end = 0, index = 0;
+  if (node == doc->root) { /* the first tag after the prolog */
+    while (true) {
+      const char *lt = (const char *)memchr(src + end, '<', len - end);
+      if (lt == NULL) return C14N_NOT_FOUND;
+      at = (size_t)(lt - src);
+      if (at + 1 < len && src[at + 1] != '!' && src[at + 1] != '?') return at;
+      if ((end = C14NMarkupEnd(src, len, at)) == 0) return C14N_NOT_FOUND;
+    }
+  }
+  if (node->parent == NULL || (at = C14NSourceFind(doc, node->parent, len)) == C14N_NOT_FOUND) return C14N_NOT_FOUND;
+
+  for (size_t i = 0; i < node->parent->children.count && node->parent->children.nodes[i] != node; ++i) {
+    if (C14NIsElement(node->parent->children.nodes[i])) index++;
+  }
+  if ((end = C14NMarkupEnd(src, len, at)) == 0 || src[end - 2] == '/') return C14N_NOT_FOUND;
+  while (true) { /* the parent's content up to its `index`th element */
+    const char *lt = (const char *)memchr(src + end, '<', len - end);
+    if (lt == NULL) return C14N_NOT_FOUND;
+    at = (size_t)(lt - src);
+    if ((at + 1 < len && src[at + 1] == '/') || (end = C14NMarkupEnd(src, len, at)) == 0) return C14N_NOT_FOUND;
+    if (src[at + 1] == '!' || src[at + 1] == '?') continue;
+    if (index-- == 0) return at;
+    if (src[end - 2] != '/') {
+      int skipped = lexer_skip_element(src, (int)len, (int)end);
+      if (skipped < 0) return C14N_NOT_FOUND;
+      end = (size_t)skipped;
+    }
+  }
+}
+
+/* the document from `contents`: nodes before the root end with a line feed, the ones after it start with one */
+static bool C14NSourceDocument(C14NState *st, const XMLDocument *doc) {
+  const char *src = doc->contents;
+  size_t len = strlen(src), end = 0;
+  bool after = false;
+  while (true) {
+    const char *lt = (const char *)memchr(src + end, '<', len - end);
+    if (lt == NULL) return true;
+    size_t at = (size_t)(lt - src);
+    if (at + 1 < len && src[at + 1] != '!' && src[at + 1] != '?') {
+      if (after || (end = C14NSourceElement(st, doc->root, src, len, at, true)) == 0) return false;
+      after = true;
+      continue;
+    }
+    if ((end = C14NMarkupEnd(src, len, at)) == 0) return false;
+    bool written = false;
+    if (src[at + 1] == '?') {
+      if (after) XMLWriterPutChar(st->w, '\n');
+      written = C14NPutPI(st->w, src + at, end - at);
+    } else if (!strncmp(src + at, "<!--", 4) && st->comments) {
+      if (after) XMLWriterPutChar(st->w, '\n');
+      C14NPutLines(st->w, src + at, end - at);
+      written = true;
+    }
+    if (written && !after) XMLWriterPutChar(st->w, '\n');
+  }
+}
+
+static void C14NStateInit(C14NState *st, XMLWriter *w, bool with_comments) {
+  memset(st, 0, sizeof(C14NState));
+  st->w = w;
+  st->comments = with_comments;
+}
+
+static bool C14NStateFree(C14NState *st) {
+  free(st->rendered);
+  free(st->decls);
+  free(st->attrs);
+  return !st->failed && !st->w->failed;
+}
+
+bool XMLNodeWriteC14N(XMLWriter *w, const XMLDocument *doc, XMLNode *node, bool with_comments) {
+  C14NState st;
+  if (w == NULL || node == NULL) return false;
+  C14NStateInit(&st, w, with_comments);
+  if (C14NIsElement(node) && C14NHasSource(doc)) {
+    size_t len = strlen(doc->contents);
+    size_t at = C14NSourceFind(doc, node, len);
+    if (at == C14N_NOT_FOUND || C14NSourceElement(&st, node, doc->contents, len, at, true) == 0) st.failed = true;
+  } else {
+    C14NNode(&st, node, true);
+  }
+  return C14NStateFree(&st);
+}
+
+bool XMLDocumentWriteC14N(XMLWriter *w, const XMLDocument *doc, bool with_comments) {
+  C14NState st;
+  if (w == NULL || doc == NULL) return false;
+  C14NStateInit(&st, w, with_comments);
+  if (C14NHasSource(doc) && doc->root) {
+    if (!C14NSourceDocument(&st, doc)) st.failed = true;
+    return C14NStateFree(&st);
+  }
+
+  /* from the tree: nodes before the root element end with a line feed */
+  for (size_t i = 0; i < doc->others.count; ++i) {
+    const XMLNode *node = doc->others.nodes[i];
+    bool written = false;
+    if (node->type == NT_PI) {
+      written = C14NPutPI(w, node->name, strlen(node->name));
+    } else if (node->type == NT_COMMENT && with_comments) {
+      C14NPutLines(w, node->name, strlen(node->name));
+      written = true;
+    }
+    if (written) XMLWriterPutChar(w, '\n');
+  }
+  if (doc->root) C14NNode(&st, doc->root, true);
+  return C14NStateFree(&st);
+}
+
+/* XML to JSON */
+#define JSON_LOOKAHEAD 65536
+
+typedef struct JSONFrame {
+  const char *name;    /* in the input */
+  int name_len;
+  bool object;         /* its `{` is written */
+  size_t members;
+  size_t text;         /* where its text starts in `text` */
+  const char *run;     /* name of its last child, NULL before the first */
+  int run_len;
+  bool array;          /* the children of the run are an array: its `[` is written */
+  bool pending;        /* not known yet whether the run's first child is followed by another */
+  size_t pending_at;   /* then: where the value of that child starts, counted from the start of the output */
+  int pending_tag;     /* and the offset of its start tag in the input */
+}JSONFrame;
+
+typedef struct JSONState {
+  XMLWriter *w;
+  const char *attr_prefix, *text_key;
+  size_t lookahead;
+  const char *input;
+  int input_len;
+  lexer_t lexer;
+  JSONFrame *frames;   /* the open elements, after the document's */
+  size_t depth, frames_capacity;
+  char *hold;          /* output held back while a frame is pending */
+  size_t hold_len, hold_capacity;
+  size_t held;         /* offset of `hold` in the output */
+  size_t pending;      /* frames which are */
+  XMLWriter text;      /* text of the open elements, escaped, innermost last */
+  XMLWriter value;     /* an attribute value, escaped */
+  XMLError error;
+  bool failed;
+}JSONState;
+
+void XMLJsonOptionsInit(XMLJsonOptions *options) {
+  options->attr_prefix = "@";
+  options->text_key = "#text";
+  options->lookahead = JSON_LOOKAHEAD;
+}
+
+static void JSONPutChar(XMLWriter *w, unsigned int cp) {
+  static const char hex[] = "0123456789abcdef";
+  switch (cp) {
+    case '"': XMLWriterPut(w, "\\\"", 2); break;
+    case '\\': XMLWriterPut(w, "\\\\", 2); break;
+    case '\n': XMLWriterPut(w, "\\n", 2); break;
+    case '\r': XMLWriterPut(w, "\\r", 2); break;
+    case '\t': XMLWriterPut(w, "\\t", 2); break;
+    case '\b': XMLWriterPut(w, "\\b", 2); break;
+    case '\f': XMLWriterPut(w, "\\f", 2); break;
+    default:
+      if (cp < 0x20) {
+        char buf[6] = { '\\', 'u', '0', '0', hex[cp >> 4], hex[cp & 0xF] };
+        XMLWriterPut(w, buf, 6);
+      } else {
+        XMLPutUTF8(w, cp);
+      }
+      break;
+  }
+}
+
+/* as C14NPutValue, into the body of a JSON string */
+static void JSONPutValue(XMLWriter *w, const char *s, size_t len, bool attr, bool literal) {
+  size_t i = 0, run = 0;
+  while (i < len) {
+    unsigned char c = (unsigned char)s[i];
+    if (c >= 0x20 && c != '"' && c != '\\' && (c != '&' || literal)) {
+      i++;
+      continue;
+    }
+    XMLWriterPut(w, s + run, i - run);
+    unsigned int cp = 0;
+    size_t n = 0;
+    if (c == '&' && (n = XMLReference(s + i, len - i, &cp)) > 0) {
+      JSONPutChar(w, cp);
+      i += n;
+    } else if (c == '\r' || (attr && (c == '\t' || c == '\n'))) {
+      if (c == '\r' && i + 1 < len && s[i + 1] == '\n') i++;
+      if (attr) XMLWriterPutChar(w, ' ');
+      else XMLWriterPut(w, "\\n", 2);
+      i++;
+    } else {
+      JSONPutChar(w, c);
+      i++;
+    }
+    run = i;
+  }
+  XMLWriterPut(w, s + run, i - run);
+}
+
+static bool JSONFail(JSONState *st, XMLErrorCode code, const token_t *tok, token_type_t expected) {
+  if (st->error.code != XML_OK) return false;
+  st->error.code = code;
+  if (tok == NULL) {
+    st->error.offset = 0;
+  } else if (tok->literal >= st->input && tok->literal <= st->input + st->input_len) {
+    st->error.offset = (size_t)(tok->literal - st->input);
+  } else {
+    st->error.offset = (size_t)st->input_len; /* EOF */
+  }
+  st->error.expected = expected == TOKEN_NONE ? NULL : token_type_to_string(expected);
+  st->error.actual = tok ? token_type_to_string(tok->type) : NULL;
+  return false;
+}
+
+static size_t JSONOutermostPending(const JSONState *st) {
+  size_t i = 0;
+  while (!st->frames[i].pending) i++;
+  return i;
+}
+
+/* the run of frame `f` is an array or not: `[` goes in, and what is no longer held back goes out */
+static void JSONResolve(JSONState *st, size_t f, bool array) {
+  JSONFrame *frame = &st->frames[f];
+  if (array) {
+    size_t at = frame->pending_at - st->held;
+    if (st->hold_len == st->hold_capacity) {
+      char *hold = (char *)realloc(st->hold, st->hold_capacity * 2);
+      if (hold == NULL) {
+        st->failed = true;
+        return;
+      }
+      st->hold = hold;
+      st->hold_capacity *= 2;
+    }
+    memmove(st->hold + at + 1, st->hold + at, st->hold_len - at);
+    st->hold[at] = '[';
+    st->hold_len++;
+    for (size_t i = f + 1; i <= st->depth; ++i) {
+      if (st->frames[i].pending) st->frames[i].pending_at++;
+    }
+  }
+  frame->array = array;
+  frame->pending = false;
+  st->pending--;
+
+  for (size_t i = 0; i < f; ++i) {
+    if (st->frames[i].pending) return; /* still held back by an outer one */
+  }
+  size_t flush = st->hold_len;
+  for (size_t i = f + 1; i <= st->depth; ++i) {
+    if (st->frames[i].pending) {
+      flush = st->frames[i].pending_at - st->held;
+      break;
+    }
+  }
+  XMLWriterPut(st->w, st->hold, flush);
+  memmove(st->hold, st->hold + flush, st->hold_len - flush);
+  st->hold_len -= flush;
+  st->held += flush;
+}
+
+/* whether the next sibling of the first child of the run has the same name, from the input */
+static bool JSONScanRun(const JSONState *st, const JSONFrame *frame) {
+  int next = lexer_next_sibling(st->input, st->input_len, frame->pending_tag);
+  if (next < 0 || st->input_len - next - 1 <= frame->run_len) return false;
+  const char *name = st->input + next + 1;
+  if (memcmp(name, frame->run, frame->run_len) != 0) return false;
+  char c = name[frame->run_len];
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '/' || c == '>';
+}
+
+static void JSONPut(JSONState *st, const char *s, size_t len) {
+  while (st->pending > 0 && st->hold_len + len > st->lookahead && !st->failed) {
+    size_t f = JSONOutermostPending(st);
+    JSONResolve(st, f, JSONScanRun(st, &st->frames[f]));
+  }
+  if (st->pending == 0) {
+    XMLWriterPut(st->w, s, len);
+    st->held += len;
+    return;
+  }
+  if (st->hold_capacity - st->hold_len < len) { /* only after a `[` went in */
+    size_t capacity = st->hold_capacity * 2 + len;
+    char *hold = (char *)realloc(st->hold, capacity);
+    if (hold == NULL) {
+      st->failed = true;
+      return;
+    }
+    st->hold = hold;
+    st->hold_capacity = capacity;
+  }
+  memcpy(st->hold + st->hold_len, s, len);
+  st->hold_len += len;
+}
+
+static inline void JSONPutString(JSONState *st, const char *s) {
+  JSONPut(st, s, strlen(s));
+}
+
+/* `"prefix name":` */
+static void JSONPutKey(JSONState *st, const char *prefix, const char *name, size_t len) {
+  JSONPut(st, "\"", 1);
+  if (prefix) JSONPutString(st, prefix);
+  JSONPut(st, name, len);
+  JSONPut(st, "\":", 2);
+}
+
+/* a member of the top frame: `{` before the first, `,` between them */
+static void JSONMember(JSONState *st) {
+  JSONFrame *frame = &st->frames[st->depth];
+  if (!frame->object) {
+    JSONPut(st, "{", 1);
+    frame->object = true;
+  }
+  if (frame->members++ > 0) JSONPut(st, ",", 1);
+}
+
+static bool JSONPush(JSONState *st, const char *name, int len) {
+  if (st->depth + 1 == st->frames_capacity) {
+    size_t capacity = st->frames_capacity * 2;
+    JSONFrame *frames = (JSONFrame *)realloc(st->frames, sizeof(JSONFrame) * capacity);
+    if (frames == NULL) return false;
+    st->frames = frames;
+    st->frames_capacity = capacity;
+  }
+  JSONFrame *frame = &st->frames[++st->depth];
+  memset(frame, 0, sizeof(JSONFrame));
+  frame->name = name;
+  frame->name_len = len;
+  frame->text = st->text.len;
+  return true;
+}
+
+/* a child named `name`, whose start tag is at `tag`, in the top frame */
+static void JSONChild(JSONState *st, const char *name, int len, int tag) {
+  JSONFrame *frame = &st->frames[st->depth];
+  if (frame->run && frame->run_len == len && memcmp(frame->run, name, len) == 0) {
+    if (frame->pending) JSONResolve(st, st->depth, true);
+    JSONPut(st, ",", 1);
+    return;
+  }
+
+  if (frame->pending) JSONResolve(st, st->depth, false);
+  if (frame->array) {
+    JSONPut(st, "]", 1);
+    frame->array = false;
+  }
+  JSONMember(st);
+  JSONPutKey(st, NULL, name, len);
+  frame->run = name;
+  frame->run_len = len;
+  if (st->depth > 0) { /* the document has a single child */
+    frame->pending = true;
+    frame->pending_at = st->held + st->hold_len;
+    frame->pending_tag = tag;
+    st->pending++;
+  }
+}
+
+static void JSONEndElement(JSONState *st) {
+  JSONFrame *frame = &st->frames[st->depth];
+  const char *text = st->text.data + frame->text;
+  size_t text_len = st->text.len - frame->text;
+
+  if (frame->pending) JSONResolve(st, st->depth, false);
+  if (frame->array) JSONPut(st, "]", 1);
+  if (frame->object) {
+    if (text_len > 0) {
+      JSONPut(st, ",", 1);
+      JSONPutKey(st, NULL, st->text_key, strlen(st->text_key));
+      JSONPut(st, "\"", 1);
+      JSONPut(st, text, text_len);
+      JSONPut(st, "\"", 1);
+    }
+    JSONPut(st, "}", 1);
+  } else if (text_len > 0) {
+    JSONPut(st, "\"", 1);
+    JSONPut(st, text, text_len);
+    JSONPut(st, "\"", 1);
+  } else {
+    JSONPut(st, "null", 4);
+  }
+  st->text.len = frame->text;
+  st->depth--;
+}
+
+/* comment, PI, DOCTYPE & CDATA tokens run to the end of the input when they aren't closed */
+static bool JSONMarkupClosed(const token_t *tok) {
+  const char *end = NULL;
+  int len = 0;
+  switch (tok->type) {
+    case TOKEN_COMMENT: end = "-->"; len = 7; break;
+    case TOKEN_PI: end = "?>"; len = 4; break;
+    case TOKEN_CDATA: end = "]]>"; len = 12; break;
+    case TOKEN_DOCTYPE: end = ">"; len = 1; break;
+    default: return true;
+  }
+  int end_len = (int)strlen(end);
+  return tok->len >= len && memcmp(tok->literal + tok->len - end_len, end, end_len) == 0;
+}
+
+/* '<' name (name = "value")* ('>' | '/>') */
+static bool JSONStartTag(JSONState *st) {
+  lexer_t *lexer = &st->lexer;
+  int tag = (int)(lexer->cur_token.literal - st->input);
+  if (!lexer_expect_peek(lexer, TOKEN_NAME)) return JSONFail(st, XML_ERROR_UNEXPECTED_TOKEN, &lexer->peek_token, TOKEN_NAME);
+  JSONChild(st, lexer->cur_token.literal, lexer->cur_token.len, tag);
+  if (!JSONPush(st, lexer->cur_token.literal, lexer->cur_token.len)) return JSONFail(st, XML_ERROR_MEMORY, &lexer->cur_token, TOKEN_NONE);
+  lexer_next_token(lexer);
+
+  while (lexer_cur_token_is(lexer, TOKEN_NAME)) {
+    token_t key = lexer->cur_token;
+    if (!lexer_expect_peek(lexer, TOKEN_ASSIGN)) return JSONFail(st, XML_ERROR_UNEXPECTED_TOKEN, &lexer->peek_token, TOKEN_ASSIGN);
+    if (!lexer_expect_peek(lexer, TOKEN_STRING)) return JSONFail(st, XML_ERROR_UNEXPECTED_TOKEN, &lexer->peek_token, TOKEN_STRING);
+    st->value.len = 0;
+    JSONPutValue(&st->value, lexer->cur_token.literal, (size_t)lexer->cur_token.len, true, false);
+    JSONMember(st);
+    JSONPutKey(st, st->attr_prefix, key.literal, (size_t)key.len);
+    JSONPut(st, "\"", 1);
+    JSONPut(st, st->value.data, st->value.len);
+    JSONPut(st, "\"", 1);
+    lexer_next_token(lexer);
+  }
+  if (lexer_cur_token_is(lexer, TOKEN_CLOSESLASH_TAG)) {
+    JSONEndElement(st);
+  } else if (!lexer_cur_token_is(lexer, TOKEN_CLOSE_TAG)) {
+    return JSONFail(st, XML_ERROR_UNEXPECTED_TOKEN, &lexer->cur_token, TOKEN_CLOSE_TAG);
+  }
+  return true;
+}
+
+/* the same checks as `ValidateDocument` */
+static bool JSONDocument(JSONState *st) {
+  lexer_t *lexer = &st->lexer;
+
+  lexer_next_token(lexer);
+  lexer_next_token(lexer);
+  while (lexer_cur_token_is(lexer, TOKEN_DOCTYPE) || lexer_cur_token_is(lexer, TOKEN_COMMENT) ||
+         lexer_cur_token_is(lexer, TOKEN_CDATA) || lexer_cur_token_is(lexer, TOKEN_PI)) {
+    if (!JSONMarkupClosed(&lexer->cur_token)) return JSONFail(st, XML_ERROR_UNTERMINATED, &lexer->cur_token, TOKEN_NONE);
+    lexer_next_token(lexer);
+  }
+  if (!lexer_cur_token_is(lexer, TOKEN_OPEN_TAG)) return JSONFail(st, XML_ERROR_UNEXPECTED_TOKEN, &lexer->cur_token, TOKEN_OPEN_TAG);
+
+  do {
+    token_t *tok = &lexer->cur_token;
+    switch (tok->type) {
+      case TOKEN_OPEN_TAG:
+        if (!JSONStartTag(st)) return false;
+        break;
+      case TOKEN_OPENSLASH_TAG: {
+        if (!lexer_expect_peek(lexer, TOKEN_NAME)) return JSONFail(st, XML_ERROR_UNEXPECTED_TOKEN, &lexer->peek_token, TOKEN_NAME);
+        const JSONFrame *open = &st->frames[st->depth];
+        if (open->name_len != tok->len || memcmp(open->name, tok->literal, tok->len) != 0) {
+          return JSONFail(st, XML_ERROR_MISMATCHED_TAG, tok, TOKEN_NONE);
+        }
+        if (!lexer_expect_peek(lexer, TOKEN_CLOSE_TAG)) return JSONFail(st, XML_ERROR_UNEXPECTED_TOKEN, &lexer->peek_token, TOKEN_CLOSE_TAG);
+        JSONEndElement(st);
+        break;
+      }
+      case TOKEN_TEXT: { /* leading white space is skipped by the lexer */
+        int len = tok->len;
+        while (len > 0 && (tok->literal[len - 1] == ' ' || tok->literal[len - 1] == '\t' ||
+                           tok->literal[len - 1] == '\r' || tok->literal[len - 1] == '\n')) len--;
+        JSONPutValue(&st->text, tok->literal, (size_t)len, false, false);
+        break;
+      }
+      case TOKEN_CDATA:
+        if (!JSONMarkupClosed(tok)) return JSONFail(st, XML_ERROR_UNTERMINATED, tok, TOKEN_NONE);
+        JSONPutValue(&st->text, tok->literal + 9, (size_t)tok->len - 12, false, true);
+        break;
+      case TOKEN_COMMENT:
+        if (!JSONMarkupClosed(tok)) return JSONFail(st, XML_ERROR_UNTERMINATED, tok, TOKEN_NONE);
+        break;
+      default:
+        return JSONFail(st, XML_ERROR_UNEXPECTED_TOKEN, tok, TOKEN_NONE);
+    }
+    if (st->failed || st->text.failed || st->value.failed) return JSONFail(st, XML_ERROR_MEMORY, tok, TOKEN_NONE);
+    lexer_next_token(lexer);
+  } while (st->depth > 0);
+
+  if (!lexer_cur_token_is(lexer, TOKEN_EOF)) return JSONFail(st, XML_ERROR_TRAILING_CONTENT, &lexer->cur_token, TOKEN_EOF);
+  JSONPut(st, "}", 1);
+  return true;
+}
+
+bool XMLConvertJSON(XMLWriter *w, const char *xml, size_t len, const XMLJsonOptions *options, XMLError *error) {
+  XMLJsonOptions defaults;
+  JSONState st;
+  if (w == NULL || xml == NULL) return false;
+  if (options == NULL) {
+    XMLJsonOptionsInit(&defaults);
+    options = &defaults;
+  }
+
+  memset(&st, 0, sizeof(JSONState));
+  if (len >= 3 && memcmp(xml, "\xEF\xBB\xBF", 3) == 0) { /* byte order mark */
+    xml += 3;
+    len -= 3;
+  }
+  st.input = xml;
+  st.input_len = (int)len;
+  if (len > INT_MAX) { /* the lexer's offsets are ints */
+    JSONFail(&st, XML_ERROR_MEMORY, NULL, TOKEN_NONE);
+  } else if ((st.error.offset = XMLUTF8Validate(xml, len)) != len) {
+    st.error.code = XML_ERROR_ENCODING;
+  } else {
+    st.error.offset = 0;
+    st.w = w;
+    st.attr_prefix = options->attr_prefix ? options->attr_prefix : "";
+    st.text_key = options->text_key ? options->text_key : "#text";
+    st.lookahead = options->lookahead;
+    st.hold_capacity = options->lookahead + 1;
+    st.hold = (char *)malloc(st.hold_capacity);
+    st.frames_capacity = 16;
+    st.frames = (JSONFrame *)malloc(sizeof(JSONFrame) * st.frames_capacity);
+    XMLWriterInit(&st.text, NULL, NULL);
+    XMLWriterInit(&st.value, NULL, NULL);
+    if (st.hold == NULL || st.frames == NULL) {
+      JSONFail(&st, XML_ERROR_MEMORY, NULL, TOKEN_NONE);
+    } else {
+      memset(st.frames, 0, sizeof(JSONFrame));
+      lexer_init_len(&st.lexer, xml, (int)len, NULL);
+      lexer_set_flags(&st.lexer, LEXER_NO_POSITIONS);
+      if (JSONDocument(&st) && w->failed) st.error.code = XML_ERROR_IO;
+    }
+    free(st.hold);
+    free(st.frames);
+    XMLWriterFree(&st.text);
+    XMLWriterFree(&st.value);
+  }
+  if (error) *error = st.error;
+  return st.error.code == XML_OK;
+}
+
+bool XMLConvertJSONFile(XMLWriter *w, const char *path, const XMLJsonOptions *options, XMLError *error) {
+  struct stat sb;
+  XMLError io_error = { 0 };
+  bool ok = false;
+  int fd = open(path, O_RDONLY);
+
+  io_error.code = XML_ERROR_IO;
+  if (fd < 0 || fstat(fd, &sb) != 0) {
+    if (fd >= 0) close(fd);
+    if (error) *error = io_error;
+    return false;
+  }
+  if (sb.st_size == 0) {
+    close(fd);
+    return XMLConvertJSON(w, "", 0, options, error);
+  }
+  size_t size = (size_t)sb.st_size;
+  char *data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    if (error) *error = io_error;
+    return false;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  size_t bom = 0;
+  XMLEncoding encoding = XMLDetectEncoding(data, size, &bom);
+  if (encoding == XML_ENCODING_UTF8) {
+    ok = XMLConvertJSON(w, data, size, options, error);
+  } else {
+    char *out = NULL;
+    size_t capacity = 0, out_size = 0, error_offset = 0;
+    if (XMLTranscode(data + bom, size - bom, encoding, &out, &capacity, &out_size, &error_offset)) {
+      ok = XMLConvertJSON(w, out, out_size, options, error);
+    } else if (error) {
+      memset(error, 0, sizeof(XMLError));
+      error->code = out == NULL && encoding != XML_ENCODING_UNKNOWN ? XML_ERROR_MEMORY : XML_ERROR_ENCODING;
+      error->offset = error_offset + bom;
+    }
+    free(out);
+  }
+  munmap(data, size);
+  return ok;
+}
@@ -0,0 +1,97 @@
+#ifndef __XML_WRITER_H__
+#define __XML_WRITER_H__
+
+#include <stdio.h>
+#include <string.h>
+#include "xml_parser.h"
+
+/* Output sink of the serializers: a buffer handed to `write` each time it is full, and at
+ * XMLWriterFlush. Without `write` the buffer grows instead, and `data`/`len` end up holding
+ * the whole output. After a failed write or allocation, `failed` is set and the rest is dropped.
+ * */
+typedef bool (*XMLWriteFn)(const char *data, size_t len, void *user_data);
+
+typedef struct XMLWriter {
+  char *data;
+  size_t len;
+  size_t capacity;
+  XMLWriteFn write;  /* NULL: keep everything in `data` */
+  void *user_data;
+  bool failed;
+}XMLWriter;
+
+void XMLWriterInit(XMLWriter *w, XMLWriteFn write, void *user_data);
+/* write into `fp` */
+void XMLWriterInitFile(XMLWriter *w, FILE *fp);
+/* Hand what is buffered to `write`(nothing to do without one). Returns false if anything failed. */
+bool XMLWriterFlush(XMLWriter *w);
+/* Flush, then free the buffer. Returns false if anything failed. */
+bool XMLWriterFree(XMLWriter *w);
+
+/* slow path of XMLWriterPut: the buffer is full */
+bool XMLWriterPutSlow(XMLWriter *w, const char *data, size_t len);
+
+static inline bool XMLWriterPut(XMLWriter *w, const char *data, size_t len) {
+  if (len == 0) return true; /* `w->data` may be NULL still, memcpy must not see it */
+  if (w->capacity - w->len < len) return XMLWriterPutSlow(w, data, len);
+  memcpy(w->data + w->len, data, len);
+  w->len += len;
+  return true;
+}
+
+static inline bool XMLWriterPutChar(XMLWriter *w, char ch) {
+  if (w->len == w->capacity) return XMLWriterPutSlow(w, &ch, 1);
+  w->data[w->len++] = ch;
+  return true;
+}
+
+/* Canonical XML 1.0(inclusive, https://www.w3.org/TR/xml-c14n) of a document, or of the subtree
+ * of `node` as a document subset: namespace declarations sorted by prefix and written only where
+ * they change what is in scope, attributes sorted by namespace URI then local name, empty elements
+ * as start & end tags, references replaced, CDATA sections as escaped text, attribute values
+ * normalized and line ends as `\n`. Comments are kept if `with_comments`. The XML declaration and
+ * the DOCTYPE are dropped, and no DTD is applied(default attributes, typed normalization).
+ * While the tree is the one parsed from `doc->contents`(not edited since), the character data
+ * comes from `contents`: mixed content and whitespace are written in document order, as are
+ * comments & PIs after the root. Otherwise(an edited tree, a snapshot, `doc` NULL for a node)
+ * only the tree is written, in which an element has one text, written before its children.
+ * Returns false if the writer failed, or if `contents` doesn't match the tree.
+ * */
+bool XMLDocumentWriteC14N(XMLWriter *w, const XMLDocument *doc, bool with_comments);
+bool XMLNodeWriteC14N(XMLWriter *w, const XMLDocument *doc, XMLNode *node, bool with_comments);
+
+/* XML to JSON, straight from the lexer's tokens(no tree is built):
+ *
+ *   <feed id="1"><entry>a</entry><entry>b</entry><note/></feed>
+ *   {"feed":{"@id":"1","entry":["a","b"],"note":null}}
+ *
+ * The document is an object with the root as its only member. An element with attributes or
+ * children is an object: attributes as `attr_prefix` + name, children by name, and its text as
+ * `text_key`. An element with only text is a string, an empty element is null. Consecutive
+ * children with the same name are an array. Other repeats are not grouped: they are written as
+ * repeated members, e.g. {"a":{"b":null,"c":null,"b":null}}.
+ * Values are strings with references replaced; text is trimmed, the pieces of mixed content
+ * are joined, CDATA is text. Comments, PIs & the DOCTYPE are dropped, names are written as is.
+ *
+ * Whether a child starts an array is known at its next sibling, so output is held back meanwhile,
+ * at most `lookahead` bytes: past that, the input is scanned ahead for the sibling instead.
+ * The input is read in place, so it must be in memory(a file is mapped, or converted whole if it is
+ * not UTF-8). Besides it, memory is this buffer plus a frame per open element and their text.
+ * */
+typedef struct XMLJsonOptions {
+  const char *attr_prefix; /* "@" */
+  const char *text_key;    /* "#text" */
+  size_t lookahead;        /* 64KB */
+}XMLJsonOptions;
+
+void XMLJsonOptionsInit(XMLJsonOptions *options);
+
+/* Convert `len` bytes of UTF-8 `xml`. `options`: NULL for the defaults.
+ * Returns false if the input is not well-formed(see `error`, which may be NULL), or if the
+ * writer failed(XML_ERROR_IO); what was written is then incomplete.
+ * */
+bool XMLConvertJSON(XMLWriter *w, const char *xml, size_t len, const XMLJsonOptions *options, XMLError *error);
+/* the file is mapped, or converted to UTF-8 first if it is in another encoding */
+bool XMLConvertJSONFile(XMLWriter *w, const char *path, const XMLJsonOptions *options, XMLError *error);
+
+#endif
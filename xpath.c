@@ -3,6 +3,10 @@
 #include <string.h>
 #include <stdbool.h>
 #include "xpath.h"
+#include "xml_thread.h"
+
+/* Below this many nodes in the frontier, `//name` is not worth splitting further */
+#define XPATH_PARALLEL_TASKS_PER_THREAD 8
 
 typedef enum Action {
     SELECT_PARENT,                     // /..                select parent node
@@ -107,13 +111,22 @@ static const char *action_to_str(Action action) {
   }
 }
 
+/* append `str` to `out`(a XPathResult.text), truncating instead of overflowing */
+static void xpath_append_text(char *out, const char *str) {
+  size_t len = strlen(out);
+  size_t size = sizeof(((XPathResult *)0)->text);
+  if (str == NULL || len + 1 >= size) return;
+  snprintf(out + len, size - len, "%s", str);
+}
+
 /* //text() */
 static void xpath_select_texts_from_child(XMLNode *node, char *out) {
+  XMLNodeExpand(node);
   for (size_t i = 0; i < node->children.count; ++i) {
     XMLNode *child = node->children.nodes[i];
     if (child->text == NULL) continue;
-    strcat(out, child->text);
-    strcat(out, " ");
+    xpath_append_text(out, child->text);
+    xpath_append_text(out, " ");
   }
 }
 
@@ -137,6 +150,7 @@ static XMLNode *xpath_select_node_by_attrValue_and_name(const char* name, XMLNod
   strncpy(value_name, equal_idx + 1, r_idx - equal_idx - 1);
   strncpy(node_name, name, l_idx-name);
 
+  XMLNodeExpand(node);
   for (size_t i = 0; i < node->children.count; ++i) {
     XMLNode *child = node->children.nodes[i];
     if (strcmp(child->name, node_name) == 0) {
@@ -164,6 +178,7 @@ static XMLNode *xpath_select_node_by_attr_and_name(const char *name, XMLNode *no
   strncpy(attr_name, at_idx + 1, r_idx - at_idx - 1);
   strncpy(node_name, name, l_idx-name);
 
+  XMLNodeExpand(node);
   for (size_t i = 0; i < node->children.count; ++i) {
     XMLNode *child = node->children.nodes[i];
     if (strcmp(child->name, node_name) == 0) {
@@ -192,6 +207,7 @@ static XMLNode *xpath_select_node_by_array_and_name(const char *name, XMLNode *n
   int j = atoi(str_idx);
   strncpy(attr_name, name, l_idx-name);
 
+  XMLNodeExpand(node);
   for (size_t i = 0; i < node->children.count; ++i) {
     XMLNode *child = node->children.nodes[i];
     if (strcmp(child->name, attr_name) == 0) {
@@ -204,6 +220,7 @@ static XMLNode *xpath_select_node_by_array_and_name(const char *name, XMLNode *n
 /* /name */
 static XMLNode *xpath_select_node_first_child(const char *name, XMLNode *node) {
   if (strcmp(node->name, name) == 0) return node;
+  XMLNodeExpand(node);
   if (node->children.count == 0) return NULL;
   for (size_t i = 0; i < node->children.count; ++i) {
     XMLNode *child = node->children.nodes[i];
@@ -218,11 +235,11 @@ static void xpath_select_attr_from_this(const char *name, XMLNode *node, char *o
   char attr_name[64] = { 0 };
 
   at_idx = strstr(name, "@");
-  strcpy(attr_name, at_idx + 1);
+  snprintf(attr_name, sizeof(attr_name), "%s", at_idx + 1);
   for (size_t i = 0; i < node->attrList.count; ++i) {
     XMLAttr attr = node->attrList.attrs[i];
     if (strcmp(attr.key, name) == 0) {
-      strncpy(out, attr.value, strlen(attr.value));
+      xpath_append_text(out, attr.value);
       return;
     }
   }
@@ -236,52 +253,114 @@ static void xpath_select_node_all_descendants(const char *name, XMLNode *node, X
     return;
   }
 
+  XMLNodeExpand(node);
   for (size_t i = 0; i < node->children.count; ++i) {
     XMLNode *child = node->children.nodes[i];
     xpath_select_node_all_descendants(name, child, list);
   }
 }
 
+/* one subtree of a parallel `//name` */
+typedef struct DescendantTasks {
+  const char *name;
+  XMLNodeList frontier; /* subtree roots, in document order */
+  XMLNodeList *results; /* results[i]: matches under frontier[i] */
+}DescendantTasks;
+
+static void xpath_descendants_task(size_t index, void *user_data) {
+  DescendantTasks *tasks = (DescendantTasks *)user_data;
+  xpath_select_node_all_descendants(tasks->name, tasks->frontier.nodes[index], &tasks->results[index]);
+}
+
+/* //name, spread over `threads` threads.
+ * The subtree is cut into a frontier of disjoint subtrees: a node which doesn't match is replaced by
+ * its children, level by level, until there are enough tasks. Every task walks its subtree like the
+ * serial version, and the results are appended in frontier order, which is document order.
+ * */
+static void xpath_select_node_all_descendants_parallel(const char *name, XMLNode *node, XMLNodeList *list, int threads) {
+  DescendantTasks tasks = { 0 };
+  size_t wanted = (size_t)threads * XPATH_PARALLEL_TASKS_PER_THREAD;
+
+  tasks.name = name;
+  XMLNodeListInit(&tasks.frontier);
+  XMLNodeListAdd(&tasks.frontier, node);
+
+  bool expanded = true;
+  while (tasks.frontier.count < wanted && expanded) {
+    XMLNodeList next = { 0 };
+    XMLNodeListInit(&next);
+    expanded = false;
+    for (size_t i = 0; i < tasks.frontier.count; ++i) {
+      XMLNode *n = tasks.frontier.nodes[i];
+      if (strcmp(n->name, name) == 0) { /* a match stops the walk, keep it as it is */
+        XMLNodeListAdd(&next, n);
+      } else if (XMLNodeChildrenCount(n) > 0) {
+        for (size_t j = 0; j < n->children.count; ++j) XMLNodeListAdd(&next, n->children.nodes[j]);
+        expanded = true;
+      }
+    }
+    free(tasks.frontier.nodes);
+    tasks.frontier = next;
+  }
+
+  tasks.results = (XMLNodeList *)malloc(sizeof(XMLNodeList) * tasks.frontier.count);
+  if (tasks.results == NULL) {
+    for (size_t i = 0; i < tasks.frontier.count; ++i) xpath_select_node_all_descendants(name, tasks.frontier.nodes[i], list);
+    free(tasks.frontier.nodes);
+    return;
+  }
+  for (size_t i = 0; i < tasks.frontier.count; ++i) XMLNodeListInit(&tasks.results[i]);
+
+  XMLParallelFor(tasks.frontier.count, threads, xpath_descendants_task, &tasks);
+
+  for (size_t i = 0; i < tasks.frontier.count; ++i) {
+    XMLNodeListAddList(list, &tasks.results[i]);
+    free(tasks.results[i].nodes);
+  }
+  free(tasks.results);
+  free(tasks.frontier.nodes);
+}
+
 static pair_t* parse_sub_path(const char *op) {
   pair_t *ret = malloc(sizeof(pair_t));
   if (strstr(op, "//") != NULL) {
     if (strstr(op, "text()") != NULL) {
       ret->first = SELECT_TEXTS_FROM_CHILD;
-      strcpy(ret->second, op+2);
+      snprintf(ret->second, sizeof(ret->second), "%s", op+2);
     } else {
       ret->first = SELECT_NODE_ALL_DESC;
-      strcpy(ret->second, op+2);
+      snprintf(ret->second, sizeof(ret->second), "%s", op+2);
     }
   } else {
     //å–å­ä»£
     if (strstr(op, "..") != NULL) {
       ret->first = SELECT_PARENT;
-      strcpy(ret->second, "");
+      ret->second[0] = '\0';
     } else if (strstr(op, ".") != NULL) {
       ret->first = SELECT_THIS;
-      strcpy(ret->second, "");
+      ret->second[0] = '\0';
     } else if (strstr(op, "[") != NULL) {
       if (strstr(op, "@") != NULL) {
         if (strstr(op, "=") != NULL) {
           ret->first = SELECT_NODE_BY_ATTRVALUE_AND_NAME;
-          strcpy(ret->second, op+1);
+          snprintf(ret->second, sizeof(ret->second), "%s", op+1);
         } else {
           ret->first = SELECT_NODE_BY_ATTR_AND_NAME;
-          strcpy(ret->second, op+1);
+          snprintf(ret->second, sizeof(ret->second), "%s", op+1);
         }
       } else {
         ret->first = SELECT_NODE_BY_ARRAY_AND_NAME;
-        strcpy(ret->second, op+1);
+        snprintf(ret->second, sizeof(ret->second), "%s", op+1);
       }
     } else if (strstr(op, "@") != NULL) {
       ret->first = SELECT_ATTR;
-      strcpy(ret->second, op+1);
+      snprintf(ret->second, sizeof(ret->second), "%s", op+1);
     } else if (strstr(op, "text()") != NULL) {
       ret->first = SELECT_TEXT;
-      strcpy(ret->second, op+1);
+      snprintf(ret->second, sizeof(ret->second), "%s", op+1);
     } else {
       ret->first = SELECT_NODE_FIRST_CHILD;
-      strcpy(ret->second, op+1);
+      snprintf(ret->second, sizeof(ret->second), "%s", op+1);
     }
   }
 #ifdef DEBUG
@@ -303,7 +382,7 @@ static void parse_path(optionList *options, const char *exp) {
         r++;
       }
       char sub_option[256] = { 0 };
-      strncpy(sub_option, exp+l, r-l);
+      snprintf(sub_option, sizeof(sub_option), "%.*s", r - l, exp + l);
       optionListAdd(options, parse_sub_path(sub_option));
     }
     len = r;
@@ -311,7 +390,7 @@ static void parse_path(optionList *options, const char *exp) {
   }
 }
 
-static bool execute(optionList *options, XMLNode *node, XPathResult *ret) {
+static bool execute(optionList *options, XMLNode *node, XPathResult *ret, int threads) {
   XMLNode *n = node;
   for (size_t i = 0; i < options->count; ++i) {
     pair_t *pair = options->pairs[i];
@@ -329,7 +408,8 @@ static bool execute(optionList *options, XMLNode *node, XPathResult *ret) {
 	ret->isMulti = false;
         break;
       case SELECT_NODE_ALL_DESC:
-        xpath_select_node_all_descendants(name, n, &ret->nodes);
+        if (threads > 1) xpath_select_node_all_descendants_parallel(name, n, &ret->nodes, threads);
+        else             xpath_select_node_all_descendants(name, n, &ret->nodes);
 	ret->isMulti = true;
 	break;
       case SELECT_NODE_FIRST_CHILD:
@@ -357,7 +437,7 @@ static bool execute(optionList *options, XMLNode *node, XPathResult *ret) {
         ret->node = n;
         break;
       case SELECT_TEXT:
-        strcpy(ret->text, n->text);
+        xpath_append_text(ret->text, n->text);
 	ret->isMulti = false;
         return true;
       case SELECT_TEXTS_FROM_CHILD:
@@ -375,7 +455,7 @@ static bool execute(optionList *options, XMLNode *node, XPathResult *ret) {
   return true;
 }
 
-XPathResult xpath(const char *path, XMLNode *node) {
+static XPathResult xpath_internal(const char *path, XMLNode *node, int threads) {
   //char *_path = NULL;
   optionList options = { 0 };
   XPathResult ret = { 0 };
@@ -385,14 +465,26 @@ XPathResult xpath(const char *path, XMLNode *node) {
 
   parse_path(&options, path);
 
-  bool result = execute(&options, node, &ret);
-  if (!result) memset(&ret, 0x00, sizeof(ret));
+  bool result = execute(&options, node, &ret, threads);
+  if (!result) {
+    xpath_free(&ret);
+    memset(&ret, 0x00, sizeof(ret));
+  }
 
   optionListFree(&options);
 
   return ret;
 }
 
+XPathResult xpath(const char *path, XMLNode *node) {
+  return xpath_internal(path, node, 1);
+}
+
+XPathResult xpath_parallel(const char *path, XMLNode *node, int threads) {
+  if (threads <= 0) threads = XMLThreadCount();
+  return xpath_internal(path, node, threads);
+}
+
 void xpath_free(XPathResult *path_result) {
   if (path_result == NULL) return;
   if (path_result->nodes.nodes) {
@@ -18,5 +18,114 @@ typedef struct XPathResult {
 }XPathResult;
 
  XPathResult xpath(const char *path, XMLNode *root);
+ /* same as `xpath`, but `//name` steps are evaluated on `threads` threads
+  * (0: one per CPU). The result is identical, in document order.
+  * Only the `//name` search itself is split: the other steps of the path run on the calling
+  * thread, and the XPath 1.0 expressions below(xpath_evaluate) have no parallel mode.
+  * */
+ XPathResult xpath_parallel(const char *path, XMLNode *root, int threads);
  void xpath_free(XPathResult *path_result);
+
+/******************************************************************************
+ * XPath 1.0 expressions
+ *
+ * Compile once with `xpath_compile`, evaluate many times with `xpath_evaluate`.
+ * Supported: location paths with the child, descendant, descendant-or-self, self,
+ * parent, ancestor, ancestor-or-self, following-sibling, preceding-sibling,
+ * following, preceding and attribute axes (and the `//`, `.`, `..`, `@` abbreviations),
+ * name/`*`/text()/node()/comment() tests, predicates, `|`, `and`, `or`, comparisons,
+ * arithmetic and the core functions: last() position() count() name() local-name()
+ * namespace-uri() string() concat() starts-with() contains() substring() substring-before()
+ * substring-after() string-length() normalize-space() boolean() not() true() false()
+ * number() sum() floor() ceiling() round().
+ *
+ * The text of an element is its `text()` node, it comes before the element's children.
+ * Note: unlike `xpath`, string values must be quoted: book[@category='WEB'].
+ ******************************************************************************/
+typedef enum XPathItemType {
+  XPATH_ITEM_ROOT,  /* the document node, `node` is the top element */
+  XPATH_ITEM_NODE,  /* element or comment */
+  XPATH_ITEM_TEXT,  /* text of `node` */
+  XPATH_ITEM_ATTR   /* `attr` of `node` */
+}XPathItemType;
+
+typedef struct XPathItem {
+  XPathItemType type;
+  XMLNode *node;
+  XMLAttr *attr;
+}XPathItem;
+
+typedef struct XPathNodeSet {
+  size_t count;
+  size_t capacity;
+  XPathItem *items;
+}XPathNodeSet;
+
+typedef enum XPathValueType {
+  XPATH_VALUE_NODESET,
+  XPATH_VALUE_BOOLEAN,
+  XPATH_VALUE_NUMBER,
+  XPATH_VALUE_STRING
+}XPathValueType;
+
+typedef struct XPathValue {
+  XPathValueType type;
+  XPathNodeSet nodes; /* in document order */
+  bool boolean;
+  double number;
+  char *string;
+}XPathValue;
+
+typedef struct XPathExpr XPathExpr;
+
+/* Compile `expr`. Returns NULL on syntax error. */
+XPathExpr *xpath_compile(const char *expr);
+/* Same as `xpath_compile`, with name tests matched by namespace: `namespaces` is a NULL
+ * terminated list of prefix, URI pairs, e.g. { "b", "urn:books", NULL }. `b:book` then matches
+ * the elements named `book` in "urn:books" whatever their prefix in the document, and an
+ * unprefixed name only matches elements in no namespace. Names are compared as atoms(see
+ * XMLAtom), not as strings. Returns NULL as well if a prefix is not in `namespaces`.
+ * */
+XPathExpr *xpath_compile_ns(const char *expr, const char *const *namespaces);
+/* Evaluate `expr` with `node` as the context node.
+ * Note: you must free `result` with `xpath_value_free` if it returns true.
+ * */
+bool xpath_evaluate(const XPathExpr *expr, XMLNode *node, XPathValue *result);
+void xpath_expr_free(XPathExpr *expr);
+void xpath_value_free(XPathValue *value);
+
+/* Work done by one evaluation, see `xpath_evaluate_stats` */
+typedef struct XPathStats {
+  size_t steps;         /* location steps applied to a context node */
+  size_t nodes_visited; /* nodes & attributes tested while walking the axes */
+}XPathStats;
+
+/* Same as `xpath_evaluate`, and reports its work in `*stats`.
+ * The counters are only collected when the library is built with XML_STATS, otherwise they stay 0.
+ * */
+bool xpath_evaluate_stats(const XPathExpr *expr, XMLNode *node, XPathValue *result, XPathStats *stats);
+
+/* The string value of `value`(for a node-set: of its first node).
+ * Note: you must free the returned string.
+ * */
+char *xpath_value_to_string(const XPathValue *value);
+
+/******************************************************************************
+ * Query cache
+ *
+ * Remembers the results of (compiled expression, context node) pairs for one
+ * document. Every entry is dropped when the document's generation changes,
+ * i.e. after it is parsed again, reset, freed or `XMLDocumentChanged` is called.
+ * A cache is not thread safe: use one per thread.
+ ******************************************************************************/
+typedef struct XPathCache XPathCache;
+
+/* `slots`: number of results kept(rounded up to a power of two, 0: 256) */
+XPathCache *xpath_cache_new(const XMLDocument *doc, size_t slots);
+/* Same as `xpath_evaluate`, but the result is owned by the cache: don't free it.
+ * It is valid until the next call on `cache`. Returns NULL on error.
+ * */
+const XPathValue *xpath_cache_evaluate(XPathCache *cache, const XPathExpr *expr, XMLNode *node);
+void xpath_cache_clear(XPathCache *cache);
+void xpath_cache_free(XPathCache *cache);
 #endif
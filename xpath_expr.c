@@ -0,0 +1,1909 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include "xml_lexer.h"
+#include "xpath.h"
+
+/******************************************************************************
+ * Tokenizer
+ ******************************************************************************/
+typedef enum XPathTokenType {
+  XT_END,
+  XT_NAME,      /* QName, `prefix:*` or an operator name(and, or, div, mod) */
+  XT_NUMBER,
+  XT_LITERAL,   /* '...' or "..." */
+  XT_SLASH,     /* / */
+  XT_DSLASH,    /* // */
+  XT_LBRACKET,  /* [ */
+  XT_RBRACKET,  /* ] */
+  XT_LPAREN,    /* ( */
+  XT_RPAREN,    /* ) */
+  XT_AT,        /* @ */
+  XT_COMMA,     /* , */
+  XT_PIPE,      /* | */
+  XT_DOT,       /* . */
+  XT_DDOT,      /* .. */
+  XT_DCOLON,    /* :: */
+  XT_STAR,      /* * as a name test */
+  XT_OPERATOR,  /* = != < <= > >= + - and * as multiply, `or` `and` `div` `mod` */
+}XPathTokenType;
+
+typedef struct XPathToken {
+  XPathTokenType type;
+  const char *text;
+  int len;
+  double number;
+}XPathToken;
+
+typedef struct XPathTokens {
+  size_t count;
+  size_t capacity;
+  XPathToken *tokens;
+  size_t pos; /* parser position */
+}XPathTokens;
+
+static void xpath_tokens_add(XPathTokens *list, XPathTokenType type, const char *text, int len) {
+  while (list->count >= list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 16;
+    list->tokens = (XPathToken *)realloc(list->tokens, sizeof(XPathToken) * list->capacity);
+  }
+  XPathToken *tok = &list->tokens[list->count++];
+  tok->type = type;
+  tok->text = text;
+  tok->len = len;
+  tok->number = 0;
+}
+
+static bool xpath_is_name_start(char ch) {
+  return isalpha((unsigned char)ch) || ch == '_' || (unsigned char)ch >= 0x80;
+}
+
+static bool xpath_is_name_char(char ch) {
+  return xpath_is_name_start(ch) || isdigit((unsigned char)ch) || ch == '-' || ch == '.';
+}
+
+static bool xpath_token_is(const XPathToken *tok, XPathTokenType type, const char *text) {
+  return tok->type == type && (int)strlen(text) == tok->len && strncmp(tok->text, text, tok->len) == 0;
+}
+
+/* XPath 1.0, 3.7: `*` and operator names are operators unless they start an expression */
+static bool xpath_operator_expected(const XPathTokens *list) {
+  if (list->count == 0) return false;
+  const XPathToken *prev = &list->tokens[list->count - 1];
+  switch (prev->type) {
+    case XT_AT: case XT_DCOLON: case XT_LPAREN: case XT_LBRACKET: case XT_COMMA:
+    case XT_OPERATOR: case XT_SLASH: case XT_DSLASH: case XT_PIPE:
+      return false;
+    default:
+      return true;
+  }
+}
+
+static bool xpath_tokenize(const char *expr, XPathTokens *list) {
+  const char *p = expr;
+  while (true) {
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+    const char *start = p;
+    char ch = *p;
+
+    if (ch == '\0') {
+      xpath_tokens_add(list, XT_END, p, 0);
+      return true;
+    }
+
+    if (ch == '/') {
+      if (p[1] == '/') { xpath_tokens_add(list, XT_DSLASH, p, 2); p += 2; }
+      else             { xpath_tokens_add(list, XT_SLASH, p, 1); p += 1; }
+    } else if (ch == '[') { xpath_tokens_add(list, XT_LBRACKET, p++, 1);
+    } else if (ch == ']') { xpath_tokens_add(list, XT_RBRACKET, p++, 1);
+    } else if (ch == '(') { xpath_tokens_add(list, XT_LPAREN, p++, 1);
+    } else if (ch == ')') { xpath_tokens_add(list, XT_RPAREN, p++, 1);
+    } else if (ch == '@') { xpath_tokens_add(list, XT_AT, p++, 1);
+    } else if (ch == ',') { xpath_tokens_add(list, XT_COMMA, p++, 1);
+    } else if (ch == '|') { xpath_tokens_add(list, XT_PIPE, p++, 1);
+    } else if (ch == ':' && p[1] == ':') { xpath_tokens_add(list, XT_DCOLON, p, 2); p += 2;
+    } else if (ch == '.' && p[1] == '.') { xpath_tokens_add(list, XT_DDOT, p, 2); p += 2;
+    } else if (ch == '.' && !isdigit((unsigned char)p[1])) { xpath_tokens_add(list, XT_DOT, p++, 1);
+    } else if (ch == '*') {
+      xpath_tokens_add(list, xpath_operator_expected(list) ? XT_OPERATOR : XT_STAR, p++, 1);
+    } else if (ch == '=' || ch == '+' || ch == '-') { xpath_tokens_add(list, XT_OPERATOR, p++, 1);
+    } else if (ch == '!' || ch == '<' || ch == '>') {
+      if (p[1] == '=') { xpath_tokens_add(list, XT_OPERATOR, p, 2); p += 2; }
+      else if (ch == '!') return false;
+      else { xpath_tokens_add(list, XT_OPERATOR, p++, 1); }
+    } else if (ch == '"' || ch == '\'') {
+      const char *end = strchr(p + 1, ch);
+      if (end == NULL) return false;
+      xpath_tokens_add(list, XT_LITERAL, p + 1, (int)(end - p - 1));
+      p = end + 1;
+    } else if (isdigit((unsigned char)ch) || ch == '.') {
+      char *end = NULL;
+      double number = strtod(p, &end);
+      xpath_tokens_add(list, XT_NUMBER, p, (int)(end - p));
+      list->tokens[list->count - 1].number = number;
+      p = end;
+    } else if (xpath_is_name_start(ch)) {
+      while (xpath_is_name_char(*p)) p++;
+      if (p[0] == ':' && p[1] == '*') {
+        p += 2; /* prefix:* */
+      } else if (p[0] == ':' && p[1] != ':' && xpath_is_name_start(p[1])) {
+        p++; /* prefix:local */
+        while (xpath_is_name_char(*p)) p++;
+      }
+      int len = (int)(p - start);
+      bool is_operator_name = (len == 2 && !strncmp(start, "or", 2)) || (len == 3 && (!strncmp(start, "and", 3) ||
+                              !strncmp(start, "div", 3) || !strncmp(start, "mod", 3)));
+      if (is_operator_name && xpath_operator_expected(list)) xpath_tokens_add(list, XT_OPERATOR, start, len);
+      else                                                   xpath_tokens_add(list, XT_NAME, start, len);
+    } else {
+      return false;
+    }
+  }
+}
+
+/******************************************************************************
+ * AST
+ ******************************************************************************/
+typedef enum XPathOp {
+  XPATH_OP_OR,
+  XPATH_OP_AND,
+  XPATH_OP_EQ,
+  XPATH_OP_NE,
+  XPATH_OP_LT,
+  XPATH_OP_LE,
+  XPATH_OP_GT,
+  XPATH_OP_GE,
+  XPATH_OP_ADD,
+  XPATH_OP_SUB,
+  XPATH_OP_MUL,
+  XPATH_OP_DIV,
+  XPATH_OP_MOD,
+  XPATH_OP_NEG,
+  XPATH_OP_UNION,
+  XPATH_OP_NUMBER,
+  XPATH_OP_STRING,
+  XPATH_OP_FUNCTION,
+  XPATH_OP_PATH
+}XPathOp;
+
+typedef enum XPathAxis {
+  XPATH_AXIS_CHILD,
+  XPATH_AXIS_DESCENDANT,
+  XPATH_AXIS_DESCENDANT_OR_SELF,
+  XPATH_AXIS_SELF,
+  XPATH_AXIS_PARENT,
+  XPATH_AXIS_ANCESTOR,
+  XPATH_AXIS_ANCESTOR_OR_SELF,
+  XPATH_AXIS_FOLLOWING_SIBLING,
+  XPATH_AXIS_PRECEDING_SIBLING,
+  XPATH_AXIS_FOLLOWING,
+  XPATH_AXIS_PRECEDING,
+  XPATH_AXIS_ATTRIBUTE
+}XPathAxis;
+
+static struct {
+  const char *name;
+  XPathAxis axis;
+} AxisNames[] = {
+  {"child", XPATH_AXIS_CHILD},
+  {"descendant", XPATH_AXIS_DESCENDANT},
+  {"descendant-or-self", XPATH_AXIS_DESCENDANT_OR_SELF},
+  {"self", XPATH_AXIS_SELF},
+  {"parent", XPATH_AXIS_PARENT},
+  {"ancestor", XPATH_AXIS_ANCESTOR},
+  {"ancestor-or-self", XPATH_AXIS_ANCESTOR_OR_SELF},
+  {"following-sibling", XPATH_AXIS_FOLLOWING_SIBLING},
+  {"preceding-sibling", XPATH_AXIS_PRECEDING_SIBLING},
+  {"following", XPATH_AXIS_FOLLOWING},
+  {"preceding", XPATH_AXIS_PRECEDING},
+  {"attribute", XPATH_AXIS_ATTRIBUTE},
+};
+
+typedef enum XPathTest {
+  XPATH_TEST_NAME,     /* qname */
+  XPATH_TEST_PREFIX,   /* prefix:* */
+  XPATH_TEST_ANY,      /* * */
+  XPATH_TEST_NODE,     /* node() */
+  XPATH_TEST_TEXT,     /* text() */
+  XPATH_TEST_COMMENT,  /* comment() */
+  XPATH_TEST_PI        /* processing-instruction(), never matches inside the tree */
+}XPathTest;
+
+typedef enum XPathFunction {
+  XPATH_FN_LAST,
+  XPATH_FN_POSITION,
+  XPATH_FN_COUNT,
+  XPATH_FN_NAME,
+  XPATH_FN_LOCAL_NAME,
+  XPATH_FN_NAMESPACE_URI,
+  XPATH_FN_STRING,
+  XPATH_FN_CONCAT,
+  XPATH_FN_STARTS_WITH,
+  XPATH_FN_CONTAINS,
+  XPATH_FN_SUBSTRING,
+  XPATH_FN_SUBSTRING_BEFORE,
+  XPATH_FN_SUBSTRING_AFTER,
+  XPATH_FN_STRING_LENGTH,
+  XPATH_FN_NORMALIZE_SPACE,
+  XPATH_FN_BOOLEAN,
+  XPATH_FN_NOT,
+  XPATH_FN_TRUE,
+  XPATH_FN_FALSE,
+  XPATH_FN_NUMBER,
+  XPATH_FN_SUM,
+  XPATH_FN_FLOOR,
+  XPATH_FN_CEILING,
+  XPATH_FN_ROUND
+}XPathFunction;
+
+static struct {
+  const char *name;
+  XPathFunction function;
+  int min_args;
+  int max_args; /* -1: any */
+} FunctionNames[] = {
+  {"last", XPATH_FN_LAST, 0, 0},
+  {"position", XPATH_FN_POSITION, 0, 0},
+  {"count", XPATH_FN_COUNT, 1, 1},
+  {"name", XPATH_FN_NAME, 0, 1},
+  {"local-name", XPATH_FN_LOCAL_NAME, 0, 1},
+  {"namespace-uri", XPATH_FN_NAMESPACE_URI, 0, 1},
+  {"string", XPATH_FN_STRING, 0, 1},
+  {"concat", XPATH_FN_CONCAT, 2, -1},
+  {"starts-with", XPATH_FN_STARTS_WITH, 2, 2},
+  {"contains", XPATH_FN_CONTAINS, 2, 2},
+  {"substring", XPATH_FN_SUBSTRING, 2, 3},
+  {"substring-before", XPATH_FN_SUBSTRING_BEFORE, 2, 2},
+  {"substring-after", XPATH_FN_SUBSTRING_AFTER, 2, 2},
+  {"string-length", XPATH_FN_STRING_LENGTH, 0, 1},
+  {"normalize-space", XPATH_FN_NORMALIZE_SPACE, 0, 1},
+  {"boolean", XPATH_FN_BOOLEAN, 1, 1},
+  {"not", XPATH_FN_NOT, 1, 1},
+  {"true", XPATH_FN_TRUE, 0, 0},
+  {"false", XPATH_FN_FALSE, 0, 0},
+  {"number", XPATH_FN_NUMBER, 0, 1},
+  {"sum", XPATH_FN_SUM, 1, 1},
+  {"floor", XPATH_FN_FLOOR, 1, 1},
+  {"ceiling", XPATH_FN_CEILING, 1, 1},
+  {"round", XPATH_FN_ROUND, 1, 1},
+};
+
+typedef struct XPathAstList {
+  size_t count;
+  size_t capacity;
+  struct XPathAst **items;
+}XPathAstList;
+
+typedef struct XPathStep {
+  XPathAxis axis;
+  XPathTest test;
+  char *name;              /* XPATH_TEST_NAME: qname, XPATH_TEST_PREFIX: "prefix:" */
+  size_t name_len;
+  bool by_atom;            /* compiled with namespaces: match `ns`(and `local` for names) instead of `name` */
+  XMLAtom ns;
+  XMLAtom local;
+  XPathAstList predicates;
+  size_t index;            /* > 0: the first predicate is the number `index`, picked directly */
+}XPathStep;
+
+typedef struct XPathAst {
+  XPathOp op;
+  struct XPathAst *left;   /* binary operators, XPATH_OP_NEG */
+  struct XPathAst *right;
+  double number;           /* XPATH_OP_NUMBER */
+  char *string;            /* XPATH_OP_STRING */
+  XPathFunction function;  /* XPATH_OP_FUNCTION */
+  XPathAstList args;
+  bool absolute;           /* XPATH_OP_PATH: starts at the document node */
+  struct XPathAst *filter; /* XPATH_OP_PATH: primary expression the steps start from, or NULL */
+  XPathAstList filter_predicates;
+  size_t step_count;
+  XPathStep *steps;
+}XPathAst;
+
+struct XPathExpr {
+  XPathAst *ast;
+  unsigned long id; /* unique per compile, so a cache never confuses a freed expression with a new one */
+};
+
+static pthread_mutex_t expr_id_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long expr_id_next = 1;
+
+static void xpath_ast_free(XPathAst *ast);
+
+static void xpath_ast_list_add(XPathAstList *list, XPathAst *ast) {
+  while (list->count >= list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 2;
+    list->items = (XPathAst **)realloc(list->items, sizeof(XPathAst *) * list->capacity);
+  }
+  list->items[list->count++] = ast;
+}
+
+static void xpath_ast_list_free(XPathAstList *list) {
+  for (size_t i = 0; i < list->count; ++i) xpath_ast_free(list->items[i]);
+  free(list->items);
+  list->items = NULL;
+  list->count = list->capacity = 0;
+}
+
+static void xpath_ast_free(XPathAst *ast) {
+  if (ast == NULL) return;
+  xpath_ast_free(ast->left);
+  xpath_ast_free(ast->right);
+  free(ast->string);
+  xpath_ast_list_free(&ast->args);
+  xpath_ast_free(ast->filter);
+  xpath_ast_list_free(&ast->filter_predicates);
+  for (size_t i = 0; i < ast->step_count; ++i) {
+    free(ast->steps[i].name);
+    xpath_ast_list_free(&ast->steps[i].predicates);
+  }
+  free(ast->steps);
+  free(ast);
+}
+
+static XPathAst *xpath_ast_new(XPathOp op) {
+  XPathAst *ast = (XPathAst *)calloc(1, sizeof(XPathAst));
+  if (ast) ast->op = op;
+  return ast;
+}
+
+static XPathStep *xpath_ast_add_step(XPathAst *path, XPathAxis axis, XPathTest test) {
+  path->steps = (XPathStep *)realloc(path->steps, sizeof(XPathStep) * (path->step_count + 1));
+  XPathStep *step = &path->steps[path->step_count++];
+  memset(step, 0, sizeof(XPathStep));
+  step->axis = axis;
+  step->test = test;
+  return step;
+}
+
+/******************************************************************************
+ * Parser: XPath 1.0 grammar, recursive descent
+ ******************************************************************************/
+static XPathAst *xpath_parse_or(XPathTokens *tks);
+
+static XPathToken *xpath_peek(XPathTokens *tks) {
+  return &tks->tokens[tks->pos];
+}
+
+static XPathToken *xpath_peek_at(XPathTokens *tks, size_t n) {
+  size_t pos = tks->pos + n;
+  if (pos >= tks->count) pos = tks->count - 1; /* XT_END */
+  return &tks->tokens[pos];
+}
+
+static XPathToken *xpath_next(XPathTokens *tks) {
+  XPathToken *tok = &tks->tokens[tks->pos];
+  if (tok->type != XT_END) tks->pos++;
+  return tok;
+}
+
+static bool xpath_accept(XPathTokens *tks, XPathTokenType type) {
+  if (xpath_peek(tks)->type != type) return false;
+  xpath_next(tks);
+  return true;
+}
+
+static bool xpath_is_node_type(const XPathToken *tok) {
+  return xpath_token_is(tok, XT_NAME, "text") || xpath_token_is(tok, XT_NAME, "node") ||
+         xpath_token_is(tok, XT_NAME, "comment") || xpath_token_is(tok, XT_NAME, "processing-instruction");
+}
+
+/* Predicate* */
+static bool xpath_parse_predicates(XPathTokens *tks, XPathAstList *predicates) {
+  while (xpath_accept(tks, XT_LBRACKET)) {
+    XPathAst *pred = xpath_parse_or(tks);
+    if (pred == NULL) return false;
+    xpath_ast_list_add(predicates, pred);
+    if (!xpath_accept(tks, XT_RBRACKET)) return false;
+  }
+  return true;
+}
+
+/* Step ::= AxisSpecifier NodeTest Predicate* | '.' | '..' */
+static bool xpath_parse_step(XPathTokens *tks, XPathAst *path) {
+  if (xpath_accept(tks, XT_DOT)) {
+    xpath_ast_add_step(path, XPATH_AXIS_SELF, XPATH_TEST_NODE);
+    return true;
+  }
+  if (xpath_accept(tks, XT_DDOT)) {
+    xpath_ast_add_step(path, XPATH_AXIS_PARENT, XPATH_TEST_NODE);
+    return true;
+  }
+
+  XPathAxis axis = XPATH_AXIS_CHILD;
+  if (xpath_accept(tks, XT_AT)) {
+    axis = XPATH_AXIS_ATTRIBUTE;
+  } else if (xpath_peek(tks)->type == XT_NAME && xpath_peek_at(tks, 1)->type == XT_DCOLON) {
+    XPathToken *name = xpath_next(tks);
+    size_t i = 0;
+    for (i = 0; i < ARRAY_SIZE(AxisNames); ++i) {
+      if (xpath_token_is(name, XT_NAME, AxisNames[i].name)) break;
+    }
+    if (i == ARRAY_SIZE(AxisNames)) return false; /* e.g. namespace:: */
+    axis = AxisNames[i].axis;
+    xpath_next(tks); /* :: */
+  }
+
+  XPathToken *tok = xpath_next(tks);
+  XPathStep *step = NULL;
+  if (tok->type == XT_STAR) {
+    step = xpath_ast_add_step(path, axis, XPATH_TEST_ANY);
+  } else if (tok->type == XT_NAME && xpath_is_node_type(tok) && xpath_peek(tks)->type == XT_LPAREN) {
+    XPathTest test = XPATH_TEST_NODE;
+    if (xpath_token_is(tok, XT_NAME, "text")) test = XPATH_TEST_TEXT;
+    else if (xpath_token_is(tok, XT_NAME, "comment")) test = XPATH_TEST_COMMENT;
+    else if (xpath_token_is(tok, XT_NAME, "processing-instruction")) test = XPATH_TEST_PI;
+    xpath_next(tks);
+    if (test == XPATH_TEST_PI && xpath_peek(tks)->type == XT_LITERAL) xpath_next(tks);
+    if (!xpath_accept(tks, XT_RPAREN)) return false;
+    step = xpath_ast_add_step(path, axis, test);
+  } else if (tok->type == XT_NAME) {
+    bool is_prefix = tok->len >= 2 && tok->text[tok->len - 1] == '*';
+    step = xpath_ast_add_step(path, axis, is_prefix ? XPATH_TEST_PREFIX : XPATH_TEST_NAME);
+    step->name_len = is_prefix ? tok->len - 1 : tok->len; /* keep the ':' of `prefix:*` */
+    step->name = strndup(tok->text, step->name_len);
+  } else {
+    return false;
+  }
+
+  return xpath_parse_predicates(tks, &step->predicates);
+}
+
+static bool xpath_starts_step(const XPathToken *tok) {
+  return tok->type == XT_NAME || tok->type == XT_STAR || tok->type == XT_AT ||
+         tok->type == XT_DOT || tok->type == XT_DDOT;
+}
+
+/* RelativeLocationPath ::= Step (('/' | '//') Step)* */
+static bool xpath_parse_relative_path(XPathTokens *tks, XPathAst *path) {
+  if (!xpath_parse_step(tks, path)) return false;
+  while (true) {
+    if (xpath_accept(tks, XT_SLASH)) {
+      if (!xpath_parse_step(tks, path)) return false;
+    } else if (xpath_accept(tks, XT_DSLASH)) {
+      xpath_ast_add_step(path, XPATH_AXIS_DESCENDANT_OR_SELF, XPATH_TEST_NODE);
+      if (!xpath_parse_step(tks, path)) return false;
+    } else {
+      return true;
+    }
+  }
+}
+
+/* PrimaryExpr ::= '(' Expr ')' | Literal | Number | FunctionCall */
+static XPathAst *xpath_parse_primary(XPathTokens *tks) {
+  XPathToken *tok = xpath_next(tks);
+  if (tok->type == XT_LPAREN) {
+    XPathAst *ast = xpath_parse_or(tks);
+    if (ast == NULL) return NULL;
+    if (!xpath_accept(tks, XT_RPAREN)) {
+      xpath_ast_free(ast);
+      return NULL;
+    }
+    return ast;
+  }
+  if (tok->type == XT_LITERAL) {
+    XPathAst *ast = xpath_ast_new(XPATH_OP_STRING);
+    ast->string = strndup(tok->text, tok->len);
+    return ast;
+  }
+  if (tok->type == XT_NUMBER) {
+    XPathAst *ast = xpath_ast_new(XPATH_OP_NUMBER);
+    ast->number = tok->number;
+    return ast;
+  }
+
+  /* FunctionCall */
+  size_t i = 0;
+  for (i = 0; i < ARRAY_SIZE(FunctionNames); ++i) {
+    if (xpath_token_is(tok, XT_NAME, FunctionNames[i].name)) break;
+  }
+  if (i == ARRAY_SIZE(FunctionNames) || !xpath_accept(tks, XT_LPAREN)) return NULL;
+
+  XPathAst *ast = xpath_ast_new(XPATH_OP_FUNCTION);
+  ast->function = FunctionNames[i].function;
+  if (!xpath_accept(tks, XT_RPAREN)) {
+    do {
+      XPathAst *arg = xpath_parse_or(tks);
+      if (arg == NULL) {
+        xpath_ast_free(ast);
+        return NULL;
+      }
+      xpath_ast_list_add(&ast->args, arg);
+    } while (xpath_accept(tks, XT_COMMA));
+    if (!xpath_accept(tks, XT_RPAREN)) {
+      xpath_ast_free(ast);
+      return NULL;
+    }
+  }
+
+  int argc = (int)ast->args.count;
+  if (argc < FunctionNames[i].min_args || (FunctionNames[i].max_args >= 0 && argc > FunctionNames[i].max_args)) {
+    xpath_ast_free(ast);
+    return NULL;
+  }
+  return ast;
+}
+
+/* PathExpr ::= LocationPath | FilterExpr | FilterExpr ('/' | '//') RelativeLocationPath */
+static XPathAst *xpath_parse_path(XPathTokens *tks) {
+  XPathAst *path = xpath_ast_new(XPATH_OP_PATH);
+  XPathToken *tok = xpath_peek(tks);
+  bool ok = true;
+
+  if (tok->type == XT_SLASH) {
+    xpath_next(tks);
+    path->absolute = true;
+    if (xpath_starts_step(xpath_peek(tks))) ok = xpath_parse_relative_path(tks, path);
+  } else if (tok->type == XT_DSLASH) {
+    xpath_next(tks);
+    path->absolute = true;
+    xpath_ast_add_step(path, XPATH_AXIS_DESCENDANT_OR_SELF, XPATH_TEST_NODE);
+    ok = xpath_parse_relative_path(tks, path);
+  } else if (tok->type == XT_LPAREN || tok->type == XT_LITERAL || tok->type == XT_NUMBER ||
+             (tok->type == XT_NAME && !xpath_is_node_type(tok) && xpath_peek_at(tks, 1)->type == XT_LPAREN)) {
+    XPathAst *primary = xpath_parse_primary(tks);
+    if (primary == NULL) {
+      xpath_ast_free(path);
+      return NULL;
+    }
+    ok = xpath_parse_predicates(tks, &path->filter_predicates);
+    if (ok && xpath_peek(tks)->type != XT_SLASH && xpath_peek(tks)->type != XT_DSLASH && path->filter_predicates.count == 0) {
+      xpath_ast_free(path); /* a plain primary expression */
+      return primary;
+    }
+    path->filter = primary;
+    if (ok && xpath_accept(tks, XT_SLASH)) {
+      ok = xpath_parse_relative_path(tks, path);
+    } else if (ok && xpath_accept(tks, XT_DSLASH)) {
+      xpath_ast_add_step(path, XPATH_AXIS_DESCENDANT_OR_SELF, XPATH_TEST_NODE);
+      ok = xpath_parse_relative_path(tks, path);
+    }
+  } else {
+    ok = xpath_parse_relative_path(tks, path);
+  }
+
+  if (!ok) {
+    xpath_ast_free(path);
+    return NULL;
+  }
+  return path;
+}
+
+/* UnionExpr ::= PathExpr ('|' PathExpr)* */
+static XPathAst *xpath_parse_union(XPathTokens *tks) {
+  XPathAst *left = xpath_parse_path(tks);
+  while (left && xpath_accept(tks, XT_PIPE)) {
+    XPathAst *ast = xpath_ast_new(XPATH_OP_UNION);
+    ast->left = left;
+    ast->right = xpath_parse_path(tks);
+    if (ast->right == NULL) {
+      xpath_ast_free(ast);
+      return NULL;
+    }
+    left = ast;
+  }
+  return left;
+}
+
+/* UnaryExpr ::= UnionExpr | '-' UnaryExpr */
+static XPathAst *xpath_parse_unary(XPathTokens *tks) {
+  if (xpath_token_is(xpath_peek(tks), XT_OPERATOR, "-")) {
+    xpath_next(tks);
+    XPathAst *operand = xpath_parse_unary(tks);
+    if (operand == NULL) return NULL;
+    XPathAst *ast = xpath_ast_new(XPATH_OP_NEG);
+    ast->left = operand;
+    return ast;
+  }
+  return xpath_parse_union(tks);
+}
+
+typedef XPathAst *(*XPathParseFn)(XPathTokens *tks);
+
+/* left associative binary operators of one precedence level */
+static XPathAst *xpath_parse_binary(XPathTokens *tks, XPathParseFn operandFn, const char **ops, const XPathOp *codes, int n) {
+  XPathAst *left = operandFn(tks);
+  while (left) {
+    int i = 0;
+    for (i = 0; i < n; ++i) {
+      if (xpath_token_is(xpath_peek(tks), XT_OPERATOR, ops[i])) break;
+    }
+    if (i == n) break;
+    xpath_next(tks);
+
+    XPathAst *ast = xpath_ast_new(codes[i]);
+    ast->left = left;
+    ast->right = operandFn(tks);
+    if (ast->right == NULL) {
+      xpath_ast_free(ast);
+      return NULL;
+    }
+    left = ast;
+  }
+  return left;
+}
+
+static XPathAst *xpath_parse_multiplicative(XPathTokens *tks) {
+  static const char *ops[] = {"*", "div", "mod"};
+  static const XPathOp codes[] = {XPATH_OP_MUL, XPATH_OP_DIV, XPATH_OP_MOD};
+  return xpath_parse_binary(tks, xpath_parse_unary, ops, codes, 3);
+}
+
+static XPathAst *xpath_parse_additive(XPathTokens *tks) {
+  static const char *ops[] = {"+", "-"};
+  static const XPathOp codes[] = {XPATH_OP_ADD, XPATH_OP_SUB};
+  return xpath_parse_binary(tks, xpath_parse_multiplicative, ops, codes, 2);
+}
+
+static XPathAst *xpath_parse_relational(XPathTokens *tks) {
+  static const char *ops[] = {"<", "<=", ">", ">="};
+  static const XPathOp codes[] = {XPATH_OP_LT, XPATH_OP_LE, XPATH_OP_GT, XPATH_OP_GE};
+  return xpath_parse_binary(tks, xpath_parse_additive, ops, codes, 4);
+}
+
+static XPathAst *xpath_parse_equality(XPathTokens *tks) {
+  static const char *ops[] = {"=", "!="};
+  static const XPathOp codes[] = {XPATH_OP_EQ, XPATH_OP_NE};
+  return xpath_parse_binary(tks, xpath_parse_relational, ops, codes, 2);
+}
+
+static XPathAst *xpath_parse_and(XPathTokens *tks) {
+  static const char *ops[] = {"and"};
+  static const XPathOp codes[] = {XPATH_OP_AND};
+  return xpath_parse_binary(tks, xpath_parse_equality, ops, codes, 1);
+}
+
+static XPathAst *xpath_parse_or(XPathTokens *tks) {
+  static const char *ops[] = {"or"};
+  static const XPathOp codes[] = {XPATH_OP_OR};
+  return xpath_parse_binary(tks, xpath_parse_and, ops, codes, 1);
+}
+
+/******************************************************************************
+ * Compiling: rewrite the AST into a cheaper plan
+ ******************************************************************************/
+
+/* true if `ast` may evaluate to a number or depends on the context position/size,
+ * i.e. the predicate [ast] could select by position */
+static bool xpath_ast_is_positional(const XPathAst *ast) {
+  switch (ast->op) {
+    case XPATH_OP_OR: case XPATH_OP_AND:
+    case XPATH_OP_EQ: case XPATH_OP_NE: case XPATH_OP_LT: case XPATH_OP_LE: case XPATH_OP_GT: case XPATH_OP_GE:
+      return xpath_ast_is_positional(ast->left) || xpath_ast_is_positional(ast->right);
+    case XPATH_OP_STRING:
+      return false;
+    case XPATH_OP_PATH:
+      return ast->filter != NULL && xpath_ast_is_positional(ast->filter);
+    case XPATH_OP_UNION:
+      return xpath_ast_is_positional(ast->left) || xpath_ast_is_positional(ast->right);
+    case XPATH_OP_FUNCTION:
+      switch (ast->function) {
+        case XPATH_FN_LAST: case XPATH_FN_POSITION: case XPATH_FN_COUNT: case XPATH_FN_STRING_LENGTH:
+        case XPATH_FN_NUMBER: case XPATH_FN_SUM: case XPATH_FN_FLOOR: case XPATH_FN_CEILING: case XPATH_FN_ROUND:
+          return true;
+        default:
+          for (size_t i = 0; i < ast->args.count; ++i) {
+            if (xpath_ast_is_positional(ast->args.items[i])) return true;
+          }
+          return false;
+      }
+    default: /* numbers & arithmetic */
+      return true;
+  }
+}
+
+static void xpath_optimize(XPathAst *ast) {
+  if (ast == NULL) return;
+  xpath_optimize(ast->left);
+  xpath_optimize(ast->right);
+  xpath_optimize(ast->filter);
+  for (size_t i = 0; i < ast->args.count; ++i) xpath_optimize(ast->args.items[i]);
+  for (size_t i = 0; i < ast->filter_predicates.count; ++i) xpath_optimize(ast->filter_predicates.items[i]);
+
+  for (size_t i = 0; i < ast->step_count; ++i) {
+    XPathStep *step = &ast->steps[i];
+    for (size_t j = 0; j < step->predicates.count; ++j) xpath_optimize(step->predicates.items[j]);
+
+    /* [3]: pick the 3rd item instead of evaluating the predicate for every item */
+    if (step->predicates.count > 0 && step->predicates.items[0]->op == XPATH_OP_NUMBER) {
+      double n = step->predicates.items[0]->number;
+      if (n >= 1 && n == floor(n)) step->index = (size_t)n;
+    }
+  }
+
+  /* `//name` is descendant-or-self::node()/child::name, i.e. every node of the
+   * subtree as an intermediate result. Without positional predicates it is the
+   * same as descendant::name, which needs a single walk. */
+  for (size_t i = 0; i + 1 < ast->step_count; ++i) {
+    XPathStep *step = &ast->steps[i];
+    XPathStep *next = &ast->steps[i + 1];
+    if (step->axis != XPATH_AXIS_DESCENDANT_OR_SELF || step->test != XPATH_TEST_NODE || step->predicates.count > 0) continue;
+    if (next->axis != XPATH_AXIS_CHILD) continue;
+
+    bool positional = false;
+    for (size_t j = 0; j < next->predicates.count; ++j) {
+      if (xpath_ast_is_positional(next->predicates.items[j])) positional = true;
+    }
+    if (positional) continue;
+
+    next->axis = XPATH_AXIS_DESCENDANT;
+    memmove(step, next, sizeof(XPathStep) * (ast->step_count - i - 1));
+    ast->step_count--;
+  }
+}
+
+/* resolve the names of every step against `namespaces`(prefix, URI pairs) */
+static bool xpath_bind_namespaces(XPathAst *ast, const char *const *namespaces) {
+  if (ast == NULL) return true;
+  if (!xpath_bind_namespaces(ast->left, namespaces) || !xpath_bind_namespaces(ast->right, namespaces) ||
+      !xpath_bind_namespaces(ast->filter, namespaces)) return false;
+  for (size_t i = 0; i < ast->args.count; ++i) {
+    if (!xpath_bind_namespaces(ast->args.items[i], namespaces)) return false;
+  }
+  for (size_t i = 0; i < ast->filter_predicates.count; ++i) {
+    if (!xpath_bind_namespaces(ast->filter_predicates.items[i], namespaces)) return false;
+  }
+
+  for (size_t i = 0; i < ast->step_count; ++i) {
+    XPathStep *step = &ast->steps[i];
+    for (size_t j = 0; j < step->predicates.count; ++j) {
+      if (!xpath_bind_namespaces(step->predicates.items[j], namespaces)) return false;
+    }
+    if (step->test != XPATH_TEST_NAME && step->test != XPATH_TEST_PREFIX) continue;
+
+    const char *colon = strchr(step->name, ':');
+    const char *local = colon ? colon + 1 : step->name;
+    step->by_atom = true;
+    step->ns = 0; /* unprefixed names are in no namespace, as in XPath 1.0 */
+    if (colon) {
+      size_t len = (size_t)(colon - step->name);
+      const char *const *ns = namespaces;
+      while (ns[0] && (strncmp(ns[0], step->name, len) != 0 || ns[0][len] != '\0')) ns += 2;
+      if (ns[0] == NULL) return false; /* undeclared prefix */
+      step->ns = XMLAtomIntern(ns[1]);
+      if (step->ns == 0) return false;
+    }
+    if (step->test == XPATH_TEST_NAME && (step->local = XMLAtomIntern(local)) == 0) return false;
+  }
+  return true;
+}
+
+XPathExpr *xpath_compile_ns(const char *expr, const char *const *namespaces) {
+  XPathTokens tks = { 0 };
+  XPathAst *ast = NULL;
+
+  if (expr == NULL) return NULL;
+  if (xpath_tokenize(expr, &tks)) {
+    ast = xpath_parse_or(&tks);
+    if (ast != NULL && xpath_peek(&tks)->type != XT_END) { /* trailing garbage */
+      xpath_ast_free(ast);
+      ast = NULL;
+    }
+  }
+  free(tks.tokens);
+  if (ast != NULL && namespaces != NULL && !xpath_bind_namespaces(ast, namespaces)) {
+    xpath_ast_free(ast);
+    ast = NULL;
+  }
+  if (ast == NULL) return NULL;
+
+  xpath_optimize(ast);
+
+  XPathExpr *compiled = (XPathExpr *)malloc(sizeof(XPathExpr));
+  if (compiled == NULL) {
+    xpath_ast_free(ast);
+    return NULL;
+  }
+  compiled->ast = ast;
+  pthread_mutex_lock(&expr_id_lock);
+  compiled->id = expr_id_next++;
+  pthread_mutex_unlock(&expr_id_lock);
+  return compiled;
+}
+
+XPathExpr *xpath_compile(const char *expr) {
+  return xpath_compile_ns(expr, NULL);
+}
+
+void xpath_expr_free(XPathExpr *expr) {
+  if (expr == NULL) return;
+  xpath_ast_free(expr->ast);
+  free(expr);
+}
+
+/******************************************************************************
+ * Node-sets
+ ******************************************************************************/
+static void xpath_nodeset_add(XPathNodeSet *set, XPathItemType type, XMLNode *node, XMLAttr *attr) {
+  while (set->count >= set->capacity) {
+    set->capacity = set->capacity ? set->capacity * 2 : 8;
+    set->items = (XPathItem *)realloc(set->items, sizeof(XPathItem) * set->capacity);
+  }
+  XPathItem *item = &set->items[set->count++];
+  item->type = type;
+  item->node = node;
+  item->attr = attr;
+}
+
+static void xpath_nodeset_free(XPathNodeSet *set) {
+  free(set->items);
+  set->items = NULL;
+  set->count = set->capacity = 0;
+}
+
+static size_t xpath_node_depth(const XMLNode *node) {
+  size_t depth = 0;
+  while (node->parent) {
+    node = node->parent;
+    depth++;
+  }
+  return depth;
+}
+
+/* document order of two tree nodes */
+static int xpath_node_cmp(const XMLNode *a, const XMLNode *b) {
+  if (a == b) return 0;
+  size_t da = xpath_node_depth(a);
+  size_t db = xpath_node_depth(b);
+  const XMLNode *pa = a, *pb = b;
+  while (da > db) { pa = pa->parent; da--; }
+  while (db > da) { pb = pb->parent; db--; }
+  if (pa == pb) return a == pa ? -1 : 1; /* one is the ancestor of the other */
+  while (pa->parent != pb->parent) {
+    pa = pa->parent;
+    pb = pb->parent;
+  }
+  if (pa->parent == NULL) return pa < pb ? -1 : 1; /* different trees */
+  return XMLNodeIndex(pa) < XMLNodeIndex(pb) ? -1 : 1;
+}
+
+/* within one element: the element, its text, then its attributes */
+static size_t xpath_item_rank(const XPathItem *item) {
+  switch (item->type) {
+    case XPATH_ITEM_NODE: return 0;
+    case XPATH_ITEM_TEXT: return 1;
+    case XPATH_ITEM_ATTR: return 2 + (size_t)(item->attr - item->node->attrList.attrs);
+    default: return 0;
+  }
+}
+
+static int xpath_item_cmp(const void *pa, const void *pb) {
+  const XPathItem *a = (const XPathItem *)pa;
+  const XPathItem *b = (const XPathItem *)pb;
+  if (a->type == XPATH_ITEM_ROOT || b->type == XPATH_ITEM_ROOT) {
+    return (b->type == XPATH_ITEM_ROOT) - (a->type == XPATH_ITEM_ROOT);
+  }
+
+  /* the text & attributes of an element come before its children */
+  int cmp = xpath_node_cmp(a->node, b->node);
+  if (cmp != 0) {
+    if (a->type != XPATH_ITEM_NODE && cmp < 0 && xpath_node_depth(b->node) > xpath_node_depth(a->node)) return -1;
+    if (b->type != XPATH_ITEM_NODE && cmp > 0 && xpath_node_depth(a->node) > xpath_node_depth(b->node)) return 1;
+    return cmp;
+  }
+  size_t ra = xpath_item_rank(a), rb = xpath_item_rank(b);
+  return ra < rb ? -1 : (ra > rb ? 1 : 0);
+}
+
+static bool xpath_item_equal(const XPathItem *a, const XPathItem *b) {
+  return a->type == b->type && a->node == b->node && a->attr == b->attr;
+}
+
+/* sort into document order and drop duplicates. Already sorted sets(the usual case) cost one pass. */
+static void xpath_nodeset_normalize(XPathNodeSet *set) {
+  bool sorted = true;
+  for (size_t i = 1; i < set->count && sorted; ++i) {
+    if (xpath_item_cmp(&set->items[i - 1], &set->items[i]) >= 0) sorted = false;
+  }
+  if (sorted) return;
+
+  qsort(set->items, set->count, sizeof(XPathItem), xpath_item_cmp);
+  size_t n = 0;
+  for (size_t i = 0; i < set->count; ++i) {
+    if (n > 0 && xpath_item_equal(&set->items[n - 1], &set->items[i])) continue;
+    set->items[n++] = set->items[i];
+  }
+  set->count = n;
+}
+
+/******************************************************************************
+ * String values
+ ******************************************************************************/
+typedef struct XPathBuffer {
+  char *data;
+  size_t len;
+  size_t capacity;
+}XPathBuffer;
+
+/* make room for `len` more bytes and the terminating '\0' */
+static void xpath_buffer_reserve(XPathBuffer *buf, size_t len) {
+  if (buf->len + len + 1 > buf->capacity) {
+    size_t capacity = buf->capacity ? buf->capacity : 64;
+    while (buf->len + len + 1 > capacity) capacity *= 2;
+    buf->data = (char *)realloc(buf->data, capacity);
+    buf->capacity = capacity;
+  }
+}
+
+static void xpath_buffer_append(XPathBuffer *buf, const char *str, size_t len) {
+  xpath_buffer_reserve(buf, len);
+  memcpy(buf->data + buf->len, str, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+}
+
+static char *xpath_buffer_take(XPathBuffer *buf) {
+  if (buf->data == NULL) return strdup("");
+  return buf->data;
+}
+
+static bool xpath_is_element(const XMLNode *node) {
+  return node->type != NT_COMMENT && node->type != NT_PI && node->type != NT_DOCTYPE;
+}
+
+static void xpath_append_decoded(XPathBuffer *buf, const XMLNode *node) {
+  size_t len = strlen(node->text);
+  xpath_buffer_reserve(buf, len); /* decoding never makes the text longer */
+  buf->len += XMLDecodeTextTo(node, buf->data + buf->len, buf->capacity - buf->len);
+}
+
+static void xpath_element_string(XPathBuffer *buf, const XMLNode *node) {
+  if (node->text) xpath_append_decoded(buf, node);
+  XMLNodeExpand((XMLNode *)node);
+  for (size_t i = 0; i < node->children.count; ++i) {
+    XMLNode *child = node->children.nodes[i];
+    if (xpath_is_element(child)) xpath_element_string(buf, child);
+  }
+}
+
+static char *xpath_item_string(const XPathItem *item) {
+  XPathBuffer buf = { 0 };
+  switch (item->type) {
+    case XPATH_ITEM_ROOT:
+      xpath_element_string(&buf, item->node);
+      break;
+    case XPATH_ITEM_TEXT:
+      xpath_append_decoded(&buf, item->node);
+      break;
+    case XPATH_ITEM_ATTR:
+      return strdup(item->attr->value ? item->attr->value : "");
+    case XPATH_ITEM_NODE:
+      if (item->node->type == NT_COMMENT) { /* the name holds `<!--...-->` */
+        const char *s = item->node->name;
+        size_t len = strlen(s);
+        if (len >= 7 && !strncmp(s, "<!--", 4)) xpath_buffer_append(&buf, s + 4, len - 7);
+        else xpath_buffer_append(&buf, s, len);
+      } else {
+        xpath_element_string(&buf, item->node);
+      }
+      break;
+  }
+  return xpath_buffer_take(&buf);
+}
+
+static double xpath_string_to_number(const char *s) {
+  char *end = NULL;
+  while (isspace((unsigned char)*s)) s++;
+  if (*s == '\0') return NAN;
+  double n = strtod(s, &end);
+  while (isspace((unsigned char)*end)) end++;
+  if (*end != '\0') return NAN;
+  return n;
+}
+
+/* string(): a plain decimal, never with an exponent(XPath 1.0, 4.2), to 15 significant digits */
+static char *xpath_number_to_string(double n) {
+  char digits[32], str[400];
+  if (isnan(n)) return strdup("NaN");
+  if (isinf(n)) return strdup(n > 0 ? "Infinity" : "-Infinity");
+  if (n == floor(n) && fabs(n) < 1e15) {
+    snprintf(str, sizeof(str), "%.0f", n == 0 ? 0.0 : n);
+    return strdup(str);
+  }
+
+  /* d.dddddddddddddde[+-]x: the digits, then placed around the point by hand */
+  snprintf(digits, sizeof(digits), "%.14e", fabs(n));
+  int exponent = atoi(strchr(digits, 'e') + 1);
+  char mantissa[16];
+  int count = 0;
+  for (const char *p = digits; *p != 'e'; ++p) {
+    if (*p != '.') mantissa[count++] = *p;
+  }
+  while (count > 1 && mantissa[count - 1] == '0') count--;
+
+  size_t len = 0;
+  if (n < 0) str[len++] = '-';
+  if (exponent < 0) {
+    str[len++] = '0';
+    str[len++] = '.';
+    for (int i = 0; i < -exponent - 1; ++i) str[len++] = '0';
+    for (int i = 0; i < count; ++i) str[len++] = mantissa[i];
+  } else {
+    for (int i = 0; i <= exponent; ++i) str[len++] = i < count ? mantissa[i] : '0';
+    if (count > exponent + 1) {
+      str[len++] = '.';
+      for (int i = exponent + 1; i < count; ++i) str[len++] = mantissa[i];
+    }
+  }
+  str[len] = '\0';
+  return strdup(str);
+}
+
+/******************************************************************************
+ * Values
+ ******************************************************************************/
+void xpath_value_free(XPathValue *value) {
+  if (value == NULL) return;
+  xpath_nodeset_free(&value->nodes);
+  free(value->string);
+  value->string = NULL;
+}
+
+static char *xpath_value_string(const XPathValue *v) {
+  switch (v->type) {
+    case XPATH_VALUE_NODESET:
+      return v->nodes.count ? xpath_item_string(&v->nodes.items[0]) : strdup("");
+    case XPATH_VALUE_BOOLEAN:
+      return strdup(v->boolean ? "true" : "false");
+    case XPATH_VALUE_NUMBER:
+      return xpath_number_to_string(v->number);
+    case XPATH_VALUE_STRING:
+      return strdup(v->string);
+  }
+  return strdup("");
+}
+
+char *xpath_value_to_string(const XPathValue *value) {
+  return xpath_value_string(value);
+}
+
+static double xpath_value_number(const XPathValue *v) {
+  switch (v->type) {
+    case XPATH_VALUE_NUMBER:
+      return v->number;
+    case XPATH_VALUE_BOOLEAN:
+      return v->boolean ? 1 : 0;
+    case XPATH_VALUE_STRING:
+      return xpath_string_to_number(v->string);
+    case XPATH_VALUE_NODESET: {
+      char *s = xpath_value_string(v);
+      double n = xpath_string_to_number(s);
+      free(s);
+      return n;
+    }
+  }
+  return NAN;
+}
+
+static bool xpath_value_boolean(const XPathValue *v) {
+  switch (v->type) {
+    case XPATH_VALUE_NUMBER:
+      return v->number != 0 && !isnan(v->number);
+    case XPATH_VALUE_BOOLEAN:
+      return v->boolean;
+    case XPATH_VALUE_STRING:
+      return v->string[0] != '\0';
+    case XPATH_VALUE_NODESET:
+      return v->nodes.count > 0;
+  }
+  return false;
+}
+
+static void xpath_set_number(XPathValue *v, double n) {
+  memset(v, 0, sizeof(XPathValue));
+  v->type = XPATH_VALUE_NUMBER;
+  v->number = n;
+}
+
+static void xpath_set_boolean(XPathValue *v, bool b) {
+  memset(v, 0, sizeof(XPathValue));
+  v->type = XPATH_VALUE_BOOLEAN;
+  v->boolean = b;
+}
+
+/* takes ownership of `s` */
+static void xpath_set_string(XPathValue *v, char *s) {
+  memset(v, 0, sizeof(XPathValue));
+  v->type = XPATH_VALUE_STRING;
+  v->string = s;
+}
+
+/******************************************************************************
+ * Evaluation
+ ******************************************************************************/
+typedef struct XPathContext {
+  XPathItem item;
+  size_t position; /* 1 based */
+  size_t size;
+}XPathContext;
+
+#ifdef XML_STATS
+/* counters of the evaluation running on this thread, NULL if nobody asked */
+static _Thread_local XPathStats *xpath_stats;
+#define XPATH_STAT(field) do { if (xpath_stats) xpath_stats->field++; } while (0)
+#else
+#define XPATH_STAT(field) ((void)0)
+#endif
+
+static bool xpath_eval(const XPathAst *ast, const XPathContext *ctx, XPathValue *out);
+
+static bool xpath_test_match(const XPathStep *step, XPathItemType type, const XMLNode *node, const XMLAttr *attr) {
+  XPATH_STAT(nodes_visited);
+  if (step->axis == XPATH_AXIS_ATTRIBUTE) { /* principal node type: attribute */
+    switch (step->test) {
+      case XPATH_TEST_NODE: case XPATH_TEST_ANY: return true;
+      case XPATH_TEST_NAME:
+        if (step->by_atom) return attr->local == step->local && attr->ns == step->ns;
+        return strcmp(attr->key, step->name) == 0;
+      case XPATH_TEST_PREFIX:
+        if (step->by_atom) return attr->ns == step->ns;
+        return strncmp(attr->key, step->name, step->name_len) == 0;
+      default: return false;
+    }
+  }
+
+  switch (step->test) {
+    case XPATH_TEST_NODE:
+      return true;
+    case XPATH_TEST_TEXT:
+      return type == XPATH_ITEM_TEXT;
+    case XPATH_TEST_COMMENT:
+      return type == XPATH_ITEM_NODE && node->type == NT_COMMENT;
+    case XPATH_TEST_PI:
+      return false;
+    case XPATH_TEST_ANY:
+      return type == XPATH_ITEM_NODE && xpath_is_element(node);
+    case XPATH_TEST_NAME:
+      if (type != XPATH_ITEM_NODE || !xpath_is_element(node)) return false;
+      if (step->by_atom) return node->local == step->local && node->ns == step->ns;
+      return strcmp(node->name, step->name) == 0;
+    case XPATH_TEST_PREFIX:
+      if (type != XPATH_ITEM_NODE || !xpath_is_element(node)) return false;
+      if (step->by_atom) return node->ns == step->ns;
+      return strncmp(node->name, step->name, step->name_len) == 0;
+  }
+  return false;
+}
+
+/* add `node` if it passes the node test, return false once `limit` items were found */
+static bool xpath_axis_add(const XPathStep *step, XPathNodeSet *out, XPathItemType type, XMLNode *node, size_t limit) {
+  if (xpath_test_match(step, type, node, NULL)) {
+    xpath_nodeset_add(out, type, node, NULL);
+    if (limit && out->count >= limit) return false;
+  }
+  return true;
+}
+
+/* a lazily parsed `node` which can't have what `step` looks for: the skip index says so without building it */
+static bool xpath_axis_misses(const XPathStep *step, XMLNode *node, bool descendants) {
+  if (step->axis == XPATH_AXIS_ATTRIBUTE || step->test != XPATH_TEST_NAME || step->by_atom) return false;
+  return !XMLNodeMayContain(node, step->name, step->name_len, descendants);
+}
+
+/* the element's text comes first, then its children */
+static bool xpath_axis_children(const XPathStep *step, XMLNode *node, XPathNodeSet *out, size_t limit) {
+  if (xpath_axis_misses(step, node, false)) return true;
+  XMLNodeExpand(node); /* lazily parsed document */
+  if (node->text && !xpath_axis_add(step, out, XPATH_ITEM_TEXT, node, limit)) return false;
+  for (size_t i = 0; i < node->children.count; ++i) {
+    if (!xpath_axis_add(step, out, XPATH_ITEM_NODE, node->children.nodes[i], limit)) return false;
+  }
+  return true;
+}
+
+static bool xpath_axis_descendants(const XPathStep *step, XMLNode *node, XPathNodeSet *out, size_t limit) {
+  if (xpath_axis_misses(step, node, true)) return true;
+  XMLNodeExpand(node);
+  if (node->text && !xpath_axis_add(step, out, XPATH_ITEM_TEXT, node, limit)) return false;
+  for (size_t i = 0; i < node->children.count; ++i) {
+    XMLNode *child = node->children.nodes[i];
+    if (!xpath_axis_add(step, out, XPATH_ITEM_NODE, child, limit)) return false;
+    if (!xpath_axis_descendants(step, child, out, limit)) return false;
+  }
+  return true;
+}
+
+/* everything after `node`'s subtree, in document order */
+static bool xpath_axis_following(const XPathStep *step, XMLNode *node, XPathNodeSet *out, size_t limit) {
+  for (XMLNode *n = node; n->parent; n = n->parent) {
+    XMLNode *parent = n->parent;
+    for (size_t i = XMLNodeIndex(n) + 1; i < parent->children.count; ++i) {
+      XMLNode *sibling = parent->children.nodes[i];
+      if (!xpath_axis_add(step, out, XPATH_ITEM_NODE, sibling, limit)) return false;
+      if (!xpath_axis_descendants(step, sibling, out, limit)) return false;
+    }
+  }
+  return true;
+}
+
+/* reverse document order of a subtree: children last to first, each after its own descendants */
+static bool xpath_axis_descendants_reverse(const XPathStep *step, XMLNode *node, XPathNodeSet *out, size_t limit) {
+  XMLNodeExpand(node);
+  for (size_t i = node->children.count; i > 0; --i) {
+    XMLNode *child = node->children.nodes[i - 1];
+    if (!xpath_axis_descendants_reverse(step, child, out, limit)) return false;
+    if (!xpath_axis_add(step, out, XPATH_ITEM_NODE, child, limit)) return false;
+  }
+  if (node->text && !xpath_axis_add(step, out, XPATH_ITEM_TEXT, node, limit)) return false;
+  return true;
+}
+
+/* everything before `node` except its ancestors, in reverse document order */
+static bool xpath_axis_preceding(const XPathStep *step, XMLNode *node, XPathNodeSet *out, size_t limit) {
+  for (XMLNode *n = node; n->parent; n = n->parent) {
+    XMLNode *parent = n->parent;
+    for (size_t i = XMLNodeIndex(n); i > 0; --i) {
+      XMLNode *sibling = parent->children.nodes[i - 1];
+      if (!xpath_axis_descendants_reverse(step, sibling, out, limit)) return false;
+      if (!xpath_axis_add(step, out, XPATH_ITEM_NODE, sibling, limit)) return false;
+    }
+    if (parent->text && !xpath_axis_add(step, out, XPATH_ITEM_TEXT, parent, limit)) return false;
+  }
+  return true;
+}
+
+/* Collect the nodes of `step`'s axis from `item` which pass the node test, in axis order
+ * (reverse axes in reverse document order). Stops after `limit` nodes if it isn't 0.
+ * */
+static void xpath_axis_collect(const XPathStep *step, const XPathItem *item, XPathNodeSet *out, size_t limit) {
+  XMLNode *node = item->node;
+
+  if (item->type == XPATH_ITEM_ROOT) {
+    switch (step->axis) {
+      case XPATH_AXIS_SELF: case XPATH_AXIS_ANCESTOR_OR_SELF:
+        if (step->test == XPATH_TEST_NODE) xpath_nodeset_add(out, XPATH_ITEM_ROOT, node, NULL);
+        break;
+      case XPATH_AXIS_DESCENDANT_OR_SELF:
+        if (step->test == XPATH_TEST_NODE) xpath_nodeset_add(out, XPATH_ITEM_ROOT, node, NULL);
+        /* fall through */
+      case XPATH_AXIS_DESCENDANT:
+        if (xpath_axis_add(step, out, XPATH_ITEM_NODE, node, limit)) xpath_axis_descendants(step, node, out, limit);
+        break;
+      case XPATH_AXIS_CHILD:
+        xpath_axis_add(step, out, XPATH_ITEM_NODE, node, limit);
+        break;
+      default:
+        break;
+    }
+    return;
+  }
+
+  if (item->type != XPATH_ITEM_NODE) { /* text & attribute: only self & the ancestor axes */
+    switch (step->axis) {
+      case XPATH_AXIS_SELF: case XPATH_AXIS_DESCENDANT_OR_SELF: case XPATH_AXIS_ANCESTOR_OR_SELF:
+        if (xpath_test_match(step, item->type, node, item->attr) && step->axis != XPATH_AXIS_ATTRIBUTE) {
+          xpath_nodeset_add(out, item->type, node, item->attr);
+        }
+        if (step->axis != XPATH_AXIS_ANCESTOR_OR_SELF) break;
+        /* fall through */
+      case XPATH_AXIS_PARENT: case XPATH_AXIS_ANCESTOR: {
+        XPathItem owner = { XPATH_ITEM_NODE, node, NULL };
+        if (step->axis == XPATH_AXIS_PARENT) {
+          xpath_axis_add(step, out, XPATH_ITEM_NODE, node, limit);
+        } else {
+          XPathStep self_or_above = *step;
+          self_or_above.axis = XPATH_AXIS_ANCESTOR_OR_SELF;
+          xpath_axis_collect(&self_or_above, &owner, out, limit);
+        }
+        break;
+      }
+      case XPATH_AXIS_FOLLOWING: /* the owner's children come after its text & attributes */
+        XMLNodeExpand(node);
+        for (size_t i = 0; i < node->children.count; ++i) {
+          if (!xpath_axis_add(step, out, XPATH_ITEM_NODE, node->children.nodes[i], limit)) return;
+          if (!xpath_axis_descendants(step, node->children.nodes[i], out, limit)) return;
+        }
+        xpath_axis_following(step, node, out, limit);
+        break;
+      case XPATH_AXIS_PRECEDING:
+        xpath_axis_preceding(step, node, out, limit);
+        break;
+      default:
+        break;
+    }
+    return;
+  }
+
+  switch (step->axis) {
+    case XPATH_AXIS_CHILD:
+      xpath_axis_children(step, node, out, limit);
+      break;
+    case XPATH_AXIS_DESCENDANT_OR_SELF:
+      if (!xpath_axis_add(step, out, XPATH_ITEM_NODE, node, limit)) break;
+      /* fall through */
+    case XPATH_AXIS_DESCENDANT:
+      xpath_axis_descendants(step, node, out, limit);
+      break;
+    case XPATH_AXIS_SELF:
+      xpath_axis_add(step, out, XPATH_ITEM_NODE, node, limit);
+      break;
+    case XPATH_AXIS_PARENT:
+      if (node->parent) xpath_axis_add(step, out, XPATH_ITEM_NODE, node->parent, limit);
+      else if (step->test == XPATH_TEST_NODE) xpath_nodeset_add(out, XPATH_ITEM_ROOT, node, NULL);
+      break;
+    case XPATH_AXIS_ANCESTOR_OR_SELF:
+      if (!xpath_axis_add(step, out, XPATH_ITEM_NODE, node, limit)) break;
+      /* fall through */
+    case XPATH_AXIS_ANCESTOR: {
+      XMLNode *n = node;
+      for (; n->parent; n = n->parent) {
+        if (!xpath_axis_add(step, out, XPATH_ITEM_NODE, n->parent, limit)) return;
+      }
+      if (step->test == XPATH_TEST_NODE) xpath_nodeset_add(out, XPATH_ITEM_ROOT, n, NULL);
+      break;
+    }
+    case XPATH_AXIS_FOLLOWING_SIBLING:
+      if (node->parent == NULL) break;
+      for (size_t i = XMLNodeIndex(node) + 1; i < node->parent->children.count; ++i) {
+        if (!xpath_axis_add(step, out, XPATH_ITEM_NODE, node->parent->children.nodes[i], limit)) break;
+      }
+      break;
+    case XPATH_AXIS_PRECEDING_SIBLING:
+      if (node->parent == NULL) break;
+      for (size_t i = XMLNodeIndex(node); i > 0; --i) {
+        if (!xpath_axis_add(step, out, XPATH_ITEM_NODE, node->parent->children.nodes[i - 1], limit)) break;
+      }
+      break;
+    case XPATH_AXIS_FOLLOWING:
+      xpath_axis_following(step, node, out, limit);
+      break;
+    case XPATH_AXIS_PRECEDING:
+      xpath_axis_preceding(step, node, out, limit);
+      break;
+    case XPATH_AXIS_ATTRIBUTE:
+      for (size_t i = 0; i < node->attrList.count; ++i) {
+        XMLAttr *attr = &node->attrList.attrs[i];
+        if (xpath_test_match(step, XPATH_ITEM_ATTR, node, attr)) {
+          xpath_nodeset_add(out, XPATH_ITEM_ATTR, node, attr);
+          if (limit && out->count >= limit) break;
+        }
+      }
+      break;
+  }
+}
+
+static bool xpath_axis_is_reverse(XPathAxis axis) {
+  return axis == XPATH_AXIS_ANCESTOR || axis == XPATH_AXIS_ANCESTOR_OR_SELF ||
+         axis == XPATH_AXIS_PRECEDING || axis == XPATH_AXIS_PRECEDING_SIBLING;
+}
+
+/* keep the items of `set` for which `pred` is true; positions are counted in `set`'s order */
+static bool xpath_filter(const XPathAst *pred, XPathNodeSet *set) {
+  size_t n = 0;
+  for (size_t i = 0; i < set->count; ++i) {
+    XPathContext ctx = { set->items[i], i + 1, set->count };
+    XPathValue v = { 0 };
+    if (!xpath_eval(pred, &ctx, &v)) return false;
+    bool keep = v.type == XPATH_VALUE_NUMBER ? v.number == (double)(i + 1) : xpath_value_boolean(&v);
+    xpath_value_free(&v);
+    if (keep) set->items[n++] = set->items[i];
+  }
+  set->count = n;
+  return true;
+}
+
+/* apply `step` to every item of `input`, replacing it with the (document ordered) result */
+static bool xpath_eval_step(const XPathStep *step, XPathNodeSet *input) {
+  XPathNodeSet result = { 0 };
+  XPathNodeSet candidates = { 0 };
+
+  /* with [n] first and no other predicate, the axis walk can stop at the n-th match */
+  size_t limit = (step->index && step->predicates.count == 1) ? step->index : 0;
+
+  for (size_t i = 0; i < input->count; ++i) {
+    XPATH_STAT(steps);
+    candidates.count = 0;
+    xpath_axis_collect(step, &input->items[i], &candidates, limit);
+
+    size_t first_predicate = 0;
+    if (step->index) {
+      if (step->index <= candidates.count) {
+        candidates.items[0] = candidates.items[step->index - 1];
+        candidates.count = 1;
+      } else {
+        candidates.count = 0;
+      }
+      first_predicate = 1;
+    }
+    for (size_t j = first_predicate; j < step->predicates.count && candidates.count > 0; ++j) {
+      if (!xpath_filter(step->predicates.items[j], &candidates)) {
+        xpath_nodeset_free(&candidates);
+        xpath_nodeset_free(&result);
+        return false;
+      }
+    }
+    for (size_t j = 0; j < candidates.count; ++j) {
+      XPathItem *item = &candidates.items[j];
+      xpath_nodeset_add(&result, item->type, item->node, item->attr);
+    }
+  }
+  xpath_nodeset_free(&candidates);
+
+  if (input->count > 1 || xpath_axis_is_reverse(step->axis)) xpath_nodeset_normalize(&result);
+
+  xpath_nodeset_free(input);
+  *input = result;
+  return true;
+}
+
+static XMLNode *xpath_top(XMLNode *node) {
+  while (node->parent) node = node->parent;
+  return node;
+}
+
+static bool xpath_eval_path(const XPathAst *ast, const XPathContext *ctx, XPathValue *out) {
+  XPathNodeSet set = { 0 };
+
+  if (ast->filter) {
+    XPathValue v = { 0 };
+    if (!xpath_eval(ast->filter, ctx, &v)) return false;
+    if (v.type != XPATH_VALUE_NODESET) {
+      xpath_value_free(&v);
+      return false;
+    }
+    set = v.nodes;
+    for (size_t i = 0; i < ast->filter_predicates.count; ++i) {
+      if (!xpath_filter(ast->filter_predicates.items[i], &set)) {
+        xpath_nodeset_free(&set);
+        return false;
+      }
+    }
+  } else if (ast->absolute) {
+    xpath_nodeset_add(&set, XPATH_ITEM_ROOT, xpath_top(ctx->item.node), NULL);
+  } else {
+    xpath_nodeset_add(&set, ctx->item.type, ctx->item.node, ctx->item.attr);
+  }
+
+  for (size_t i = 0; i < ast->step_count && set.count > 0; ++i) {
+    if (!xpath_eval_step(&ast->steps[i], &set)) {
+      xpath_nodeset_free(&set);
+      return false;
+    }
+  }
+
+  memset(out, 0, sizeof(XPathValue));
+  out->type = XPATH_VALUE_NODESET;
+  out->nodes = set;
+  return true;
+}
+
+/* XPath 1.0, 3.4: comparisons with node-sets are true if any node compares true */
+static bool xpath_compare_atoms(XPathOp op, const XPathValue *a, const XPathValue *b) {
+  if (op == XPATH_OP_EQ || op == XPATH_OP_NE) {
+    bool eq = false;
+    if (a->type == XPATH_VALUE_BOOLEAN || b->type == XPATH_VALUE_BOOLEAN) {
+      eq = xpath_value_boolean(a) == xpath_value_boolean(b);
+    } else if (a->type == XPATH_VALUE_NUMBER || b->type == XPATH_VALUE_NUMBER) {
+      eq = xpath_value_number(a) == xpath_value_number(b);
+    } else {
+      eq = strcmp(a->string, b->string) == 0;
+    }
+    return op == XPATH_OP_EQ ? eq : !eq;
+  }
+
+  double x = xpath_value_number(a), y = xpath_value_number(b);
+  switch (op) {
+    case XPATH_OP_LT: return x < y;
+    case XPATH_OP_LE: return x <= y;
+    case XPATH_OP_GT: return x > y;
+    case XPATH_OP_GE: return x >= y;
+    default: return false;
+  }
+}
+
+static bool xpath_compare(XPathOp op, const XPathValue *a, const XPathValue *b) {
+  if (a->type == XPATH_VALUE_NODESET && b->type == XPATH_VALUE_BOOLEAN) {
+    XPathValue ba = { 0 };
+    xpath_set_boolean(&ba, xpath_value_boolean(a));
+    return xpath_compare_atoms(op, &ba, b);
+  }
+  if (b->type == XPATH_VALUE_NODESET && a->type == XPATH_VALUE_BOOLEAN) {
+    XPathValue bb = { 0 };
+    xpath_set_boolean(&bb, xpath_value_boolean(b));
+    return xpath_compare_atoms(op, a, &bb);
+  }
+
+  if (a->type == XPATH_VALUE_NODESET) {
+    for (size_t i = 0; i < a->nodes.count; ++i) {
+      XPathValue s = { 0 };
+      xpath_set_string(&s, xpath_item_string(&a->nodes.items[i]));
+      bool match = xpath_compare(op, &s, b);
+      xpath_value_free(&s);
+      if (match) return true;
+    }
+    return false;
+  }
+  if (b->type == XPATH_VALUE_NODESET) {
+    for (size_t i = 0; i < b->nodes.count; ++i) {
+      XPathValue s = { 0 };
+      xpath_set_string(&s, xpath_item_string(&b->nodes.items[i]));
+      bool match = xpath_compare(op, a, &s);
+      xpath_value_free(&s);
+      if (match) return true;
+    }
+    return false;
+  }
+  return xpath_compare_atoms(op, a, b);
+}
+
+/* evaluate argument `i` of a function */
+static bool xpath_eval_arg(const XPathAst *ast, size_t i, const XPathContext *ctx, XPathValue *out) {
+  return xpath_eval(ast->args.items[i], ctx, out);
+}
+
+static char *xpath_arg_string(const XPathAst *ast, size_t i, const XPathContext *ctx, bool *ok) {
+  XPathValue v = { 0 };
+  if (i >= ast->args.count) { /* default: the context node */
+    return xpath_item_string(&ctx->item);
+  }
+  if (!xpath_eval_arg(ast, i, ctx, &v)) {
+    *ok = false;
+    return strdup("");
+  }
+  char *s = xpath_value_string(&v);
+  xpath_value_free(&v);
+  return s;
+}
+
+static double xpath_arg_number(const XPathAst *ast, size_t i, const XPathContext *ctx, bool *ok) {
+  XPathValue v = { 0 };
+  if (!xpath_eval_arg(ast, i, ctx, &v)) {
+    *ok = false;
+    return NAN;
+  }
+  double n = xpath_value_number(&v);
+  xpath_value_free(&v);
+  return n;
+}
+
+/* the node-set argument `i`, or the context node when it is absent */
+static bool xpath_arg_nodeset(const XPathAst *ast, size_t i, const XPathContext *ctx, XPathValue *v) {
+  if (i >= ast->args.count) {
+    memset(v, 0, sizeof(XPathValue));
+    v->type = XPATH_VALUE_NODESET;
+    xpath_nodeset_add(&v->nodes, ctx->item.type, ctx->item.node, ctx->item.attr);
+    return true;
+  }
+  if (!xpath_eval_arg(ast, i, ctx, v)) return false;
+  if (v->type != XPATH_VALUE_NODESET) {
+    xpath_value_free(v);
+    return false;
+  }
+  return true;
+}
+
+static const char *xpath_item_name(const XPathItem *item) {
+  if (item->type == XPATH_ITEM_ATTR) return item->attr->key;
+  if (item->type == XPATH_ITEM_NODE && xpath_is_element(item->node)) return item->node->name;
+  return "";
+}
+
+static bool xpath_eval_function(const XPathAst *ast, const XPathContext *ctx, XPathValue *out) {
+  bool ok = true;
+  XPathValue v = { 0 };
+
+  switch (ast->function) {
+    case XPATH_FN_LAST:
+      xpath_set_number(out, (double)ctx->size);
+      return true;
+    case XPATH_FN_POSITION:
+      xpath_set_number(out, (double)ctx->position);
+      return true;
+    case XPATH_FN_COUNT:
+      if (!xpath_arg_nodeset(ast, 0, ctx, &v)) return false;
+      xpath_set_number(out, (double)v.nodes.count);
+      xpath_value_free(&v);
+      return true;
+    case XPATH_FN_NAME: case XPATH_FN_LOCAL_NAME: {
+      if (!xpath_arg_nodeset(ast, 0, ctx, &v)) return false;
+      const char *name = v.nodes.count ? xpath_item_name(&v.nodes.items[0]) : "";
+      if (ast->function == XPATH_FN_LOCAL_NAME && strchr(name, ':')) name = strchr(name, ':') + 1;
+      xpath_set_string(out, strdup(name));
+      xpath_value_free(&v);
+      return true;
+    }
+    case XPATH_FN_NAMESPACE_URI: {
+      if (!xpath_arg_nodeset(ast, 0, ctx, &v)) return false;
+      const char *uri = NULL;
+      if (v.nodes.count && v.nodes.items[0].type == XPATH_ITEM_ATTR) uri = XMLAtomString(v.nodes.items[0].attr->ns);
+      else if (v.nodes.count && v.nodes.items[0].type == XPATH_ITEM_NODE) uri = XMLAtomString(v.nodes.items[0].node->ns);
+      xpath_set_string(out, strdup(uri ? uri : ""));
+      xpath_value_free(&v);
+      return true;
+    }
+    case XPATH_FN_STRING:
+      xpath_set_string(out, xpath_arg_string(ast, 0, ctx, &ok));
+      return ok;
+    case XPATH_FN_CONCAT: {
+      XPathBuffer buf = { 0 };
+      for (size_t i = 0; i < ast->args.count && ok; ++i) {
+        char *s = xpath_arg_string(ast, i, ctx, &ok);
+        xpath_buffer_append(&buf, s, strlen(s));
+        free(s);
+      }
+      xpath_set_string(out, xpath_buffer_take(&buf));
+      return ok;
+    }
+    case XPATH_FN_STARTS_WITH: case XPATH_FN_CONTAINS: {
+      char *s = xpath_arg_string(ast, 0, ctx, &ok);
+      char *t = xpath_arg_string(ast, 1, ctx, &ok);
+      bool b = ast->function == XPATH_FN_CONTAINS ? strstr(s, t) != NULL : strncmp(s, t, strlen(t)) == 0;
+      xpath_set_boolean(out, b);
+      free(s);
+      free(t);
+      return ok;
+    }
+    case XPATH_FN_SUBSTRING_BEFORE: case XPATH_FN_SUBSTRING_AFTER: {
+      char *s = xpath_arg_string(ast, 0, ctx, &ok);
+      char *t = xpath_arg_string(ast, 1, ctx, &ok);
+      char *found = strstr(s, t);
+      if (found == NULL) xpath_set_string(out, strdup(""));
+      else if (ast->function == XPATH_FN_SUBSTRING_BEFORE) xpath_set_string(out, strndup(s, found - s));
+      else xpath_set_string(out, strdup(found + strlen(t)));
+      free(s);
+      free(t);
+      return ok;
+    }
+    case XPATH_FN_SUBSTRING: {
+      /* positions are in characters: count UTF-8 lead bytes */
+      char *s = xpath_arg_string(ast, 0, ctx, &ok);
+      double start = round(xpath_arg_number(ast, 1, ctx, &ok));
+      double end = ast->args.count > 2 ? start + round(xpath_arg_number(ast, 2, ctx, &ok)) : INFINITY;
+      XPathBuffer buf = { 0 };
+      double pos = 0;
+      for (const char *p = s; *p; ) {
+        size_t len = 1;
+        while ((p[len] & 0xC0) == 0x80) len++;
+        pos++;
+        if (pos >= start && pos < end) xpath_buffer_append(&buf, p, len);
+        p += len;
+      }
+      xpath_set_string(out, xpath_buffer_take(&buf));
+      free(s);
+      return ok;
+    }
+    case XPATH_FN_STRING_LENGTH: {
+      char *s = xpath_arg_string(ast, 0, ctx, &ok);
+      size_t n = 0;
+      for (const char *p = s; *p; ++p) if ((*p & 0xC0) != 0x80) n++;
+      xpath_set_number(out, (double)n);
+      free(s);
+      return ok;
+    }
+    case XPATH_FN_NORMALIZE_SPACE: {
+      char *s = xpath_arg_string(ast, 0, ctx, &ok);
+      char *d = s;
+      bool space = false;
+      for (const char *p = s; *p; ++p) {
+        if (isspace((unsigned char)*p)) {
+          space = d != s;
+        } else {
+          if (space) *d++ = ' ';
+          space = false;
+          *d++ = *p;
+        }
+      }
+      *d = '\0';
+      xpath_set_string(out, s);
+      return ok;
+    }
+    case XPATH_FN_BOOLEAN: case XPATH_FN_NOT:
+      if (!xpath_eval_arg(ast, 0, ctx, &v)) return false;
+      xpath_set_boolean(out, xpath_value_boolean(&v) == (ast->function == XPATH_FN_BOOLEAN));
+      xpath_value_free(&v);
+      return true;
+    case XPATH_FN_TRUE: case XPATH_FN_FALSE:
+      xpath_set_boolean(out, ast->function == XPATH_FN_TRUE);
+      return true;
+    case XPATH_FN_NUMBER:
+      if (ast->args.count == 0) {
+        char *s = xpath_item_string(&ctx->item);
+        xpath_set_number(out, xpath_string_to_number(s));
+        free(s);
+        return true;
+      }
+      xpath_set_number(out, xpath_arg_number(ast, 0, ctx, &ok));
+      return ok;
+    case XPATH_FN_SUM: {
+      double sum = 0;
+      if (!xpath_arg_nodeset(ast, 0, ctx, &v)) return false;
+      for (size_t i = 0; i < v.nodes.count; ++i) {
+        char *s = xpath_item_string(&v.nodes.items[i]);
+        sum += xpath_string_to_number(s);
+        free(s);
+      }
+      xpath_value_free(&v);
+      xpath_set_number(out, sum);
+      return true;
+    }
+    case XPATH_FN_FLOOR:
+      xpath_set_number(out, floor(xpath_arg_number(ast, 0, ctx, &ok)));
+      return ok;
+    case XPATH_FN_CEILING:
+      xpath_set_number(out, ceil(xpath_arg_number(ast, 0, ctx, &ok)));
+      return ok;
+    case XPATH_FN_ROUND:
+      xpath_set_number(out, floor(xpath_arg_number(ast, 0, ctx, &ok) + 0.5));
+      return ok;
+  }
+  return false;
+}
+
+static bool xpath_eval(const XPathAst *ast, const XPathContext *ctx, XPathValue *out) {
+  XPathValue a = { 0 }, b = { 0 };
+  bool ok = true;
+
+  switch (ast->op) {
+    case XPATH_OP_OR: case XPATH_OP_AND: {
+      if (!xpath_eval(ast->left, ctx, &a)) return false;
+      bool left = xpath_value_boolean(&a);
+      xpath_value_free(&a);
+      if (left == (ast->op == XPATH_OP_OR)) { /* short circuit */
+        xpath_set_boolean(out, left);
+        return true;
+      }
+      if (!xpath_eval(ast->right, ctx, &b)) return false;
+      xpath_set_boolean(out, xpath_value_boolean(&b));
+      xpath_value_free(&b);
+      return true;
+    }
+    case XPATH_OP_EQ: case XPATH_OP_NE: case XPATH_OP_LT: case XPATH_OP_LE: case XPATH_OP_GT: case XPATH_OP_GE:
+      if (!xpath_eval(ast->left, ctx, &a)) return false;
+      if (!xpath_eval(ast->right, ctx, &b)) {
+        xpath_value_free(&a);
+        return false;
+      }
+      xpath_set_boolean(out, xpath_compare(ast->op, &a, &b));
+      xpath_value_free(&a);
+      xpath_value_free(&b);
+      return true;
+    case XPATH_OP_ADD: case XPATH_OP_SUB: case XPATH_OP_MUL: case XPATH_OP_DIV: case XPATH_OP_MOD: {
+      if (!xpath_eval(ast->left, ctx, &a)) return false;
+      if (!xpath_eval(ast->right, ctx, &b)) {
+        xpath_value_free(&a);
+        return false;
+      }
+      double x = xpath_value_number(&a), y = xpath_value_number(&b), r = 0;
+      switch (ast->op) {
+        case XPATH_OP_ADD: r = x + y; break;
+        case XPATH_OP_SUB: r = x - y; break;
+        case XPATH_OP_MUL: r = x * y; break;
+        case XPATH_OP_DIV: r = x / y; break;
+        default: r = fmod(x, y); break;
+      }
+      xpath_value_free(&a);
+      xpath_value_free(&b);
+      xpath_set_number(out, r);
+      return true;
+    }
+    case XPATH_OP_NEG:
+      if (!xpath_eval(ast->left, ctx, &a)) return false;
+      xpath_set_number(out, -xpath_value_number(&a));
+      xpath_value_free(&a);
+      return true;
+    case XPATH_OP_UNION:
+      if (!xpath_eval(ast->left, ctx, &a)) return false;
+      if (!xpath_eval(ast->right, ctx, &b) || a.type != XPATH_VALUE_NODESET || b.type != XPATH_VALUE_NODESET) {
+        xpath_value_free(&a);
+        xpath_value_free(&b);
+        return false;
+      }
+      for (size_t i = 0; i < b.nodes.count; ++i) {
+        XPathItem *item = &b.nodes.items[i];
+        xpath_nodeset_add(&a.nodes, item->type, item->node, item->attr);
+      }
+      xpath_value_free(&b);
+      xpath_nodeset_normalize(&a.nodes);
+      *out = a;
+      return true;
+    case XPATH_OP_NUMBER:
+      xpath_set_number(out, ast->number);
+      return true;
+    case XPATH_OP_STRING:
+      xpath_set_string(out, strdup(ast->string));
+      return true;
+    case XPATH_OP_FUNCTION:
+      ok = xpath_eval_function(ast, ctx, out);
+      if (!ok) xpath_value_free(out);
+      return ok;
+    case XPATH_OP_PATH:
+      return xpath_eval_path(ast, ctx, out);
+  }
+  return false;
+}
+
+bool xpath_evaluate(const XPathExpr *expr, XMLNode *node, XPathValue *result) {
+  if (expr == NULL || node == NULL || result == NULL) return false;
+  XPathContext ctx = { { XPATH_ITEM_NODE, node, NULL }, 1, 1 };
+  memset(result, 0, sizeof(XPathValue));
+  return xpath_eval(expr->ast, &ctx, result);
+}
+
+bool xpath_evaluate_stats(const XPathExpr *expr, XMLNode *node, XPathValue *result, XPathStats *stats) {
+  if (stats) memset(stats, 0, sizeof(XPathStats));
+#ifdef XML_STATS
+  xpath_stats = stats;
+  bool ok = xpath_evaluate(expr, node, result);
+  xpath_stats = NULL;
+  return ok;
+#else
+  return xpath_evaluate(expr, node, result);
+#endif
+}
+
+/******************************************************************************
+ * Query cache: direct mapped, a new result replaces the one in its slot
+ ******************************************************************************/
+typedef struct XPathCacheEntry {
+  unsigned long expr_id; /* 0: empty */
+  const XMLNode *node;
+  XPathValue value;
+}XPathCacheEntry;
+
+struct XPathCache {
+  const XMLDocument *doc;
+  unsigned long generation;
+  size_t mask;
+  XPathCacheEntry *entries;
+};
+
+XPathCache *xpath_cache_new(const XMLDocument *doc, size_t slots) {
+  size_t capacity = 1;
+  if (doc == NULL) return NULL;
+  if (slots == 0) slots = 256;
+  while (capacity < slots) capacity *= 2;
+
+  XPathCache *cache = (XPathCache *)calloc(1, sizeof(XPathCache));
+  if (cache == NULL) return NULL;
+  cache->entries = (XPathCacheEntry *)calloc(capacity, sizeof(XPathCacheEntry));
+  if (cache->entries == NULL) {
+    free(cache);
+    return NULL;
+  }
+  cache->doc = doc;
+  cache->generation = doc->generation;
+  cache->mask = capacity - 1;
+  return cache;
+}
+
+void xpath_cache_clear(XPathCache *cache) {
+  if (cache == NULL) return;
+  for (size_t i = 0; i <= cache->mask; ++i) {
+    XPathCacheEntry *entry = &cache->entries[i];
+    if (entry->expr_id == 0) continue;
+    xpath_value_free(&entry->value);
+    entry->expr_id = 0;
+    entry->node = NULL;
+  }
+  cache->generation = cache->doc->generation;
+}
+
+void xpath_cache_free(XPathCache *cache) {
+  if (cache == NULL) return;
+  xpath_cache_clear(cache);
+  free(cache->entries);
+  free(cache);
+}
+
+const XPathValue *xpath_cache_evaluate(XPathCache *cache, const XPathExpr *expr, XMLNode *node) {
+  if (cache == NULL || expr == NULL || node == NULL) return NULL;
+  if (cache->generation != cache->doc->generation) xpath_cache_clear(cache);
+
+  size_t hash = (size_t)expr->id * 0x9E3779B97F4A7C15ULL ^ ((uintptr_t)node >> 4);
+  XPathCacheEntry *entry = &cache->entries[(hash ^ (hash >> 17)) & cache->mask];
+  if (entry->expr_id == expr->id && entry->node == node) return &entry->value;
+
+  XPathValue value;
+  if (!xpath_evaluate(expr, node, &value)) return NULL;
+  if (entry->expr_id != 0) xpath_value_free(&entry->value);
+  entry->expr_id = expr->id;
+  entry->node = node;
+  entry->value = value;
+  return &entry->value;
+}
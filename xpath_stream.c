@@ -0,0 +1,605 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include "xml_lexer.h"
+#include "xpath_stream.h"
+
+#define NEXT(lexer) lexer_next_token((lexer))
+
+typedef enum StreamPredicateOp {
+  STREAM_PRED_EXISTS, /* [@key] */
+  STREAM_PRED_EQ,     /* [@key='value'] */
+  STREAM_PRED_NE      /* [@key!='value'] */
+}StreamPredicateOp;
+
+typedef struct StreamPredicate {
+  StreamPredicateOp op;
+  char *key;
+  char *value;
+}StreamPredicate;
+
+typedef struct StreamStep {
+  bool descendant;   /* `//name` instead of `/name` */
+  char *name;        /* NULL: `*` */
+  size_t predicate_count;
+  StreamPredicate *predicates;
+}StreamStep;
+
+typedef enum StreamTarget {
+  STREAM_TARGET_ELEMENT,
+  STREAM_TARGET_ATTR,  /* /@name, /@* */
+  STREAM_TARGET_TEXT   /* /text() */
+}StreamTarget;
+
+typedef struct StreamPath {
+  size_t step_count;
+  StreamStep *steps;
+  StreamTarget target;
+  char *attr_name;    /* STREAM_TARGET_ATTR, NULL: `@*` */
+  XPathStreamFn fn;
+  void *user_data;
+}StreamPath;
+
+/* (path, step): the children of the element owning the state must match `step` of `path` next */
+typedef struct StreamState {
+  size_t path;
+  size_t step;
+}StreamState;
+
+/* element which is open while lexing */
+typedef struct StreamLevel {
+  XMLNode *node;
+  size_t state_begin;  /* states for the children, in XPathStream.states */
+  size_t match_begin;  /* paths matched by this element, in XPathStream.matches */
+  bool captured;       /* the node is part of a subtree which is materialised */
+}StreamLevel;
+
+struct XPathStream {
+  size_t path_count;
+  StreamPath *paths;
+
+  /* stacks, indexed by StreamLevel */
+  size_t state_count, state_capacity;
+  StreamState *states;
+  size_t match_count, match_capacity;
+  size_t *matches;
+  size_t depth, depth_capacity;
+  StreamLevel *levels;
+
+  /* decoding buffers for text() & attribute values */
+  char *raw;
+  char *decoded;
+  size_t text_capacity;
+
+  bool stopped;
+};
+
+/******************************************************************************
+ * Paths
+ ******************************************************************************/
+static bool stream_is_name_char(char ch) {
+  return ch && !strchr("/[]@=!'\"*() \t\r\n", ch);
+}
+
+/* the end of the name at `s`, `s` if there is none: `.` and `..` are not names, a name doesn't start with a `.` */
+static const char *stream_skip_name(const char *s) {
+  if (*s == '.') return s;
+  while (stream_is_name_char(*s)) s++;
+  return s;
+}
+
+/* `[@key]`, `[@key='value']`, `[@key!='value']` */
+static bool stream_parse_predicate(const char **p, StreamStep *step) {
+  const char *s = *p;
+  StreamPredicate pred = { STREAM_PRED_EXISTS, NULL, NULL };
+
+  if (*s++ != '[' || *s++ != '@') return false;
+  const char *key = s;
+  s = stream_skip_name(s);
+  if (s == key) return false;
+
+  if (*s == '=' || (s[0] == '!' && s[1] == '=')) {
+    const char *op = s;
+    pred.op = *op == '=' ? STREAM_PRED_EQ : STREAM_PRED_NE;
+    s += pred.op == STREAM_PRED_EQ ? 1 : 2;
+    char quote = *s++;
+    if (quote != '\'' && quote != '"') return false;
+    const char *end = strchr(s, quote);
+    if (end == NULL) return false;
+    pred.key = strndup(key, op - key);
+    pred.value = strndup(s, end - s);
+    s = end + 1;
+  } else {
+    pred.key = strndup(key, s - key);
+  }
+  if (*s++ != ']') {
+    free(pred.key);
+    free(pred.value);
+    return false;
+  }
+
+  step->predicates = (StreamPredicate *)realloc(step->predicates, sizeof(StreamPredicate) * (step->predicate_count + 1));
+  step->predicates[step->predicate_count++] = pred;
+  *p = s;
+  return true;
+}
+
+static void stream_path_free(StreamPath *path) {
+  for (size_t i = 0; i < path->step_count; ++i) {
+    StreamStep *step = &path->steps[i];
+    for (size_t j = 0; j < step->predicate_count; ++j) {
+      free(step->predicates[j].key);
+      free(step->predicates[j].value);
+    }
+    free(step->predicates);
+    free(step->name);
+  }
+  free(path->steps);
+  free(path->attr_name);
+}
+
+static bool stream_parse_path(const char *s, StreamPath *path) {
+  memset(path, 0, sizeof(StreamPath));
+  if (*s != '/') return false; /* absolute paths only */
+
+  while (*s) {
+    bool descendant = false;
+    if (s[0] == '/' && s[1] == '/') {
+      descendant = true;
+      s += 2;
+    } else if (s[0] == '/') {
+      s += 1;
+    } else {
+      return false;
+    }
+
+    if (*s == '@') { /* the last step: an attribute */
+      const char *name = ++s;
+      if (*s == '*') s++;
+      else s = stream_skip_name(s);
+      if (s == name || *s || descendant) return false;
+      path->target = STREAM_TARGET_ATTR;
+      if (*name != '*') path->attr_name = strndup(name, s - name);
+      break;
+    }
+    if (!strcmp(s, "text()")) {
+      if (descendant) return false;
+      path->target = STREAM_TARGET_TEXT;
+      break;
+    }
+
+    const char *name = s;
+    if (*s == '*') s++;
+    else s = stream_skip_name(s);
+    if (s == name) return false;
+
+    path->steps = (StreamStep *)realloc(path->steps, sizeof(StreamStep) * (path->step_count + 1));
+    StreamStep *step = &path->steps[path->step_count++];
+    memset(step, 0, sizeof(StreamStep));
+    step->descendant = descendant;
+    if (*name != '*') step->name = strndup(name, s - name);
+
+    while (*s == '[') {
+      if (!stream_parse_predicate(&s, step)) return false;
+    }
+  }
+
+  return path->step_count > 0;
+}
+
+XPathStream *xpath_stream_new(void) {
+  return (XPathStream *)calloc(1, sizeof(XPathStream));
+}
+
+bool xpath_stream_add(XPathStream *stream, const char *path, XPathStreamFn fn, void *user_data) {
+  StreamPath parsed;
+  if (stream == NULL || path == NULL || fn == NULL) return false;
+  if (!stream_parse_path(path, &parsed)) {
+    stream_path_free(&parsed);
+    return false;
+  }
+  parsed.fn = fn;
+  parsed.user_data = user_data;
+
+  stream->paths = (StreamPath *)realloc(stream->paths, sizeof(StreamPath) * (stream->path_count + 1));
+  stream->paths[stream->path_count++] = parsed;
+  return true;
+}
+
+void xpath_stream_free(XPathStream *stream) {
+  if (stream == NULL) return;
+  for (size_t i = 0; i < stream->path_count; ++i) stream_path_free(&stream->paths[i]);
+  free(stream->paths);
+  free(stream->states);
+  free(stream->matches);
+  free(stream->levels);
+  free(stream->raw);
+  free(stream->decoded);
+  free(stream);
+}
+
+/******************************************************************************
+ * Matching
+ ******************************************************************************/
+static void stream_add_state(XPathStream *stream, size_t begin, size_t path, size_t step) {
+  for (size_t i = begin; i < stream->state_count; ++i) { /* `//a//b` may reach a state twice */
+    if (stream->states[i].path == path && stream->states[i].step == step) return;
+  }
+  if (stream->state_count >= stream->state_capacity) {
+    stream->state_capacity = stream->state_capacity ? stream->state_capacity * 2 : 16;
+    stream->states = (StreamState *)realloc(stream->states, sizeof(StreamState) * stream->state_capacity);
+  }
+  stream->states[stream->state_count].path = path;
+  stream->states[stream->state_count].step = step;
+  stream->state_count++;
+}
+
+static void stream_add_match(XPathStream *stream, size_t path) {
+  if (stream->match_count >= stream->match_capacity) {
+    stream->match_capacity = stream->match_capacity ? stream->match_capacity * 2 : 16;
+    stream->matches = (size_t *)realloc(stream->matches, sizeof(size_t) * stream->match_capacity);
+  }
+  stream->matches[stream->match_count++] = path;
+}
+
+/* `text`(`len` bytes) with the entities & CDATA sections replaced, valid until the next call */
+static const char *stream_decode(XPathStream *stream, const char *text, size_t len) {
+  if (stream->text_capacity < len + 1) {
+    stream->text_capacity = len + 1;
+    stream->raw = (char *)realloc(stream->raw, stream->text_capacity);
+    stream->decoded = (char *)realloc(stream->decoded, stream->text_capacity);
+  }
+  memcpy(stream->raw, text, len);
+  stream->raw[len] = '\0';
+
+  XMLNode chunk = { 0 };
+  chunk.text = stream->raw;
+  XMLDecodeTextTo(&chunk, stream->decoded, stream->text_capacity);
+  return stream->decoded;
+}
+
+/* the decoded value of attribute `key` of `node` */
+static const char *stream_attr_value(XPathStream *stream, const XMLNode *node, const char *key) {
+  for (size_t i = 0; i < node->attrList.count; ++i) {
+    const XMLAttr *attr = &node->attrList.attrs[i];
+    if (!strcmp(attr->key, key)) return stream_decode(stream, attr->value, strlen(attr->value));
+  }
+  return NULL;
+}
+
+static bool stream_step_match(XPathStream *stream, const StreamStep *step, const XMLNode *node) {
+  if (step->name && strcmp(step->name, node->name) != 0) return false;
+  for (size_t i = 0; i < step->predicate_count; ++i) {
+    const StreamPredicate *pred = &step->predicates[i];
+    const char *value = stream_attr_value(stream, node, pred->key);
+    if (value == NULL) return false;
+    if (pred->op == STREAM_PRED_EQ && strcmp(value, pred->value) != 0) return false;
+    if (pred->op == STREAM_PRED_NE && strcmp(value, pred->value) == 0) return false;
+  }
+  return true;
+}
+
+static void stream_call(XPathStream *stream, const StreamPath *path, XMLNode *node, const char *value) {
+  if (stream->stopped) return;
+  if (!path->fn(node, value, path->user_data)) stream->stopped = true;
+}
+
+/* The start tag of `level->node` was read: advance the states of its parent,
+ * report attribute matches and record which paths it completes.
+ * */
+static void stream_open(XPathStream *stream, StreamLevel *level, size_t parent_begin, size_t parent_end) {
+  XMLNode *node = level->node;
+  level->state_begin = stream->state_count;
+  level->match_begin = stream->match_count;
+
+  for (size_t i = parent_begin; i < parent_end; ++i) {
+    StreamState state = stream->states[i];
+    const StreamPath *path = &stream->paths[state.path];
+    const StreamStep *step = &path->steps[state.step];
+
+    if (step->descendant) stream_add_state(stream, level->state_begin, state.path, state.step);
+    if (!stream_step_match(stream, step, node)) continue;
+
+    if (state.step + 1 < path->step_count) {
+      stream_add_state(stream, level->state_begin, state.path, state.step + 1);
+      continue;
+    }
+
+    switch (path->target) {
+      case STREAM_TARGET_ELEMENT:
+        level->captured = true;
+        /* fall through */
+      case STREAM_TARGET_TEXT:
+        stream_add_match(stream, state.path);
+        break;
+      case STREAM_TARGET_ATTR:
+        for (size_t j = 0; j < node->attrList.count; ++j) {
+          XMLAttr *attr = &node->attrList.attrs[j];
+          if (path->attr_name && strcmp(path->attr_name, attr->key) != 0) continue;
+          stream_call(stream, path, node, stream_decode(stream, attr->value, strlen(attr->value)));
+        }
+        break;
+    }
+  }
+}
+
+/* a text chunk of `level->node` */
+static void stream_text(XPathStream *stream, StreamLevel *level, const char *text, size_t len) {
+  if (stream->match_count == level->match_begin) return;
+
+  bool any = false;
+  for (size_t i = level->match_begin; i < stream->match_count; ++i) {
+    if (stream->paths[stream->matches[i]].target == STREAM_TARGET_TEXT) any = true;
+  }
+  if (!any) return;
+
+  const char *decoded = stream_decode(stream, text, len);
+  for (size_t i = level->match_begin; i < stream->match_count; ++i) {
+    const StreamPath *path = &stream->paths[stream->matches[i]];
+    if (path->target == STREAM_TARGET_TEXT) stream_call(stream, path, level->node, decoded);
+  }
+}
+
+/******************************************************************************
+ * Nodes: plain malloc'd nodes, like the ones of a document parsed without a context
+ ******************************************************************************/
+static XMLNode *stream_node_new(XMLNode *parent, NodeType type) {
+  XMLNode *node = (XMLNode *)calloc(1, sizeof(XMLNode));
+  node->type = type;
+  XMLAttrListInit(&node->attrList);
+  XMLNodeListInit(&node->children);
+  if (parent) {
+    node->parent = parent;
+    node->index = parent->children.count;
+    XMLNodeListAdd(&parent->children, node);
+  }
+  return node;
+}
+
+/* free `node` and its subtree */
+static void stream_node_free(XMLNode *node) {
+  XMLNodeList owner;
+  XMLNodeListInit(&owner);
+  XMLNodeListAdd(&owner, node);
+  XMLNodeListFree(&owner);
+}
+
+static void stream_push(XPathStream *stream, XMLNode *node, bool captured) {
+  if (stream->depth >= stream->depth_capacity) {
+    stream->depth_capacity = stream->depth_capacity ? stream->depth_capacity * 2 : 16;
+    stream->levels = (StreamLevel *)realloc(stream->levels, sizeof(StreamLevel) * stream->depth_capacity);
+  }
+  StreamLevel *level = &stream->levels[stream->depth++];
+  level->node = node;
+  level->captured = captured;
+}
+
+/******************************************************************************
+ * Parsing
+ ******************************************************************************/
+
+/* the start tag after '<': name & attributes. Returns the node, or NULL on error. */
+static XMLNode *stream_start_tag(lexer_t *lexer, XMLNode *parent) {
+  if (!lexer_expect_peek(lexer, TOKEN_NAME)) return NULL;
+  XMLNode *node = stream_node_new(parent, NT_NODE);
+  node->name = strndup(lexer->cur_token.literal, lexer->cur_token.len);
+  NEXT(lexer);
+
+  while (!lexer_cur_token_is(lexer, TOKEN_CLOSE_TAG) && !lexer_cur_token_is(lexer, TOKEN_CLOSESLASH_TAG)) {
+    XMLAttr attr = { 0 };
+    if (!lexer_cur_token_is(lexer, TOKEN_NAME)) break;
+    attr.node = node;
+    attr.key = strndup(lexer->cur_token.literal, lexer->cur_token.len);
+    if (!lexer_expect_peek(lexer, TOKEN_ASSIGN) || !lexer_expect_peek(lexer, TOKEN_STRING)) {
+      free(attr.key);
+      break;
+    }
+    attr.value = strndup(lexer->cur_token.literal, lexer->cur_token.len);
+    XMLAttrListAdd(&node->attrList, &attr);
+    NEXT(lexer);
+  }
+
+  if (!lexer_cur_token_is(lexer, TOKEN_CLOSE_TAG) && !lexer_cur_token_is(lexer, TOKEN_CLOSESLASH_TAG)) {
+    if (parent == NULL) stream_node_free(node); /* a captured node is freed with its subtree */
+    return NULL;
+  }
+  return node;
+}
+
+/* The element on top of the stack is complete: report it, then drop it unless
+ * it belongs to a subtree which is still being materialised.
+ * */
+static void stream_close(XPathStream *stream) {
+  StreamLevel *level = &stream->levels[stream->depth - 1];
+  for (size_t i = level->match_begin; i < stream->match_count; ++i) {
+    const StreamPath *path = &stream->paths[stream->matches[i]];
+    if (path->target == STREAM_TARGET_ELEMENT) stream_call(stream, path, level->node, NULL);
+  }
+
+  if (level->node->parent == NULL) stream_node_free(level->node);
+  stream->state_count = level->state_begin;
+  stream->match_count = level->match_begin;
+  stream->depth--;
+}
+
+/* free what is still open after an error or a stop */
+static void stream_unwind(XPathStream *stream) {
+  for (size_t i = stream->depth; i > 0; --i) {
+    XMLNode *node = stream->levels[i - 1].node;
+    if (node->parent == NULL) stream_node_free(node);
+  }
+  stream->depth = 0;
+  stream->state_count = 0;
+  stream->match_count = 0;
+}
+
+/* Input of `xpath_stream_parse_file`: read in chunks, and what was lexed is dropped(`stream_compact`) */
+#define XPATH_STREAM_CHUNK 65536
+
+typedef struct StreamInput {
+  FILE *fp;
+  char *buf;
+  size_t len, capacity;
+  bool error;
+}StreamInput;
+
+static bool stream_refill(lexer_t *lexer, void *user_data) {
+  StreamInput *in = (StreamInput *)user_data;
+  if (in->error || feof(in->fp)) return false;
+  if (in->capacity - in->len < XPATH_STREAM_CHUNK + 1) {
+    size_t capacity = in->capacity ? in->capacity : XPATH_STREAM_CHUNK * 4;
+    while (capacity - in->len < XPATH_STREAM_CHUNK + 1) capacity *= 2;
+    char *buf = (char *)realloc(in->buf, capacity);
+    if (buf == NULL) {
+      in->error = true;
+      return false;
+    }
+    in->buf = buf;
+    in->capacity = capacity;
+  }
+  size_t n = fread(in->buf + in->len, 1, in->capacity - in->len - 1, in->fp);
+  if (ferror(in->fp) || in->len + n > INT_MAX) in->error = true; /* the lexer's offsets are ints */
+  if (n == 0 || in->error) return false;
+  in->len += n;
+  in->buf[in->len] = '\0';
+  lexer_rebase(lexer, in->buf, (int)in->len);
+  return true;
+}
+
+/* drop the input before `keep` once it is the larger part of the buffer. Returns the number of bytes dropped. */
+static size_t stream_compact(lexer_t *lexer, StreamInput *in, size_t keep) {
+  if (in == NULL || keep < XPATH_STREAM_CHUNK || keep < in->len / 2) return 0;
+  memmove(in->buf, in->buf + keep, in->len - keep + 1);
+  in->len -= keep;
+  lexer_discard(lexer, in->buf, (int)in->len, (int)keep);
+  return keep;
+}
+
+/* the start tag at `tag` was read(up to its `>`): step over its content and end tag, checking that the tags
+ * match, and go on lexing after it. Returns false if it does not end well.
+ * */
+static bool stream_skip(lexer_t *lexer, StreamInput *in, int tag) {
+  lexer_skip_t skip = { 0 };
+  int position = tag, result = 0;
+
+  while ((result = lexer_skip_resume(&skip, lexer->input, lexer->input_len, &position)) == 0) {
+    if (in == NULL) break;
+    position -= (int)stream_compact(lexer, in, (size_t)position);
+    if (!stream_refill(lexer, in)) break;
+  }
+  lexer_skip_free(&skip);
+  if (result != 1) return false;
+  lexer_seek(lexer, position);
+  return true;
+}
+
+static bool stream_parse(XPathStream *stream, lexer_t *lexer, StreamInput *in) {
+  bool ok = true;
+
+  lexer_set_flags(lexer, LEXER_NO_POSITIONS);
+  NEXT(lexer);
+  NEXT(lexer);
+  stream->stopped = false;
+
+  /* the document level: every path starts here */
+  for (size_t i = 0; i < stream->path_count; ++i) stream_add_state(stream, 0, i, 0);
+
+  /* nodes before root */
+  while (lexer_cur_token_is(lexer, TOKEN_DOCTYPE) || lexer_cur_token_is(lexer, TOKEN_COMMENT) ||
+         lexer_cur_token_is(lexer, TOKEN_CDATA) || lexer_cur_token_is(lexer, TOKEN_PI)) {
+    NEXT(lexer);
+  }
+  if (!lexer_cur_token_is(lexer, TOKEN_OPEN_TAG)) ok = false;
+
+  bool done = false;
+  while (ok && !done && !stream->stopped) {
+    StreamLevel *top = stream->depth ? &stream->levels[stream->depth - 1] : NULL;
+    if (!lexer_cur_token_is(lexer, TOKEN_EOF)) stream_compact(lexer, in, (size_t)(lexer->cur_token.literal - lexer->input));
+
+    if (lexer_cur_token_is(lexer, TOKEN_OPEN_TAG)) {
+      bool captured = top && top->captured;
+      int tag = (int)(lexer->cur_token.literal - lexer->input);
+      XMLNode *node = stream_start_tag(lexer, captured ? top->node : NULL);
+      if (node == NULL) {
+        ok = false;
+        break;
+      }
+      size_t parent_begin = top ? top->state_begin : 0;
+      size_t parent_end = stream->state_count;
+      stream_push(stream, node, captured);
+      stream_open(stream, &stream->levels[stream->depth - 1], parent_begin, parent_end);
+
+      StreamLevel *level = &stream->levels[stream->depth - 1];
+      if (lexer_cur_token_is(lexer, TOKEN_CLOSESLASH_TAG)) {
+        stream_close(stream);
+        done = stream->depth == 0;
+      } else if (!level->captured && stream->state_count == level->state_begin && stream->match_count == level->match_begin) {
+        /* nothing can match inside: jump over the content without lexing it */
+        if (!stream_skip(lexer, in, tag)) {
+          ok = false;
+          break;
+        }
+        stream_close(stream);
+        done = stream->depth == 0;
+        continue;
+      }
+      NEXT(lexer);
+    } else if (top == NULL) {
+      ok = false;
+    } else if (lexer_cur_token_is(lexer, TOKEN_OPENSLASH_TAG)) {
+      if (!lexer_expect_peek(lexer, TOKEN_NAME) || strlen(top->node->name) != (size_t)lexer->cur_token.len ||
+          strncmp(top->node->name, lexer->cur_token.literal, lexer->cur_token.len) != 0) {
+        ok = false;
+        break;
+      }
+      NEXT(lexer);
+      stream_close(stream);
+      done = stream->depth == 0;
+      NEXT(lexer);
+    } else if (lexer_cur_token_is(lexer, TOKEN_TEXT) || lexer_cur_token_is(lexer, TOKEN_CDATA)) {
+      if (top->captured) { /* same as the DOM: the last chunk is the text */
+        free(top->node->text);
+        top->node->text = strndup(lexer->cur_token.literal, lexer->cur_token.len);
+        top->node->type = lexer_cur_token_is(lexer, TOKEN_TEXT) ? NT_TEXT : NT_CDATA;
+      }
+      stream_text(stream, top, lexer->cur_token.literal, lexer->cur_token.len);
+      NEXT(lexer);
+    } else if (lexer_cur_token_is(lexer, TOKEN_COMMENT)) {
+      if (top->captured) {
+        XMLNode *comment = stream_node_new(top->node, NT_COMMENT);
+        comment->name = strndup(lexer->cur_token.literal, lexer->cur_token.len);
+      }
+      NEXT(lexer);
+    } else {
+      ok = false;
+    }
+  }
+
+  if (ok && !stream->stopped && !lexer_cur_token_is(lexer, TOKEN_EOF)) ok = false;
+
+  stream_unwind(stream);
+  return ok;
+}
+
+bool xpath_stream_parse_str(XPathStream *stream, const char *xmlStr) {
+  lexer_t lexer = { 0 };
+  size_t len = xmlStr ? strlen(xmlStr) : 0;
+  if (stream == NULL || xmlStr == NULL || len > XML_MAX_INPUT) return false;
+  lexer_init_len(&lexer, xmlStr, (int)len, NULL);
+  return stream_parse(stream, &lexer, NULL);
+}
+
+bool xpath_stream_parse_file(XPathStream *stream, const char *path) {
+  StreamInput in = { 0 };
+  lexer_t lexer = { 0 };
+
+  if (stream == NULL || path == NULL) return false;
+  if ((in.fp = fopen(path, "r")) == NULL) return false;
+  lexer_init_refill(&lexer, "", 0, path, stream_refill, &in);
+  bool ok = stream_parse(stream, &lexer, &in) && !in.error;
+  fclose(in.fp);
+  free(in.buf);
+  return ok;
+}
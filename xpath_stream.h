@@ -0,0 +1,53 @@
+#ifndef __XML_XPATH_STREAM__
+#define __XML_XPATH_STREAM__
+
+#include <stdbool.h>
+#include "xml_parser.h"
+
+/******************************************************************************
+ * Streaming XPath
+ *
+ * Register forward-only paths before parsing, get called back while the
+ * document is lexed. No DOM is built: only the subtrees of matched elements
+ * are materialised, and freed again once their callback returned.
+ *
+ * Supported paths: absolute, made of `/name` and `//name` steps (`*` for any name) with
+ * attribute predicates `[@key]`, `[@key='value']` or `[@key!='value']`, and
+ * optionally ending in `/@name`, `/@*` or `/text()`:
+ *
+ *    /feed/entry[@type='news']       -> `node` is the whole <entry> subtree
+ *    //entry/@id                     -> `value` is the decoded attribute value
+ *    //entry[@lang='en']/title/text() -> `value` is the decoded text
+ *
+ * Element matches are reported when the element closes (so a nested match is
+ * reported before the match that contains it), attribute matches when the
+ * start tag is read, text matches for each text chunk.
+ *
+ * Predicates compare decoded attribute values.
+ *
+ * Elements inside which no path can match are stepped over without lexing
+ * them: there, only that the end tags match the start tags is checked.
+ *
+ * `xpath_stream_parse_file` reads the file in chunks and drops what was lexed:
+ * the memory used is about the largest token or text, plus the subtrees being
+ * materialised.
+ ******************************************************************************/
+
+/* `node`: the matched element, or for `@name`/`text()` the element owning the
+ * value(its attributes are set, its children are not).
+ * `value`: NULL for element matches.
+ * Both are only valid during the call, copy what you need.
+ * Return false to stop parsing.
+ * */
+typedef bool (*XPathStreamFn)(XMLNode *node, const char *value, void *user_data);
+
+typedef struct XPathStream XPathStream;
+
+XPathStream *xpath_stream_new(void);
+/* Register `path`. Returns false if `path` is not in the supported subset. */
+bool xpath_stream_add(XPathStream *stream, const char *path, XPathStreamFn fn, void *user_data);
+/* Returns false if the document is not well formed. Stopping from a callback is not an error. */
+bool xpath_stream_parse_str(XPathStream *stream, const char *xmlStr);
+bool xpath_stream_parse_file(XPathStream *stream, const char *path);
+void xpath_stream_free(XPathStream *stream);
+#endif